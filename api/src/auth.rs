@@ -13,7 +13,7 @@ use rand::Rng;
 use serde::{Deserialize, Serialize};
 use sha2::{Digest, Sha256};
 use std::sync::Arc;
-use tracing::info;
+use tracing::{info, warn};
 
 // ============ Config Extension ============
 
@@ -469,6 +469,14 @@ pub async fn check_clanker_verification(
     db::set_user_type(pool, &user.id, "clanker", Some(&verification.twitter_handle)).await?;
     db::verify_user(pool, &user.id, "twitter_clanker").await?;
 
+    // The user's entries now rank among clankers
+    state.leaderboard_cache.invalidate(None);
+    if let Some(queue) = &state.queue {
+        if let Err(e) = queue.publish_leaderboard_update(None).await {
+            warn!(user_id = %user.id, error = %e, "Failed to publish leaderboard update");
+        }
+    }
+
     info!(
         user_id = %user.id,
         twitter = %verification.twitter_handle,
@@ -1,7 +1,9 @@
 use crate::auth::AuthenticatedUser;
 use crate::db::{self, Challenge, TestCase, VerifyMode};
 use crate::error::ApiError;
-use crate::queue::{CompileJob, CompileStatus, Job, JobStatus, Language, Optimization, QueueClient};
+use crate::leaderboard_cache::LeaderboardCache;
+use crate::queue::{BatchCaseResult, BatchResult, CachedExecution, CompileJob, CompileStatus, ExecMode, Job, JobStatus, Language, Optimization, QueueClient};
+use crate::sandbox::ExecutionResult;
 use axum::{
     extract::{Multipart, Path, Query, State},
     Json,
@@ -56,6 +58,7 @@ pub struct ChallengeDetailResponse {
     pub output_spec: String,
     pub test_cases: Vec<PublicTestCase>,
     pub verify_mode: String,
+    pub score_metric: String,
     pub baselines: Option<Vec<ChallengeBaseline>>,
 }
 
@@ -171,6 +174,7 @@ pub async fn get_challenge(
         output_spec: challenge.output_spec,
         test_cases: public_test_cases,
         verify_mode: challenge.verify_mode,
+        score_metric: challenge.score_metric,
         baselines,
     }))
 }
@@ -264,6 +268,7 @@ pub async fn submit_challenge(
     if let Err(e) = process_challenge_submission(
         pool,
         queue,
+        &state.leaderboard_cache,
         submission_id,
         &challenge,
         &user,
@@ -300,6 +305,7 @@ pub async fn submit_challenge(
 async fn process_challenge_submission(
     pool: &PgPool,
     queue: &QueueClient,
+    leaderboard_cache: &LeaderboardCache,
     submission_id: Uuid,
     challenge: &Challenge,
     user: &db::User,
@@ -318,7 +324,15 @@ async fn process_challenge_submission(
         .and_then(|s| Optimization::from_str(s))
         .unwrap_or(Optimization::Release);
 
-    // Submit compile job
+    // Parse test cases
+    let test_cases: Vec<TestCase> = serde_json::from_value(challenge.test_cases.clone())
+        .map_err(|e| ApiError::Internal(format!("Invalid test cases: {}", e)))?;
+
+    // Submit compile job; PGO trains on the test case inputs, which are public
+    let training_stdin = match optimization {
+        Optimization::Pgo => test_cases.iter().map(|tc| tc.stdin.clone()).collect(),
+        _ => Vec::new(),
+    };
     let compile_job = CompileJob {
         id: Uuid::new_v4(),
         user_id: Some(user.id),
@@ -326,22 +340,24 @@ async fn process_challenge_submission(
         language,
         optimization,
         flags: HashMap::new(),
+        training_stdin,
+        tune: false,
         created_at: Utc::now(),
     };
 
     let compile_job_id = compile_job.id;
     queue.submit_compile_job(compile_job).await?;
 
-    // Wait for compilation
-    let compile_result = wait_for_compile(&queue, compile_job_id, Duration::from_secs(120)).await?;
+    // Wait for compilation; a PGO build is two compiles and the training runs
+    let compile_timeout = match optimization {
+        Optimization::Pgo => Duration::from_secs(360),
+        _ => Duration::from_secs(120),
+    };
+    let compile_result = wait_for_compile(&queue, compile_job_id, compile_timeout).await?;
 
     let binary_id = compile_result.binary_id;
     db::update_challenge_submission_status(pool, &submission_id, "running", Some(&binary_id), None, None, None).await?;
 
-    // Parse test cases
-    let test_cases: Vec<TestCase> = serde_json::from_value(challenge.test_cases.clone())
-        .map_err(|e| ApiError::Internal(format!("Invalid test cases: {}", e)))?;
-
     let verify_mode = match challenge.verify_mode.as_str() {
         "exact" => VerifyMode::Exact,
         "trimmed" => VerifyMode::Trimmed,
@@ -357,47 +373,106 @@ async fn process_challenge_submission(
     let mut final_run_id: Option<Uuid> = None;
 
     // Parse challenge env_vars if present
-    let challenge_env_vars: std::collections::HashMap<String, String> = challenge.env_vars
+    let mut challenge_env_vars: std::collections::HashMap<String, String> = challenge.env_vars
         .as_ref()
         .and_then(|v| serde_json::from_value(v.clone()).ok())
         .unwrap_or_default();
+    // ROI markers are only recognised when asked for
+    if challenge.score_metric == "roi" {
+        challenge_env_vars.insert("ROI".to_string(), "on".to_string());
+    }
 
-    for (i, test_case) in test_cases.iter().enumerate() {
-        // Submit execute job
+    // Submit every test case as one multi-input job: the worker fetches the
+    // binary once and runs the cases in parallel
+    let instruction_limit = 1_000_000_000; // 1B instruction limit for challenges
+
+    // Re-verifying an unchanged binary: take every case from the execution
+    // cache if all of them are there. Then each hit gets a run of its own,
+    // copied from the cached job's, so the entry never points at someone
+    // else's run; the copies are made in one transaction, so a case whose
+    // run is gone leaves none behind.
+    let mut hits = Vec::with_capacity(test_cases.len());
+    for test_case in &test_cases {
+        match queue
+            .check_exec_cache(
+                &binary_id,
+                test_case.stdin.as_bytes(),
+                instruction_limit,
+                &challenge_env_vars,
+                challenge.network_enabled,
+            )
+            .await
+        {
+            Ok(Some(cached)) => hits.push(cached),
+            _ => break,
+        }
+    }
+    let mut cached_cases = Vec::new();
+    if !hits.is_empty() && hits.len() == test_cases.len() {
+        match copy_cached_runs(pool, hits, &challenge.id).await {
+            Ok(Some(cases)) => cached_cases = cases,
+            Ok(None) => {}
+            Err(e) => warn!(submission_id = %submission_id, error = %e, "Failed to copy cached runs"),
+        }
+    }
+
+    let (cases, batch_error) = if test_cases.is_empty() {
+        (Vec::new(), None)
+    } else if cached_cases.len() == test_cases.len() {
+        info!(submission_id = %submission_id, "All test cases served from execution cache");
+        (cached_cases, None)
+    } else {
         let job = Job {
             id: Uuid::new_v4(),
             user_id: Some(user.id),
             binary_id: binary_id.clone(),
-            instruction_limit: 1_000_000_000, // 1B instruction limit for challenges
-            stdin: test_case.stdin.as_bytes().to_vec(),
+            instruction_limit,
+            stdin: Vec::new(),
             created_at: Utc::now(),
             benchmark_id: Some(challenge.id.clone()),
             network_enabled: challenge.network_enabled,
-            env_vars: challenge_env_vars.clone(),
+            env_vars: challenge_env_vars,
+            stdin_batch: test_cases.iter().map(|tc| tc.stdin.as_bytes().to_vec()).collect(),
+            mode: ExecMode::Qemu,
         };
 
         let job_id = job.id;
         queue.submit_job(job).await?;
 
-        // Wait for execution
-        let exec_result = match wait_for_execution(&queue, job_id, Duration::from_secs(30)).await {
-            Ok(result) => result,
-            Err(e) => {
+        // Allow 30s per case, as sequential runs did, in case the worker has fewer slots than cases
+        let batch_timeout = Duration::from_secs(30 * test_cases.len() as u64);
+        match wait_for_batch_execution(&queue, job_id, batch_timeout).await {
+            Ok(batch) => (batch.cases, None),
+            Err(e) => (Vec::new(), Some(e.to_string())),
+        }
+    };
+
+    for (i, test_case) in test_cases.iter().enumerate() {
+        let case = cases.get(i);
+        let exec_result = match case.and_then(|c| c.result.as_ref()) {
+            Some(result) => result,
+            None => {
+                let error = case
+                    .and_then(|c| c.error.clone())
+                    .or_else(|| batch_error.clone())
+                    .unwrap_or_else(|| "Missing test case result".to_string());
                 test_results.push(TestResult {
                     test_index: i,
                     passed: false,
                     expected_preview: Some(truncate_preview(&test_case.expected_stdout, 50)),
                     actual_preview: None,
-                    error: Some(format!("Execution failed: {}", e)),
+                    error: Some(format!("Execution failed: {}", error)),
                 });
                 all_passed = false;
                 continue;
             }
         };
 
-        // Get the run from database (saved by worker)
-        if let Ok(Some(run)) = db::get_run_by_job_id(pool, &job_id).await {
-            final_run_id = Some(run.id);
+        // Get the run from database (saved by worker under the case's job id)
+        if let Some(case) = case {
+            if let Ok(Some(run)) = db::get_run_by_job_id(pool, &case.job_id).await {
+                final_run_id = Some(run.id);
+            }
         }
 
         // Check output
@@ -408,9 +483,10 @@ async fn process_challenge_submission(
             all_passed = false;
         }
 
-        total_instructions += exec_result.instructions as i64;
-        if exec_result.instructions as i64 > max_instructions {
-            max_instructions = exec_result.instructions as i64;
+        let instructions = scored_instructions(exec_result, &challenge.score_metric) as i64;
+        total_instructions += instructions;
+        if instructions > max_instructions {
+            max_instructions = instructions;
         }
 
         test_results.push(TestResult {
@@ -445,7 +521,7 @@ async fn process_challenge_submission(
     // If all tests passed, update leaderboard
     if all_passed {
         if let Some(run_id) = final_run_id {
-            db::update_leaderboard_entry(
+            let entry = db::update_leaderboard_entry(
                 pool,
                 &user.id,
                 &challenge.id,
@@ -457,19 +533,67 @@ async fn process_challenge_submission(
             )
             .await?;
 
-            info!(
-                user_id = %user.id,
-                challenge_id = %challenge.id,
-                language = %language_str,
-                instructions = max_instructions,
-                "Leaderboard entry updated"
-            );
+            // Rankings only moved when this run became the entry
+            if entry.run_id == run_id {
+                leaderboard_cache.invalidate(Some(&challenge.id));
+                if let Err(e) = queue.publish_leaderboard_update(Some(&challenge.id)).await {
+                    warn!(challenge_id = %challenge.id, error = %e, "Failed to publish leaderboard update");
+                }
+
+                info!(
+                    user_id = %user.id,
+                    challenge_id = %challenge.id,
+                    language = %language_str,
+                    instructions = max_instructions,
+                    "Leaderboard entry updated"
+                );
+            }
         }
     }
 
     Ok(())
 }
 
+/// Instruction count a challenge ranks on. ROI challenges use the count inside
+/// the guest's ROI markers and net challenges the count minus the runtime's
+/// empty-program baseline, each falling back to the whole run when missing.
+/// A run row per cache hit under a fresh job id, all or none: None when a
+/// cached job has no run left to copy
+async fn copy_cached_runs(
+    pool: &PgPool,
+    hits: Vec<CachedExecution>,
+    challenge_id: &str,
+) -> Result<Option<Vec<BatchCaseResult>>, ApiError> {
+    let mut tx = pool
+        .begin()
+        .await
+        .map_err(|e| ApiError::DatabaseError(format!("Failed to start transaction: {}", e)))?;
+    let mut cases = Vec::with_capacity(hits.len());
+    for cached in hits {
+        let job_id = Uuid::new_v4();
+        if db::copy_run(&mut *tx, &cached.job_id, &job_id, Some(challenge_id)).await?.is_none() {
+            return Ok(None); // dropping tx rolls the earlier copies back
+        }
+        cases.push(BatchCaseResult {
+            job_id,
+            result: Some(cached.result),
+            error: None,
+        });
+    }
+    tx.commit()
+        .await
+        .map_err(|e| ApiError::DatabaseError(format!("Failed to commit cached runs: {}", e)))?;
+    Ok(Some(cases))
+}
+
+fn scored_instructions(result: &ExecutionResult, score_metric: &str) -> u64 {
+    match score_metric {
+        "roi" => result.roi_instructions.unwrap_or(result.instructions),
+        "net" => result.instructions_net.unwrap_or(result.instructions),
+        _ => result.instructions,
+    }
+}
+
 fn verify_output(actual: &str, expected: &str, mode: &VerifyMode) -> bool {
     match mode {
         VerifyMode::Exact => actual == expected,
@@ -528,36 +652,18 @@ async fn wait_for_compile(
     }
 }
 
-async fn wait_for_execution(
+async fn wait_for_batch_execution(
     queue: &QueueClient,
     job_id: Uuid,
     timeout: Duration,
-) -> Result<crate::sandbox::ExecutionResult, ApiError> {
-    let start = std::time::Instant::now();
-
-    loop {
-        if start.elapsed() > timeout {
-            return Err(ApiError::Timeout(timeout.as_secs()));
-        }
-
-        if let Some(metadata) = queue.get_job_status(&job_id).await? {
-            match metadata.status {
-                JobStatus::Completed => {
-                    if let Some(result) = queue.get_job_result(&job_id).await? {
-                        return Ok(result);
-                    }
-                }
-                JobStatus::Failed => {
-                    return Err(ApiError::Internal(
-                        metadata.error.unwrap_or_else(|| "Execution failed".to_string()),
-                    ));
-                }
-                _ => {}
-            }
-        }
-
-        tokio::time::sleep(Duration::from_millis(100)).await;
+) -> Result<BatchResult, ApiError> {
+    let metadata = queue.wait_for_job(&job_id, timeout).await?;
+    if metadata.status == JobStatus::Failed {
+        return Err(ApiError::Internal(
+            metadata.error.unwrap_or_else(|| "Execution failed".to_string()),
+        ));
     }
+    queue.get_batch_result(&job_id).await?.ok_or(ApiError::JobNotReady)
 }
 
 pub async fn get_submission_status(
@@ -613,14 +719,15 @@ pub async fn get_challenge_leaderboard(
         .await?
         .ok_or_else(|| ApiError::ChallengeNotFound(challenge_id.clone()))?;
 
-    let leaderboard = db::get_challenge_leaderboard(
-        pool,
-        &challenge_id,
-        query.language.as_deref(),
-        query.user_type.as_deref(),
-        query.limit.min(500),
-    )
-    .await?;
+    let limit = query.limit.min(500);
+    let cache = &state.leaderboard_cache;
+    let (language, user_type) = (query.language.as_deref(), query.user_type.as_deref());
+    if let Some(page) = cache.challenge_page(&challenge_id, language, user_type, limit) {
+        return Ok(Json(page.as_ref().clone()));
+    }
+
+    let leaderboard = db::get_challenge_leaderboard(pool, &challenge_id, language, user_type, limit).await?;
+    cache.store_challenge_page(&challenge_id, language, user_type, limit, Arc::new(leaderboard.clone()));
 
     Ok(Json(leaderboard))
 }
@@ -647,12 +754,15 @@ pub async fn get_global_leaderboard(
         .as_ref()
         .ok_or_else(|| ApiError::DatabaseError("Database not available".to_string()))?;
 
-    let leaderboard = db::get_global_leaderboard(
-        pool,
-        query.user_type.as_deref(),
-        query.limit.min(500),
-    )
-    .await?;
+    let limit = query.limit.min(500);
+    let cache = &state.leaderboard_cache;
+    let user_type = query.user_type.as_deref();
+    if let Some(page) = cache.global_page(user_type, limit) {
+        return Ok(Json(page.as_ref().clone()));
+    }
+
+    let leaderboard = db::get_global_leaderboard(pool, user_type, limit).await?;
+    cache.store_global_page(user_type, limit, Arc::new(leaderboard.clone()));
 
     Ok(Json(leaderboard))
 }
@@ -740,6 +850,7 @@ _start:
         false,
         None,
         Some(&hello_baselines),
+        None,
     )
     .await?;
 
@@ -868,6 +979,7 @@ itoa:
         true,  // Network enabled for port scanning
         None,
         Some(&portscan_baselines),
+        None,
     )
     .await?;
 
@@ -982,6 +1094,7 @@ exit:
         false,
         Some(&env_vars),  // Set FLAG env var
         Some(&env_baselines),
+        None,
     )
     .await?;
 
@@ -1085,6 +1198,7 @@ fn base64_decode(s: &str) -> Vec<u8> {
         false,
         None,
         Some(&b64_baselines),
+        None,
     )
     .await?;
 
@@ -1188,6 +1302,7 @@ func main() {
         false,
         None,
         Some(&xor_baselines),
+        None,
     )
     .await?;
 
@@ -1266,6 +1381,7 @@ print(result, end="")"#
         false,
         None,
         Some(&crypto_chain_baselines),
+        None,
     )
     .await?;
 
@@ -1334,6 +1450,7 @@ func main() {
         true,  // Network enabled for HTTP
         None,
         Some(&http_baselines),
+        None,
     )
     .await?;
 
@@ -1,4 +1,6 @@
 use crate::error::ApiError;
+use crate::profile;
+use crate::sandbox::{BlockProfile, FunctionProfile};
 use chrono::{DateTime, DurationRound, TimeDelta, Utc};
 use serde::{Deserialize, Serialize};
 use sqlx::postgres::PgPoolOptions;
@@ -120,8 +122,13 @@ pub struct Challenge {
     pub env_vars: Option<serde_json::Value>, // HashMap<String, String> as JSON
     // Baseline solutions per language
     pub baselines: Option<serde_json::Value>, // Vec<ChallengeBaseline> as JSON
+    // What the leaderboard ranks: "instructions" (whole process), "roi" or "net"
+    pub score_metric: String,
 }
 
+/// Values of `challenges.score_metric`, as `scored_instructions` ranks them
+pub const SCORE_METRICS: &[&str] = &["instructions", "roi", "net"];
+
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct ChallengeBaseline {
     pub language: String,
@@ -290,6 +297,9 @@ pub async fn run_migrations(pool: &PgPool) -> Result<(), ApiError> {
         .execute(pool).await.ok();
     sqlx::query(r#"ALTER TABLE challenges ADD COLUMN IF NOT EXISTS baselines JSONB"#)
         .execute(pool).await.ok();
+    // Set per challenge through create_challenge; see SCORE_METRICS
+    sqlx::query(r#"ALTER TABLE challenges ADD COLUMN IF NOT EXISTS score_metric VARCHAR(20) DEFAULT 'instructions'"#)
+        .execute(pool).await.ok();
 
     // Create leaderboard_entries table
     sqlx::query(
@@ -319,6 +329,55 @@ pub async fn run_migrations(pool: &PgPool) -> Result<(), ApiError> {
     sqlx::query(r#"CREATE INDEX IF NOT EXISTS idx_leaderboard_user ON leaderboard_entries(user_id)"#)
         .execute(pool).await.ok();
 
+    // Rankings maintained from leaderboard_entries on every new best (see
+    // rank_leaderboard_group), so leaderboard reads are one index range
+    sqlx::query(
+        r#"
+        CREATE TABLE IF NOT EXISTS leaderboard_rankings (
+            challenge_id VARCHAR(100) NOT NULL REFERENCES challenges(id) ON DELETE CASCADE,
+            language VARCHAR(50) NOT NULL,
+            user_id UUID NOT NULL REFERENCES users(id) ON DELETE CASCADE,
+            user_type VARCHAR(20) NOT NULL,
+            instructions BIGINT NOT NULL,
+            submitted_at TIMESTAMPTZ NOT NULL,
+            rank BIGINT NOT NULL,
+            type_rank BIGINT NOT NULL,
+            score BIGINT NOT NULL,
+            first_place BOOLEAN NOT NULL,
+            PRIMARY KEY (challenge_id, language, user_id)
+        )
+        "#,
+    )
+    .execute(pool)
+    .await
+    .ok();
+    sqlx::query(r#"CREATE INDEX IF NOT EXISTS idx_rankings_rank ON leaderboard_rankings(challenge_id, language, rank)"#)
+        .execute(pool).await.ok();
+    sqlx::query(
+        r#"CREATE INDEX IF NOT EXISTS idx_rankings_type_rank ON leaderboard_rankings(challenge_id, user_type, language, type_rank)"#,
+    )
+    .execute(pool).await.ok();
+    sqlx::query(r#"CREATE INDEX IF NOT EXISTS idx_rankings_user ON leaderboard_rankings(user_id)"#)
+        .execute(pool).await.ok();
+    sqlx::query(
+        r#"
+        CREATE TABLE IF NOT EXISTS leaderboard_scores (
+            user_id UUID PRIMARY KEY REFERENCES users(id) ON DELETE CASCADE,
+            user_type VARCHAR(20) NOT NULL,
+            total_score BIGINT NOT NULL,
+            challenges_completed BIGINT NOT NULL,
+            first_places BIGINT NOT NULL
+        )
+        "#,
+    )
+    .execute(pool)
+    .await
+    .ok();
+    sqlx::query(r#"CREATE INDEX IF NOT EXISTS idx_scores_total ON leaderboard_scores(total_score DESC, user_id)"#)
+        .execute(pool).await.ok();
+    sqlx::query(r#"CREATE INDEX IF NOT EXISTS idx_scores_type_total ON leaderboard_scores(user_type, total_score DESC, user_id)"#)
+        .execute(pool).await.ok();
+
     // Create challenge_submissions table
     sqlx::query(
         r#"
@@ -616,6 +675,11 @@ pub async fn create_binaries_table(pool: &PgPool) -> Result<(), ApiError> {
         .await
         .ok();
 
+    sqlx::query(r#"ALTER TABLE binaries ADD COLUMN IF NOT EXISTS baseline_binary_id VARCHAR(100)"#)
+        .execute(pool)
+        .await
+        .ok();
+
     // Create index for cleanup
     sqlx::query(
         r#"
@@ -635,6 +699,10 @@ pub struct BinaryMetadata {
     pub optimization: Option<String>,
     pub compiler_version: Option<String>,
     pub compile_flags: Option<serde_json::Value>,
+    /// Empty program built with the same language, optimization, flags and
+    /// compiler image; the worker subtracts its count for `instructions_net`
+    #[serde(default)]
+    pub baseline_binary_id: Option<String>,
 }
 
 pub async fn store_binary(
@@ -644,26 +712,28 @@ pub async fn store_binary(
     metadata: Option<&BinaryMetadata>,
 ) -> Result<(), ApiError> {
     let size = data.len() as i64;
-    let (language, optimization, compiler_version, compile_flags) = metadata
+    let (language, optimization, compiler_version, compile_flags, baseline_binary_id) = metadata
         .map(|m| {
             (
                 m.language.as_deref(),
                 m.optimization.as_deref(),
                 m.compiler_version.as_deref(),
                 m.compile_flags.as_ref(),
+                m.baseline_binary_id.as_deref(),
             )
         })
-        .unwrap_or((None, None, None, None));
+        .unwrap_or((None, None, None, None, None));
 
     sqlx::query(
         r#"
-        INSERT INTO binaries (id, data, size, language, optimization, compiler_version, compile_flags)
-        VALUES ($1, $2, $3, $4, $5, $6, $7)
+        INSERT INTO binaries (id, data, size, language, optimization, compiler_version, compile_flags, baseline_binary_id)
+        VALUES ($1, $2, $3, $4, $5, $6, $7, $8)
         ON CONFLICT (id) DO UPDATE SET
             language = COALESCE(EXCLUDED.language, binaries.language),
             optimization = COALESCE(EXCLUDED.optimization, binaries.optimization),
             compiler_version = COALESCE(EXCLUDED.compiler_version, binaries.compiler_version),
-            compile_flags = COALESCE(EXCLUDED.compile_flags, binaries.compile_flags)
+            compile_flags = COALESCE(EXCLUDED.compile_flags, binaries.compile_flags),
+            baseline_binary_id = COALESCE(EXCLUDED.baseline_binary_id, binaries.baseline_binary_id)
         "#,
     )
     .bind(id)
@@ -673,6 +743,7 @@ pub async fn store_binary(
     .bind(optimization)
     .bind(compiler_version)
     .bind(compile_flags)
+    .bind(baseline_binary_id)
     .execute(pool)
     .await
     .map_err(|e| ApiError::DatabaseError(format!("Failed to store binary: {}", e)))?;
@@ -698,9 +769,9 @@ pub async fn get_binary_metadata(
     pool: &PgPool,
     id: &str,
 ) -> Result<Option<BinaryMetadata>, ApiError> {
-    let result: Option<(Option<String>, Option<String>, Option<String>, Option<serde_json::Value>)> = sqlx::query_as(
+    let result: Option<(Option<String>, Option<String>, Option<String>, Option<serde_json::Value>, Option<String>)> = sqlx::query_as(
         r#"
-        SELECT language, optimization, compiler_version, compile_flags FROM binaries WHERE id = $1
+        SELECT language, optimization, compiler_version, compile_flags, baseline_binary_id FROM binaries WHERE id = $1
         "#,
     )
     .bind(id)
@@ -708,11 +779,12 @@ pub async fn get_binary_metadata(
     .await
     .map_err(|e| ApiError::DatabaseError(format!("Failed to get binary metadata: {}", e)))?;
 
-    Ok(result.map(|(language, optimization, compiler_version, compile_flags)| BinaryMetadata {
+    Ok(result.map(|(language, optimization, compiler_version, compile_flags, baseline_binary_id)| BinaryMetadata {
         language,
         optimization,
         compiler_version,
         compile_flags,
+        baseline_binary_id,
     }))
 }
 
@@ -824,6 +896,20 @@ pub async fn create_runs_table(pool: &PgPool) -> Result<(), ApiError> {
         .await
         .ok();
 
+    // Compact profile blob (see profile.rs) for diffs between runs; only
+    // read by the diff endpoint, never with the run itself
+    sqlx::query(r#"ALTER TABLE runs ADD COLUMN IF NOT EXISTS profile BYTEA"#)
+        .execute(pool)
+        .await
+        .ok();
+
+    // qemu (exact emulated counts) or native (approximate hardware
+    // counters); only qemu runs are diffed or count as a benchmark best
+    sqlx::query(r#"ALTER TABLE runs ADD COLUMN IF NOT EXISTS mode VARCHAR(10) NOT NULL DEFAULT 'qemu'"#)
+        .execute(pool)
+        .await
+        .ok();
+
     Ok(())
 }
 
@@ -860,6 +946,7 @@ pub struct Run {
     pub stdout: Option<String>,
     pub stderr: Option<String>,
     pub benchmark_id: Option<String>,
+    pub mode: String,
     pub created_at: DateTime<Utc>,
     pub started_at: Option<DateTime<Utc>>,
     pub completed_at: Option<DateTime<Utc>>,
@@ -899,6 +986,14 @@ pub struct SaveRunRequest {
     pub benchmark_id: Option<String>,
     pub started_at: Option<DateTime<Utc>>,
     pub completed_at: Option<DateTime<Utc>>,
+    /// "native" for perf_event counts; None is an exact QEMU run
+    #[serde(default)]
+    pub mode: Option<String>,
+    /// Block and function profiles of a PROFILE=on run, stored as the blob
+    #[serde(default)]
+    pub profile: Vec<BlockProfile>,
+    #[serde(default)]
+    pub functions: Vec<FunctionProfile>,
 }
 
 pub async fn save_run(pool: &PgPool, req: &SaveRunRequest) -> Result<Uuid, ApiError> {
@@ -911,9 +1006,9 @@ pub async fn save_run(pool: &PgPool, req: &SaveRunRequest) -> Result<Uuid, ApiEr
             io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
             guest_heap_bytes, limit_reached, exit_code,
             execution_time_ms, instruction_limit, syscalls, syscall_breakdown,
-            stdout, stderr, benchmark_id, started_at, completed_at
+            stdout, stderr, benchmark_id, started_at, completed_at, profile, mode
         )
-        VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16, $17, $18, $19, $20, $21, $22, $23, $24, $25, $26, $27, $28, $29, $30, $31)
+        VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16, $17, $18, $19, $20, $21, $22, $23, $24, $25, $26, $27, $28, $29, $30, $31, $32, COALESCE($33, 'qemu'))
         ON CONFLICT (job_id) DO UPDATE SET
             instructions = EXCLUDED.instructions,
             memory_peak_kb = EXCLUDED.memory_peak_kb,
@@ -933,7 +1028,9 @@ pub async fn save_run(pool: &PgPool, req: &SaveRunRequest) -> Result<Uuid, ApiEr
             syscall_breakdown = EXCLUDED.syscall_breakdown,
             stdout = EXCLUDED.stdout,
             stderr = EXCLUDED.stderr,
-            completed_at = EXCLUDED.completed_at
+            completed_at = EXCLUDED.completed_at,
+            profile = EXCLUDED.profile,
+            mode = EXCLUDED.mode
         RETURNING id
         "#,
     )
@@ -968,6 +1065,8 @@ pub async fn save_run(pool: &PgPool, req: &SaveRunRequest) -> Result<Uuid, ApiEr
     .bind(&req.benchmark_id)
     .bind(req.started_at)
     .bind(req.completed_at)
+    .bind(profile::encode(&req.profile, &req.functions))
+    .bind(&req.mode)
     .fetch_one(pool)
     .await
     .map_err(|e| ApiError::DatabaseError(format!("Failed to save run: {}", e)))?;
@@ -975,6 +1074,60 @@ pub async fn save_run(pool: &PgPool, req: &SaveRunRequest) -> Result<Uuid, ApiEr
     Ok(result.0)
 }
 
+/// Save a run for a job served from the execution cache, copying the
+/// results of the job that produced them. None when the cached job has no
+/// run or the new job already has one.
+pub async fn copy_run(
+    conn: &mut sqlx::PgConnection,
+    from_job_id: &Uuid,
+    to_job_id: &Uuid,
+    benchmark_id: Option<&str>,
+) -> Result<Option<Uuid>, ApiError> {
+    let result: Option<(Uuid,)> = sqlx::query_as(
+        r#"
+        INSERT INTO runs (
+            job_id, binary_id, binary_size, source_code, language, optimization, compiler_version,
+            compile_time_ms, compile_cached, instructions, memory_peak_kb,
+            memory_rss_kb, memory_hwm_kb, memory_data_kb, memory_stack_kb,
+            io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
+            guest_heap_bytes, limit_reached, exit_code,
+            execution_time_ms, instruction_limit, syscalls, syscall_breakdown,
+            stdout, stderr, benchmark_id, started_at, completed_at, profile, mode
+        )
+        SELECT $2, binary_id, binary_size, source_code, language, optimization, compiler_version,
+               compile_time_ms, compile_cached, instructions, memory_peak_kb,
+               memory_rss_kb, memory_hwm_kb, memory_data_kb, memory_stack_kb,
+               io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
+               guest_heap_bytes, limit_reached, exit_code,
+               execution_time_ms, instruction_limit, syscalls, syscall_breakdown,
+               stdout, stderr, COALESCE($3, benchmark_id), started_at, NOW(), profile, mode
+        FROM runs
+        WHERE job_id = $1
+        ON CONFLICT (job_id) DO NOTHING
+        RETURNING id
+        "#,
+    )
+    .bind(from_job_id)
+    .bind(to_job_id)
+    .bind(benchmark_id)
+    .fetch_optional(conn)
+    .await
+    .map_err(|e| ApiError::DatabaseError(format!("Failed to copy run: {}", e)))?;
+
+    Ok(result.map(|(id,)| id))
+}
+
+/// A run's profile blob, None for a run saved without one
+pub async fn get_run_profile(pool: &PgPool, run_id: &Uuid) -> Result<Option<Vec<u8>>, ApiError> {
+    let result: Option<(Option<Vec<u8>>,)> = sqlx::query_as(r#"SELECT profile FROM runs WHERE id = $1"#)
+        .bind(run_id)
+        .fetch_optional(pool)
+        .await
+        .map_err(|e| ApiError::DatabaseError(format!("Failed to get run profile: {}", e)))?;
+
+    Ok(result.and_then(|(blob,)| blob))
+}
+
 pub async fn get_run(pool: &PgPool, run_id: &Uuid) -> Result<Option<Run>, ApiError> {
     let result: Option<Run> = sqlx::query_as(
         r#"
@@ -984,7 +1137,7 @@ pub async fn get_run(pool: &PgPool, run_id: &Uuid) -> Result<Option<Run>, ApiErr
                io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
                guest_heap_bytes, limit_reached, exit_code,
                execution_time_ms, instruction_limit, syscalls, syscall_breakdown,
-               stdout, stderr, benchmark_id, created_at, started_at, completed_at
+               stdout, stderr, benchmark_id, mode, created_at, started_at, completed_at
         FROM runs
         WHERE id = $1
         "#,
@@ -1006,7 +1159,7 @@ pub async fn get_run_by_job_id(pool: &PgPool, job_id: &Uuid) -> Result<Option<Ru
                io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
                guest_heap_bytes, limit_reached, exit_code,
                execution_time_ms, instruction_limit, syscalls, syscall_breakdown,
-               stdout, stderr, benchmark_id, created_at, started_at, completed_at
+               stdout, stderr, benchmark_id, mode, created_at, started_at, completed_at
         FROM runs
         WHERE job_id = $1
         "#,
@@ -1028,7 +1181,7 @@ pub async fn list_runs(pool: &PgPool, limit: i64, offset: i64) -> Result<Vec<Run
                io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
                guest_heap_bytes, limit_reached, exit_code,
                execution_time_ms, instruction_limit, syscalls, syscall_breakdown,
-               stdout, stderr, benchmark_id, created_at, started_at, completed_at
+               stdout, stderr, benchmark_id, mode, created_at, started_at, completed_at
         FROM runs
         ORDER BY created_at DESC
         LIMIT $1 OFFSET $2
@@ -1051,7 +1204,7 @@ pub async fn get_min_instructions(
         r#"
         SELECT language, MIN(instructions) as min_instructions
         FROM runs
-        WHERE benchmark_id = $1 AND language IS NOT NULL AND limit_reached = FALSE
+        WHERE benchmark_id = $1 AND language IS NOT NULL AND limit_reached = FALSE AND mode = 'qemu'
         GROUP BY language
         "#,
     )
@@ -1183,6 +1336,13 @@ pub async fn set_user_type(
     user_type: &str,
     clanker_twitter: Option<&str>,
 ) -> Result<(), ApiError> {
+    let map_err = |e: sqlx::Error| ApiError::DatabaseError(format!("Failed to set user type: {}", e));
+    let mut tx = pool.begin().await.map_err(map_err)?;
+    sqlx::query("SELECT pg_advisory_xact_lock($1)")
+        .bind(RANKING_LOCK_KEY)
+        .execute(&mut *tx)
+        .await
+        .map_err(map_err)?;
     sqlx::query(
         r#"
         UPDATE users
@@ -1193,9 +1353,22 @@ pub async fn set_user_type(
     .bind(user_id)
     .bind(user_type)
     .bind(clanker_twitter)
-    .execute(pool)
+    .execute(&mut *tx)
     .await
-    .map_err(|e| ApiError::DatabaseError(format!("Failed to set user type: {}", e)))?;
+    .map_err(map_err)?;
+
+    // Per-type ranks of every group the user is in move with the new type
+    let groups: Vec<(String, String)> = sqlx::query_as(
+        r#"SELECT challenge_id, language FROM leaderboard_entries WHERE user_id = $1"#,
+    )
+    .bind(user_id)
+    .fetch_all(&mut *tx)
+    .await
+    .map_err(map_err)?;
+    for (challenge_id, language) in &groups {
+        rank_leaderboard_group(&mut tx, challenge_id, language).await.map_err(map_err)?;
+    }
+    tx.commit().await.map_err(map_err)?;
 
     Ok(())
 }
@@ -1304,7 +1477,8 @@ pub async fn get_challenge(pool: &PgPool, challenge_id: &str) -> Result<Option<C
         r#"
         SELECT id, name, description, category, difficulty, input_spec, output_spec,
                test_cases, verify_mode, is_active, created_at,
-               COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines
+               COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines,
+               COALESCE(score_metric, 'instructions') as score_metric
         FROM challenges
         WHERE id = $1
         "#,
@@ -1323,7 +1497,8 @@ pub async fn list_challenges(pool: &PgPool, active_only: bool) -> Result<Vec<Cha
             r#"
             SELECT id, name, description, category, difficulty, input_spec, output_spec,
                    test_cases, verify_mode, is_active, created_at,
-                   COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines
+                   COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines,
+                   COALESCE(score_metric, 'instructions') as score_metric
             FROM challenges
             WHERE is_active = TRUE
             ORDER BY created_at ASC
@@ -1336,7 +1511,8 @@ pub async fn list_challenges(pool: &PgPool, active_only: bool) -> Result<Vec<Cha
             r#"
             SELECT id, name, description, category, difficulty, input_spec, output_spec,
                    test_cases, verify_mode, is_active, created_at,
-                   COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines
+                   COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines,
+                   COALESCE(score_metric, 'instructions') as score_metric
             FROM challenges
             ORDER BY created_at ASC
             "#,
@@ -1349,6 +1525,8 @@ pub async fn list_challenges(pool: &PgPool, active_only: bool) -> Result<Vec<Cha
     Ok(results)
 }
 
+/// Insert or update a challenge. A None score_metric keeps the existing
+/// one (instructions for a new challenge).
 pub async fn create_challenge(
     pool: &PgPool,
     id: &str,
@@ -1363,11 +1541,20 @@ pub async fn create_challenge(
     network_enabled: bool,
     env_vars: Option<&serde_json::Value>,
     baselines: Option<&serde_json::Value>,
+    score_metric: Option<&str>,
 ) -> Result<Challenge, ApiError> {
+    if let Some(metric) = score_metric {
+        if !SCORE_METRICS.contains(&metric) {
+            return Err(ApiError::InvalidField(format!(
+                "score_metric must be one of {}",
+                SCORE_METRICS.join(", ")
+            )));
+        }
+    }
     let result: Challenge = sqlx::query_as(
         r#"
-        INSERT INTO challenges (id, name, description, category, difficulty, input_spec, output_spec, test_cases, verify_mode, network_enabled, env_vars, baselines)
-        VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12)
+        INSERT INTO challenges (id, name, description, category, difficulty, input_spec, output_spec, test_cases, verify_mode, network_enabled, env_vars, baselines, score_metric)
+        VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, COALESCE($13, 'instructions'))
         ON CONFLICT (id) DO UPDATE SET
             name = EXCLUDED.name,
             description = EXCLUDED.description,
@@ -1379,10 +1566,12 @@ pub async fn create_challenge(
             verify_mode = EXCLUDED.verify_mode,
             network_enabled = EXCLUDED.network_enabled,
             env_vars = EXCLUDED.env_vars,
-            baselines = EXCLUDED.baselines
+            baselines = EXCLUDED.baselines,
+            score_metric = COALESCE($13, challenges.score_metric)
         RETURNING id, name, description, category, difficulty, input_spec, output_spec,
                   test_cases, verify_mode, is_active, created_at,
-                  COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines
+                  COALESCE(network_enabled, FALSE) as network_enabled, env_vars, baselines,
+                  COALESCE(score_metric, 'instructions') as score_metric
         "#,
     )
     .bind(id)
@@ -1397,6 +1586,7 @@ pub async fn create_challenge(
     .bind(network_enabled)
     .bind(env_vars)
     .bind(baselines)
+    .bind(score_metric)
     .fetch_one(pool)
     .await
     .map_err(|e| ApiError::DatabaseError(format!("Failed to create challenge: {}", e)))?;
@@ -1492,6 +1682,135 @@ pub async fn update_challenge_submission_status(
 
 // ============ Leaderboard Functions ============
 
+/// Serialises ranking maintenance, so two new bests never rank from
+/// snapshots missing each other (pg_advisory_xact_lock key)
+const RANKING_LOCK_KEY: i64 = 0x6c6561646572;
+
+/// Ranks, per-entry scores and first places of the (challenge, language)
+/// groups matched by `{filter}`, a condition on `le`. An entry scores 1000
+/// when it is the best of its group and best / instructions * 1000 otherwise.
+/// Rows whose values did not change are not rewritten.
+const RANK_GROUPS_SQL: &str = r#"
+    WITH ranked AS (
+        SELECT
+            le.challenge_id, le.language, le.user_id, COALESCE(u.user_type, 'human') as user_type,
+            le.instructions, le.created_at as submitted_at,
+            ROW_NUMBER() OVER (PARTITION BY le.challenge_id, le.language
+                               ORDER BY le.instructions, le.created_at, le.user_id) as rank,
+            ROW_NUMBER() OVER (PARTITION BY le.challenge_id, le.language, COALESCE(u.user_type, 'human')
+                               ORDER BY le.instructions, le.created_at, le.user_id) as type_rank,
+            MIN(le.instructions) OVER (PARTITION BY le.challenge_id, le.language) as best
+        FROM leaderboard_entries le
+        JOIN users u ON le.user_id = u.id
+        WHERE {filter}
+    )
+    INSERT INTO leaderboard_rankings
+        (challenge_id, language, user_id, user_type, instructions, submitted_at, rank, type_rank, score, first_place)
+    SELECT
+        challenge_id, language, user_id, user_type, instructions, submitted_at, rank, type_rank,
+        CASE WHEN instructions = best THEN 1000
+             ELSE (best::float / instructions::float * 1000)::bigint END,
+        instructions = best
+    FROM ranked
+    ON CONFLICT (challenge_id, language, user_id) DO UPDATE SET
+        user_type = EXCLUDED.user_type,
+        instructions = EXCLUDED.instructions,
+        submitted_at = EXCLUDED.submitted_at,
+        rank = EXCLUDED.rank,
+        type_rank = EXCLUDED.type_rank,
+        score = EXCLUDED.score,
+        first_place = EXCLUDED.first_place
+    WHERE (leaderboard_rankings.user_type, leaderboard_rankings.instructions, leaderboard_rankings.submitted_at,
+           leaderboard_rankings.rank, leaderboard_rankings.type_rank, leaderboard_rankings.score,
+           leaderboard_rankings.first_place)
+          IS DISTINCT FROM
+          (EXCLUDED.user_type, EXCLUDED.instructions, EXCLUDED.submitted_at,
+           EXCLUDED.rank, EXCLUDED.type_rank, EXCLUDED.score, EXCLUDED.first_place)
+"#;
+
+/// Global scores of the users matched by `{filter}`, a condition on `lr`,
+/// summed from their rankings
+const SCORE_USERS_SQL: &str = r#"
+    INSERT INTO leaderboard_scores (user_id, user_type, total_score, challenges_completed, first_places)
+    SELECT
+        user_id, MAX(user_type), SUM(score)::bigint, COUNT(DISTINCT challenge_id),
+        COUNT(*) FILTER (WHERE first_place)
+    FROM leaderboard_rankings
+    WHERE user_id IN (SELECT lr.user_id FROM leaderboard_rankings lr WHERE {filter})
+    GROUP BY user_id
+    ON CONFLICT (user_id) DO UPDATE SET
+        user_type = EXCLUDED.user_type,
+        total_score = EXCLUDED.total_score,
+        challenges_completed = EXCLUDED.challenges_completed,
+        first_places = EXCLUDED.first_places
+    WHERE (leaderboard_scores.user_type, leaderboard_scores.total_score,
+           leaderboard_scores.challenges_completed, leaderboard_scores.first_places)
+          IS DISTINCT FROM
+          (EXCLUDED.user_type, EXCLUDED.total_score, EXCLUDED.challenges_completed, EXCLUDED.first_places)
+"#;
+
+/// Re-rank one (challenge, language) group and re-score its users; only
+/// that group's ranks and scores can change when one of its entries does
+async fn rank_leaderboard_group(
+    conn: &mut sqlx::PgConnection,
+    challenge_id: &str,
+    language: &str,
+) -> Result<(), sqlx::Error> {
+    sqlx::query(&RANK_GROUPS_SQL.replace("{filter}", "le.challenge_id = $1 AND le.language = $2"))
+        .bind(challenge_id)
+        .bind(language)
+        .execute(&mut *conn)
+        .await?;
+    sqlx::query(&SCORE_USERS_SQL.replace("{filter}", "lr.challenge_id = $1 AND lr.language = $2"))
+        .bind(challenge_id)
+        .bind(language)
+        .execute(&mut *conn)
+        .await?;
+    Ok(())
+}
+
+/// Rebuild every ranking and score from leaderboard_entries. Run at startup,
+/// it also catches up on what per-group maintenance does not see: entries
+/// removed with a deleted user, and rankings from before this table existed.
+pub async fn rebuild_leaderboard_rankings(pool: &PgPool) -> Result<(), ApiError> {
+    let map_err = |e: sqlx::Error| ApiError::DatabaseError(format!("Failed to rebuild leaderboard rankings: {}", e));
+    let mut tx = pool.begin().await.map_err(map_err)?;
+    sqlx::query("SELECT pg_advisory_xact_lock($1)")
+        .bind(RANKING_LOCK_KEY)
+        .execute(&mut *tx)
+        .await
+        .map_err(map_err)?;
+    sqlx::query(
+        r#"
+        DELETE FROM leaderboard_rankings lr
+        WHERE NOT EXISTS (
+            SELECT 1 FROM leaderboard_entries le
+            WHERE le.challenge_id = lr.challenge_id AND le.language = lr.language AND le.user_id = lr.user_id
+        )
+        "#,
+    )
+    .execute(&mut *tx)
+    .await
+    .map_err(map_err)?;
+    sqlx::query(&RANK_GROUPS_SQL.replace("{filter}", "TRUE"))
+        .execute(&mut *tx)
+        .await
+        .map_err(map_err)?;
+    sqlx::query(r#"DELETE FROM leaderboard_scores ls WHERE NOT EXISTS (SELECT 1 FROM leaderboard_rankings lr WHERE lr.user_id = ls.user_id)"#)
+        .execute(&mut *tx)
+        .await
+        .map_err(map_err)?;
+    sqlx::query(&SCORE_USERS_SQL.replace("{filter}", "TRUE"))
+        .execute(&mut *tx)
+        .await
+        .map_err(map_err)?;
+    tx.commit().await.map_err(map_err)?;
+    Ok(())
+}
+
+/// Keep the entry with the lower instruction count. When `run_id` became the
+/// entry (a first entry or a new best) the rankings are brought up to date
+/// in the same transaction; the returned entry's run_id tells the two apart.
 pub async fn update_leaderboard_entry(
     pool: &PgPool,
     user_id: &Uuid,
@@ -1502,6 +1821,14 @@ pub async fn update_leaderboard_entry(
     source_code: &str,
     is_verified: bool,
 ) -> Result<LeaderboardEntry, ApiError> {
+    let map_err = |e: sqlx::Error| ApiError::DatabaseError(format!("Failed to update leaderboard entry: {}", e));
+    let mut tx = pool.begin().await.map_err(map_err)?;
+    sqlx::query("SELECT pg_advisory_xact_lock($1)")
+        .bind(RANKING_LOCK_KEY)
+        .execute(&mut *tx)
+        .await
+        .map_err(map_err)?;
+
     // Only update if this is a better score (lower instructions)
     let result: LeaderboardEntry = sqlx::query_as(
         r#"
@@ -1533,9 +1860,14 @@ pub async fn update_leaderboard_entry(
     .bind(run_id)
     .bind(source_code)
     .bind(is_verified)
-    .fetch_one(pool)
+    .fetch_one(&mut *tx)
     .await
-    .map_err(|e| ApiError::DatabaseError(format!("Failed to update leaderboard entry: {}", e)))?;
+    .map_err(map_err)?;
+
+    if result.run_id == *run_id {
+        rank_leaderboard_group(&mut tx, challenge_id, language).await.map_err(map_err)?;
+    }
+    tx.commit().await.map_err(map_err)?;
 
     Ok(result)
 }
@@ -1547,47 +1879,48 @@ pub async fn get_challenge_leaderboard(
     user_type: Option<&str>,
     limit: i64,
 ) -> Result<Vec<LeaderboardEntryWithUser>, ApiError> {
+    // Ranks are maintained by rank_leaderboard_group, so a page is one index range
     let results: Vec<(i64, Uuid, String, Option<String>, Option<String>, Option<String>, bool, String, DateTime<Utc>, i64, String, DateTime<Utc>)> =
         if let Some(lang) = language {
             if let Some(utype) = user_type {
                 sqlx::query_as(
                     r#"
                     SELECT
-                        ROW_NUMBER() OVER (ORDER BY le.instructions ASC) as rank,
+                        lr.type_rank,
                         u.id, u.username, u.avatar_url, u.display_name, u.twitter_handle,
                         COALESCE(u.is_verified, FALSE) as is_verified, COALESCE(u.user_type, 'human') as user_type, u.created_at,
-                        le.instructions, le.language, le.created_at as submitted_at
-                    FROM leaderboard_entries le
-                    JOIN users u ON le.user_id = u.id
-                    WHERE le.challenge_id = $1 AND le.language = $2 AND COALESCE(u.user_type, 'human') = $4
-                    ORDER BY le.instructions ASC
-                    LIMIT $3
+                        lr.instructions, lr.language, lr.submitted_at
+                    FROM leaderboard_rankings lr
+                    JOIN users u ON lr.user_id = u.id
+                    WHERE lr.challenge_id = $1 AND lr.user_type = $3 AND lr.language = $4
+                    ORDER BY lr.type_rank
+                    LIMIT $2
                     "#,
                 )
                 .bind(challenge_id)
-                .bind(lang)
                 .bind(limit)
                 .bind(utype)
+                .bind(lang)
                 .fetch_all(pool)
                 .await
             } else {
                 sqlx::query_as(
                     r#"
                     SELECT
-                        ROW_NUMBER() OVER (ORDER BY le.instructions ASC) as rank,
+                        lr.rank,
                         u.id, u.username, u.avatar_url, u.display_name, u.twitter_handle,
                         COALESCE(u.is_verified, FALSE) as is_verified, COALESCE(u.user_type, 'human') as user_type, u.created_at,
-                        le.instructions, le.language, le.created_at as submitted_at
-                    FROM leaderboard_entries le
-                    JOIN users u ON le.user_id = u.id
-                    WHERE le.challenge_id = $1 AND le.language = $2
-                    ORDER BY le.instructions ASC
-                    LIMIT $3
+                        lr.instructions, lr.language, lr.submitted_at
+                    FROM leaderboard_rankings lr
+                    JOIN users u ON lr.user_id = u.id
+                    WHERE lr.challenge_id = $1 AND lr.language = $3
+                    ORDER BY lr.rank
+                    LIMIT $2
                     "#,
                 )
                 .bind(challenge_id)
-                .bind(lang)
                 .bind(limit)
+                .bind(lang)
                 .fetch_all(pool)
                 .await
             }
@@ -1595,14 +1928,14 @@ pub async fn get_challenge_leaderboard(
             sqlx::query_as(
                 r#"
                 SELECT
-                    ROW_NUMBER() OVER (PARTITION BY le.language ORDER BY le.instructions ASC) as rank,
+                    lr.type_rank,
                     u.id, u.username, u.avatar_url, u.display_name, u.twitter_handle,
                     COALESCE(u.is_verified, FALSE) as is_verified, COALESCE(u.user_type, 'human') as user_type, u.created_at,
-                    le.instructions, le.language, le.created_at as submitted_at
-                FROM leaderboard_entries le
-                JOIN users u ON le.user_id = u.id
-                WHERE le.challenge_id = $1 AND COALESCE(u.user_type, 'human') = $3
-                ORDER BY le.language, le.instructions ASC
+                    lr.instructions, lr.language, lr.submitted_at
+                FROM leaderboard_rankings lr
+                JOIN users u ON lr.user_id = u.id
+                WHERE lr.challenge_id = $1 AND lr.user_type = $3
+                ORDER BY lr.language, lr.type_rank
                 LIMIT $2
                 "#,
             )
@@ -1615,14 +1948,14 @@ pub async fn get_challenge_leaderboard(
             sqlx::query_as(
                 r#"
                 SELECT
-                    ROW_NUMBER() OVER (PARTITION BY le.language ORDER BY le.instructions ASC) as rank,
+                    lr.rank,
                     u.id, u.username, u.avatar_url, u.display_name, u.twitter_handle,
                     COALESCE(u.is_verified, FALSE) as is_verified, COALESCE(u.user_type, 'human') as user_type, u.created_at,
-                    le.instructions, le.language, le.created_at as submitted_at
-                FROM leaderboard_entries le
-                JOIN users u ON le.user_id = u.id
-                WHERE le.challenge_id = $1
-                ORDER BY le.language, le.instructions ASC
+                    lr.instructions, lr.language, lr.submitted_at
+                FROM leaderboard_rankings lr
+                JOIN users u ON lr.user_id = u.id
+                WHERE lr.challenge_id = $1
+                ORDER BY lr.language, lr.rank
                 LIMIT $2
                 "#,
             )
@@ -1748,50 +2081,22 @@ pub async fn get_global_leaderboard(
     user_type: Option<&str>,
     limit: i64,
 ) -> Result<Vec<GlobalLeaderboardEntry>, ApiError> {
-    // Score = sum of (best_in_language / user_instructions * 1000) for each entry
-    // Plus bonus for #1 positions
+    // Scores are maintained by rank_leaderboard_group: the sum over a user's
+    // entries of best_in_language / user_instructions * 1000, 1000 for a #1.
+    // Ranking them is a scan of the score index up to `limit`.
     let results: Vec<(i64, Uuid, String, Option<String>, Option<String>, Option<String>, bool, String, DateTime<Utc>, i64, i64, i64)> =
         if let Some(utype) = user_type {
             sqlx::query_as(
                 r#"
-                WITH user_scores AS (
-                    SELECT
-                        le.user_id,
-                        COUNT(DISTINCT le.challenge_id) as challenges_completed,
-                        SUM(
-                            CASE
-                                WHEN le.instructions = (
-                                    SELECT MIN(le2.instructions)
-                                    FROM leaderboard_entries le2
-                                    WHERE le2.challenge_id = le.challenge_id AND le2.language = le.language
-                                ) THEN 1000
-                                ELSE (
-                                    SELECT MIN(le2.instructions)::float / le.instructions::float * 1000
-                                    FROM leaderboard_entries le2
-                                    WHERE le2.challenge_id = le.challenge_id AND le2.language = le.language
-                                )::bigint
-                            END
-                        ) as total_score,
-                        SUM(
-                            CASE WHEN le.instructions = (
-                                SELECT MIN(le2.instructions)
-                                FROM leaderboard_entries le2
-                                WHERE le2.challenge_id = le.challenge_id AND le2.language = le.language
-                            ) THEN 1 ELSE 0 END
-                        ) as first_places
-                    FROM leaderboard_entries le
-                    JOIN users u ON le.user_id = u.id
-                    WHERE COALESCE(u.user_type, 'human') = $2
-                    GROUP BY le.user_id
-                )
                 SELECT
-                    ROW_NUMBER() OVER (ORDER BY us.total_score DESC) as rank,
+                    ROW_NUMBER() OVER (ORDER BY ls.total_score DESC, ls.user_id) as rank,
                     u.id, u.username, u.avatar_url, u.display_name, u.twitter_handle,
                     COALESCE(u.is_verified, FALSE) as is_verified, COALESCE(u.user_type, 'human') as user_type, u.created_at,
-                    us.total_score, us.challenges_completed, us.first_places
-                FROM user_scores us
-                JOIN users u ON us.user_id = u.id
-                ORDER BY us.total_score DESC
+                    ls.total_score, ls.challenges_completed, ls.first_places
+                FROM leaderboard_scores ls
+                JOIN users u ON ls.user_id = u.id
+                WHERE ls.user_type = $2
+                ORDER BY ls.total_score DESC, ls.user_id
                 LIMIT $1
                 "#,
             )
@@ -1802,42 +2107,14 @@ pub async fn get_global_leaderboard(
         } else {
             sqlx::query_as(
                 r#"
-                WITH user_scores AS (
-                    SELECT
-                        le.user_id,
-                        COUNT(DISTINCT le.challenge_id) as challenges_completed,
-                        SUM(
-                            CASE
-                                WHEN le.instructions = (
-                                    SELECT MIN(le2.instructions)
-                                    FROM leaderboard_entries le2
-                                    WHERE le2.challenge_id = le.challenge_id AND le2.language = le.language
-                                ) THEN 1000
-                                ELSE (
-                                    SELECT MIN(le2.instructions)::float / le.instructions::float * 1000
-                                    FROM leaderboard_entries le2
-                                    WHERE le2.challenge_id = le.challenge_id AND le2.language = le.language
-                                )::bigint
-                            END
-                        ) as total_score,
-                        SUM(
-                            CASE WHEN le.instructions = (
-                                SELECT MIN(le2.instructions)
-                                FROM leaderboard_entries le2
-                                WHERE le2.challenge_id = le.challenge_id AND le2.language = le.language
-                            ) THEN 1 ELSE 0 END
-                        ) as first_places
-                    FROM leaderboard_entries le
-                    GROUP BY le.user_id
-                )
                 SELECT
-                    ROW_NUMBER() OVER (ORDER BY us.total_score DESC) as rank,
+                    ROW_NUMBER() OVER (ORDER BY ls.total_score DESC, ls.user_id) as rank,
                     u.id, u.username, u.avatar_url, u.display_name, u.twitter_handle,
                     COALESCE(u.is_verified, FALSE) as is_verified, COALESCE(u.user_type, 'human') as user_type, u.created_at,
-                    us.total_score, us.challenges_completed, us.first_places
-                FROM user_scores us
-                JOIN users u ON us.user_id = u.id
-                ORDER BY us.total_score DESC
+                    ls.total_score, ls.challenges_completed, ls.first_places
+                FROM leaderboard_scores ls
+                JOIN users u ON ls.user_id = u.id
+                ORDER BY ls.total_score DESC, ls.user_id
                 LIMIT $1
                 "#,
             )
@@ -0,0 +1,124 @@
+//! Leaderboard pages cached in memory between ranking changes.
+//!
+//! A page is dropped when its challenge's rankings change: locally by the
+//! request that changed them, on other API instances through
+//! `QueueClient::publish_leaderboard_update`. The TTL bounds how stale a
+//! page can get when an update is missed (NATS down, or a change made
+//! outside the API).
+
+use crate::db::{GlobalLeaderboardEntry, LeaderboardEntryWithUser};
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+/// Pages kept per kind; past it the cache is cleared rather than evicted
+/// entry by entry, since only odd query combinations get there
+const MAX_PAGES: usize = 1024;
+
+/// (challenge id, language, user type, limit)
+type ChallengeKey = (String, Option<String>, Option<String>, i64);
+/// (user type, limit)
+type GlobalKey = (Option<String>, i64);
+
+struct Cached<T> {
+    page: Arc<Vec<T>>,
+    at: Instant,
+}
+
+pub struct LeaderboardCache {
+    ttl: Duration,
+    challenges: Mutex<HashMap<ChallengeKey, Cached<LeaderboardEntryWithUser>>>,
+    global: Mutex<HashMap<GlobalKey, Cached<GlobalLeaderboardEntry>>>,
+}
+
+fn lookup<K: std::hash::Hash + Eq, T>(
+    map: &Mutex<HashMap<K, Cached<T>>>,
+    key: &K,
+    ttl: Duration,
+) -> Option<Arc<Vec<T>>> {
+    let map = map.lock().unwrap();
+    map.get(key).filter(|c| c.at.elapsed() < ttl).map(|c| c.page.clone())
+}
+
+fn store<K: std::hash::Hash + Eq, T>(map: &Mutex<HashMap<K, Cached<T>>>, key: K, page: Arc<Vec<T>>) {
+    let mut map = map.lock().unwrap();
+    if map.len() >= MAX_PAGES {
+        map.clear();
+    }
+    map.insert(key, Cached { page, at: Instant::now() });
+}
+
+impl LeaderboardCache {
+    /// A zero TTL disables caching
+    pub fn new(ttl_seconds: u64) -> Self {
+        Self {
+            ttl: Duration::from_secs(ttl_seconds),
+            challenges: Mutex::new(HashMap::new()),
+            global: Mutex::new(HashMap::new()),
+        }
+    }
+
+    pub fn enabled(&self) -> bool {
+        !self.ttl.is_zero()
+    }
+
+    pub fn challenge_page(
+        &self,
+        challenge_id: &str,
+        language: Option<&str>,
+        user_type: Option<&str>,
+        limit: i64,
+    ) -> Option<Arc<Vec<LeaderboardEntryWithUser>>> {
+        let key = (
+            challenge_id.to_string(),
+            language.map(str::to_string),
+            user_type.map(str::to_string),
+            limit,
+        );
+        lookup(&self.challenges, &key, self.ttl)
+    }
+
+    pub fn store_challenge_page(
+        &self,
+        challenge_id: &str,
+        language: Option<&str>,
+        user_type: Option<&str>,
+        limit: i64,
+        page: Arc<Vec<LeaderboardEntryWithUser>>,
+    ) {
+        if !self.enabled() {
+            return;
+        }
+        let key = (
+            challenge_id.to_string(),
+            language.map(str::to_string),
+            user_type.map(str::to_string),
+            limit,
+        );
+        store(&self.challenges, key, page);
+    }
+
+    pub fn global_page(&self, user_type: Option<&str>, limit: i64) -> Option<Arc<Vec<GlobalLeaderboardEntry>>> {
+        lookup(&self.global, &(user_type.map(str::to_string), limit), self.ttl)
+    }
+
+    pub fn store_global_page(&self, user_type: Option<&str>, limit: i64, page: Arc<Vec<GlobalLeaderboardEntry>>) {
+        if !self.enabled() {
+            return;
+        }
+        store(&self.global, (user_type.map(str::to_string), limit), page);
+    }
+
+    /// Drop the pages of one challenge (None: every challenge), and the
+    /// global pages its scores feed
+    pub fn invalidate(&self, challenge_id: Option<&str>) {
+        {
+            let mut challenges = self.challenges.lock().unwrap();
+            match challenge_id {
+                Some(id) => challenges.retain(|key, _| key.0 != id),
+                None => challenges.clear(),
+            }
+        }
+        self.global.lock().unwrap().clear();
+    }
+}
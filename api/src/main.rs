@@ -3,12 +3,15 @@ mod challenges;
 mod config;
 mod db;
 mod error;
+mod leaderboard_cache;
+mod profile;
 mod queue;
 mod sandbox;
 
 use axum::{
     extract::{DefaultBodyLimit, Multipart, Path, Query, State},
     http::{header, Method},
+    response::sse::{Event, KeepAlive, Sse},
     routing::{get, post, put},
     Json, Router,
 };
@@ -16,9 +19,11 @@ use db::{BinaryMetadata, Run, SaveRunRequest};
 use chrono::Utc;
 use config::Config;
 use error::ApiError;
-use queue::{CompileJob, CompileStatus, Job, JobStatus, Language, Optimization, QueueClient};
+use futures::{Stream, StreamExt};
+use queue::{CompileJob, CompileStatus, ExecMode, Job, JobMetadata, JobStatus, Language, Optimization, QueueClient};
 use serde::{Deserialize, Serialize};
 use sqlx::PgPool;
+use std::convert::Infallible;
 use std::sync::Arc;
 use std::time::Duration;
 use tokio::sync::Semaphore;
@@ -33,6 +38,7 @@ pub struct AppState {
     pub queue: Option<QueueClient>,
     pub db: Option<PgPool>,
     pub auth_config: Option<auth::AuthConfig>,
+    pub leaderboard_cache: leaderboard_cache::LeaderboardCache,
 }
 
 // ============ Benchmark Types ============
@@ -274,6 +280,8 @@ struct CompileResultResponse {
     binary_size: usize,
     compile_time_ms: u64,
     cached: bool,
+    #[serde(skip_serializing_if = "Vec::is_empty")]
+    variants: Vec<queue::TuneVariant>,
 }
 
 async fn health(State(state): State<Arc<AppState>>) -> Json<HealthResponse> {
@@ -317,6 +325,7 @@ async fn submit(
     let mut stdin: Vec<u8> = Vec::new();
     let mut benchmark_id: Option<String> = None;
     let mut env_vars: std::collections::HashMap<String, String> = std::collections::HashMap::new();
+    let mut mode = ExecMode::Qemu;
 
     // Parse multipart form
     while let Some(field) = multipart
@@ -384,6 +393,17 @@ async fn submit(
                 env_vars = serde_json::from_str(&text)
                     .map_err(|e| ApiError::InvalidField(format!("env_vars: {}", e)))?;
             }
+            "mode" => {
+                let text = field
+                    .text()
+                    .await
+                    .map_err(|e| ApiError::Internal(e.to_string()))?;
+                mode = match text.as_str() {
+                    "qemu" => ExecMode::Qemu,
+                    "native" => ExecMode::Native,
+                    _ => return Err(ApiError::InvalidField("mode must be qemu or native".into())),
+                };
+            }
             _ => {
                 warn!("Unknown field: {}", name);
             }
@@ -411,6 +431,11 @@ async fn submit(
     };
     let instruction_limit = instruction_limit.unwrap_or(state.config.default_instruction_limit);
 
+    // Benchmark runs are ranked, and only QEMU counts are exact
+    if mode == ExecMode::Native && benchmark_id.is_some() {
+        return Err(ApiError::InvalidField("native mode is not available for benchmark runs".into()));
+    }
+
     // Create job with binary_id reference (not the full binary data)
     let job = Job {
         id: Uuid::new_v4(),
@@ -422,6 +447,8 @@ async fn submit(
         benchmark_id,
         network_enabled: false,
         env_vars,
+        stdin_batch: Vec::new(),
+        mode,
     };
 
     let job_id = job.id;
@@ -431,6 +458,38 @@ async fn submit(
         let _ = db::record_submission(pool, None, &job_id, None).await;
     }
 
+    // Identical inputs already ran on this sandbox version: answer from the
+    // cache. Native results are never cached.
+    let cached = match job.mode {
+        ExecMode::Native => None,
+        ExecMode::Qemu => queue
+            .check_exec_cache(&job.binary_id, &job.stdin, job.instruction_limit, &job.env_vars, job.network_enabled)
+            .await
+            .unwrap_or_else(|e| {
+                warn!(job_id = %job_id, error = %e, "Execution cache lookup failed");
+                None
+            }),
+    };
+    if let Some(cached) = cached {
+        queue.complete_cached_job(&job, &cached.result).await?;
+        // The run is looked up by the new job's id
+        if let Some(ref pool) = state.db {
+            let copied = match pool.acquire().await {
+                Ok(mut conn) => db::copy_run(&mut conn, &cached.job_id, &job_id, job.benchmark_id.as_deref()).await,
+                Err(e) => Err(ApiError::DatabaseError(format!("Failed to acquire connection: {}", e))),
+            };
+            if let Err(e) = copied {
+                warn!(job_id = %job_id, error = %e, "Failed to copy cached run");
+            }
+        }
+        info!(job_id = %job_id, cached_job_id = %cached.job_id, "Job completed from execution cache");
+        return Ok(Json(SubmitResponse {
+            job_id,
+            status: "completed",
+            position: None,
+        }));
+    }
+
     // Submit to queue
     queue.submit_job(job).await?;
 
@@ -460,6 +519,10 @@ async fn status(
         .await?
         .ok_or_else(|| ApiError::JobNotFound(job_id.to_string()))?;
 
+    Ok(Json(status_response(queue, job_id, metadata).await))
+}
+
+async fn status_response(queue: &QueueClient, job_id: Uuid, metadata: JobMetadata) -> StatusResponse {
     // Get approximate position for pending jobs
     let position = if metadata.status == JobStatus::Pending {
         queue.get_queue_depth().await.ok()
@@ -467,7 +530,7 @@ async fn status(
         None
     };
 
-    Ok(Json(StatusResponse {
+    StatusResponse {
         job_id,
         status: format!("{:?}", metadata.status).to_lowercase(),
         position,
@@ -475,7 +538,57 @@ async fn status(
         started_at: metadata.started_at.map(|t| t.to_rfc3339()),
         completed_at: metadata.completed_at.map(|t| t.to_rfc3339()),
         error: metadata.error,
-    }))
+    }
+}
+
+enum JobEvent {
+    Status(JobMetadata),
+    Progress(String),
+}
+
+/// Server-sent events for one job instead of polling /status: a `status`
+/// event (the /status body) on every status change, starting with the
+/// current one, and a `progress` event with each of the worker's progress
+/// updates while the job runs. Ends after the completed or failed status.
+async fn status_stream(
+    State(state): State<Arc<AppState>>,
+    Path(job_id): Path<Uuid>,
+) -> Result<Sse<impl Stream<Item = Result<Event, Infallible>>>, ApiError> {
+    let queue = state
+        .queue
+        .as_ref()
+        .ok_or_else(|| ApiError::QueueError("Queue not available".to_string()))?;
+
+    if queue.get_job_status(&job_id).await?.is_none() {
+        return Err(ApiError::JobNotFound(job_id.to_string()));
+    }
+
+    // Subscribed first, so no update falls between the two
+    let updates = queue
+        .subscribe_progress(&job_id)
+        .await?
+        .map(|message| JobEvent::Progress(String::from_utf8_lossy(&message.payload).into_owned()));
+    let statuses = queue
+        .watch_job_status(&job_id)
+        .await?
+        .filter_map(|entry| async move { serde_json::from_slice::<JobMetadata>(&entry.ok()?.value).ok() })
+        .map(JobEvent::Status);
+    let events = Box::pin(futures::stream::select(statuses, updates));
+
+    let stream = futures::stream::unfold(Some((state.clone(), events)), move |next| async move {
+        let (state, mut events) = next?;
+        let (event, finished) = match events.next().await? {
+            JobEvent::Status(metadata) => {
+                let finished = matches!(metadata.status, JobStatus::Completed | JobStatus::Failed);
+                let response = status_response(state.queue.as_ref()?, job_id, metadata).await;
+                (Event::default().event("status").json_data(response).ok()?, finished)
+            }
+            JobEvent::Progress(update) => (Event::default().event("progress").data(update), false),
+        };
+        Some((Ok(event), (!finished).then_some((state, events))))
+    });
+
+    Ok(Sse::new(stream).keep_alive(KeepAlive::default()))
 }
 
 async fn result(
@@ -539,6 +652,9 @@ async fn compile(
     let mut language: Option<Language> = None;
     let mut optimization: Optimization = Optimization::Release;
     let mut flags: std::collections::HashMap<String, String> = std::collections::HashMap::new();
+    let mut training_stdin: Vec<String> = Vec::new();
+    let mut challenge_id: Option<String> = None;
+    let mut tune = false;
 
     // Parse multipart form
     while let Some(field) = multipart
@@ -596,6 +712,30 @@ async fn compile(
                     .map_err(|e| ApiError::Internal(e.to_string()))?;
                 flags.insert(flag_name, value);
             }
+            "training_stdin" => {
+                // One field per PGO training run
+                let text = field
+                    .text()
+                    .await
+                    .map_err(|e| ApiError::Internal(e.to_string()))?;
+                training_stdin.push(text);
+            }
+            "tune" => {
+                let text = field
+                    .text()
+                    .await
+                    .map_err(|e| ApiError::Internal(e.to_string()))?;
+                tune = text == "true";
+            }
+            "challenge_id" => {
+                // PGO and tune jobs run the challenge's test case inputs
+                challenge_id = Some(
+                    field
+                        .text()
+                        .await
+                        .map_err(|e| ApiError::Internal(e.to_string()))?,
+                );
+            }
             _ => {
                 warn!("Unknown field: {}", name);
             }
@@ -605,10 +745,32 @@ async fn compile(
     let source_code = source_code.ok_or(ApiError::MissingField("source_code"))?;
     let language = language.ok_or(ApiError::MissingField("language"))?;
 
-    // Check compile cache first
+    if tune && optimization == Optimization::Pgo {
+        return Err(ApiError::InvalidField("tune does not combine with optimization=pgo".to_string()));
+    }
+    if optimization != Optimization::Pgo && !tune {
+        training_stdin.clear();
+    } else if training_stdin.is_empty() {
+        let challenge_id = challenge_id.ok_or_else(|| {
+            ApiError::InvalidField("optimization=pgo and tune need training_stdin or challenge_id".to_string())
+        })?;
+        let pool = state
+            .db
+            .as_ref()
+            .ok_or_else(|| ApiError::DatabaseError("Database not available".to_string()))?;
+        let challenge = db::get_challenge(pool, &challenge_id)
+            .await?
+            .ok_or_else(|| ApiError::ChallengeNotFound(challenge_id))?;
+        let test_cases: Vec<db::TestCase> = serde_json::from_value(challenge.test_cases)
+            .map_err(|e| ApiError::Internal(format!("Invalid test cases: {}", e)))?;
+        training_stdin = test_cases.into_iter().map(|tc| tc.stdin).collect();
+    }
+
+    // Check compile cache first (tune results are cached by the worker under their own key)
     if let Ok(Some(cached_result)) = queue
-        .check_compile_cache(&source_code, language, optimization, &flags)
+        .check_compile_cache(&source_code, language, optimization, &flags, &training_stdin)
         .await
+        .map(|cached| cached.filter(|_| !tune))
     {
         info!(
             binary_id = %cached_result.binary_id,
@@ -626,6 +788,8 @@ async fn compile(
         language,
         optimization,
         flags,
+        training_stdin,
+        tune,
         created_at: Utc::now(),
     };
 
@@ -709,6 +873,7 @@ async fn compile_result(
                 binary_size: result.binary_size,
                 compile_time_ms: result.compile_time_ms,
                 cached: result.cached,
+                variants: result.variants,
             }))
         }
         CompileStatus::Failed => Err(ApiError::CompileError(
@@ -888,6 +1053,69 @@ async fn get_run_by_job(
     Ok(Json(run))
 }
 
+#[derive(Serialize)]
+struct RunDiffResponse {
+    base_run_id: Uuid,
+    other_run_id: Uuid,
+    base_instructions: i64,
+    other_instructions: i64,
+    instructions_delta: i64,
+    /// Block addresses are only comparable between runs of one binary
+    same_binary: bool,
+    /// False when either run was saved without a profile; the deltas are empty
+    profiled: bool,
+    functions: Vec<profile::FunctionDelta>,
+    blocks: Vec<profile::BlockDelta>,
+}
+
+async fn diff_runs(
+    State(state): State<Arc<AppState>>,
+    Path((run_id, other_id)): Path<(Uuid, Uuid)>,
+) -> Result<Json<RunDiffResponse>, ApiError> {
+    let pool = state
+        .db
+        .as_ref()
+        .ok_or_else(|| ApiError::DatabaseError("Database not available".to_string()))?;
+
+    let base = db::get_run(pool, &run_id)
+        .await?
+        .ok_or_else(|| ApiError::NotFound(format!("Run '{}' not found", run_id)))?;
+    let other = db::get_run(pool, &other_id)
+        .await?
+        .ok_or_else(|| ApiError::NotFound(format!("Run '{}' not found", other_id)))?;
+    // Native counts are approximate and carry kernel noise: no exact deltas
+    if base.mode != "qemu" || other.mode != "qemu" {
+        return Err(ApiError::InvalidField("native-mode runs cannot be diffed".into()));
+    }
+
+    let base_profile = db::get_run_profile(pool, &run_id).await?.as_deref().and_then(profile::decode);
+    let other_profile = db::get_run_profile(pool, &other_id).await?.as_deref().and_then(profile::decode);
+    let same_binary = base.binary_id == other.binary_id;
+
+    let (profiled, diff) = match (base_profile, other_profile) {
+        (Some(b), Some(o)) => {
+            let mut diff = profile::diff(&b, &o);
+            if !same_binary {
+                diff.blocks.clear();
+            }
+            (true, diff)
+        }
+        _ => (false, profile::ProfileDiff { functions: Vec::new(), blocks: Vec::new() }),
+    };
+
+    Ok(Json(RunDiffResponse {
+        base_run_id: base.id,
+        other_run_id: other.id,
+        base_instructions: base.instructions,
+        other_instructions: other.instructions,
+        instructions_delta: other.instructions - base.instructions,
+        same_binary,
+        profiled,
+        functions: diff.functions,
+        blocks: diff.blocks,
+    }))
+}
+
 async fn list_runs(
     State(state): State<Arc<AppState>>,
     Query(query): Query<ListRunsQuery>,
@@ -916,6 +1144,7 @@ struct StoreBinaryQuery {
     optimization: Option<String>,
     compiler_version: Option<String>,
     compile_flags: Option<String>, // JSON string
+    baseline_binary_id: Option<String>,
 }
 
 async fn store_binary(
@@ -946,6 +1175,7 @@ async fn store_binary(
         optimization: query.optimization,
         compiler_version: query.compiler_version,
         compile_flags,
+        baseline_binary_id: query.baseline_binary_id,
     };
 
     if let Err(e) = db::store_binary(pool, &binary_id, &body, Some(&metadata)).await {
@@ -1070,37 +1300,23 @@ async fn execute(
             benchmark_id: None,
             network_enabled: false,
             env_vars: std::collections::HashMap::new(),
+            stdin_batch: Vec::new(),
+            mode: ExecMode::Qemu,
         };
         let job_id = job.id;
         queue.submit_job(job).await?;
 
-        // Poll for result with timeout
+        // Wait for the result with timeout; the worker stores it before
+        // marking the job completed
         let timeout = Duration::from_secs(state.config.timeout_sec);
-        let start = std::time::Instant::now();
-
-        loop {
-            if start.elapsed() > timeout {
-                return Err(ApiError::Timeout(state.config.timeout_sec));
-            }
-
-            if let Some(metadata) = queue.get_job_status(&job_id).await? {
-                match metadata.status {
-                    JobStatus::Completed => {
-                        if let Some(result) = queue.get_job_result(&job_id).await? {
-                            return Ok(Json(result));
-                        }
-                    }
-                    JobStatus::Failed => {
-                        return Err(ApiError::Internal(
-                            metadata.error.unwrap_or_else(|| "Job failed".to_string()),
-                        ));
-                    }
-                    _ => {}
-                }
-            }
-
-            tokio::time::sleep(Duration::from_millis(100)).await;
+        let metadata = queue.wait_for_job(&job_id, timeout).await?;
+        if metadata.status == JobStatus::Failed {
+            return Err(ApiError::Internal(
+                metadata.error.unwrap_or_else(|| "Job failed".to_string()),
+            ));
         }
+        let result = queue.get_job_result(&job_id).await?.ok_or(ApiError::JobNotReady)?;
+        return Ok(Json(result));
     }
 
     // Fallback: direct execution (original behavior)
@@ -1209,7 +1425,13 @@ async fn main() {
     );
 
     // Try to connect to NATS (optional - fallback to direct execution)
-    let queue = match QueueClient::connect(&config.nats_url, config.job_ttl_seconds, config.binary_ttl_seconds).await {
+    let queue = match QueueClient::connect(
+        &config.nats_url,
+        config.job_ttl_seconds,
+        config.binary_ttl_seconds,
+        config.exec_cache_ttl_seconds,
+    )
+    .await {
         Ok(q) => {
             info!("Connected to NATS at {}", config.nats_url);
             Some(q)
@@ -1227,6 +1449,9 @@ async fn main() {
                 warn!("Failed to run migrations: {}", e);
             } else {
                 info!("Connected to PostgreSQL and ran migrations");
+                if let Err(e) = db::rebuild_leaderboard_rankings(&pool).await {
+                    warn!("Failed to rebuild leaderboard rankings: {}", e);
+                }
             }
             // Try to seed challenges
             if let Err(e) = challenges::seed_challenges(&pool).await {
@@ -1250,12 +1475,31 @@ async fn main() {
 
     let state = Arc::new(AppState {
         semaphore: Semaphore::new(config.max_concurrent),
+        leaderboard_cache: leaderboard_cache::LeaderboardCache::new(config.leaderboard_cache_ttl_seconds),
         config,
         queue,
         db,
         auth_config,
     });
 
+    // Drop cached leaderboard pages when another instance changes rankings
+    if let Some(queue) = &state.queue {
+        match queue.subscribe_leaderboard_updates().await {
+            Ok(mut updates) => {
+                let state = state.clone();
+                tokio::spawn(async move {
+                    while let Some(msg) = updates.next().await {
+                        let challenge_id = std::str::from_utf8(&msg.payload).unwrap_or_default();
+                        state
+                            .leaderboard_cache
+                            .invalidate(Some(challenge_id).filter(|id| !id.is_empty()));
+                    }
+                });
+            }
+            Err(e) => warn!("Failed to subscribe to leaderboard updates: {}", e),
+        }
+    }
+
     // Configure CORS - when using credentials, we can't use wildcards
     let frontend_url = std::env::var("FRONTEND_URL").unwrap_or_else(|_| "http://localhost:8080".to_string());
     let allowed_origins: Vec<_> = frontend_url
@@ -1279,6 +1523,7 @@ async fn main() {
         .route("/execute", post(execute))
         .route("/submit", post(submit))
         .route("/status/:job_id", get(status))
+        .route("/status/:job_id/stream", get(status_stream))
         .route("/result/:job_id", get(result))
         .route("/queue/stats", get(queue_stats))
         // Compile endpoints
@@ -1296,6 +1541,7 @@ async fn main() {
         // Runs endpoints (permanent storage)
         .route("/runs", post(save_run).get(list_runs))
         .route("/runs/:id", get(get_run))
+        .route("/runs/:id/diff/:other_id", get(diff_runs))
         .route("/runs/job/:job_id", get(get_run_by_job))
         // Auth endpoints
         .route("/auth/github", get(auth::github_login))
@@ -0,0 +1,214 @@
+//! Compact per-run profile blob, stored with each run, and diffs between two.
+//!
+//! The blob keeps a run's block profile sorted by address and its function
+//! breakdown sorted by name, so two runs diff in one linear merge of each.
+//! Layout (version 1), integers as unsigned LEB128 varints:
+//!   "CTFP", u8 version
+//!   block count, then per block: address delta from the previous block,
+//!   length in instructions, executions
+//!   function count, then per function: name length, name bytes, instructions
+//! A block's instructions are its length times its executions, so they are
+//! not stored. The plugin reports the hottest PROFILE_TOP blocks and
+//! functions, so an entry missing from one run was not absent there, just
+//! colder than its top; diffs leave its count unknown rather than zero.
+
+use crate::sandbox::{BlockProfile, FunctionProfile};
+use serde::Serialize;
+use std::cmp::Ordering;
+
+const BLOB_MAGIC: &[u8; 4] = b"CTFP";
+const BLOB_VERSION: u8 = 1;
+
+pub struct Profile {
+    /// (address, length, executions), ascending by address then length
+    blocks: Vec<(u64, u64, u64)>,
+    /// (name, instructions), ascending by name
+    functions: Vec<(String, u64)>,
+}
+
+fn put_varint(out: &mut Vec<u8>, mut v: u64) {
+    while v >= 0x80 {
+        out.push((v as u8) | 0x80);
+        v >>= 7;
+    }
+    out.push(v as u8);
+}
+
+fn get_varint(data: &mut &[u8]) -> Option<u64> {
+    let mut v = 0u64;
+    for shift in (0..64).step_by(7) {
+        let (&byte, rest) = data.split_first()?;
+        *data = rest;
+        v |= u64::from(byte & 0x7f) << shift;
+        if byte & 0x80 == 0 {
+            return Some(v);
+        }
+    }
+    None
+}
+
+/// Blob for a run's profile, None when the run was not profiled
+pub fn encode(blocks: &[BlockProfile], functions: &[FunctionProfile]) -> Option<Vec<u8>> {
+    if blocks.is_empty() && functions.is_empty() {
+        return None;
+    }
+
+    let mut sorted_blocks: Vec<(u64, u64, u64)> = blocks
+        .iter()
+        .filter_map(|b| {
+            let addr = u64::from_str_radix(b.addr.trim_start_matches("0x"), 16).ok()?;
+            Some((addr, b.len, b.execs))
+        })
+        .collect();
+    sorted_blocks.sort_unstable();
+    let mut sorted_functions: Vec<&FunctionProfile> = functions.iter().collect();
+    sorted_functions.sort_unstable_by(|a, b| a.name.cmp(&b.name));
+
+    let mut out = Vec::with_capacity(8 + sorted_blocks.len() * 8 + sorted_functions.len() * 24);
+    out.extend_from_slice(BLOB_MAGIC);
+    out.push(BLOB_VERSION);
+    put_varint(&mut out, sorted_blocks.len() as u64);
+    let mut prev = 0;
+    for &(addr, len, execs) in &sorted_blocks {
+        put_varint(&mut out, addr - prev);
+        put_varint(&mut out, len);
+        put_varint(&mut out, execs);
+        prev = addr;
+    }
+    put_varint(&mut out, sorted_functions.len() as u64);
+    for f in sorted_functions {
+        put_varint(&mut out, f.name.len() as u64);
+        out.extend_from_slice(f.name.as_bytes());
+        put_varint(&mut out, f.instructions);
+    }
+    Some(out)
+}
+
+/// Profile from a blob, None if it is not a version this API reads
+pub fn decode(blob: &[u8]) -> Option<Profile> {
+    let mut data = blob.strip_prefix(BLOB_MAGIC)?;
+    let (&version, rest) = data.split_first()?;
+    if version != BLOB_VERSION {
+        return None;
+    }
+    data = rest;
+
+    // Counts come from the blob; cap the reservation by what it could hold
+    let count = get_varint(&mut data)? as usize;
+    let mut blocks = Vec::with_capacity(count.min(data.len() / 3));
+    let mut addr = 0u64;
+    for _ in 0..count {
+        addr = addr.checked_add(get_varint(&mut data)?)?;
+        blocks.push((addr, get_varint(&mut data)?, get_varint(&mut data)?));
+    }
+
+    let count = get_varint(&mut data)? as usize;
+    let mut functions = Vec::with_capacity(count.min(data.len() / 2));
+    for _ in 0..count {
+        let len = get_varint(&mut data)? as usize;
+        if len > data.len() {
+            return None;
+        }
+        let (name, rest) = data.split_at(len);
+        data = rest;
+        functions.push((String::from_utf8_lossy(name).into_owned(), get_varint(&mut data)?));
+    }
+
+    Some(Profile { blocks, functions })
+}
+
+#[derive(Debug, Serialize)]
+pub struct FunctionDelta {
+    pub name: String,
+    /// Instructions in each run; None when outside that run's reported top
+    pub base: Option<u64>,
+    pub other: Option<u64>,
+    /// other - base, when both are known
+    pub delta: Option<i64>,
+}
+
+#[derive(Debug, Serialize)]
+pub struct BlockDelta {
+    pub addr: String,
+    pub len: u64,
+    pub base: Option<u64>,
+    pub other: Option<u64>,
+    pub delta: Option<i64>,
+}
+
+#[derive(Debug, Serialize)]
+pub struct ProfileDiff {
+    pub functions: Vec<FunctionDelta>,
+    pub blocks: Vec<BlockDelta>,
+}
+
+/// Linear merge of two ascending lists: (key, base value, other value) for
+/// every key in either
+fn merge<K: Ord + Clone>(base: &[(K, u64)], other: &[(K, u64)]) -> Vec<(K, Option<u64>, Option<u64>)> {
+    let mut out = Vec::with_capacity(base.len().max(other.len()));
+    let (mut i, mut j) = (0, 0);
+    while i < base.len() || j < other.len() {
+        let order = match (base.get(i), other.get(j)) {
+            (Some(a), Some(b)) => a.0.cmp(&b.0),
+            (Some(_), None) => Ordering::Less,
+            _ => Ordering::Greater,
+        };
+        match order {
+            Ordering::Less => {
+                out.push((base[i].0.clone(), Some(base[i].1), None));
+                i += 1;
+            }
+            Ordering::Greater => {
+                out.push((other[j].0.clone(), None, Some(other[j].1)));
+                j += 1;
+            }
+            Ordering::Equal => {
+                out.push((base[i].0.clone(), Some(base[i].1), Some(other[j].1)));
+                i += 1;
+                j += 1;
+            }
+        }
+    }
+    out
+}
+
+fn delta(base: Option<u64>, other: Option<u64>) -> Option<i64> {
+    Some(other? as i64 - base? as i64)
+}
+
+/// Biggest known changes first, then entries known on one side only by size
+fn by_change(a: (Option<i64>, Option<u64>, Option<u64>), b: (Option<i64>, Option<u64>, Option<u64>)) -> Ordering {
+    match (a.0, b.0) {
+        (Some(x), Some(y)) => y.unsigned_abs().cmp(&x.unsigned_abs()),
+        (Some(_), None) => Ordering::Less,
+        (None, Some(_)) => Ordering::Greater,
+        (None, None) => b.1.max(b.2).cmp(&a.1.max(a.2)),
+    }
+}
+
+/// Per-function and per-block deltas from `base` to `other`. Block addresses
+/// only line up between runs of the same binary.
+pub fn diff(base: &Profile, other: &Profile) -> ProfileDiff {
+    let mut functions: Vec<FunctionDelta> = merge(&base.functions, &other.functions)
+        .into_iter()
+        .map(|(name, b, o)| FunctionDelta { name, base: b, other: o, delta: delta(b, o) })
+        .collect();
+    functions.sort_by(|x, y| by_change((x.delta, x.base, x.other), (y.delta, y.base, y.other)));
+
+    let instructions = |blocks: &[(u64, u64, u64)]| -> Vec<((u64, u64), u64)> {
+        blocks.iter().map(|&(addr, len, execs)| ((addr, len), len * execs)).collect()
+    };
+    let mut blocks: Vec<BlockDelta> = merge(&instructions(&base.blocks), &instructions(&other.blocks))
+        .into_iter()
+        .map(|((addr, len), b, o)| BlockDelta {
+            addr: format!("0x{:x}", addr),
+            len,
+            base: b,
+            other: o,
+            delta: delta(b, o),
+        })
+        .collect();
+    blocks.sort_by(|x, y| by_change((x.delta, x.base, x.other), (y.delta, y.base, y.other)));
+
+    ProfileDiff { functions, blocks }
+}
@@ -1,7 +1,8 @@
 use crate::error::ApiError;
 use crate::sandbox::ExecutionResult;
-use async_nats::jetstream::{self, kv::Store, stream::Stream};
+use async_nats::jetstream::{self, kv::{Store, Watch}, stream::Stream};
 use chrono::{DateTime, Utc};
+use futures::StreamExt;
 use serde::{Deserialize, Serialize};
 use sha2::{Digest, Sha256};
 use std::sync::Arc;
@@ -16,6 +17,14 @@ const COMPILES_STREAM: &str = "COMPILES";
 const COMPILES_KV: &str = "compiles";
 const BINARIES_KV: &str = "binaries";
 const COMPILE_CACHE_KV: &str = "compile_cache";
+const EXEC_CACHE_KV: &str = "exec_cache";
+/// Key in EXEC_CACHE_KV naming the sandbox image version (published by the worker)
+const SANDBOX_VERSION_KEY: &str = "sandbox_version";
+/// Workers publish running jobs' progress on `progress.<job id>` (core NATS)
+const PROGRESS_SUBJECT: &str = "progress";
+/// API instances publish a challenge id here after its rankings changed, or
+/// an empty payload when every leaderboard may have (core NATS)
+const LEADERBOARD_SUBJECT: &str = "leaderboard.updated";
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct Job {
@@ -32,6 +41,44 @@ pub struct Job {
     pub network_enabled: bool,
     #[serde(default)]
     pub env_vars: std::collections::HashMap<String, String>,
+    /// Multi-input job: when non-empty the worker fetches the binary once and
+    /// runs it once per entry (`stdin` is ignored), storing a `BatchResult`
+    #[serde(default)]
+    pub stdin_batch: Vec<Vec<u8>>,
+    #[serde(default)]
+    pub mode: ExecMode,
+}
+
+/// How the worker executes a job. `Native` runs the binary under hardware
+/// counters: much faster but approximate, so never used for scoring.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum ExecMode {
+    #[default]
+    Qemu,
+    Native,
+}
+
+/// One case of a multi-input job. `job_id` is the per-case id its run was
+/// persisted under.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct BatchCaseResult {
+    pub job_id: Uuid,
+    pub result: Option<ExecutionResult>,
+    pub error: Option<String>,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct BatchResult {
+    pub cases: Vec<BatchCaseResult>,
+}
+
+/// Execution cache entry written by the worker; `job_id` is the job the
+/// result was first produced (and persisted as a run) under
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct CachedExecution {
+    pub job_id: Uuid,
+    pub result: ExecutionResult,
 }
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
@@ -173,6 +220,8 @@ pub enum Optimization {
     #[default]
     Release,
     Size,
+    /// Release, rebuilt with the profile of a run on the job's training inputs
+    Pgo,
 }
 
 impl Optimization {
@@ -181,6 +230,7 @@ impl Optimization {
             "debug" => Some(Optimization::Debug),
             "release" => Some(Optimization::Release),
             "size" => Some(Optimization::Size),
+            "pgo" => Some(Optimization::Pgo),
             _ => None,
         }
     }
@@ -190,6 +240,7 @@ impl Optimization {
             Optimization::Debug => "debug",
             Optimization::Release => "release",
             Optimization::Size => "size",
+            Optimization::Pgo => "pgo",
         }
     }
 }
@@ -205,6 +256,13 @@ pub struct CompileJob {
     pub optimization: Optimization,
     #[serde(default)]
     pub flags: HashMap<String, String>,
+    /// Stdin of each training run for `optimization=pgo`, or of each
+    /// round of a tune job
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub training_stdin: Vec<String>,
+    /// Search compiler flags for the lowest-instruction build
+    #[serde(default, skip_serializing_if = "std::ops::Not::not")]
+    pub tune: bool,
     pub created_at: DateTime<Utc>,
 }
 
@@ -233,9 +291,32 @@ pub struct CompileResult {
     pub binary_size: usize,
     pub compile_time_ms: u64,
     pub cached: bool,
+    /// Tune jobs: every variant tried, best first; binary_id is the best's
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub variants: Vec<TuneVariant>,
 }
 
-fn compute_cache_key(source: &str, language: Language, optimization: Optimization, flags: &HashMap<String, String>) -> String {
+/// One build a tune job tried
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct TuneVariant {
+    pub flags: HashMap<String, String>,
+    pub binary_id: Option<String>,
+    /// Instructions summed over the inputs it ran
+    pub instructions: u64,
+    /// Inputs run before it won, was halved out, or failed
+    pub inputs_run: usize,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub error: Option<String>,
+}
+
+/// Compile cache key. Must match `compute_cache_key` in compile-worker/src/main.rs.
+fn compute_cache_key(
+    source: &str,
+    language: Language,
+    optimization: Optimization,
+    flags: &HashMap<String, String>,
+    training_stdin: &[String],
+) -> String {
     let mut hasher = Sha256::new();
     hasher.update(source.as_bytes());
     hasher.update(language.as_str().as_bytes());
@@ -249,10 +330,47 @@ fn compute_cache_key(source: &str, language: Language, optimization: Optimizatio
         hasher.update(v.as_bytes());
         hasher.update(b";");
     }
+    // A PGO build is only as good as what it trained on
+    for stdin in training_stdin {
+        hasher.update(b"stdin=");
+        hasher.update(Sha256::digest(stdin.as_bytes()));
+    }
+    hex::encode(hasher.finalize())
+}
+
+/// Execution cache key: everything that determines the plugin's output. The
+/// runner's own plugin env is part of `sandbox_version`.
+/// Must match `compute_exec_cache_key` in worker/src/main.rs.
+fn compute_exec_cache_key(
+    sandbox_version: &str,
+    binary_id: &str,
+    stdin: &[u8],
+    instruction_limit: u64,
+    env_vars: &HashMap<String, String>,
+) -> String {
+    let mut hasher = Sha256::new();
+    hasher.update(sandbox_version.as_bytes());
+    hasher.update(b";");
+    hasher.update(binary_id.as_bytes());
+    hasher.update(b";");
+    hasher.update(hex::encode(Sha256::digest(stdin)).as_bytes());
+    hasher.update(b";");
+    hasher.update(instruction_limit.to_string().as_bytes());
+    hasher.update(b";");
+    // Sort env vars for consistent hashing
+    let mut env_pairs: Vec<_> = env_vars.iter().collect();
+    env_pairs.sort_by_key(|(k, _)| *k);
+    for (k, v) in env_pairs {
+        hasher.update(k.as_bytes());
+        hasher.update(b"=");
+        hasher.update(v.as_bytes());
+        hasher.update(b";");
+    }
     hex::encode(hasher.finalize())
 }
 
 pub struct QueueClient {
+    client: async_nats::Client,
     jetstream: jetstream::Context,
     jobs_stream: Arc<RwLock<Stream>>,
     jobs_kv: Store,
@@ -261,10 +379,16 @@ pub struct QueueClient {
     compiles_kv: Store,
     binaries_kv: Store,
     compile_cache_kv: Store,
+    exec_cache_kv: Store,
 }
 
 impl QueueClient {
-    pub async fn connect(nats_url: &str, job_ttl_seconds: u64, binary_ttl_seconds: u64) -> Result<Self, ApiError> {
+    pub async fn connect(
+        nats_url: &str,
+        job_ttl_seconds: u64,
+        binary_ttl_seconds: u64,
+        exec_cache_ttl_seconds: u64,
+    ) -> Result<Self, ApiError> {
         // Use longer request timeout for large binary operations
         let nats_options = async_nats::ConnectOptions::new()
             .request_timeout(Some(std::time::Duration::from_secs(120)));
@@ -273,7 +397,7 @@ impl QueueClient {
             .await
             .map_err(|e| ApiError::QueueError(format!("Failed to connect to NATS: {}", e)))?;
 
-        let jetstream = jetstream::new(client);
+        let jetstream = jetstream::new(client.clone());
 
         // Create or get the JOBS stream (work queue pattern)
         let jobs_stream = jetstream
@@ -359,7 +483,20 @@ impl QueueClient {
             .await
             .map_err(|e| ApiError::QueueError(format!("Failed to create compile_cache KV: {}", e)))?;
 
+        // Create or get the exec_cache KV bucket for execution inputs -> result,
+        // filled by the worker
+        let exec_cache_kv = jetstream
+            .create_key_value(jetstream::kv::Config {
+                bucket: EXEC_CACHE_KV.to_string(),
+                max_age: Duration::from_secs(exec_cache_ttl_seconds),
+                storage: jetstream::stream::StorageType::File,
+                ..Default::default()
+            })
+            .await
+            .map_err(|e| ApiError::QueueError(format!("Failed to create exec_cache KV: {}", e)))?;
+
         Ok(Self {
+            client,
             jetstream,
             jobs_stream: Arc::new(RwLock::new(jobs_stream)),
             jobs_kv,
@@ -368,6 +505,7 @@ impl QueueClient {
             compiles_kv,
             binaries_kv,
             compile_cache_kv,
+            exec_cache_kv,
         })
     }
 
@@ -423,6 +561,61 @@ impl QueueClient {
         }
     }
 
+    /// Every change to a job's metadata, starting with its current value
+    pub async fn watch_job_status(&self, job_id: &Uuid) -> Result<Watch, ApiError> {
+        self.jobs_kv
+            .watch_with_history(job_id.to_string())
+            .await
+            .map_err(|e| ApiError::QueueError(format!("Failed to watch job status: {}", e)))
+    }
+
+    /// Wait until a job completed or failed, woken by its status changes
+    /// instead of polling them
+    pub async fn wait_for_job(&self, job_id: &Uuid, timeout: Duration) -> Result<JobMetadata, ApiError> {
+        let mut watch = self.watch_job_status(job_id).await?;
+        let finished = async {
+            while let Some(entry) = watch.next().await {
+                let entry = entry.map_err(|e| ApiError::QueueError(format!("Failed to watch job status: {}", e)))?;
+                let Ok(metadata) = serde_json::from_slice::<JobMetadata>(&entry.value) else { continue };
+                if matches!(metadata.status, JobStatus::Completed | JobStatus::Failed) {
+                    return Ok(metadata);
+                }
+            }
+            Err(ApiError::QueueError("Job status watch ended".to_string()))
+        };
+
+        tokio::time::timeout(timeout, finished)
+            .await
+            .map_err(|_| ApiError::Timeout(timeout.as_secs()))?
+    }
+
+    /// Progress updates the worker publishes while the job runs. They are
+    /// not stored: a subscriber only sees those published after it joined.
+    pub async fn subscribe_progress(&self, job_id: &Uuid) -> Result<async_nats::Subscriber, ApiError> {
+        self.client
+            .subscribe(format!("{}.{}", PROGRESS_SUBJECT, job_id))
+            .await
+            .map_err(|e| ApiError::QueueError(format!("Failed to subscribe to job progress: {}", e)))
+    }
+
+    /// Tell every API instance that a challenge's leaderboard (None: all of
+    /// them) changed, so they drop cached pages. Core NATS: an instance that
+    /// misses it serves its cache until the TTL.
+    pub async fn publish_leaderboard_update(&self, challenge_id: Option<&str>) -> Result<(), ApiError> {
+        let payload = challenge_id.unwrap_or_default().as_bytes().to_vec();
+        self.client
+            .publish(LEADERBOARD_SUBJECT, payload.into())
+            .await
+            .map_err(|e| ApiError::QueueError(format!("Failed to publish leaderboard update: {}", e)))
+    }
+
+    pub async fn subscribe_leaderboard_updates(&self) -> Result<async_nats::Subscriber, ApiError> {
+        self.client
+            .subscribe(LEADERBOARD_SUBJECT)
+            .await
+            .map_err(|e| ApiError::QueueError(format!("Failed to subscribe to leaderboard updates: {}", e)))
+    }
+
     pub async fn get_job_result(&self, job_id: &Uuid) -> Result<Option<ExecutionResult>, ApiError> {
         let key = job_id.to_string();
 
@@ -440,6 +633,23 @@ impl QueueClient {
         }
     }
 
+    pub async fn get_batch_result(&self, job_id: &Uuid) -> Result<Option<BatchResult>, ApiError> {
+        let key = job_id.to_string();
+
+        match self.results_kv.get(&key).await {
+            Ok(Some(entry)) => {
+                let result: BatchResult = serde_json::from_slice(&entry)
+                    .map_err(|e| ApiError::Internal(format!("Failed to parse batch result: {}", e)))?;
+                Ok(Some(result))
+            }
+            Ok(None) => Ok(None),
+            Err(e) => Err(ApiError::QueueError(format!(
+                "Failed to get batch result: {}",
+                e
+            ))),
+        }
+    }
+
     pub async fn get_queue_depth(&self) -> Result<u64, ApiError> {
         let mut stream = self.jobs_stream.write().await;
         let info = stream
@@ -509,6 +719,66 @@ impl QueueClient {
         Ok(())
     }
 
+    /// Look up a previous execution with the same inputs on the current sandbox
+    /// version. Network-enabled jobs are never cached.
+    pub async fn check_exec_cache(
+        &self,
+        binary_id: &str,
+        stdin: &[u8],
+        instruction_limit: u64,
+        env_vars: &HashMap<String, String>,
+        network_enabled: bool,
+    ) -> Result<Option<CachedExecution>, ApiError> {
+        if network_enabled {
+            return Ok(None);
+        }
+
+        let version = match self.exec_cache_kv.get(SANDBOX_VERSION_KEY).await {
+            Ok(Some(v)) => String::from_utf8_lossy(&v).into_owned(),
+            Ok(None) => return Ok(None), // No worker has published a version yet
+            Err(e) => return Err(ApiError::QueueError(format!("Failed to check exec cache: {}", e))),
+        };
+        let cache_key = compute_exec_cache_key(&version, binary_id, stdin, instruction_limit, env_vars);
+
+        match self.exec_cache_kv.get(&cache_key).await {
+            Ok(Some(entry)) => {
+                let cached: CachedExecution = serde_json::from_slice(&entry)
+                    .map_err(|e| ApiError::Internal(format!("Failed to parse cache entry: {}", e)))?;
+                Ok(Some(cached))
+            }
+            Ok(None) => Ok(None),
+            Err(e) => Err(ApiError::QueueError(format!(
+                "Failed to check exec cache: {}",
+                e
+            ))),
+        }
+    }
+
+    /// Record a job as completed with a cached result without queueing it
+    pub async fn complete_cached_job(&self, job: &Job, result: &ExecutionResult) -> Result<(), ApiError> {
+        let now = Utc::now();
+        let metadata = JobMetadata {
+            status: JobStatus::Completed,
+            created_at: job.created_at,
+            started_at: Some(now),
+            completed_at: Some(now),
+            error: None,
+        };
+
+        self.store_job_result(&job.id, result).await?;
+        self.jobs_kv
+            .put(
+                &job.id.to_string(),
+                serde_json::to_vec(&metadata)
+                    .map_err(|e| ApiError::Internal(e.to_string()))?
+                    .into(),
+            )
+            .await
+            .map_err(|e| ApiError::QueueError(format!("Failed to store job metadata: {}", e)))?;
+
+        Ok(())
+    }
+
     // ============ Compile Methods ============
 
     pub async fn submit_compile_job(&self, job: CompileJob) -> Result<(), ApiError> {
@@ -608,8 +878,9 @@ impl QueueClient {
         language: Language,
         optimization: Optimization,
         flags: &HashMap<String, String>,
+        training_stdin: &[String],
     ) -> Result<Option<CompileResult>, ApiError> {
-        let cache_key = compute_cache_key(source, language, optimization, flags);
+        let cache_key = compute_cache_key(source, language, optimization, flags, training_stdin);
 
         match self.compile_cache_kv.get(&cache_key).await {
             Ok(Some(entry)) => {
@@ -5,17 +5,43 @@ use regex::bytes::Regex;
 use serde::{Deserialize, Serialize};
 use std::os::unix::fs::PermissionsExt;
 use std::sync::LazyLock;
+use std::path::Path;
 use std::time::Instant;
-use tempfile::NamedTempFile;
-use tokio::io::AsyncWriteExt;
+use tempfile::{NamedTempFile, TempDir};
+use tokio::io::{AsyncBufReadExt, AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::net::TcpStream;
 use tokio::process::Command;
+use tracing::warn;
+use uuid::Uuid;
 
 static STATS_REGEX: LazyLock<Regex> =
     LazyLock::new(|| Regex::new(r"\n(\{[^\n]+\})\n?$").unwrap());
 
-#[derive(Debug, Deserialize)]
+/// Stats record the plugin writes to its stats file (see STATS_MAGIC in
+/// sandbox/plugin/sandbox.c): magic, version, header size, nonce, payload length
+const STATS_MAGIC: &[u8; 8] = b"CTFSTATS";
+const STATS_VERSION: u32 = 1;
+const STATS_HEADER_SIZE: usize = 40;
+/// The guest can write the stats file too; a plugin record never gets near this
+const MAX_STATS_SIZE: u64 = 64 * 1024 * 1024;
+
+#[derive(Debug, Default, Deserialize)]
 struct PluginStats {
     instructions: u64,
+    #[serde(default)]
+    mode: Option<String>,
+    #[serde(default)]
+    cycles: Option<u64>,
+    #[serde(default)]
+    cycles_estimate: Option<u64>,
+    #[serde(default)]
+    loads: Option<u64>,
+    #[serde(default)]
+    stores: Option<u64>,
+    #[serde(default)]
+    l1_misses: Option<u64>,
+    #[serde(default)]
+    l2_misses: Option<u64>,
     memory_peak_kb: u64,
     #[serde(default)]
     memory_rss_kb: u64,
@@ -36,6 +62,9 @@ struct PluginStats {
     guest_mmap_peak: u64,
     #[serde(default)]
     guest_heap_bytes: u64,
+    /// Peak pages the guest touched and still had mapped, with RSS=on
+    #[serde(default)]
+    guest_rss_peak_bytes: Option<u64>,
     limit_reached: bool,
     #[serde(default)]
     syscalls: u64,
@@ -43,11 +72,65 @@ struct PluginStats {
     syscall_cost: u64,
     #[serde(default)]
     syscall_breakdown: std::collections::HashMap<String, u64>,
+    #[serde(default)]
+    syscall_cost_breakdown: std::collections::HashMap<String, u64>,
+    #[serde(default)]
+    thread_breakdown: Vec<ThreadStats>,
+    #[serde(default)]
+    roi_instructions: Option<u64>,
+    #[serde(default)]
+    roi_regions: u64,
+    #[serde(default)]
+    profile: Vec<BlockProfile>,
+    #[serde(default)]
+    functions: Vec<FunctionProfile>,
+}
+
+/// Per-vCPU (guest thread) counters from the plugin
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ThreadStats {
+    pub vcpu: u32,
+    pub instructions: u64,
+    pub syscalls: u64,
+}
+
+/// One translation block from the plugin's profile=on output
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct BlockProfile {
+    pub addr: String,
+    pub len: u64,
+    pub execs: u64,
+    pub instructions: u64,
+}
+
+/// Instructions attributed to one function symbol (`[unknown]` outside any)
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct FunctionProfile {
+    pub name: String,
+    pub instructions: u64,
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct ExecutionResult {
     pub instructions: u64,
+    /// "qemu" (exact, emulated) or "native" (hardware counters)
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub mode: Option<String>,
+    /// Measured user-space cycles, native mode only
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub cycles: Option<u64>,
+    /// Weighted cost from the plugin's cost model, when one is loaded
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub cycles_estimate: Option<u64>,
+    /// Guest memory accesses and the cache model's misses, with MEM=on
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub loads: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub stores: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub l1_misses: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub l2_misses: Option<u64>,
     pub memory_peak_kb: u64,
     #[serde(default)]
     pub memory_rss_kb: u64,
@@ -68,6 +151,8 @@ pub struct ExecutionResult {
     pub guest_mmap_peak: u64,
     #[serde(default)]
     pub guest_heap_bytes: u64,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub guest_rss_peak_bytes: Option<u64>,
     pub limit_reached: bool,
     pub exit_code: i32,
     pub stdout: String,
@@ -77,6 +162,28 @@ pub struct ExecutionResult {
     pub syscalls: u64,
     #[serde(default)]
     pub syscall_breakdown: std::collections::HashMap<String, u64>,
+    /// Virtual instructions charged per syscall, when a syscall cost table is loaded
+    #[serde(default, skip_serializing_if = "std::collections::HashMap::is_empty")]
+    pub syscall_cost_breakdown: std::collections::HashMap<String, u64>,
+    #[serde(default)]
+    pub thread_breakdown: Vec<ThreadStats>,
+    /// Instructions minus the empty-program baseline for the binary's runtime,
+    /// filled in by the worker when a baseline is known
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub instructions_net: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub baseline_instructions: Option<u64>,
+    /// Instructions inside ROI markers, when the guest has any
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub roi_instructions: Option<u64>,
+    #[serde(default)]
+    pub roi_regions: u64,
+    /// Hottest translation blocks, present when the sandbox runs with PROFILE=on
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub profile: Vec<BlockProfile>,
+    /// Instructions per function symbol, alongside `profile`
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub functions: Vec<FunctionProfile>,
 }
 
 pub async fn execute(
@@ -85,6 +192,10 @@ pub async fn execute(
     stdin: Vec<u8>,
     config: &Config,
 ) -> Result<ExecutionResult, ApiError> {
+    if let Some(addr) = &config.sandbox_runner_addr {
+        return execute_runner(&binary, instruction_limit, &stdin, config, addr).await;
+    }
+
     // Write binary to temp file
     let temp_file = NamedTempFile::new().map_err(|e| ApiError::Internal(e.to_string()))?;
     let binary_path = temp_file.path().to_path_buf();
@@ -111,6 +222,9 @@ pub async fn execute(
         .await
         .map_err(|e| ApiError::Internal(e.to_string()))?;
 
+    let nonce = *Uuid::new_v4().as_bytes();
+    let stats_dir = create_stats_dir(&nonce).await?;
+
     let start = Instant::now();
 
     // Build docker command
@@ -127,6 +241,10 @@ pub async fn execute(
         "--tmpfs=/var:rw,nosuid,size=16m",
         "-e",
         &format!("LIMIT={}", instruction_limit),
+        "-e",
+        "STATS_FILE=/stats/stats",
+        "-v",
+        &format!("{}:/stats", stats_dir.path().display()),
         "-v",
         &format!("{}:/work/binary:ro", binary_path.display()),
         &config.sandbox_image,
@@ -163,53 +281,204 @@ pub async fn execute(
         Err(_) => return Err(ApiError::Timeout(config.timeout_sec)),
     };
 
-    // Parse plugin stats from stderr
-    let mut stderr = output.stderr;
-    let stats = if let Some(captures) = STATS_REGEX.captures(&stderr) {
-        let json_match = captures.get(1).unwrap();
-        let stats: PluginStats = serde_json::from_slice(json_match.as_bytes())
-            .unwrap_or(PluginStats {
-                instructions: 0,
-                memory_peak_kb: 0,
-                memory_rss_kb: 0,
-                memory_hwm_kb: 0,
-                memory_data_kb: 0,
-                memory_stack_kb: 0,
-                io_read_bytes: 0,
-                io_write_bytes: 0,
-                guest_mmap_bytes: 0,
-                guest_mmap_peak: 0,
-                guest_heap_bytes: 0,
-                limit_reached: false,
-                syscalls: 0,
-                syscall_cost: 0,
-                syscall_breakdown: std::collections::HashMap::new(),
-            });
-        // Remove stats JSON from stderr
-        stderr.truncate(json_match.start() - 1); // -1 for the leading \n
-        stats
-    } else {
-        PluginStats {
-            instructions: 0,
-            memory_peak_kb: 0,
-            memory_rss_kb: 0,
-            memory_hwm_kb: 0,
-            memory_data_kb: 0,
-            memory_stack_kb: 0,
-            io_read_bytes: 0,
-            io_write_bytes: 0,
-            guest_mmap_bytes: 0,
-            guest_mmap_peak: 0,
-            guest_heap_bytes: 0,
-            limit_reached: false,
-            syscalls: 0,
-            syscall_cost: 0,
-            syscall_breakdown: std::collections::HashMap::new(),
+    let record = read_stats_file(&stats_dir.path().join("stats")).await;
+    build_result(
+        output.status.code().unwrap_or(-1),
+        &output.stdout,
+        output.stderr,
+        StatsChannel::Record(stats_payload(&record, &nonce)),
+        execution_time_ms,
+    )
+}
+
+/// Per-run directory mounted at /stats, with the stats file seeded with the
+/// nonce the plugin must put in its record
+async fn create_stats_dir(nonce: &[u8; 16]) -> Result<TempDir, ApiError> {
+    let dir = tempfile::tempdir().map_err(|e| ApiError::Internal(e.to_string()))?;
+    let path = dir.path().join("stats");
+    tokio::fs::write(&path, nonce)
+        .await
+        .map_err(|e| ApiError::Internal(e.to_string()))?;
+    tokio::fs::set_permissions(&path, std::fs::Permissions::from_mode(0o666))
+        .await
+        .map_err(|e| ApiError::Internal(e.to_string()))?;
+    Ok(dir)
+}
+
+async fn read_stats_file(path: &Path) -> Vec<u8> {
+    let mut data = Vec::new();
+    if let Ok(file) = tokio::fs::File::open(path).await {
+        let _ = file.take(MAX_STATS_SIZE).read_to_end(&mut data).await;
+    }
+    data
+}
+
+/// Where a run's plugin stats come from
+enum StatsChannel<'a> {
+    /// The line at the end of stderr (runners without stats files)
+    Stderr,
+    /// The stats record's payload, None when the run left no valid record
+    Record(Option<&'a [u8]>),
+}
+
+/// JSON payload of a stats record, borrowed from `record`, if it is a version
+/// this API reads and carries the run's nonce
+fn stats_payload<'a>(record: &'a [u8], nonce: &[u8; 16]) -> Option<&'a [u8]> {
+    if record.len() < STATS_HEADER_SIZE || &record[..8] != STATS_MAGIC {
+        return None;
+    }
+    let version = u32::from_le_bytes(record[8..12].try_into().ok()?);
+    let header_size = u32::from_le_bytes(record[12..16].try_into().ok()?) as usize;
+    if version != STATS_VERSION || header_size < STATS_HEADER_SIZE || &record[16..32] != nonce {
+        return None;
+    }
+    let length = usize::try_from(u64::from_le_bytes(record[32..40].try_into().ok()?)).ok()?;
+    record.get(header_size..header_size.checked_add(length)?)
+}
+
+#[derive(Debug, Serialize)]
+struct RunnerRequest<'a> {
+    limit: u64,
+    binary_size: usize,
+    stdin_size: usize,
+    network: bool,
+    timeout_sec: u64,
+    stats_nonce: String,
+    token: &'a str,
+}
+
+#[derive(Debug, Deserialize)]
+struct RunnerResponse {
+    exit_code: i32,
+    stdout_size: usize,
+    stderr_size: usize,
+    /// Size of the stats file that follows stderr; absent from runners that
+    /// leave the stats on stderr
+    #[serde(default)]
+    stats_size: Option<usize>,
+    error: Option<String>,
+}
+
+/// Run on the long-lived sandbox runner (sandbox/runner/runner.py)
+/// instead of starting a fresh container
+async fn execute_runner(
+    binary: &[u8],
+    instruction_limit: u64,
+    stdin: &[u8],
+    config: &Config,
+    addr: &str,
+) -> Result<ExecutionResult, ApiError> {
+    let start = Instant::now();
+    let nonce = *Uuid::new_v4().as_bytes();
+
+    let exchange = async {
+        let stream = TcpStream::connect(addr)
+            .await
+            .map_err(|e| ApiError::DockerError(format!("Failed to connect to sandbox runner {}: {}", addr, e)))?;
+        let (reader, mut writer) = stream.into_split();
+
+        let request = RunnerRequest {
+            limit: instruction_limit,
+            binary_size: binary.len(),
+            stdin_size: stdin.len(),
+            network: false,
+            timeout_sec: config.timeout_sec,
+            stats_nonce: hex::encode(nonce),
+            token: &config.sandbox_runner_token,
+        };
+        let mut header = serde_json::to_vec(&request).map_err(|e| ApiError::Internal(e.to_string()))?;
+        header.push(b'\n');
+        writer.write_all(&header).await.map_err(|e| ApiError::DockerError(e.to_string()))?;
+        writer.write_all(binary).await.map_err(|e| ApiError::DockerError(e.to_string()))?;
+        writer.write_all(stdin).await.map_err(|e| ApiError::DockerError(e.to_string()))?;
+        writer.flush().await.map_err(|e| ApiError::DockerError(e.to_string()))?;
+
+        let mut reader = BufReader::new(reader);
+        let mut line = Vec::new();
+        reader
+            .read_until(b'\n', &mut line)
+            .await
+            .map_err(|e| ApiError::DockerError(e.to_string()))?;
+        let response: RunnerResponse = serde_json::from_slice(&line)
+            .map_err(|e| ApiError::DockerError(format!("Invalid runner response: {}", e)))?;
+
+        let mut stdout = vec![0u8; response.stdout_size];
+        reader.read_exact(&mut stdout).await.map_err(|e| ApiError::DockerError(e.to_string()))?;
+        let mut stderr = vec![0u8; response.stderr_size];
+        reader.read_exact(&mut stderr).await.map_err(|e| ApiError::DockerError(e.to_string()))?;
+        let mut stats = vec![0u8; response.stats_size.unwrap_or(0).min(MAX_STATS_SIZE as usize)];
+        reader.read_exact(&mut stats).await.map_err(|e| ApiError::DockerError(e.to_string()))?;
+
+        Ok::<_, ApiError>((response, stdout, stderr, stats))
+    };
+
+    // Leave the runner a moment past its own timeout to report back
+    let (response, stdout, stderr, stats) = match tokio::time::timeout(
+        std::time::Duration::from_secs(config.timeout_sec + 5),
+        exchange,
+    )
+    .await
+    {
+        Ok(result) => result?,
+        Err(_) => return Err(ApiError::Timeout(config.timeout_sec)),
+    };
+
+    if let Some(error) = response.error {
+        return Err(ApiError::DockerError(error));
+    }
+
+    let execution_time_ms = start.elapsed().as_millis() as u64;
+    let channel = match response.stats_size {
+        Some(_) => StatsChannel::Record(stats_payload(&stats, &nonce)),
+        None => StatsChannel::Stderr,
+    };
+    build_result(response.exit_code, &stdout, stderr, channel, execution_time_ms)
+}
+
+/// Parse the plugin stats (splitting the line off stderr when they are there)
+/// and assemble the result. A run that was given a stats file but left no
+/// readable record there is an error, never a 0-instruction result: the guest
+/// can lose the record on purpose (closing the plugin's fd, SIGKILL).
+fn build_result(
+    exit_code: i32,
+    stdout: &[u8],
+    mut stderr: Vec<u8>,
+    channel: StatsChannel,
+    execution_time_ms: u64,
+) -> Result<ExecutionResult, ApiError> {
+    let stats = match channel {
+        // Guest stderr is left alone: a stats-looking line there is just output
+        StatsChannel::Record(Some(payload)) => serde_json::from_slice(payload).map_err(|e| {
+            warn!("Unreadable sandbox stats record: {}", e);
+            ApiError::DockerError(format!("Unreadable sandbox stats record: {}", e))
+        })?,
+        StatsChannel::Record(None) => {
+            warn!("Sandbox left no valid stats record");
+            return Err(ApiError::DockerError("Sandbox left no valid stats record".to_string()));
+        }
+        StatsChannel::Stderr => {
+            if let Some(captures) = STATS_REGEX.captures(&stderr) {
+                let json_match = captures.get(1).unwrap();
+                let stats: PluginStats = serde_json::from_slice(json_match.as_bytes())
+                    .unwrap_or(PluginStats::default());
+                // Remove stats JSON from stderr
+                stderr.truncate(json_match.start() - 1); // -1 for the leading \n
+                stats
+            } else {
+                PluginStats::default()
+            }
         }
     };
 
     Ok(ExecutionResult {
         instructions: stats.instructions,
+        mode: stats.mode,
+        cycles: stats.cycles,
+        cycles_estimate: stats.cycles_estimate,
+        loads: stats.loads,
+        stores: stats.stores,
+        l1_misses: stats.l1_misses,
+        l2_misses: stats.l2_misses,
         memory_peak_kb: stats.memory_peak_kb,
         memory_rss_kb: stats.memory_rss_kb,
         memory_hwm_kb: stats.memory_hwm_kb,
@@ -220,13 +489,22 @@ pub async fn execute(
         guest_mmap_bytes: stats.guest_mmap_bytes,
         guest_mmap_peak: stats.guest_mmap_peak,
         guest_heap_bytes: stats.guest_heap_bytes,
+        guest_rss_peak_bytes: stats.guest_rss_peak_bytes,
         limit_reached: stats.limit_reached,
-        exit_code: output.status.code().unwrap_or(-1),
-        stdout: BASE64.encode(&output.stdout),
+        exit_code,
+        stdout: BASE64.encode(stdout),
         stderr: BASE64.encode(&stderr),
         execution_time_ms,
         syscalls: stats.syscalls,
         syscall_breakdown: stats.syscall_breakdown,
+        syscall_cost_breakdown: stats.syscall_cost_breakdown,
+        thread_breakdown: stats.thread_breakdown,
+        instructions_net: None,
+        baseline_instructions: None,
+        roi_instructions: stats.roi_instructions,
+        roi_regions: stats.roi_regions,
+        profile: stats.profile,
+        functions: stats.functions,
     })
 }
 
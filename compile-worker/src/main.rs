@@ -1,22 +1,31 @@
+mod warm_pool;
+
 use async_nats::jetstream::{self, consumer::PullConsumer, kv::Store};
 use chrono::{DateTime, Utc};
 use futures::StreamExt;
 use serde::{Deserialize, Serialize};
 use sha2::{Digest, Sha256};
+use std::cmp::Reverse;
 use std::collections::HashMap;
 use std::env;
+use std::future::Future;
+use std::os::unix::fs::PermissionsExt;
+use std::path::Path;
+use std::sync::Arc;
 use std::time::{Duration, Instant};
 use tempfile::TempDir;
 use tokio::io::AsyncWriteExt;
 use tokio::process::Command;
+use tokio::sync::Semaphore;
 use tracing::{error, info, warn};
 use uuid::Uuid;
+use warm_pool::{WarmLease, WarmPool};
 
 const COMPILES_STREAM: &str = "COMPILES";
 const COMPILES_KV: &str = "compiles";
 const COMPILE_CACHE_KV: &str = "compile_cache";
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Serialize, Deserialize)]
 #[serde(rename_all = "lowercase")]
 pub enum Language {
     // Tier 1: Native compilation
@@ -134,6 +143,8 @@ pub enum Optimization {
     #[default]
     Release,
     Size,
+    /// Release, rebuilt with the profile of a run on the job's training inputs
+    Pgo,
 }
 
 impl Optimization {
@@ -142,6 +153,7 @@ impl Optimization {
             Optimization::Debug => "debug",
             Optimization::Release => "release",
             Optimization::Size => "size",
+            Optimization::Pgo => "pgo",
         }
     }
 }
@@ -155,6 +167,13 @@ pub struct CompileJob {
     pub optimization: Optimization,
     #[serde(default)]
     pub flags: HashMap<String, String>,
+    /// Stdin of each training run for `optimization=pgo`, or of each
+    /// round of a tune job
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub training_stdin: Vec<String>,
+    /// Search the flags in `tune_matrix` for the lowest-instruction build
+    #[serde(default, skip_serializing_if = "std::ops::Not::not")]
+    pub tune: bool,
     pub created_at: DateTime<Utc>,
 }
 
@@ -183,16 +202,51 @@ pub struct CompileResult {
     pub binary_size: usize,
     pub compile_time_ms: u64,
     pub cached: bool,
+    /// Tune jobs: every variant tried, best first; binary_id is the best's
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub variants: Vec<TuneVariant>,
+}
+
+/// One build a tune job tried
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct TuneVariant {
+    /// The job's flags plus the values this variant tried
+    pub flags: HashMap<String, String>,
+    pub binary_id: Option<String>,
+    /// Instructions summed over the inputs it ran
+    pub instructions: u64,
+    /// Inputs run before it won, was halved out, or failed
+    pub inputs_run: usize,
+    /// Why it dropped out: compile error, failed run, or output unlike the
+    /// untuned build's
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub error: Option<String>,
 }
 
 struct Config {
     nats_url: String,
     api_url: String,
     compiler_image: String,
+    /// Image id of compiler_image, resolved at startup; keys baselines per rollout
+    compiler_image_digest: Option<String>,
     memory_limit_mb: u32,
     timeout_sec: u64,
     job_ttl_seconds: u64,
     binary_ttl_seconds: u64,
+    /// Image the PGO training runs execute in
+    sandbox_image: String,
+    /// Instruction limit of each PGO training run and tune run
+    training_limit: u64,
+    /// Tune variants compiled, and run, at once
+    tune_parallelism: usize,
+    /// Tune jobs run at once, each beside the compile loop
+    tune_concurrency: usize,
+    /// Languages given pre-started compiler containers, and how many each
+    warm_pool_languages: Vec<Language>,
+    warm_pool_size: usize,
+    warm_pool: Option<Arc<WarmPool>>,
+    /// Host dir of precompiled C++ headers shared between compiles
+    pch_dir: Option<String>,
 }
 
 impl Config {
@@ -201,6 +255,7 @@ impl Config {
             nats_url: env::var("NATS_URL").unwrap_or_else(|_| "nats://localhost:4222".to_string()),
             api_url: env::var("API_URL").unwrap_or_else(|_| "http://ctf-api:3000".to_string()),
             compiler_image: env::var("COMPILER_IMAGE").unwrap_or_else(|_| "compiler".to_string()),
+            compiler_image_digest: None,
             memory_limit_mb: env::var("COMPILE_MEMORY_LIMIT_MB")
                 .ok()
                 .and_then(|s| s.parse().ok())
@@ -217,11 +272,48 @@ impl Config {
                 .ok()
                 .and_then(|s| s.parse().ok())
                 .unwrap_or(86400),
+            sandbox_image: env::var("SANDBOX_IMAGE").unwrap_or_else(|_| "sandbox".to_string()),
+            training_limit: env::var("TRAINING_LIMIT")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(1_000_000_000),
+            tune_parallelism: env::var("TUNE_PARALLELISM")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .filter(|&n| n > 0)
+                .unwrap_or(4),
+            tune_concurrency: env::var("TUNE_CONCURRENCY")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .filter(|&n| n > 0)
+                .unwrap_or(1),
+            warm_pool_languages: env::var("WARM_POOL_LANGUAGES")
+                .unwrap_or_else(|_| "c,cpp".to_string())
+                .split(',')
+                .filter_map(|name| serde_json::from_value(serde_json::Value::String(name.trim().to_string())).ok())
+                .collect(),
+            warm_pool_size: env::var("WARM_POOL_SIZE")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(2),
+            warm_pool: None,
+            // Mounted into compiler containers, so a path the Docker daemon sees
+            pch_dir: match env::var("PCH_CACHE_DIR") {
+                Ok(dir) if dir.is_empty() => None,
+                Ok(dir) => Some(dir),
+                Err(_) => Some("/tmp/pch-cache".to_string()),
+            },
         }
     }
 }
 
-fn compute_cache_key(source: &str, language: Language, optimization: Optimization, flags: &HashMap<String, String>) -> String {
+fn compute_cache_key(
+    source: &str,
+    language: Language,
+    optimization: Optimization,
+    flags: &HashMap<String, String>,
+    training_stdin: &[String],
+) -> String {
     let mut hasher = Sha256::new();
     hasher.update(source.as_bytes());
     hasher.update(language.as_str().as_bytes());
@@ -235,9 +327,126 @@ fn compute_cache_key(source: &str, language: Language, optimization: Optimizatio
         hasher.update(v.as_bytes());
         hasher.update(b";");
     }
+    // A PGO build is only as good as what it trained on
+    for stdin in training_stdin {
+        hasher.update(b"stdin=");
+        hasher.update(Sha256::digest(stdin.as_bytes()));
+    }
     hex::encode(hasher.finalize())
 }
 
+/// Smallest valid program per language, compiled as the startup baseline the
+/// execution worker subtracts for `instructions_net`. Languages without one
+/// get no baseline.
+fn empty_program(language: Language) -> Option<&'static str> {
+    match language {
+        Language::C | Language::Cpp => Some("int main(void) { return 0; }\n"),
+        Language::Rust => Some("fn main() {}\n"),
+        Language::Go => Some("package main\n\nfunc main() {}\n"),
+        Language::Zig => Some("pub fn main() void {}\n"),
+        Language::Nim => Some("discard\n"),
+        Language::Pascal => Some("program Empty;\nbegin\nend.\n"),
+        Language::Ocaml => Some("let () = ()\n"),
+        Language::Swift => Some("\n"),
+        Language::Haskell => Some("main :: IO ()\nmain = return ()\n"),
+        Language::Csharp => Some("return;\n"),
+        Language::Java => Some("public class Main {\n    public static void main(String[] args) {}\n}\n"),
+        Language::Kotlin => Some("fun main() {}\n"),
+        Language::Python
+        | Language::Javascript
+        | Language::Typescript
+        | Language::Bun
+        | Language::Deno
+        | Language::Node
+        | Language::Lua
+        | Language::Perl
+        | Language::Tcl => Some("\n"),
+        Language::Php => Some("<?php\n"),
+        _ => None,
+    }
+}
+
+/// Compile cache key of a job's baseline: its empty program with the same
+/// language, optimization and flags, on the current compiler image
+fn compute_baseline_key(language: Language, optimization: Optimization, flags: &HashMap<String, String>, image_digest: &str) -> Option<String> {
+    let source = empty_program(language)?;
+    let mut hasher = Sha256::new();
+    hasher.update(b"baseline;");
+    hasher.update(image_digest.as_bytes());
+    hasher.update(b";");
+    hasher.update(compute_cache_key(source, language, optimization, flags, &[]).as_bytes());
+    Some(format!("baseline-{}", hex::encode(hasher.finalize())))
+}
+
+/// Id of the image a tag currently points at
+async fn resolve_image_digest(image: &str) -> Option<String> {
+    let output = Command::new("docker")
+        .args(["image", "inspect", "--format", "{{.Id}}", image])
+        .output()
+        .await
+        .ok()?;
+    if !output.status.success() {
+        return None;
+    }
+    let digest = String::from_utf8_lossy(&output.stdout).trim().to_string();
+    (!digest.is_empty()).then_some(digest)
+}
+
+/// Binary id of the job's baseline, compiling it the first time this
+/// language/optimization/flags combination is seen on this compiler image
+async fn ensure_baseline(
+    job: &CompileJob,
+    config: &Config,
+    http_client: &reqwest::Client,
+    compile_cache_kv: &Store,
+) -> Option<String> {
+    let digest = config.compiler_image_digest.as_deref()?;
+    let key = compute_baseline_key(job.language, job.optimization, &job.flags, digest)?;
+
+    if let Ok(Some(entry)) = compile_cache_kv.get(&key).await {
+        if let Ok(cached) = serde_json::from_slice::<CompileResult>(&entry) {
+            return Some(cached.binary_id);
+        }
+    }
+
+    let baseline_job = CompileJob {
+        id: Uuid::new_v4(),
+        user_id: None,
+        source_code: empty_program(job.language)?.to_string(),
+        language: job.language,
+        optimization: job.optimization,
+        flags: job.flags.clone(),
+        training_stdin: Vec::new(),
+        tune: false,
+        created_at: Utc::now(),
+    };
+    let start = Instant::now();
+    let output = compile_source(&baseline_job, config, None)
+        .await
+        .map_err(|e| warn!(language = ?job.language, "Baseline compile failed: {}", e))
+        .ok()?;
+
+    let result = store_compile_result(
+        http_client,
+        &config.api_url,
+        compile_cache_kv,
+        &key,
+        &output.binary,
+        start.elapsed().as_millis() as u64,
+        job.language,
+        job.optimization,
+        output.compiler_version.as_deref(),
+        output.compile_flags.as_ref(),
+        None,
+    )
+    .await
+    .map_err(|e| warn!(language = ?job.language, "Failed to store baseline: {}", e))
+    .ok()?;
+
+    info!(language = ?job.language, optimization = ?job.optimization, binary_id = %result.binary_id, "Baseline compiled");
+    Some(result.binary_id)
+}
+
 fn compute_binary_id(binary: &[u8]) -> String {
     let hash = Sha256::digest(binary);
     format!("sha256-{}", hex::encode(hash))
@@ -249,11 +458,81 @@ struct CompileOutput {
     compile_flags: Option<serde_json::Value>,
 }
 
-async fn compile_source(job: &CompileJob, config: &Config) -> Result<CompileOutput, String> {
-    // Create temp directory for compilation
-    let temp_dir = TempDir::new().map_err(|e| format!("Failed to create temp dir: {}", e))?;
-    let work_dir = temp_dir.path();
+/// Phase of a profile-guided build, passed to the compile scripts as PGO
+#[derive(Clone, Copy)]
+enum Pgo<'a> {
+    /// Instrumented build that writes its profile to /pgo on exit
+    Generate,
+    /// Rebuild fed the profile in this directory
+    Use(&'a Path),
+}
+
+/// Languages whose compile scripts build with a profile; the rest compile
+/// `pgo` as `release`
+fn supports_pgo(language: Language) -> bool {
+    matches!(language, Language::C | Language::Cpp | Language::Rust)
+}
+
+/// Whether every flag value is a single plain token. The compile scripts
+/// splice FLAG_* values into command lines unquoted, so any other value can
+/// add options of its own; such jobs compile in a container of their own,
+/// without the warm pool or the shared header cache.
+fn plain_flags(flags: &HashMap<String, String>) -> bool {
+    flags
+        .values()
+        .all(|v| v.chars().all(|c| c.is_ascii_alphanumeric() || "._+-=,".contains(c)))
+}
+
+async fn compile_source(job: &CompileJob, config: &Config, pgo: Option<Pgo<'_>>) -> Result<CompileOutput, String> {
+    // A PGO rebuild mounts its profile, which a running container cannot take
+    let warm = match (&config.warm_pool, pgo) {
+        (_, Some(Pgo::Use(_))) => None,
+        (Some(pool), _) if plain_flags(&job.flags) => pool.take(job.language),
+        _ => None,
+    };
+    if let Some(lease) = warm {
+        match compile_in(job, config, pgo, Some(&lease)).await {
+            Some(result) => return result,
+            None => warn!("Warm container {} is gone, compiling in a new one", lease.name()),
+        }
+    }
+    compile_in(job, config, pgo, None)
+        .await
+        .unwrap_or_else(|| Err("Compilation failed: no compiler container".to_string()))
+}
+
+/// Compile in the leased warm container, or in a new one without a lease.
+/// None when the warm container no longer runs.
+async fn compile_in(
+    job: &CompileJob,
+    config: &Config,
+    pgo: Option<Pgo<'_>>,
+    warm: Option<&WarmLease>,
+) -> Option<Result<CompileOutput, String>> {
+    let temp_dir;
+    let work_dir = match warm {
+        Some(lease) => lease.work_dir(),
+        None => match TempDir::new() {
+            Ok(dir) => {
+                temp_dir = dir;
+                temp_dir.path()
+            }
+            Err(e) => return Some(Err(format!("Failed to create temp dir: {}", e))),
+        },
+    };
+    Some(compile_in_dir(job, config, pgo, warm, work_dir).await).filter(|result| match (warm, result) {
+        (Some(_), Err(e)) => !e.contains("No such container") && !e.contains("is not running"),
+        _ => true,
+    })
+}
 
+async fn compile_in_dir(
+    job: &CompileJob,
+    config: &Config,
+    pgo: Option<Pgo<'_>>,
+    warm: Option<&WarmLease>,
+    work_dir: &Path,
+) -> Result<CompileOutput, String> {
     // Write source file
     let source_filename = format!("source.{}", job.language.source_extension());
     let source_path = work_dir.join(&source_filename);
@@ -269,18 +548,39 @@ async fn compile_source(job: &CompileJob, config: &Config) -> Result<CompileOutp
         .map_err(|e| format!("Failed to sync source: {}", e))?;
     drop(file);
 
+    let pch_dir = config
+        .pch_dir
+        .as_deref()
+        .filter(|_| job.language == Language::Cpp && plain_flags(&job.flags));
+
     // Build docker command
     let mut cmd = Command::new("docker");
+    match warm {
+        // Started with the same limits and mounts as below
+        Some(_) => {
+            cmd.args(["exec", "-w", "/work"]);
+        }
+        None => {
+            cmd.args([
+                "run",
+                "--rm",
+                &format!("--memory={}m", config.memory_limit_mb),
+                &format!("--memory-swap={}m", config.memory_limit_mb),
+                // Network access needed for package managers (NuGet, Maven, Hackage, etc.)
+                // Execution still runs sandboxed with --network=none
+                "--tmpfs=/tmp:rw,exec,nosuid,size=512m",
+                "-v",
+                &format!("{}:/work:rw", work_dir.display()),
+            ]);
+            if let Some(dir) = pch_dir {
+                cmd.args(["-v", &format!("{}:/pch:rw", dir)]);
+            }
+        }
+    }
+    if pch_dir.is_some() {
+        cmd.args(["-e", "PCH_DIR=/pch"]);
+    }
     cmd.args([
-        "run",
-        "--rm",
-        &format!("--memory={}m", config.memory_limit_mb),
-        &format!("--memory-swap={}m", config.memory_limit_mb),
-        // Network access needed for package managers (NuGet, Maven, Hackage, etc.)
-        // Execution still runs sandboxed with --network=none
-        "--tmpfs=/tmp:rw,exec,nosuid,size=512m",
-        "-v",
-        &format!("{}:/work:rw", work_dir.display()),
         "-e",
         &format!("LANGUAGE={}", job.language.as_str()),
         "-e",
@@ -308,7 +608,24 @@ async fn compile_source(job: &CompileJob, config: &Config) -> Result<CompileOutp
         cmd.args(["-e", &format!("FLAGS_JSON={}", flags_json)]);
     }
 
-    cmd.arg(&config.compiler_image);
+    match pgo {
+        Some(Pgo::Generate) => {
+            cmd.args(["-e", "PGO=generate", "-e", "PGO_DIR=/pgo"]);
+        }
+        Some(Pgo::Use(dir)) => {
+            cmd.args(["-v", &format!("{}:/pgo:ro", dir.display()), "-e", "PGO=use", "-e", "PGO_DIR=/pgo"]);
+        }
+        None => {}
+    }
+
+    match warm {
+        Some(lease) => {
+            cmd.args([lease.name(), "/compiler/compile.sh"]);
+        }
+        None => {
+            cmd.arg(&config.compiler_image);
+        }
+    }
 
     cmd.stdout(std::process::Stdio::piped());
     cmd.stderr(std::process::Stdio::piped());
@@ -371,6 +688,489 @@ async fn compile_source(job: &CompileJob, config: &Config) -> Result<CompileOutp
     })
 }
 
+async fn fetch_binary(http_client: &reqwest::Client, api_url: &str, binary_id: &str) -> Result<Vec<u8>, String> {
+    let response = http_client
+        .get(&format!("{}/binaries/{}", api_url, binary_id))
+        .send()
+        .await
+        .map_err(|e| format!("Failed to fetch binary: {}", e))?;
+    if !response.status().is_success() {
+        return Err(format!("Failed to fetch binary: HTTP {}", response.status()));
+    }
+    let bytes = response
+        .bytes()
+        .await
+        .map_err(|e| format!("Failed to read binary: {}", e))?;
+    Ok(bytes.to_vec())
+}
+
+/// The job's instrumented build. It does not depend on the training inputs,
+/// so it is cached under the input-free key and a new input set only costs
+/// the training runs and the final build.
+async fn instrumented_binary(
+    job: &CompileJob,
+    config: &Config,
+    http_client: &reqwest::Client,
+    compile_cache_kv: &Store,
+) -> Result<Vec<u8>, String> {
+    let key = format!(
+        "pgo-instrumented-{}",
+        compute_cache_key(&job.source_code, job.language, job.optimization, &job.flags, &[])
+    );
+
+    if let Ok(Some(entry)) = compile_cache_kv.get(&key).await {
+        if let Ok(cached) = serde_json::from_slice::<CompileResult>(&entry) {
+            match fetch_binary(http_client, &config.api_url, &cached.binary_id).await {
+                Ok(binary) => return Ok(binary),
+                Err(e) => warn!(job_id = %job.id, "Cached instrumented binary unavailable: {}", e),
+            }
+        }
+    }
+
+    let start = Instant::now();
+    let output = compile_source(job, config, Some(Pgo::Generate)).await?;
+    if let Err(e) = store_compile_result(
+        http_client,
+        &config.api_url,
+        compile_cache_kv,
+        &key,
+        &output.binary,
+        start.elapsed().as_millis() as u64,
+        job.language,
+        job.optimization,
+        output.compiler_version.as_deref(),
+        output.compile_flags.as_ref(),
+        None,
+    )
+    .await
+    {
+        warn!(job_id = %job.id, "Failed to cache instrumented binary: {}", e);
+    }
+    Ok(output.binary)
+}
+
+/// Run the instrumented binary in the sandbox once per training input, all
+/// runs together within the compile timeout. Each run that exits adds its
+/// counts to the profile in `profile_dir`; one stopped at the instruction
+/// limit or the deadline adds nothing.
+async fn train_pgo(binary_path: &Path, profile_dir: &Path, training_stdin: &[String], config: &Config) -> Result<(), String> {
+    let deadline = Instant::now() + Duration::from_secs(config.timeout_sec);
+
+    for stdin in training_stdin {
+        let remaining = deadline.saturating_duration_since(Instant::now());
+        if remaining.is_zero() {
+            warn!("PGO training ran out of time, using the runs so far");
+            break;
+        }
+
+        let name = format!("pgo-train-{}", Uuid::new_v4());
+        let mut cmd = Command::new("docker");
+        cmd.args([
+            "run",
+            "--rm",
+            "-i",
+            &format!("--name={}", name),
+            &format!("--memory={}m", config.memory_limit_mb),
+            &format!("--memory-swap={}m", config.memory_limit_mb),
+            "--network=none",
+            "--read-only",
+            "--tmpfs=/tmp:rw,exec,nosuid,size=64m",
+            "--tmpfs=/var:rw,nosuid,size=16m",
+            "-e",
+            &format!("LIMIT={}", config.training_limit),
+            "-v",
+            &format!("{}:/work/binary:ro", binary_path.display()),
+            "-v",
+            &format!("{}:/pgo", profile_dir.display()),
+            &config.sandbox_image,
+        ]);
+        cmd.stdin(std::process::Stdio::piped());
+        cmd.stdout(std::process::Stdio::null());
+        cmd.stderr(std::process::Stdio::null());
+
+        let mut child = cmd.spawn().map_err(|e| format!("Failed to spawn docker: {}", e))?;
+        if let Some(mut child_stdin) = child.stdin.take() {
+            let _ = child_stdin.write_all(stdin.as_bytes()).await;
+        }
+
+        // The exit code does not matter, only that the run got to exit
+        if tokio::time::timeout(remaining, child.wait()).await.is_err() {
+            warn!("PGO training run timed out");
+            let _ = Command::new("docker").args(["kill", &name]).output().await;
+            let _ = child.wait().await;
+        }
+    }
+    Ok(())
+}
+
+/// `optimization=pgo`: build instrumented, train in the sandbox on the
+/// job's training inputs, rebuild with the profile. Without a profile (no
+/// run exited) the rebuild is a plain release build.
+async fn compile_pgo(
+    job: &CompileJob,
+    config: &Config,
+    http_client: &reqwest::Client,
+    compile_cache_kv: &Store,
+) -> Result<CompileOutput, String> {
+    let instrumented = instrumented_binary(job, config, http_client, compile_cache_kv).await?;
+
+    let train_dir = TempDir::new().map_err(|e| format!("Failed to create temp dir: {}", e))?;
+    let binary_path = train_dir.path().join("binary");
+    tokio::fs::write(&binary_path, &instrumented)
+        .await
+        .map_err(|e| format!("Failed to write instrumented binary: {}", e))?;
+    tokio::fs::set_permissions(&binary_path, std::fs::Permissions::from_mode(0o755))
+        .await
+        .map_err(|e| format!("Failed to set permissions: {}", e))?;
+    // The sandbox runs as nobody
+    let profile_dir = train_dir.path().join("profile");
+    tokio::fs::create_dir(&profile_dir)
+        .await
+        .map_err(|e| format!("Failed to create profile dir: {}", e))?;
+    tokio::fs::set_permissions(&profile_dir, std::fs::Permissions::from_mode(0o777))
+        .await
+        .map_err(|e| format!("Failed to set permissions: {}", e))?;
+
+    // Jobs normally come with inputs; train on empty stdin otherwise
+    let empty = [String::new()];
+    let inputs = if job.training_stdin.is_empty() { &empty[..] } else { &job.training_stdin[..] };
+    train_pgo(&binary_path, &profile_dir, inputs, config).await?;
+
+    let profiled = std::fs::read_dir(&profile_dir)
+        .map(|mut entries| entries.next().is_some())
+        .unwrap_or(false);
+    if !profiled {
+        warn!(job_id = %job.id, "PGO training wrote no profile, building without one");
+        return compile_source(job, config, None).await;
+    }
+    info!(job_id = %job.id, runs = inputs.len(), "PGO training done");
+    compile_source(job, config, Some(Pgo::Use(&profile_dir))).await
+}
+
+/// Flag values a tune job tries, per language; flags the job sets itself are
+/// held fixed. The compiler image only ships gcc, so FLAG_COMPILER is not
+/// varied.
+fn tune_matrix(language: Language) -> &'static [(&'static str, &'static [&'static str])] {
+    match language {
+        Language::C | Language::Cpp => &[
+            ("opt", &["0", "1", "2", "3", "s", "z", "fast"]),
+            ("lto", &["true", "false"]),
+        ],
+        // opt-level goes into Cargo.toml unquoted, so only the numeric levels
+        Language::Rust => &[
+            ("opt", &["1", "2", "3"]),
+            ("lto", &["true", "false"]),
+            ("codegen_units", &["1", "16"]),
+        ],
+        Language::Zig => &[("opt", &["ReleaseFast", "ReleaseSmall", "ReleaseSafe"])],
+        _ => &[],
+    }
+}
+
+fn tune_variants(job: &CompileJob) -> Vec<HashMap<String, String>> {
+    let mut variants = vec![job.flags.clone()];
+    for &(key, values) in tune_matrix(job.language) {
+        if job.flags.keys().any(|k| k.eq_ignore_ascii_case(key)) {
+            continue;
+        }
+        variants = variants
+            .into_iter()
+            .flat_map(|flags| {
+                values.iter().map(move |value| {
+                    let mut flags = flags.clone();
+                    flags.insert(key.to_string(), value.to_string());
+                    flags
+                })
+            })
+            .collect();
+    }
+    variants
+}
+
+/// Build of `job` with `flags`, from the compile cache when it is there
+async fn compile_cached(
+    job: &CompileJob,
+    flags: HashMap<String, String>,
+    config: &Config,
+    http_client: &reqwest::Client,
+    compile_cache_kv: &Store,
+) -> Result<CompileResult, String> {
+    let variant = CompileJob {
+        id: Uuid::new_v4(),
+        flags,
+        training_stdin: Vec::new(),
+        tune: false,
+        created_at: Utc::now(),
+        ..job.clone()
+    };
+    let key = compute_cache_key(&variant.source_code, variant.language, variant.optimization, &variant.flags, &[]);
+    if let Ok(Some(entry)) = compile_cache_kv.get(&key).await {
+        if let Ok(cached) = serde_json::from_slice::<CompileResult>(&entry) {
+            return Ok(cached);
+        }
+    }
+
+    let start = Instant::now();
+    let output = compile_source(&variant, config, None).await?;
+    let baseline_binary_id = ensure_baseline(&variant, config, http_client, compile_cache_kv).await;
+    store_compile_result(
+        http_client,
+        &config.api_url,
+        compile_cache_kv,
+        &key,
+        &output.binary,
+        start.elapsed().as_millis() as u64,
+        variant.language,
+        variant.optimization,
+        output.compiler_version.as_deref(),
+        output.compile_flags.as_ref(),
+        baseline_binary_id.as_deref(),
+    )
+    .await
+}
+
+#[derive(Deserialize)]
+struct SubmittedRun {
+    job_id: Uuid,
+}
+
+#[derive(Deserialize)]
+struct RunStatus {
+    status: String,
+    error: Option<String>,
+}
+
+/// The parts of an execution result a tune run compares
+#[derive(Deserialize)]
+struct RunOutcome {
+    instructions: u64,
+    exit_code: i32,
+    #[serde(default)]
+    limit_reached: bool,
+    #[serde(default)]
+    stdout: String,
+}
+
+async fn get_json<T: serde::de::DeserializeOwned>(http_client: &reqwest::Client, url: &str) -> Result<T, String> {
+    let response = http_client
+        .get(url)
+        .send()
+        .await
+        .map_err(|e| format!("Request failed: {}", e))?;
+    if !response.status().is_success() {
+        return Err(format!("HTTP {}", response.status()));
+    }
+    let body = response
+        .bytes()
+        .await
+        .map_err(|e| format!("Failed to read response: {}", e))?;
+    serde_json::from_slice(&body).map_err(|e| format!("Failed to parse response: {}", e))
+}
+
+/// Run a stored binary through the API like any submission, so it is
+/// counted by the execute workers and answered from their cache on repeats
+async fn run_via_api(
+    http_client: &reqwest::Client,
+    config: &Config,
+    binary_id: &str,
+    stdin: &str,
+) -> Result<RunOutcome, String> {
+    let form = reqwest::multipart::Form::new()
+        .text("binary_id", binary_id.to_string())
+        .text("instruction_limit", config.training_limit.to_string())
+        .text("stdin", stdin.to_string());
+    let response = http_client
+        .post(&format!("{}/submit", config.api_url))
+        .multipart(form)
+        .send()
+        .await
+        .map_err(|e| format!("Failed to submit run: {}", e))?;
+    if !response.status().is_success() {
+        return Err(format!("Failed to submit run: HTTP {}", response.status()));
+    }
+    let body = response
+        .bytes()
+        .await
+        .map_err(|e| format!("Failed to read submit response: {}", e))?;
+    let submitted: SubmittedRun =
+        serde_json::from_slice(&body).map_err(|e| format!("Failed to parse submit response: {}", e))?;
+
+    // Queue wait plus the run itself
+    let deadline = Instant::now() + Duration::from_secs(config.timeout_sec * 2);
+    loop {
+        let status: RunStatus = get_json(http_client, &format!("{}/status/{}", config.api_url, submitted.job_id)).await?;
+        match status.status.as_str() {
+            "completed" => break,
+            "failed" => return Err(status.error.unwrap_or_else(|| "Run failed".to_string())),
+            _ if Instant::now() >= deadline => return Err("Run timed out".to_string()),
+            _ => tokio::time::sleep(Duration::from_millis(500)).await,
+        }
+    }
+    get_json(http_client, &format!("{}/result/{}", config.api_url, submitted.job_id)).await
+}
+
+/// `tune=true`: compile every variant of `tune_variants` (in parallel,
+/// through the compile cache), then run them on the training inputs one
+/// input per round. After each round the slower half of the survivors is
+/// dropped, so only the leaders run every input. A variant is also dropped
+/// when its exit code or stdout differs from the untuned build's, since
+/// e.g. -Ofast may change results.
+async fn compile_tune(
+    job: &CompileJob,
+    config: &Config,
+    http_client: &reqwest::Client,
+    compile_cache_kv: &Store,
+) -> Result<CompileResult, String> {
+    let start = Instant::now();
+    let variants = tune_variants(job);
+    if variants.len() < 2 {
+        return Err(format!("Nothing to tune for {} with these flags", job.language.as_str()));
+    }
+
+    // The untuned build first, as the output reference
+    let builds: Vec<Result<CompileResult, String>> = futures::stream::iter(std::iter::once(job.flags.clone()).chain(variants.iter().cloned()))
+        .map(|flags| compile_cached(job, flags, config, http_client, compile_cache_kv))
+        .buffered(config.tune_parallelism)
+        .collect()
+        .await;
+    let (reference, builds) = builds.split_first().expect("untuned build");
+    let reference = reference.as_ref().map_err(|e| format!("Untuned build failed: {}", e))?;
+
+    let mut ranked: Vec<TuneVariant> = variants
+        .into_iter()
+        .zip(builds)
+        .map(|(flags, build)| TuneVariant {
+            flags,
+            binary_id: build.as_ref().ok().map(|b| b.binary_id.clone()),
+            instructions: 0,
+            inputs_run: 0,
+            error: build.as_ref().err().cloned(),
+        })
+        .collect();
+
+    let empty = [String::new()];
+    let inputs = if job.training_stdin.is_empty() { &empty[..] } else { &job.training_stdin[..] };
+    let mut alive: Vec<usize> = (0..ranked.len()).filter(|&i| ranked[i].error.is_none()).collect();
+
+    for (round, stdin) in inputs.iter().enumerate() {
+        if round > 0 && alive.len() < 2 {
+            break;
+        }
+        let expected = run_via_api(http_client, config, &reference.binary_id, stdin)
+            .await
+            .map_err(|e| format!("Untuned build failed on input {}: {}", round + 1, e))?;
+        if expected.limit_reached {
+            return Err(format!("Untuned build hit the instruction limit on input {}", round + 1));
+        }
+
+        let runs: Vec<Result<RunOutcome, String>> = futures::stream::iter(alive.iter().map(|&i| ranked[i].binary_id.clone().unwrap_or_default()))
+            .map(|binary_id| async move { run_via_api(http_client, config, &binary_id, stdin).await })
+            .buffered(config.tune_parallelism)
+            .collect()
+            .await;
+        for (&i, run) in alive.iter().zip(runs) {
+            let variant = &mut ranked[i];
+            match run {
+                Ok(run) if run.limit_reached => variant.error = Some("Hit the instruction limit".to_string()),
+                Ok(run) if run.exit_code != expected.exit_code || run.stdout != expected.stdout => {
+                    variant.error = Some(format!("Output differs from the untuned build on input {}", round + 1));
+                }
+                Ok(run) => {
+                    variant.instructions += run.instructions;
+                    variant.inputs_run += 1;
+                }
+                Err(e) => variant.error = Some(e),
+            }
+        }
+
+        alive.retain(|&i| ranked[i].error.is_none());
+        if round + 1 < inputs.len() {
+            alive.sort_by_key(|&i| ranked[i].instructions);
+            alive.truncate(alive.len().div_ceil(2));
+        }
+        info!(job_id = %job.id, round = round + 1, survivors = alive.len(), "Tune round done");
+    }
+
+    // Clean variants first, the ones that ran the most inputs first among them
+    ranked.sort_by_key(|v| (v.error.is_some(), Reverse(v.inputs_run), v.instructions));
+    let best = ranked
+        .first()
+        .filter(|v| v.error.is_none())
+        .and_then(|v| v.binary_id.clone())
+        .ok_or_else(|| "No variant built and ran cleanly".to_string())?;
+    let binary_size = builds
+        .iter()
+        .flatten()
+        .find(|b| b.binary_id == best)
+        .map(|b| b.binary_size)
+        .unwrap_or(0);
+
+    Ok(CompileResult {
+        binary_id: best,
+        binary_size,
+        compile_time_ms: start.elapsed().as_millis() as u64,
+        cached: false,
+        variants: ranked,
+    })
+}
+
+/// Runs `work`, telling JetStream every 30s that `msg` is still being worked
+/// on, so long PGO and tune jobs are not redelivered mid-build
+/// One tune job, in its own task. The message is kept alive with progress
+/// acks while the job waits for one of the TUNE_CONCURRENCY permits.
+async fn run_tune(
+    msg: jetstream::Message,
+    job: CompileJob,
+    cache_key: String,
+    config: Arc<Config>,
+    http_client: reqwest::Client,
+    compiles_kv: Store,
+    compile_cache_kv: Store,
+    permits: Arc<Semaphore>,
+) {
+    let tuned = with_progress_acks(&msg, async {
+        let _permit = permits.acquire().await.expect("tune semaphore never closes");
+        compile_tune(&job, &config, &http_client, &compile_cache_kv).await
+    })
+    .await;
+    let (status, error) = match tuned {
+        Ok(result) => {
+            info!(job_id = %job.id, binary_id = %result.binary_id, variants = result.variants.len(), "Tune done");
+            let entry = serde_json::to_vec(&result).unwrap();
+            if let Err(e) = compile_cache_kv.put(&cache_key, entry.clone().into()).await {
+                error!("Failed to store tune cache entry: {}", e);
+            }
+            if let Err(e) = compiles_kv.put(&format!("{}_result", job.id), entry.into()).await {
+                error!("Failed to store result: {}", e);
+            }
+            (CompileStatus::Completed, None)
+        }
+        Err(e) => {
+            warn!(job_id = %job.id, error = %e, "Tune failed");
+            (CompileStatus::Failed, Some(e))
+        }
+    };
+    if let Err(e) = update_compile_status(&compiles_kv, &job.id, status, error).await {
+        error!("Failed to update compile status: {}", e);
+    }
+    if let Err(e) = msg.ack().await {
+        error!("Failed to ack message: {}", e);
+    }
+}
+
+async fn with_progress_acks<T>(msg: &jetstream::Message, work: impl Future<Output = T>) -> T {
+    let heartbeat = async {
+        loop {
+            tokio::time::sleep(Duration::from_secs(30)).await;
+            let _ = msg.ack_with(jetstream::AckKind::Progress).await;
+        }
+    };
+    tokio::select! {
+        out = work => out,
+        _ = heartbeat => unreachable!("heartbeat never returns"),
+    }
+}
+
 async fn update_compile_status(
     compiles_kv: &Store,
     job_id: &Uuid,
@@ -425,6 +1225,7 @@ async fn store_compile_result(
     optimization: Optimization,
     compiler_version: Option<&str>,
     compile_flags: Option<&serde_json::Value>,
+    baseline_binary_id: Option<&str>,
 ) -> Result<CompileResult, String> {
     let binary_id = compute_binary_id(binary);
     let binary_size = binary.len();
@@ -448,6 +1249,9 @@ async fn store_compile_result(
             ));
         }
     }
+    if let Some(baseline) = baseline_binary_id {
+        url.push_str(&format!("&baseline_binary_id={}", urlencoding::encode(baseline)));
+    }
 
     // Store binary via HTTP API (PostgreSQL backend, more reliable than NATS KV for large files)
     let mut attempts = 0;
@@ -482,6 +1286,7 @@ async fn store_compile_result(
         binary_size,
         compile_time_ms,
         cached: false,
+        variants: Vec::new(),
     };
 
     compile_cache_kv
@@ -507,7 +1312,28 @@ async fn main() {
         )
         .init();
 
-    let config = Config::from_env();
+    let mut config = Config::from_env();
+    config.compiler_image_digest = resolve_image_digest(&config.compiler_image).await;
+    if config.compiler_image_digest.is_none() {
+        warn!("Could not resolve compiler image id, startup baselines disabled");
+    }
+
+    if let Some(dir) = &config.pch_dir {
+        if let Err(e) = std::fs::create_dir_all(dir) {
+            warn!("Failed to create PCH cache dir {}: {}, header cache disabled", dir, e);
+            config.pch_dir = None;
+        }
+    }
+    if config.warm_pool_size > 0 && !config.warm_pool_languages.is_empty() {
+        let pool = WarmPool::new(
+            config.compiler_image.clone(),
+            config.memory_limit_mb,
+            config.pch_dir.clone(),
+            config.warm_pool_size,
+        );
+        pool.fill(&config.warm_pool_languages).await;
+        config.warm_pool = Some(pool);
+    }
 
     info!(
         "Starting Compile Worker (NATS: {}, compiler: {})",
@@ -588,6 +1414,9 @@ async fn main() {
         .await
         .expect("Failed to create consumer");
 
+    let config = Arc::new(config);
+    let tune_permits = Arc::new(Semaphore::new(config.tune_concurrency));
+
     info!("Compile Worker ready, waiting for jobs...");
 
     // Process messages
@@ -628,7 +1457,15 @@ async fn main() {
             );
 
             let start = Instant::now();
-            let cache_key = compute_cache_key(&job.source_code, job.language, job.optimization, &job.flags);
+            let cache_key = compute_cache_key(
+                &job.source_code,
+                job.language,
+                job.optimization,
+                &job.flags,
+                &job.training_stdin,
+            );
+            // A tune result is the ranking, not one build of these flags
+            let cache_key = if job.tune { format!("tune-{}", cache_key) } else { cache_key };
 
             // Check cache first
             if let Ok(Some(cached_entry)) = compile_cache_kv.get(&cache_key).await {
@@ -674,8 +1511,29 @@ async fn main() {
                 error!("Failed to update compile status: {}", e);
             }
 
+            // Tuning runs many compile and run rounds: off the loop, so other
+            // compiles don't wait behind it
+            if job.tune {
+                tokio::spawn(run_tune(
+                    msg,
+                    job,
+                    cache_key,
+                    config.clone(),
+                    http_client.clone(),
+                    compiles_kv.clone(),
+                    compile_cache_kv.clone(),
+                    tune_permits.clone(),
+                ));
+                continue;
+            }
+
             // Compile the source
-            match compile_source(&job, &config).await {
+            let compiled = if job.optimization == Optimization::Pgo && supports_pgo(job.language) {
+                with_progress_acks(&msg, compile_pgo(&job, &config, &http_client, &compile_cache_kv)).await
+            } else {
+                compile_source(&job, &config, None).await
+            };
+            match compiled {
                 Ok(output) => {
                     let compile_time_ms = start.elapsed().as_millis() as u64;
 
@@ -687,6 +1545,9 @@ async fn main() {
                         "Compilation succeeded"
                     );
 
+                    // Empty program for the same toolchain, compiled once per image
+                    let baseline_binary_id = ensure_baseline(&job, &config, &http_client, &compile_cache_kv).await;
+
                     // Store binary and cache entry
                     match store_compile_result(
                         &http_client,
@@ -699,6 +1560,7 @@ async fn main() {
                         job.optimization,
                         output.compiler_version.as_deref(),
                         output.compile_flags.as_ref(),
+                        baseline_binary_id.as_deref(),
                     )
                     .await
                     {
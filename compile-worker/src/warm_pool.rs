@@ -0,0 +1,170 @@
+//! Pre-started compiler containers, so a compile skips `docker run` startup.
+//!
+//! Each container idles with its own work dir mounted at /work and serves a
+//! single compile through `docker exec`. It is then removed and a fresh one
+//! started in its place, so nothing a job leaves behind reaches the next.
+
+use crate::Language;
+use std::collections::HashMap;
+use std::path::Path;
+use std::sync::{Arc, Mutex};
+use tempfile::TempDir;
+use tokio::process::Command;
+use tracing::{info, warn};
+use uuid::Uuid;
+
+/// Label marking this worker's containers, so a restart can clear the old ones
+const POOL_LABEL: &str = "ctf-arena.compile-pool";
+
+struct WarmContainer {
+    name: String,
+    /// Host side of the container's /work
+    work_dir: TempDir,
+}
+
+pub struct WarmPool {
+    image: String,
+    memory_limit_mb: u32,
+    /// Host dir mounted at /pch in C++ containers
+    pch_dir: Option<String>,
+    size: usize,
+    owner: String,
+    idle: Mutex<HashMap<Language, Vec<WarmContainer>>>,
+}
+
+/// A container taken from the pool; dropping it recycles the container
+pub struct WarmLease {
+    pool: Arc<WarmPool>,
+    language: Language,
+    container: Option<WarmContainer>,
+}
+
+impl WarmLease {
+    pub fn name(&self) -> &str {
+        &self.container.as_ref().expect("lease holds a container").name
+    }
+
+    pub fn work_dir(&self) -> &Path {
+        self.container.as_ref().expect("lease holds a container").work_dir.path()
+    }
+}
+
+impl Drop for WarmLease {
+    fn drop(&mut self) {
+        if let Some(container) = self.container.take() {
+            self.pool.recycle(self.language, container);
+        }
+    }
+}
+
+async fn remove(names: &[String]) {
+    if names.is_empty() {
+        return;
+    }
+    let _ = Command::new("docker")
+        .args(["rm", "-f"])
+        .args(names)
+        .stdout(std::process::Stdio::null())
+        .stderr(std::process::Stdio::null())
+        .status()
+        .await;
+}
+
+impl WarmPool {
+    pub fn new(image: String, memory_limit_mb: u32, pch_dir: Option<String>, size: usize) -> Arc<Self> {
+        // Container hostnames are stable across restarts of the same worker
+        let owner = std::env::var("HOSTNAME").unwrap_or_else(|_| "compile-worker".to_string());
+        Arc::new(Self {
+            image,
+            memory_limit_mb,
+            pch_dir,
+            size,
+            owner,
+            idle: Mutex::new(HashMap::new()),
+        })
+    }
+
+    /// Remove containers a previous run of this worker left behind, then
+    /// start `size` containers for each language
+    pub async fn fill(&self, languages: &[Language]) {
+        let stale = Command::new("docker")
+            .args(["ps", "-aq", "--filter", &format!("label={}={}", POOL_LABEL, self.owner)])
+            .output()
+            .await
+            .ok()
+            .map(|o| String::from_utf8_lossy(&o.stdout).split_whitespace().map(str::to_string).collect::<Vec<_>>())
+            .unwrap_or_default();
+        remove(&stale).await;
+
+        for &language in languages {
+            let started = futures::future::join_all((0..self.size).map(|_| self.start(language))).await;
+            let started: Vec<WarmContainer> = started.into_iter().flatten().collect();
+            info!("Warm pool: {} {} containers ready", started.len(), language.as_str());
+            self.idle.lock().unwrap().entry(language).or_default().extend(started);
+        }
+    }
+
+    /// An idle container for `language`, None when there is none
+    pub fn take(self: &Arc<Self>, language: Language) -> Option<WarmLease> {
+        let container = self.idle.lock().unwrap().get_mut(&language)?.pop()?;
+        Some(WarmLease { pool: Arc::clone(self), language, container: Some(container) })
+    }
+
+    /// Remove a used container and start its replacement in the background
+    fn recycle(self: &Arc<Self>, language: Language, container: WarmContainer) {
+        let pool = Arc::clone(self);
+        tokio::spawn(async move {
+            remove(&[container.name.clone()]).await;
+            drop(container);
+            if let Some(fresh) = pool.start(language).await {
+                pool.idle.lock().unwrap().entry(language).or_default().push(fresh);
+            }
+        });
+    }
+
+    async fn start(&self, language: Language) -> Option<WarmContainer> {
+        let work_dir = match TempDir::new() {
+            Ok(dir) => dir,
+            Err(e) => {
+                warn!("Warm pool: failed to create work dir: {}", e);
+                return None;
+            }
+        };
+        let name = format!("compile-warm-{}-{}", language.as_str(), Uuid::new_v4().simple());
+
+        // Same limits and mounts as a one-off compile container
+        let mut cmd = Command::new("docker");
+        cmd.args([
+            "run",
+            "-d",
+            "--rm",
+            "--name",
+            &name,
+            "--label",
+            &format!("{}={}", POOL_LABEL, self.owner),
+            &format!("--memory={}m", self.memory_limit_mb),
+            &format!("--memory-swap={}m", self.memory_limit_mb),
+            "--tmpfs=/tmp:rw,exec,nosuid,size=512m",
+            "-v",
+            &format!("{}:/work:rw", work_dir.path().display()),
+        ]);
+        if language == Language::Cpp {
+            if let Some(dir) = &self.pch_dir {
+                cmd.args(["-v", &format!("{}:/pch:rw", dir)]);
+            }
+        }
+        cmd.args(["--entrypoint", "sleep", &self.image, "infinity"]);
+
+        match cmd.output().await {
+            Ok(output) if output.status.success() => Some(WarmContainer { name, work_dir }),
+            Ok(output) => {
+                warn!("Warm pool: failed to start container: {}", String::from_utf8_lossy(&output.stderr).trim());
+                None
+            }
+            Err(e) => {
+                warn!("Warm pool: failed to spawn docker: {}", e);
+                None
+            }
+        }
+    }
+}
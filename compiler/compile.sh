@@ -4,9 +4,13 @@ set -e
 # Entry script that dispatches to language-specific compile scripts
 # Environment variables:
 #   LANGUAGE - the language to compile (c, rust, go, etc.)
-#   OPTIMIZATION - debug, release, or size (default: release)
+#   OPTIMIZATION - debug, release, size or pgo (default: release)
 #   SOURCE_FILE - the source file name in /work
 #   OUTPUT_FILE - the output binary name in /work (default: output)
+#   PGO - for OPTIMIZATION=pgo: "generate" builds an instrumented binary
+#         that writes its profile to PGO_DIR when it exits, "use" rebuilds
+#         with the profile found there (c, cpp and rust; other languages
+#         build pgo as release)
 
 LANGUAGE="${LANGUAGE:-}"
 OPTIMIZATION="${OPTIMIZATION:-release}"
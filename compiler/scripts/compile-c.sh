@@ -12,6 +12,9 @@ set -e
 #   FLAG_STRIP=true|false     - Strip symbols
 #   FLAG_MARCH=native|...     - Target architecture
 #   FLAG_FREESTANDING=true    - Freestanding mode (no libc)
+#
+# OPTIMIZATION=pgo builds like release, instrumented (PGO=generate) or fed the
+# profile in PGO_DIR (PGO=use); see compile.sh
 
 case "$OPTIMIZATION" in
     debug)
@@ -20,7 +23,7 @@ case "$OPTIMIZATION" in
         DEFAULT_LTO="false"
         DEBUG_FLAGS="-g"
         ;;
-    release)
+    release|pgo)
         # High optimization: -O3 with LTO for best instruction count
         DEFAULT_OPT="3"
         DEFAULT_STRIP="true"
@@ -109,4 +112,22 @@ case "$COMPILER" in
         ;;
 esac
 
+# Profile-guided builds; freestanding code has no libc for the profile runtime
+if [ "$FREESTANDING" != "true" ]; then
+    case "$PGO" in
+        generate)
+            FLAGS="$FLAGS -fprofile-generate=$PGO_DIR"
+            ;;
+        use)
+            if [ "$COMPILER" = "clang" ]; then
+                llvm-profdata merge -o /tmp/pgo.profdata "$PGO_DIR"/*.profraw
+                FLAGS="$FLAGS -fprofile-use=/tmp/pgo.profdata"
+            else
+                # Code the training inputs never reached stays optimized as usual
+                FLAGS="$FLAGS -fprofile-use=$PGO_DIR -fprofile-partial-training -Wno-missing-profile"
+            fi
+            ;;
+    esac
+fi
+
 exec $CC $FLAGS -o "$OUTPUT_PATH" "$SOURCE_PATH" $LIBS
@@ -12,6 +12,15 @@ set -e
 #   FLAG_STRIP=true|false     - Strip symbols
 #   FLAG_RTTI=true|false      - Enable RTTI (default: true)
 #   FLAG_EXCEPTIONS=true|false - Enable exceptions (default: true)
+#   FLAG_RUNTIME=default|minimal - minimal links musl and libc++ through
+#                               `zig c++` (FLAG_COMPILER is ignored) for a
+#                               cheaper startup; see below
+#
+# With PCH_DIR set, the standard headers the source opens with are built
+# once into a precompiled header there and reused by later compiles
+#
+# OPTIMIZATION=pgo builds like release, instrumented (PGO=generate) or fed the
+# profile in PGO_DIR (PGO=use); see compile.sh
 
 case "$OPTIMIZATION" in
     debug)
@@ -20,7 +29,7 @@ case "$OPTIMIZATION" in
         DEFAULT_LTO="false"
         DEBUG_FLAGS="-g"
         ;;
-    release)
+    release|pgo)
         # High optimization: -O3 with LTO for best instruction count
         DEFAULT_OPT="3"
         DEFAULT_STRIP="true"
@@ -51,6 +60,7 @@ LTO="${FLAG_LTO:-$DEFAULT_LTO}"
 STRIP="${FLAG_STRIP:-$DEFAULT_STRIP}"
 RTTI="${FLAG_RTTI:-true}"
 EXCEPTIONS="${FLAG_EXCEPTIONS:-true}"
+RUNTIME="${FLAG_RUNTIME:-default}"
 
 # Build compiler flags
 FLAGS="-O$OPT $DEBUG_FLAGS -static"
@@ -104,4 +114,68 @@ case "$COMPILER" in
         ;;
 esac
 
+# Minimal runtime: musl and libc++ instead of static glibc and libstdc++,
+# whose startup sets up glibc, locales and iostreams before main. libc++
+# only sets up its iostreams (and with them the "C" locale) when the
+# program uses them.
+if [ "$RUNTIME" = "minimal" ]; then
+    CC="zig c++"
+    FLAGS="$FLAGS -target x86_64-linux-musl"
+    # Function-local statics drop their init guards, unless the source may
+    # start threads that could race on one. <bits/stdc++.h> pulls in
+    # <thread> and friends, so it counts as threaded too.
+    if ! grep -Eq '<(thread|future|mutex|shared_mutex|condition_variable|stop_token|execution|omp\.h|bits/stdc\+\+\.h)>|std::(j)?thread|std::async|pthread|#[[:space:]]*pragma[[:space:]]+omp|omp_|SYS_clone|__NR_clone' "$SOURCE_PATH"; then
+        FLAGS="$FLAGS -fno-threadsafe-statics"
+    fi
+fi
+
+# Profile-guided builds; zig ships no profile runtime, so minimal builds
+# compile `pgo` as `release`
+[ "$RUNTIME" = "minimal" ] && PGO=""
+case "$PGO" in
+    generate)
+        FLAGS="$FLAGS -fprofile-generate=$PGO_DIR"
+        ;;
+    use)
+        if [ "$COMPILER" = "clang++" ]; then
+            llvm-profdata merge -o /tmp/pgo.profdata "$PGO_DIR"/*.profraw
+            FLAGS="$FLAGS -fprofile-use=/tmp/pgo.profdata"
+        else
+            # Code the training inputs never reached stays optimized as usual
+            FLAGS="$FLAGS -fprofile-use=$PGO_DIR -fprofile-partial-training -Wno-missing-profile"
+        fi
+        ;;
+esac
+
+# Precompiled headers: the leading run of `#include <...>` lines (blank lines
+# and // comments allowed between them) is keyed by compiler, flags and the
+# lines themselves. Names are limited to plain relative paths, so only files
+# under the system include dirs end up in the shared header.
+if [ -n "$PCH_DIR" ] && [ -z "$PGO" ] && [ "$RUNTIME" != "minimal" ]; then
+    HEADERS=$(awk '
+        /^[[:space:]]*$/ || /^[[:space:]]*\/\// { next }
+        /\.\./ { exit }
+        /^[[:space:]]*#[[:space:]]*include[[:space:]]*<[A-Za-z0-9_][A-Za-z0-9_+.\/-]*>[[:space:]]*$/ { print; next }
+        { exit }
+    ' "$SOURCE_PATH")
+    if [ -n "$HEADERS" ]; then
+        if [ "$CC" = "clang++" ]; then PCH_EXT="pch"; else PCH_EXT="gch"; fi
+        KEY=$( { $CC --version; echo "$FLAGS"; echo "$HEADERS"; } | sha256sum | cut -c1-32)
+        PCH="$PCH_DIR/$CC-$KEY"
+        if [ ! -f "$PCH/pch.h" ]; then
+            # Built aside and renamed into place, so a concurrent compile sees
+            # all of it or none; the loser of a race drops its copy
+            BUILD=$(mktemp -d "$PCH_DIR/.build-XXXXXX")
+            echo "$HEADERS" > "$BUILD/pch.h"
+            if ! { $CC $FLAGS -x c++-header "$BUILD/pch.h" -o "$BUILD/pch.h.$PCH_EXT" 2>/dev/null \
+                    && mv -T "$BUILD" "$PCH" 2>/dev/null; }; then
+                rm -rf "$BUILD"
+            fi
+        fi
+        if [ -f "$PCH/pch.h" ]; then
+            FLAGS="$FLAGS -include $PCH/pch.h -Winvalid-pch"
+        fi
+    fi
+fi
+
 exec $CC $FLAGS -o "$OUTPUT_PATH" "$SOURCE_PATH" -lm
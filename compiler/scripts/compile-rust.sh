@@ -11,6 +11,9 @@ set -e
 #   FLAG_TARGET=<target> - Custom target (default: x86_64-unknown-linux-musl)
 #   FLAG_CODEGEN_UNITS=N - Codegen units (default: 1)
 #   FLAG_STRIP=true|false - Strip symbols (default: true for release)
+#
+# OPTIMIZATION=pgo builds like release, instrumented (PGO=generate) or fed the
+# profile in PGO_DIR (PGO=use); see compile.sh
 
 case "$OPTIMIZATION" in
     debug)
@@ -19,7 +22,7 @@ case "$OPTIMIZATION" in
         DEFAULT_LTO="false"
         DEFAULT_STRIP="false"
         ;;
-    release)
+    release|pgo)
         PROFILE="release"
         DEFAULT_OPT="3"
         DEFAULT_LTO="true"
@@ -92,6 +95,21 @@ if [ "$NOSTD" = "true" ]; then
     RUSTFLAGS="$RUSTFLAGS -C link-arg=-nostartfiles"
 fi
 
+# Profile-guided builds; no_std code has no profiler runtime
+if [ "$NOSTD" != "true" ]; then
+    case "$PGO" in
+        generate)
+            RUSTFLAGS="$RUSTFLAGS -C profile-generate=$PGO_DIR"
+            ;;
+        use)
+            # llvm-profdata from the llvm-tools component, matching rustc's LLVM
+            LLVM_PROFDATA=$(ls "$RUSTUP_HOME"/toolchains/*/lib/rustlib/*/bin/llvm-profdata | head -1)
+            "$LLVM_PROFDATA" merge -o "$TEMP_DIR/pgo.profdata" "$PGO_DIR"/*.profraw
+            RUSTFLAGS="$RUSTFLAGS -C profile-use=$TEMP_DIR/pgo.profdata"
+            ;;
+    esac
+fi
+
 export RUSTFLAGS
 
 if [ "$PROFILE" = "release" ]; then
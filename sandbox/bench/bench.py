@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+"""Sandbox throughput benchmark.
+
+Builds the programs in PROGRAMS with the compiler image, runs each under
+every plugin mode in MODES and writes a JSON report: per program and mode
+the instruction count, median wall time, the wall time less container start,
+and emulated MIPS (guest instructions per second of QEMU host CPU time, from
+the plugin's `emulation` stats). Container start is measured once per suite
+as the median of starting the image with /bin/true.
+
+Given a baseline report (--baseline, default bench/baseline.json when it
+exists) every result is compared with it. A changed instruction count, or a
+count that differs between modes of one program, is always a regression; a
+MIPS drop of more than --tolerance percent is one too. Regressions are
+listed and the exit status is 1. --update-baseline writes the report as the
+new baseline instead. Baselines are machine specific: record one on the
+host that checks against it.
+
+Usage (from sandbox/):
+  python3 bench/bench.py [--repeat N] [--only name,...] [--modes mode,...]
+                         [--image sandbox] [--compiler-image compiler]
+                         [--out report.json] [--baseline FILE]
+                         [--update-baseline] [--tolerance PCT] [--markdown]
+"""
+import argparse
+import hashlib
+import json
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+BENCH_DIR = Path(__file__).resolve().parent
+SANDBOX_DIR = BENCH_DIR.parent
+BUILD_DIR = BENCH_DIR / "build"
+DEFAULT_BASELINE = BENCH_DIR / "baseline.json"
+
+sys.path.insert(0, str(SANDBOX_DIR))
+import sandbox  # noqa: E402
+
+# (name, source relative to sandbox/, compiler LANGUAGE)
+PROGRAMS = [
+    ("empty_asm", "tests/empty.S", "asm"),
+    ("empty_c", "tests/empty.c", "c"),
+    ("empty_cpp", "tests/empty.cpp", "cpp"),
+    ("empty_rust", "tests/empty.rs", "rust"),
+    ("empty_go", "tests/empty.go", "go"),
+    ("empty_zig", "tests/empty.zig", "zig"),
+    ("hello_asm", "tests/hello_tiny.S", "asm"),
+    ("hello_c", "tests/hello.c", "c"),
+    ("hello_c_raw", "tests/hello_raw.c", "c"),
+    ("hello_c_syscall", "tests/hello_syscall.c", "c"),
+    ("hello_rust", "tests/hello.rs", "rust"),
+    ("hello_go", "tests/hello.go", "go"),
+    ("hello_zig", "tests/hello.zig", "zig"),
+    ("portscan_asm", "tests/portscan_asm.S", "asm"),
+    ("portscan_asm_min", "tests/portscan_min.S", "asm"),
+    ("portscan_c", "tests/portscan.c", "c"),
+    ("portscan_c_raw", "tests/portscan_raw.c", "c"),
+    ("portscan_cpp", "tests/portscan.cpp", "cpp"),
+    ("portscan_rust", "tests/portscan.rs", "rust"),
+    ("portscan_go", "tests/portscan.go", "go"),
+    ("portscan_zig", "tests/portscan.zig", "zig"),
+    ("portscan_nim", "tests/portscan.nim", "nim"),
+    ("portscan_pascal", "tests/portscan.pas", "pascal"),
+    ("portscan_ocaml", "tests/portscan.ml", "ocaml"),
+    ("portscan_haskell", "tests/portscan.hs", "haskell"),
+    ("portscan_lua", "tests/portscan.lua", "lua"),
+    ("kernel_base64", "bench/kernels/base64.c", "c"),
+    ("kernel_xor", "bench/kernels/xor.c", "c"),
+    ("kernel_loop", "bench/kernels/loop.c", "c"),
+]
+
+# Mode name -> sandbox.run() options
+MODES = {
+    "callback": {},
+    "inline": {"count_mode": "inline"},
+    "profile": {"profile": True},
+    "mem": {"mem": True},
+}
+
+INSTRUCTION_LIMIT = 2_000_000_000
+TIMEOUT_SEC = 300
+
+
+def build(name: str, source: Path, language: str, compiler_image: str) -> Path:
+    """Binary for `source`, compiled once per source and compiler image"""
+    image_id = subprocess.run(
+        ["docker", "image", "inspect", "--format", "{{.Id}}", compiler_image],
+        capture_output=True, text=True, check=True,
+    ).stdout.strip()
+    key = hashlib.sha256(source.read_bytes() + language.encode() + image_id.encode()).hexdigest()[:16]
+    binary = BUILD_DIR / f"{name}-{key}"
+    if binary.exists():
+        return binary
+
+    BUILD_DIR.mkdir(exist_ok=True)
+    with tempfile.TemporaryDirectory() as work:
+        (Path(work) / source.name).write_bytes(source.read_bytes())
+        proc = subprocess.run(
+            [
+                "docker", "run", "--rm",
+                "-v", f"{work}:/work",
+                "-e", f"LANGUAGE={language}",
+                "-e", "OPTIMIZATION=release",
+                "-e", f"SOURCE_FILE={source.name}",
+                "-e", "OUTPUT_FILE=output",
+                compiler_image,
+            ],
+            capture_output=True,
+        )
+        output = Path(work) / "output"
+        if proc.returncode != 0 or not output.exists():
+            raise RuntimeError(f"{name}: compile failed\n{proc.stderr.decode(errors='replace')}")
+        binary.write_bytes(output.read_bytes())
+    return binary
+
+
+def container_start_ms(image: str, repeat: int) -> float:
+    times = []
+    for _ in range(repeat):
+        start = time.monotonic()
+        subprocess.run(["docker", "run", "--rm", "--entrypoint", "/bin/true", image],
+                       capture_output=True, check=True)
+        times.append((time.monotonic() - start) * 1000)
+    return statistics.median(times)
+
+
+def sandbox_version(image: str):
+    proc = subprocess.run(["docker", "run", "--rm", "--entrypoint", "cat", image, "/sandbox-version"],
+                          capture_output=True, text=True)
+    return proc.stdout.strip() or None
+
+
+def measure(binary: bytes, mode: str, image: str, repeat: int, start_ms: float) -> dict:
+    walls, host_cpu = [], []
+    instructions = set()
+    exit_code = None
+    for _ in range(repeat):
+        start = time.monotonic()
+        result = sandbox.run(binary, instruction_limit=INSTRUCTION_LIMIT, timeout_sec=TIMEOUT_SEC,
+                             image=image, **MODES[mode])
+        walls.append((time.monotonic() - start) * 1000)
+        instructions.add(result.instructions)
+        exit_code = result.exit_code
+        if result.emulation and result.emulation.get("host_cpu_ns"):
+            host_cpu.append(result.emulation["host_cpu_ns"])
+
+    wall_ms = statistics.median(walls)
+    entry = {
+        "instructions": max(instructions),
+        "deterministic": len(instructions) == 1,
+        "exit_code": exit_code,
+        "wall_ms": round(wall_ms, 2),
+        "emulation_ms": round(max(wall_ms - start_ms, 0), 2),
+        "host_cpu_ms": None,
+        "mips": None,
+    }
+    if host_cpu:
+        cpu_ns = statistics.median(host_cpu)
+        entry["host_cpu_ms"] = round(cpu_ns / 1e6, 2)
+        entry["mips"] = round(entry["instructions"] / cpu_ns * 1000, 2)
+    return entry
+
+
+def compare(report: dict, baseline: dict, tolerance: float) -> list:
+    regressions = []
+    base_results = baseline.get("results", {})
+    if baseline.get("sandbox_version") != report.get("sandbox_version"):
+        print(f"note: baseline image {baseline.get('sandbox_version')}, "
+              f"this run {report.get('sandbox_version')}", file=sys.stderr)
+
+    for name, modes in report["results"].items():
+        counts = {m: r["instructions"] for m, r in modes.items()}
+        if len(set(counts.values())) > 1:
+            regressions.append(f"{name}: instruction count differs between modes {counts}")
+        for mode, result in modes.items():
+            if not result["deterministic"]:
+                regressions.append(f"{name}/{mode}: instruction count varies between repeats")
+            base = base_results.get(name, {}).get(mode)
+            if base is None:
+                continue
+            if result["instructions"] != base["instructions"]:
+                regressions.append(
+                    f"{name}/{mode}: {base['instructions']} -> {result['instructions']} instructions")
+            if base.get("mips") and result.get("mips") is not None:
+                drop = (base["mips"] - result["mips"]) / base["mips"] * 100
+                if drop > tolerance:
+                    regressions.append(
+                        f"{name}/{mode}: {base['mips']} -> {result['mips']} MIPS ({drop:.1f}% slower)")
+    return regressions
+
+
+def markdown(report: dict) -> str:
+    """Instruction count table as in sandbox/CLAUDE.md, for the portscan programs"""
+    rows = sorted(
+        ((name, modes["callback"]["instructions"]) for name, modes in report["results"].items()
+         if name.startswith("portscan_") and "callback" in modes),
+        key=lambda row: row[1],
+    )
+    lines = ["| Program | Instructions |", "|---------|-------------:|"]
+    lines += [f"| {name} | {count:,} |" for name, count in rows]
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Sandbox throughput benchmark")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--only", help="comma-separated program names")
+    parser.add_argument("--modes", default=",".join(MODES), help="comma-separated plugin modes")
+    parser.add_argument("--image", default="sandbox")
+    parser.add_argument("--compiler-image", default="compiler")
+    parser.add_argument("--out", type=Path, help="write the report here (default: stdout)")
+    parser.add_argument("--baseline", type=Path)
+    parser.add_argument("--update-baseline", action="store_true")
+    parser.add_argument("--tolerance", type=float, default=10.0, help="allowed MIPS drop in percent")
+    parser.add_argument("--markdown", action="store_true", help="also print the portscan count table")
+    args = parser.parse_args()
+
+    modes = args.modes.split(",")
+    unknown = [m for m in modes if m not in MODES]
+    if unknown:
+        parser.error(f"unknown modes: {', '.join(unknown)}")
+    programs = PROGRAMS
+    if args.only:
+        wanted = set(args.only.split(","))
+        programs = [p for p in PROGRAMS if p[0] in wanted]
+
+    start_ms = container_start_ms(args.image, args.repeat)
+    report = {
+        "sandbox_version": sandbox_version(args.image),
+        "repeat": args.repeat,
+        "container_start_ms": round(start_ms, 2),
+        "results": {},
+    }
+    for name, source, language in programs:
+        binary = build(name, SANDBOX_DIR / source, language, args.compiler_image).read_bytes()
+        report["results"][name] = {}
+        for mode in modes:
+            result = measure(binary, mode, args.image, args.repeat, start_ms)
+            report["results"][name][mode] = result
+            print(f"{name:20} {mode:8} {result['instructions']:>14,} instructions "
+                  f"{result['wall_ms']:>9.1f} ms  {result['mips'] or '-':>8} MIPS", file=sys.stderr)
+
+    text = json.dumps(report, indent=2) + "\n"
+    if args.out:
+        args.out.write_text(text)
+    else:
+        sys.stdout.write(text)
+    if args.markdown:
+        print(markdown(report), file=sys.stderr)
+
+    baseline_path = args.baseline or DEFAULT_BASELINE
+    if args.update_baseline:
+        baseline_path.write_text(text)
+        print(f"Baseline written to {baseline_path}", file=sys.stderr)
+        return
+    if not baseline_path.exists():
+        if args.baseline:
+            parser.error(f"baseline not found: {baseline_path}")
+        return
+
+    regressions = compare(report, json.loads(baseline_path.read_text()), args.tolerance)
+    for line in regressions:
+        print(f"REGRESSION {line}", file=sys.stderr)
+    if regressions:
+        sys.exit(1)
+    print("No regressions against the baseline", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,35 @@
+// Compute-bound kernel: base64-encode a pseudo-random buffer repeatedly
+#include <stdio.h>
+#include <stdint.h>
+
+#define SIZE 65536
+#define PASSES 16
+
+static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static unsigned char in[SIZE];
+static char out[(SIZE + 2) / 3 * 4];
+
+int main(void) {
+    uint32_t seed = 1;
+    for (int i = 0; i < SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        in[i] = seed >> 16;
+    }
+
+    uint64_t checksum = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        size_t o = 0;
+        for (size_t i = 0; i + 2 < SIZE; i += 3) {
+            uint32_t v = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8 | in[i + 2];
+            out[o++] = table[v >> 18 & 63];
+            out[o++] = table[v >> 12 & 63];
+            out[o++] = table[v >> 6 & 63];
+            out[o++] = table[v & 63];
+        }
+        for (size_t i = 0; i < o; i++) checksum = checksum * 31 + (unsigned char)out[i];
+        in[pass] ^= (unsigned char)checksum;
+    }
+
+    printf("%llu\n", (unsigned long long)checksum);
+    return 0;
+}
@@ -0,0 +1,16 @@
+// Compute-bound kernel: a tight dependent arithmetic loop, one short block
+#include <stdio.h>
+#include <stdint.h>
+
+#define ITERATIONS 20000000
+
+int main(void) {
+    uint64_t x = 88172645463325252ULL;
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    printf("%llu\n", (unsigned long long)x);
+    return 0;
+}
@@ -0,0 +1,22 @@
+// Compute-bound kernel: repeating-key XOR over a buffer, several passes
+#include <stdio.h>
+#include <stdint.h>
+
+#define SIZE (1 << 20)
+#define PASSES 8
+
+static unsigned char buf[SIZE];
+
+int main(void) {
+    static const unsigned char key[] = "ctf-arena-bench";
+    for (int i = 0; i < SIZE; i++) buf[i] = (unsigned char)(i * 7);
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        for (int i = 0; i < SIZE; i++) buf[i] ^= key[(i + pass) % (sizeof(key) - 1)];
+    }
+
+    uint64_t checksum = 0;
+    for (int i = 0; i < SIZE; i++) checksum += buf[i] * (uint64_t)(i & 255);
+    printf("%llu\n", (unsigned long long)checksum);
+    return 0;
+}
@@ -19,9 +19,89 @@ for var in FLAG SECRET_KEY; do
     fi
 done
 
+# Values pasted into the plugin's comma-separated options (and the argument
+# file xargs splits on blanks and quotes). Some come from the job's env: one
+# holding ",stats_file=..." or ",limit=..." would override options set here.
+for var in LIMIT COUNT_MODE COST_MODEL SYSCALL_COSTS TRANS_SAMPLE PROFILE_TOP \
+           STATS_FILE SYSCALL_REPLAY PROGRESS PROGRESS_FILE; do
+    val=$(printenv "$var" 2>/dev/null)
+    case "$val" in
+        *[,=[:space:]\"\'\\]*)
+            echo "sandbox: $var must not contain ',', '=', quotes or whitespace" >&2
+            exit 1
+            ;;
+    esac
+done
+
 # Plugin and binary
+# COUNT_MODE selects the plugin counting mode: tb (default) or inline
+PLUGIN_ARGS="limit=$LIMIT,binary=/work/binary,from_start=on"
+if [ -n "$COUNT_MODE" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,count=$COUNT_MODE"
+fi
+# COST_MODEL names a /plugin/<name>.tbl weight table for cycles_estimate
+# (e.g. skylake); none is loaded unless one is set
+if [ -n "$COST_MODEL" ] && [ "$COST_MODEL" != "none" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,cost_model=/plugin/$COST_MODEL.tbl"
+fi
+# SYSCALL_COSTS names a /plugin/<name>.tbl syscall cost table; syscalls are
+# free unless one is set
+if [ -n "$SYSCALL_COSTS" ] && [ "$SYSCALL_COSTS" != "none" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,syscall_costs=/plugin/$SYSCALL_COSTS.tbl"
+fi
+# ROI=on recognises ROI markers for roi_instructions
+if [ "$ROI" = "on" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,roi=on"
+fi
+# TRANS_SAMPLE=N times one in N translations for the emulation stats
+# host_translate_ns (e.g. 64); off unless set
+if [ -n "$TRANS_SAMPLE" ] && [ "$TRANS_SAMPLE" != "0" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,trans_sample=$TRANS_SAMPLE"
+fi
+# MEM=on counts loads/stores and estimates L1/L2 misses
+if [ "$MEM" = "on" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,mem=on"
+fi
+# RSS=on tracks touched pages for guest_rss_peak_bytes
+if [ "$RSS" = "on" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,rss=on"
+fi
+# PROFILE=on adds the hottest blocks to the stats; PROFILE_TOP sets how many
+if [ "$PROFILE" = "on" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,profile=on"
+    if [ -n "$PROFILE_TOP" ]; then
+        PLUGIN_ARGS="$PLUGIN_ARGS,profile_top=$PROFILE_TOP"
+    fi
+fi
+# STATS_FILE is a host-seeded file for the stats record instead of stderr
+if [ -n "$STATS_FILE" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,stats_file=$STATS_FILE"
+fi
+# SYSCALL_RECORD=on logs the results of network, random and clock syscalls
+# into the stats (syscall_log) for a later offline re-run. SYSCALL_REPLAY is
+# that re-run, given a recorded log: replay.py brings up the loopback
+# listeners the recording saw and prints its seed, and the plugin checks the
+# results against the log. The seed only repeats AT_RANDOM: QEMU passes
+# getrandom to the host, so its bytes are not served back (replay compares
+# only their length).
+if [ -n "$SYSCALL_REPLAY" ]; then
+    SYSCALL_SEED=$(python3 /replay.py "$SYSCALL_REPLAY") || exit 1
+    PLUGIN_ARGS="$PLUGIN_ARGS,syscall_replay=$SYSCALL_REPLAY"
+elif [ "$SYSCALL_RECORD" = "on" ]; then
+    SYSCALL_SEED=$(od -An -N4 -tu4 /dev/urandom | tr -d ' ')
+    PLUGIN_ARGS="$PLUGIN_ARGS,syscall_log=on,seed=$SYSCALL_SEED"
+fi
+if [ -n "$SYSCALL_SEED" ]; then
+    echo "-seed" >> "$ARGS_FILE"
+    echo "$SYSCALL_SEED" >> "$ARGS_FILE"
+fi
+# PROGRESS_FILE is a host-seeded file for a progress sample every PROGRESS
+# million instructions (default 100)
+if [ -n "$PROGRESS_FILE" ]; then
+    PLUGIN_ARGS="$PLUGIN_ARGS,progress=${PROGRESS:-100},progress_file=$PROGRESS_FILE"
+fi
 echo "-plugin" >> "$ARGS_FILE"
-echo "/plugin/sandbox.so,limit=$LIMIT,binary=/work/binary,from_start=on" >> "$ARGS_FILE"
+echo "/plugin/sandbox.so,$PLUGIN_ARGS" >> "$ARGS_FILE"
 echo "/work/binary" >> "$ARGS_FILE"
 
 # Execute QEMU with arguments from file
@@ -0,0 +1,201 @@
+// Native sandbox launcher: runs the binary directly under user-space
+// hardware counters (perf_event_open, instructions:u and cycles:u) and
+// prints the same stats line as the QEMU plugin, with "mode": "native".
+//
+// Counts are close to, but not the same as, the plugin's: they come from
+// the CPU rather than the emulator, and the limit is enforced by polling, so
+// a run can overshoot it by about a millisecond of execution. Only for
+// unscored runs; scores always come from the QEMU sandbox.
+//
+// Needs CAP_PERFMON (or a permissive perf_event_paranoid) and, to drop to
+// nobody before exec, CAP_SETUID/CAP_SETGID.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define GUEST_UID 65534
+#define POLL_NS 1000000  // limit check interval
+
+extern char **environ;
+
+struct counter {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+};
+
+static int open_counter(pid_t pid, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;  // nothing of the launcher itself is counted
+    attr.inherit = 1;         // threads and children of the guest too
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Counter value, scaled up if the PMU was shared with other events
+static uint64_t read_counter(int fd)
+{
+    struct counter c;
+    if (fd < 0 || read(fd, &c, sizeof(c)) != (ssize_t)sizeof(c)) return 0;
+    if (c.time_running && c.time_running < c.time_enabled) {
+        return (uint64_t)((double)c.value * c.time_enabled / c.time_running);
+    }
+    return c.value;
+}
+
+static uint64_t proc_field(pid_t pid, const char *file, const char *key)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, file);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+
+    uint64_t value = 0;
+    size_t len = strlen(key);
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, len) == 0) {
+            sscanf(line + len, "%" SCNu64, &value);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+// Child side: wait for the counters, become nobody and exec the guest
+static void run_guest(int go_fd, char **argv)
+{
+    char go;
+    if (read(go_fd, &go, 1) != 1) _exit(126);
+    close(go_fd);
+
+    if (getuid() == 0) {
+        if (setgroups(0, NULL) != 0 || setgid(GUEST_UID) != 0 || setuid(GUEST_UID) != 0) {
+            perror("perfrun: dropping privileges");
+            _exit(126);
+        }
+    }
+    prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+    execve(argv[0], argv, environ);
+    perror("perfrun: exec");
+    _exit(127);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: perfrun <binary> [args...]\n");
+        return 2;
+    }
+    const char *limit_env = getenv("LIMIT");
+    uint64_t insn_limit = limit_env ? strtoull(limit_env, NULL, 10) : 0;
+
+    int go[2];
+    if (pipe2(go, O_CLOEXEC) != 0) {
+        perror("perfrun: pipe");
+        return 125;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("perfrun: fork");
+        return 125;
+    }
+    if (pid == 0) {
+        close(go[1]);
+        run_guest(go[0], argv + 1);
+    }
+    close(go[0]);
+
+    int insn_fd = open_counter(pid, PERF_COUNT_HW_INSTRUCTIONS);
+    int cycle_fd = open_counter(pid, PERF_COUNT_HW_CPU_CYCLES);
+    if (insn_fd < 0) {
+        fprintf(stderr, "perfrun: perf_event_open: %s\n", strerror(errno));
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 125;
+    }
+    if (write(go[1], "", 1) != 1) {
+        perror("perfrun: starting guest");
+        kill(pid, SIGKILL);
+    }
+    close(go[1]);
+
+    // Poll the counter until the guest exits (WNOWAIT keeps it a zombie so
+    // its /proc entry can still be read)
+    bool limit_reached = false;
+    siginfo_t info;
+    for (;;) {
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 && errno != EINTR) {
+            perror("perfrun: waitid");
+            break;
+        }
+        if (info.si_pid == pid) break;
+
+        if (insn_limit && !limit_reached && read_counter(insn_fd) >= insn_limit) {
+            limit_reached = true;
+            kill(pid, SIGKILL);
+        }
+        struct timespec ts = { 0, POLL_NS };
+        nanosleep(&ts, NULL);
+    }
+
+    uint64_t io_read_bytes = proc_field(pid, "io", "rchar:");
+    uint64_t io_write_bytes = proc_field(pid, "io", "wchar:");
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    wait4(pid, &status, 0, &usage);
+
+    // Only exited threads are folded into the inherited count, so read after wait
+    uint64_t instructions = read_counter(insn_fd);
+    uint64_t cycles = read_counter(cycle_fd);
+    if (insn_limit && instructions >= insn_limit) limit_reached = true;
+
+    int exit_code;
+    if (limit_reached) {
+        exit_code = 137;
+    } else if (WIFEXITED(status)) {
+        exit_code = WEXITSTATUS(status);
+    } else {
+        exit_code = 128 + WTERMSIG(status);
+    }
+
+    uint64_t maxrss_kb = (uint64_t)usage.ru_maxrss;
+    fprintf(stderr, "\n{\"instructions\": %" PRIu64 ", \"cycles\": %" PRIu64
+            ", \"memory_peak_kb\": %" PRIu64 ", \"memory_rss_kb\": %" PRIu64
+            ", \"memory_hwm_kb\": %" PRIu64 ", \"memory_data_kb\": 0, \"memory_stack_kb\": 0"
+            ", \"io_read_bytes\": %" PRIu64 ", \"io_write_bytes\": %" PRIu64
+            ", \"guest_mmap_bytes\": 0, \"guest_mmap_peak\": 0, \"guest_heap_bytes\": 0"
+            ", \"limit_reached\": %s, \"syscalls\": 0, \"syscall_cost\": 0"
+            ", \"syscall_breakdown\": {}, \"thread_breakdown\": [], \"mode\": \"native\"}\n",
+            instructions, cycles, maxrss_kb, maxrss_kb, maxrss_kb,
+            io_read_bytes, io_write_bytes, limit_reached ? "true" : "false");
+    return exit_code;
+}
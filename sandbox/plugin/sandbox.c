@@ -3,11 +3,17 @@
 #include <string.h>
 #include <inttypes.h>
 #include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include "qemu-plugin.h"
 
 QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
 
-static uint64_t insn_count;
 static uint64_t insn_limit;
 static bool limit_reached;
 static uint64_t main_offset;   // main address from file (or offset for PIE)
@@ -19,20 +25,362 @@ static uint64_t start_addr;
 static bool counting;
 static bool count_from_start;  // if true, count from _start instead of main
 
+// Inline counting mode (count=inline): generated code bumps a per-vCPU
+// scoreboard slot instead of calling vcpu_tb_exec, and the limit check is a
+// conditional callback that only fires once the slot crosses insn_limit
+static bool inline_count;
+
+// Precise limit: blocks normally add their whole length on entry, so a run
+// can overshoot insn_limit by up to a block. Once less than PRECISE_MARGIN
+// instructions are left, the translation cache is flushed (qemu_plugin_reset)
+// and every block translated from then on also gets a per-instruction check
+// that stops right before the instruction past insn_limit. Only the last
+// margin of a run pays for it.
+#define PRECISE_MARGIN 4096
+static qemu_plugin_id_t plugin_id;
+static bool precise_requested;  // reset requested, old blocks may still run
+static bool precise;            // translations since the reset are precise
+static bool stopping;           // a vCPU is writing the stats and exiting
+static bool stats_written;
+
+// Stats channel (stats_file=): instead of a line on the guest's stderr, the
+// stats go to a file the host seeded with a random nonce. The nonce is read
+// and the file emptied at install, before any guest code runs, so a record
+// carrying it can only come from the plugin. Record layout, little-endian:
+//   0  magic "CTFSTATS"
+//   8  u32 version (STATS_VERSION)
+//   12 u32 header size; the payload starts here
+//   16 nonce, STATS_NONCE_SIZE bytes
+//   32 u64 payload length
+//   40 payload: the stats JSON object
+#define STATS_MAGIC "CTFSTATS"
+#define STATS_VERSION 1
+#define STATS_NONCE_SIZE 16
+struct stats_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint8_t nonce[STATS_NONCE_SIZE];
+    uint64_t length;
+};
+_Static_assert(sizeof(struct stats_header) == 40, "stats header layout is fixed per version");
+static int stats_fd = -1;
+static uint8_t stats_nonce[STATS_NONCE_SIZE];
+
+// Progress samples (progress=N, progress_file=): every N million instructions
+// a vCPU overwrites the progress file with a fixed-size sample, so the host
+// can follow a long run while it is still going. The file is seeded with a
+// nonce of its own, but the guest can read a sample and write a fake one, so
+// samples are only ever shown, never scored. Layout, little-endian:
+//   0  magic "CTFPROG\0"
+//   8  u32 version (PROGRESS_VERSION)
+//   12 u32 sample size
+//   16 nonce, STATS_NONCE_SIZE bytes
+//   32 u64 seq, then u64 instructions, syscalls, guest_mmap_bytes,
+//      guest_heap_bytes, guest_rss_bytes (0 without rss=on) and elapsed_ns
+//      since install
+//   88 u64 seq again
+// A sample is one pwrite at offset 0; a reader seeing the two seqs differ
+// read it mid-write and takes the next one.
+#define PROGRESS_MAGIC "CTFPROG"
+#define PROGRESS_VERSION 1
+struct progress_sample {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint8_t nonce[STATS_NONCE_SIZE];
+    uint64_t seq;
+    uint64_t instructions;
+    uint64_t syscalls;
+    uint64_t guest_mmap_bytes;
+    uint64_t guest_heap_bytes;
+    uint64_t guest_rss_bytes;
+    uint64_t elapsed_ns;
+    uint64_t seq_end;
+};
+_Static_assert(sizeof(struct progress_sample) == 96, "progress sample layout is fixed per version");
+static uint64_t progress_every;      // instructions between samples (0 = off)
+static int progress_fd = -1;
+static uint8_t progress_nonce[STATS_NONCE_SIZE];
+static uint64_t progress_seq;
+static struct timespec progress_epoch;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Emulator overhead: every translation is counted at translation time, and a
+// set of the block addresses translated so far tells re-translations of an
+// address (self-modifying code, TB cache flushes) from first ones. With
+// trans_sample=N, one in N translations is also timed on its vCPU thread's
+// CPU clock from the translation hook to the block's first execution (QEMU
+// runs a block right after generating it): code generation plus the plugin's
+// own translation work. The sampled block keeps an exec callback that
+// returns at once afterwards, the only cost outside translation.
+#define SEEN_MAX (1u << 22)               // addresses tracked, then a lower bound
+static uint64_t tb_translated;
+static uint64_t tb_translated_insns;
+static uint64_t tb_retranslated;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *seen_table;              // vaddr + 1, 0 = empty
+static size_t seen_capacity;              // power of two
+static size_t seen_used;
+static uint64_t trans_sample_every;       // 0 = no timing
+static uint64_t trans_samples;
+static uint64_t trans_sample_ns;
+static uint64_t trans_sample_ids;
+static __thread uint64_t trans_sample_start;   // this thread's pending sample
+static __thread uint64_t trans_sample_id;
+
+// Syscall log (syscall_log=on, syscall_replay=<file>). Plugins see syscalls
+// and read guest memory but can neither change a result nor skip a call, so
+// replay is done by rebuilding the environment instead (replay.py starts the
+// recorded loopback listeners, QEMU's -seed repeats AT_RANDOM) and this side
+// checks that the re-run got the results it recorded. getrandom is not
+// served back: QEMU 9.2 linux-user passes it to the host, so its bytes are
+// logged but only its length is compared (glibc calls it from malloc init,
+// so nearly every run would diverge there otherwise). With
+// syscall_log=on the results of calls that depend on the outside are logged
+// in order, under syslog_lock, and added to the stats as "syscall_log"
+// (base64). With syscall_replay=<file> each such result is compared with the
+// next logged one, and the stats get "syscall_replay" with the first index
+// that differed. Log layout (version 2), integers as unsigned LEB128 varints:
+//   "CTFR", u8 version, seed
+//   per call: syscall number, fd (clock id for clocks, epoll fd for epoll
+//   waits, else 0), zigzag return value, data length, data
+// Data is the sockaddr for connect, the bytes read for read/recvfrom on
+// sockets, the int for getsockopt(SO_ERROR), the type for socket, the bytes
+// returned by getrandom, the pollfds (with revents) for poll/ppoll, the read,
+// write and except sets after select/pselect6 (zeros for a NULL set), the
+// ready events for epoll_wait/epoll_pwait and the time for
+// clock_gettime/gettimeofday. Times and random bytes are logged but never
+// compared: they cannot be replayed here. Version 1 logged no data for getrandom and the
+// waits, so they could not diverge; such logs are refused.
+#define SYSLOG_MAGIC "CTFR"
+#define SYSLOG_VERSION 2
+#define SYSLOG_MAX (256 * 1024)           // log bytes, then the log is cut
+#define SYSLOG_DATA_MAX 4096              // data bytes kept per call
+#define SOCKET_FDS_MAX 1024
+static bool syslog_record;
+static uint64_t syslog_seed;              // seed= from entrypoint.sh, for the header
+static pthread_mutex_t syslog_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *syslog_buf;
+static size_t syslog_len;
+static size_t syslog_cap;
+static bool syslog_truncated;
+static uint64_t socket_fds[SOCKET_FDS_MAX / 64];  // fds returned by socket()
+static uint8_t *replay_log;               // syscall_replay=: the recorded log
+static size_t replay_len;
+static size_t replay_pos;
+static uint64_t replay_entries;
+static uint64_t replay_matched;
+static int64_t replay_diverged = -1;      // index of the first differing call
+
+// Block profile (profile=on): one slot per translated block, keyed by vaddr
+// and length. Slots are allocated at translation time and never move, so the
+// exec path bumps its own slot with a relaxed atomic add and takes no lock.
+// The hash table only holds pointers and is grown under profile_lock, which
+// is also only taken at translation time.
+struct tb_profile {
+    uint64_t vaddr;
+    uint64_t n_insns;
+    uint64_t exec_count;
+    int64_t func;                     // index into funcs, -1 if outside any
+};
+
+#define PROFILE_CHUNK 4096
+static bool profile;
+static int profile_top = 20;          // blocks reported (profile_top=N)
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tb_profile **profile_table;
+static size_t profile_capacity;       // power of two
+static size_t profile_used;
+static struct tb_profile *profile_chunk;
+static size_t profile_chunk_used = PROFILE_CHUNK;
+
+// STT_FUNC symbols from .symtab, sorted by address (kept with profile=on).
+// Blocks are attributed to a function once, when their slot is created, so
+// the per-function breakdown costs nothing at exec time.
+struct func_sym {
+    uint64_t addr;
+    uint64_t size;
+    const char *name;                 // points into the mapped binary
+};
+
+#define FUNC_NAME_MAX 128             // longer (mangled) names are truncated
+static struct func_sym *funcs;
+static size_t nfuncs;
+
+// Region of interest (roi=on): begin/end markers toggle a per-vCPU region
+// and the plugin reports the instructions inside regions next to the
+// whole-process count. Markers are found at translation time and get an
+// instruction callback of their own, so other blocks pay nothing. A marker
+// is either the entry of a ctf_roi_begin/ctf_roi_end function or one of
+// these 7-byte nops (nopl 0x4354460N(%rax)), which run natively as no-ops.
+#define ROI_MARKER_LEN 7
+static const uint8_t roi_begin_marker[ROI_MARKER_LEN] = { 0x0f, 0x1f, 0x80, 0x01, 0x46, 0x54, 0x43 };
+static const uint8_t roi_end_marker[ROI_MARKER_LEN] = { 0x0f, 0x1f, 0x80, 0x02, 0x46, 0x54, 0x43 };
+static bool roi;
+static uint64_t roi_begin_offset;     // ctf_roi_begin symbol (file address)
+static uint64_t roi_end_offset;       // ctf_roi_end symbol (file address)
+static uint64_t roi_regions;          // closed regions, all vCPUs
+
+// Symbols resolved in the single symbol table pass; first match wins.
+// Entries with a `when` flag are only looked up while it is set.
+struct wanted_sym {
+    const char *name;
+    uint64_t *value;
+    const bool *when;
+};
+
+static const struct wanted_sym wanted_syms[] = {
+    { "main", &main_offset, NULL },
+    { "main.main", &main_offset, NULL },  // Go
+    { "ctf_roi_begin", &roi_begin_offset, &roi },
+    { "ctf_roi_end", &roi_end_offset, &roi },
+};
+
 // Syscall tracking
-static uint64_t syscall_count;
 static uint64_t syscall_cost;  // Virtual instruction cost per syscall (0 = disabled)
 
 // Track counts for common syscalls (x86_64 syscall numbers)
 #define MAX_TRACKED_SYSCALLS 512
-static uint64_t syscall_counts[MAX_TRACKED_SYSCALLS];
 
-// Guest memory tracking (actual guest allocations via syscalls)
+// Per-syscall cost table (syscall_costs=<file>): a base cost charged on
+// entry plus, for I/O calls, a per-byte cost charged on return from the
+// transferred length. Syscalls the table doesn't list fall back to its
+// "default" line, or to the flat syscall_cost.
+#define SYSCALL_COST_SCALE 1000         // per_byte is in milli-instructions
+struct syscall_cost_entry {
+    uint64_t base;
+    uint64_t per_byte;
+};
+static struct syscall_cost_entry syscall_cost_table[MAX_TRACKED_SYSCALLS];
+static bool syscall_costs;              // any syscall has a non-zero cost
+
+// Per-vCPU counters. qemu-user runs each guest thread on its own host thread
+// as its own vCPU, so every slot has a single writer and plugin_exit merges
+// them. Padded to whole cache lines so neighbouring vCPUs' hot counters
+// never share a line.
+struct vcpu_stats {
+    uint64_t insn_count;
+    uint64_t limit_check_at;   // callback mode: re-check the all-vCPU total here
+    uint64_t syscall_count;
+    uint64_t syscall_counts[MAX_TRACKED_SYSCALLS];
+    uint64_t syscall_cost_acc[MAX_TRACKED_SYSCALLS];  // virtual instructions charged
+    uint64_t roi_active;       // inside a region of interest
+    uint64_t roi_start;        // insn_count where the open region began
+    uint64_t roi_count;        // instructions inside closed regions
+    uint64_t cost;             // cost model units (COST_SCALE per cycle)
+    uint64_t sys_args[4];      // arguments of the syscall in flight, for its return
+    uint64_t progress_at;      // callback mode: next progress sample at this insn_count
+    uint64_t progress_acc;     // inline mode: instructions since the last sample
+    uint64_t pad[3];
+};
+_Static_assert(sizeof(struct vcpu_stats) % 64 == 0, "vcpu_stats must fill whole cache lines");
+
+static struct qemu_plugin_scoreboard *stats_score;
+static qemu_plugin_u64 insn_entry;
+static qemu_plugin_u64 syscall_entry;
+static qemu_plugin_u64 cost_entry;
+static qemu_plugin_u64 progress_entry;
+
+// Cost model (cost_model=<file>): each instruction is classified once at
+// translation time from its bytes and weighted by its class, and the block's
+// summed weight is one more inline add per TB. Weights are in cycles in the
+// table file and kept as fixed point.
+enum insn_class {
+    IC_DEFAULT,
+    IC_NOP,
+    IC_BRANCH,
+    IC_MUL,
+    IC_DIV,
+    IC_STRING,
+    IC_REP_STRING,
+    IC_ATOMIC,
+    IC_SYSCALL,
+    IC_SERIALIZING,
+    IC_X87,
+    IC_SIMD,
+    IC_SIMD_DIV,
+    IC_COUNT
+};
+
+static const char *insn_class_names[IC_COUNT] = {
+    [IC_DEFAULT] = "default", [IC_NOP] = "nop", [IC_BRANCH] = "branch",
+    [IC_MUL] = "mul", [IC_DIV] = "div", [IC_STRING] = "string",
+    [IC_REP_STRING] = "rep_string", [IC_ATOMIC] = "atomic", [IC_SYSCALL] = "syscall",
+    [IC_SERIALIZING] = "serializing", [IC_X87] = "x87", [IC_SIMD] = "simd",
+    [IC_SIMD_DIV] = "simd_div",
+};
+
+#define COST_SCALE 1000
+static bool cost_model;
+static uint64_t class_cost[IC_COUNT];
+
+// Memory traffic (mem=on): loads and stores are counted with inline adds on
+// every instruction's memory accesses, and the accessed cache lines go to a
+// per-vCPU set-associative L1/L2 model. The address needs a callback, which
+// only appends to a ring buffer; the model runs over a full buffer at once.
+// Caches are per vCPU like a core's private L1d/L2, LRU, and an L1 miss
+// looks up L2.
+#define MEM_RING_SIZE 4096
+struct cache_level {
+    uint64_t *tags;      // sets * ways line numbers + 1, MRU first, 0 = empty
+    uint64_t set_mask;
+    uint32_t ways;
+};
+
+struct vcpu_mem {
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t l1_misses;
+    uint64_t l2_misses;
+    uint64_t ring_len;
+    uint64_t last_page;        // rss=on: last page this vCPU marked touched
+    struct cache_level l1, l2;
+    uint64_t ring[MEM_RING_SIZE];  // line numbers waiting for the model
+};
+
+static bool mem_trace;
+static uint64_t l1_kb = 32, l1_ways = 8;    // Skylake-class L1d
+static uint64_t l2_kb = 256, l2_ways = 4;   // and L2
+static uint64_t cache_line = 64;
+static unsigned int line_shift;
+static struct qemu_plugin_scoreboard *mem_score;
+static qemu_plugin_u64 loads_entry;
+static qemu_plugin_u64 stores_entry;
+
+// Guest memory tracking (actual guest allocations via syscalls). These are
+// process-wide, so they are updated atomically from whichever vCPU syscalls.
 static uint64_t guest_mmap_bytes = 0;      // Current mmap'd memory
 static uint64_t guest_mmap_peak = 0;       // Peak mmap'd memory
-static uint64_t guest_brk_base = 0;        // Initial brk (heap start)
+static uint64_t guest_brk_base = 0;        // Initial brk (heap start, 0 = not seen yet)
 static uint64_t guest_brk_current = 0;     // Current brk (heap end)
-static bool guest_brk_initialized = false;
+
+// Live guest mappings, kept from syscall return values so failed calls,
+// MAP_FIXED replacements, mremap and partial munmaps all come out right.
+// Sorted, non-overlapping [start, end) page ranges.
+#define GUEST_PAGE_SHIFT 12
+#define GUEST_PAGE_SIZE ((uint64_t)1 << GUEST_PAGE_SHIFT)
+struct mapping {
+    uint64_t start, end;
+};
+static struct mapping *mappings;
+static size_t mappings_len, mappings_cap;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// rss=on: pages the guest actually touched, from memory callbacks, in a
+// sparse table of bitmap chunks. Bits are cleared again when the pages are
+// unmapped or dropped, so the count is the guest's resident set.
+#define CHUNK_PAGE_SHIFT 15                           // 32768 pages = 128 MiB per chunk
+#define CHUNK_WORDS ((1ULL << CHUNK_PAGE_SHIFT) / 64)
+#define PAGE_CHUNKS 4096
+struct page_chunk {
+    uint64_t key;       // chunk number + 1, 0 = empty slot
+    uint64_t *bits;
+};
+static bool rss_trace;
+static struct page_chunk page_chunks[PAGE_CHUNKS];
+static pthread_mutex_t page_chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t rss_pages, rss_peak_pages;
 
 // x86_64 syscall names (complete list)
 static const char* syscall_names[] = {
@@ -137,292 +485,2066 @@ static const char* syscall_name(int64_t num) {
     return NULL;
 }
 
-static void parse_elf(const char *path)
+static struct vcpu_stats *vcpu_stats_of(unsigned int vcpu_index)
 {
-    FILE *f = fopen(path, "rb");
-    if (!f) return;
-
-    Elf64_Ehdr ehdr;
-    if (fread(&ehdr, sizeof(ehdr), 1, f) != 1) goto fail;
-    if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0) goto fail;
-
-    entry_offset = ehdr.e_entry;
-    is_pie = (ehdr.e_type == ET_DYN);
-
-    // Find section header string table
-    if (ehdr.e_shoff == 0 || ehdr.e_shstrndx == 0) goto use_entry;
-
-    Elf64_Shdr shstrtab_hdr;
-    fseek(f, ehdr.e_shoff + ehdr.e_shstrndx * sizeof(Elf64_Shdr), SEEK_SET);
-    if (fread(&shstrtab_hdr, sizeof(shstrtab_hdr), 1, f) != 1) goto use_entry;
-    if (shstrtab_hdr.sh_size == 0) goto use_entry;
-
-    char *shstrtab = malloc(shstrtab_hdr.sh_size);
-    if (!shstrtab) goto use_entry;
-    fseek(f, shstrtab_hdr.sh_offset, SEEK_SET);
-    if (fread(shstrtab, shstrtab_hdr.sh_size, 1, f) != 1) { free(shstrtab); goto use_entry; }
-
-    // Search for .symtab and .strtab
-    Elf64_Shdr symtab_hdr = {0}, strtab_hdr = {0};
-    for (int i = 0; i < ehdr.e_shnum; i++) {
-        Elf64_Shdr shdr;
-        fseek(f, ehdr.e_shoff + i * sizeof(Elf64_Shdr), SEEK_SET);
-        if (fread(&shdr, sizeof(shdr), 1, f) != 1) continue;
-        if (shdr.sh_name >= shstrtab_hdr.sh_size) continue;
-        const char *name = shstrtab + shdr.sh_name;
-        if (strcmp(name, ".symtab") == 0) symtab_hdr = shdr;
-        else if (strcmp(name, ".strtab") == 0) strtab_hdr = shdr;
-    }
-    free(shstrtab);
-
-    if (symtab_hdr.sh_size == 0 || strtab_hdr.sh_size == 0) goto use_entry;
-
-    char *strtab = malloc(strtab_hdr.sh_size);
-    if (!strtab) goto use_entry;
-    fseek(f, strtab_hdr.sh_offset, SEEK_SET);
-    if (fread(strtab, strtab_hdr.sh_size, 1, f) != 1) { free(strtab); goto use_entry; }
-
-    size_t nsyms = symtab_hdr.sh_size / sizeof(Elf64_Sym);
-    fseek(f, symtab_hdr.sh_offset, SEEK_SET);
-    for (size_t i = 0; i < nsyms; i++) {
-        Elf64_Sym sym;
-        if (fread(&sym, sizeof(sym), 1, f) != 1) break;
-        if (sym.st_name >= strtab_hdr.sh_size) continue;
-        const char *name = strtab + sym.st_name;
-        if (sym.st_value != 0) {
-            if (strcmp(name, "main") == 0) {
-                main_offset = sym.st_value;
-                break;
-            }
-            if (strcmp(name, "main.main") == 0) {
-                main_offset = sym.st_value;
-                break;
-            }
-        }
+    return qemu_plugin_scoreboard_find(stats_score, vcpu_index);
+}
+
+static uint64_t total_insn_count(void)
+{
+    return qemu_plugin_u64_sum(insn_entry);
+}
+
+static struct vcpu_mem *vcpu_mem_of(unsigned int vcpu_index)
+{
+    return qemu_plugin_scoreboard_find(mem_score, vcpu_index);
+}
+
+// Set count rounded down to a power of two so the set is a mask
+static bool cache_init(struct cache_level *c, uint64_t kb, uint64_t ways)
+{
+    uint64_t sets = kb * 1024 / cache_line / ways;
+    if (!sets) sets = 1;
+    while (sets & (sets - 1)) sets &= sets - 1;
+    c->tags = calloc(sets * ways, sizeof(*c->tags));
+    c->set_mask = sets - 1;
+    c->ways = (uint32_t)ways;
+    return c->tags != NULL;
+}
+
+// True on a hit; either way the line ends up most recently used
+static bool cache_access(struct cache_level *c, uint64_t line)
+{
+    uint64_t *set = c->tags + (line & c->set_mask) * c->ways;
+    uint64_t tag = line + 1;
+    uint32_t w = 0;
+    while (w < c->ways && set[w] != tag) w++;
+    bool hit = w < c->ways;
+    if (!hit) w = c->ways - 1;  // evict the LRU way
+    memmove(set + 1, set, w * sizeof(*set));
+    set[0] = tag;
+    return hit;
+}
+
+static void mem_drain(struct vcpu_mem *vm)
+{
+    if (!vm->l1.tags && (!cache_init(&vm->l1, l1_kb, l1_ways) || !cache_init(&vm->l2, l2_kb, l2_ways))) {
+        vm->ring_len = 0;
+        return;
+    }
+    for (uint64_t i = 0; i < vm->ring_len; i++) {
+        if (cache_access(&vm->l1, vm->ring[i])) continue;
+        vm->l1_misses++;
+        if (!cache_access(&vm->l2, vm->ring[i])) vm->l2_misses++;
     }
-    free(strtab);
+    vm->ring_len = 0;
+}
 
-use_entry:
-    if (!main_offset) main_offset = entry_offset;
-    fclose(f);
-    return;
+static bool write_stats(void);
 
-fail:
-    fclose(f);
+static void stop_at_limit(void)
+{
+    // The first vCPU to stop writes the stats once and ends the process;
+    // any other vCPU stopping meanwhile just waits for it
+    if (__atomic_exchange_n(&stopping, true, __ATOMIC_ACQ_REL)) {
+        for (;;) pause();
+    }
+    limit_reached = true;
+    if (!write_stats()) {
+        for (;;) pause();  // a normal exit is already writing them
+    }
+    _exit(137);
 }
 
-static void vcpu_syscall(qemu_plugin_id_t id, unsigned int vcpu_index,
-                         int64_t num, uint64_t a1, uint64_t a2,
-                         uint64_t a3, uint64_t a4, uint64_t a5,
-                         uint64_t a6, uint64_t a7, uint64_t a8)
+static void register_callbacks(qemu_plugin_id_t id);
+
+static void seen_reset(void);
+
+static void precise_reset_done(qemu_plugin_id_t id)
 {
-    // Always count syscalls when from_start mode is enabled
-    // (counting should already be true, but syscalls might fire before first TB)
-    if (!counting && !count_from_start) return;
+    // The flush re-translates every block; those are not the guest's doing
+    seen_reset();
+    precise = true;
+    register_callbacks(id);
+}
 
-    syscall_count++;
-    if (num >= 0 && num < MAX_TRACKED_SYSCALLS) {
-        syscall_counts[num]++;
-    }
-
-    // Track guest memory allocations
-    if (num == 9) {  // mmap
-        // mmap(addr, length, prot, flags, fd, offset)
-        // a2 = length
-        uint64_t length = a2;
-        guest_mmap_bytes += length;
-        if (guest_mmap_bytes > guest_mmap_peak) {
-            guest_mmap_peak = guest_mmap_bytes;
-        }
-    } else if (num == 11) {  // munmap
-        // munmap(addr, length) - a2 = length
-        uint64_t length = a2;
-        if (length <= guest_mmap_bytes) {
-            guest_mmap_bytes -= length;
-        } else {
-            guest_mmap_bytes = 0;
-        }
+static void request_precise(void)
+{
+    if (!__atomic_exchange_n(&precise_requested, true, __ATOMIC_RELAXED)) {
+        qemu_plugin_reset(plugin_id, precise_reset_done);
     }
+}
 
-    // Add virtual cost for syscalls if enabled
-    if (syscall_cost > 0) {
-        insn_count += syscall_cost;
-        if (insn_limit && insn_count >= insn_limit) {
-            limit_reached = true;
-            exit(137);
-        }
+// Callback mode: each vCPU only compares against its own limit_check_at, and
+// when that trips the all-vCPU total is checked and the remaining budget is
+// split across the running vCPUs. With one vCPU this is exactly insn_limit.
+// The first re-check is PRECISE_MARGIN early so the precise tier can start.
+static void check_total_limit(struct vcpu_stats *vs)
+{
+    if (precise) {
+        // Precise blocks check every instruction themselves
+        vs->limit_check_at = UINT64_MAX;
+        return;
+    }
+    uint64_t total = total_insn_count();
+    if (total >= insn_limit) {
+        stop_at_limit();
+    }
+    uint64_t left = insn_limit - total;
+    if (left <= PRECISE_MARGIN) {
+        request_precise();
+    } else if (!precise_requested) {
+        left -= PRECISE_MARGIN;
     }
+    uint64_t nvcpus = qemu_plugin_num_vcpus();
+    uint64_t share = left / (nvcpus ? nvcpus : 1);
+    vs->limit_check_at = vs->insn_count + (share ? share : 1);
 }
 
-static void vcpu_syscall_ret(qemu_plugin_id_t id, unsigned int vcpu_index,
-                              int64_t num, int64_t ret)
+static void raise_peak(uint64_t *peak_p, uint64_t cur)
 {
-    // Track brk return values to measure heap growth
-    if (num == 12 && ret > 0) {  // brk returns new brk address (or current if arg was 0)
-        uint64_t new_brk = (uint64_t)ret;
-        if (!guest_brk_initialized) {
-            guest_brk_base = new_brk;
-            guest_brk_current = new_brk;
-            guest_brk_initialized = true;
-        } else {
-            guest_brk_current = new_brk;
-        }
+    uint64_t peak = __atomic_load_n(peak_p, __ATOMIC_RELAXED);
+    while (cur > peak &&
+           !__atomic_compare_exchange_n(peak_p, &peak, cur, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
 }
 
-static void plugin_exit(qemu_plugin_id_t id, void *p)
+static uint64_t page_align_up(uint64_t v)
 {
-    uint64_t vm_peak_kb = 0;
-    uint64_t vm_rss_kb = 0;
-    uint64_t vm_hwm_kb = 0;
-    uint64_t vm_data_kb = 0;
-    uint64_t vm_stk_kb = 0;
+    return (v + GUEST_PAGE_SIZE - 1) & ~(GUEST_PAGE_SIZE - 1);
+}
 
-    FILE *status = fopen("/proc/self/status", "r");
-    if (status) {
-        char line[256];
-        while (fgets(line, sizeof(line), status)) {
-            if (strncmp(line, "VmPeak:", 7) == 0) {
-                sscanf(line + 7, "%" SCNu64, &vm_peak_kb);
-            } else if (strncmp(line, "VmRSS:", 6) == 0) {
-                sscanf(line + 6, "%" SCNu64, &vm_rss_kb);
-            } else if (strncmp(line, "VmHWM:", 6) == 0) {
-                sscanf(line + 6, "%" SCNu64, &vm_hwm_kb);
-            } else if (strncmp(line, "VmData:", 7) == 0) {
-                sscanf(line + 7, "%" SCNu64, &vm_data_kb);
-            } else if (strncmp(line, "VmStk:", 6) == 0) {
-                sscanf(line + 6, "%" SCNu64, &vm_stk_kb);
+// Room for one more mapping; needs mappings_lock
+static bool mappings_grow(void)
+{
+    if (mappings_len < mappings_cap) return true;
+    size_t cap = mappings_cap ? mappings_cap * 2 : 64;
+    struct mapping *grown = realloc(mappings, cap * sizeof(*mappings));
+    if (!grown) return false;
+    mappings = grown;
+    mappings_cap = cap;
+    return true;
+}
+
+// Drops [start, end), splitting a mapping that straddles it. Returns the
+// bytes that were mapped there. Needs mappings_lock.
+static uint64_t mapping_remove(uint64_t start, uint64_t end)
+{
+    uint64_t removed = 0;
+    size_t i = 0;
+    while (i < mappings_len && mappings[i].end <= start) i++;
+    while (i < mappings_len && mappings[i].start < end) {
+        struct mapping *m = &mappings[i];
+        if (m->start < start && m->end > end) {
+            uint64_t tail_end = m->end;
+            removed += end - start;
+            if (mappings_grow()) {
+                memmove(&mappings[i + 2], &mappings[i + 1],
+                        (mappings_len - i - 1) * sizeof(*mappings));
+                mappings[i + 1] = (struct mapping){ end, tail_end };
+                mappings_len++;
+            } else {
+                removed += tail_end - end;  // out of memory: stop tracking the tail
             }
+            mappings[i].end = start;
+            break;
+        }
+        if (m->start < start) {
+            removed += m->end - start;
+            m->end = start;
+            i++;
+        } else if (m->end > end) {
+            removed += end - m->start;
+            m->start = end;
+            break;
+        } else {
+            removed += m->end - m->start;
+            memmove(m, m + 1, (mappings_len - i - 1) * sizeof(*mappings));
+            mappings_len--;
         }
-        fclose(status);
     }
+    return removed;
+}
 
-    uint64_t io_read_bytes = 0;
-    uint64_t io_write_bytes = 0;
+// Adds [start, end), which must not overlap any mapping, joining neighbours.
+// Returns the bytes added. Needs mappings_lock.
+static uint64_t mapping_insert(uint64_t start, uint64_t end)
+{
+    size_t i = 0;
+    while (i < mappings_len && mappings[i].start < start) i++;
+    bool join_prev = i > 0 && mappings[i - 1].end == start;
+    bool join_next = i < mappings_len && mappings[i].start == end;
+    if (join_prev && join_next) {
+        mappings[i - 1].end = mappings[i].end;
+        memmove(&mappings[i], &mappings[i + 1], (mappings_len - i - 1) * sizeof(*mappings));
+        mappings_len--;
+    } else if (join_prev) {
+        mappings[i - 1].end = end;
+    } else if (join_next) {
+        mappings[i].start = start;
+    } else {
+        if (!mappings_grow()) return 0;
+        memmove(&mappings[i + 1], &mappings[i], (mappings_len - i) * sizeof(*mappings));
+        mappings[i] = (struct mapping){ start, end };
+        mappings_len++;
+    }
+    return end - start;
+}
 
-    FILE *io = fopen("/proc/self/io", "r");
-    if (io) {
-        char line[256];
-        while (fgets(line, sizeof(line), io)) {
-            if (strncmp(line, "rchar:", 6) == 0) {
-                sscanf(line + 6, "%" SCNu64, &io_read_bytes);
-            } else if (strncmp(line, "wchar:", 6) == 0) {
-                sscanf(line + 6, "%" SCNu64, &io_write_bytes);
+// A successful mmap (or mremap target): replaces anything already there
+static void guest_map(uint64_t start, uint64_t length)
+{
+    uint64_t end = start + page_align_up(length);
+    if (end <= start) return;
+    pthread_mutex_lock(&mappings_lock);
+    uint64_t cur = guest_mmap_bytes - mapping_remove(start, end);
+    cur += mapping_insert(start, end);
+    __atomic_store_n(&guest_mmap_bytes, cur, __ATOMIC_RELAXED);
+    raise_peak(&guest_mmap_peak, cur);
+    pthread_mutex_unlock(&mappings_lock);
+}
+
+static void guest_unmap(uint64_t start, uint64_t length)
+{
+    uint64_t end = start + page_align_up(length);
+    if (end <= start) return;
+    pthread_mutex_lock(&mappings_lock);
+    __atomic_store_n(&guest_mmap_bytes, guest_mmap_bytes - mapping_remove(start, end),
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mappings_lock);
+}
+
+// Bitmap chunk for a chunk number, created on first touch. Lookups are
+// lock-free; a slot's key is published only after its bitmap.
+static uint64_t *page_chunk(uint64_t chunk, bool create)
+{
+    uint64_t key = chunk + 1;
+    size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 52) & (PAGE_CHUNKS - 1);
+    for (size_t probe = 0; probe < PAGE_CHUNKS; probe++, i = (i + 1) & (PAGE_CHUNKS - 1)) {
+        struct page_chunk *c = &page_chunks[i];
+        uint64_t k = __atomic_load_n(&c->key, __ATOMIC_ACQUIRE);
+        if (k == key) return c->bits;
+        if (k) continue;
+        if (!create) return NULL;
+
+        pthread_mutex_lock(&page_chunks_lock);
+        k = c->key;
+        if (!k) {
+            c->bits = calloc(CHUNK_WORDS, sizeof(uint64_t));
+            if (c->bits) {
+                __atomic_store_n(&c->key, key, __ATOMIC_RELEASE);
+                k = key;
             }
         }
-        fclose(io);
+        pthread_mutex_unlock(&page_chunks_lock);
+        if (k == key) return c->bits;
+        if (!k) return NULL;  // out of memory
     }
+    return NULL;  // table full: pages this far out go uncounted
+}
 
-    // Build syscall breakdown for non-zero counts
-    char syscall_breakdown[4096] = "";
-    int offset = 0;
-    bool first = true;
-    for (int i = 0; i < MAX_TRACKED_SYSCALLS && offset < 4000; i++) {
-        if (syscall_counts[i] > 0) {
-            const char *name = syscall_name(i);
-            if (name) {
-                offset += snprintf(syscall_breakdown + offset, sizeof(syscall_breakdown) - offset,
-                                   "%s\"%s\": %" PRIu64, first ? "" : ", ", name, syscall_counts[i]);
-            } else {
-                offset += snprintf(syscall_breakdown + offset, sizeof(syscall_breakdown) - offset,
-                                   "%s\"sys_%d\": %" PRIu64, first ? "" : ", ", i, syscall_counts[i]);
+static void page_touch(uint64_t page)
+{
+    uint64_t *bits = page_chunk(page >> CHUNK_PAGE_SHIFT, true);
+    if (!bits) return;
+    uint64_t *word = &bits[(page & ((1ULL << CHUNK_PAGE_SHIFT) - 1)) / 64];
+    uint64_t bit = 1ULL << (page & 63);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return;
+    if (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) return;
+    raise_peak(&rss_peak_pages, __atomic_add_fetch(&rss_pages, 1, __ATOMIC_RELAXED));
+}
+
+// Clears a page's bit; true if it was set. Leaves rss_pages to the caller.
+static bool page_untouch(uint64_t page)
+{
+    uint64_t *bits = page_chunk(page >> CHUNK_PAGE_SHIFT, false);
+    if (!bits) return false;
+    uint64_t *word = &bits[(page & ((1ULL << CHUNK_PAGE_SHIFT) - 1)) / 64];
+    uint64_t bit = 1ULL << (page & 63);
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)) return false;
+    return __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED) & bit;
+}
+
+// Pages in [start, end) are no longer resident. vCPUs forget their last
+// page so touching one of these again is seen.
+static void pages_drop(uint64_t start, uint64_t end)
+{
+    uint64_t page = start >> GUEST_PAGE_SHIFT;
+    uint64_t last = page_align_up(end) >> GUEST_PAGE_SHIFT;
+    uint64_t dropped = 0;
+    while (page < last) {
+        uint64_t chunk_end = ((page >> CHUNK_PAGE_SHIFT) + 1) << CHUNK_PAGE_SHIFT;
+        if (chunk_end > last || chunk_end == 0) chunk_end = last;
+        if (page_chunk(page >> CHUNK_PAGE_SHIFT, false)) {
+            for (; page < chunk_end; page++) {
+                dropped += page_untouch(page);
             }
-            first = false;
         }
+        page = chunk_end;
+    }
+    if (dropped) {
+        __atomic_sub_fetch(&rss_pages, dropped, __ATOMIC_RELAXED);
+    }
+    int nvcpus = qemu_plugin_num_vcpus();
+    for (int v = 0; v < nvcpus; v++) {
+        vcpu_mem_of(v)->last_page = 0;
     }
+}
 
-    // Calculate guest heap size from brk
-    uint64_t guest_heap_bytes = 0;
-    if (guest_brk_initialized && guest_brk_current > guest_brk_base) {
-        guest_heap_bytes = guest_brk_current - guest_brk_base;
+// mremap moved resident pages along with the mapping
+static void pages_move(uint64_t from, uint64_t to, uint64_t length)
+{
+    for (uint64_t off = 0; off < length; off += GUEST_PAGE_SIZE) {
+        if (page_untouch((from + off) >> GUEST_PAGE_SHIFT)) {
+            __atomic_sub_fetch(&rss_pages, 1, __ATOMIC_RELAXED);
+            page_touch((to + off) >> GUEST_PAGE_SHIFT);
+        }
     }
+}
 
-    fprintf(stderr, "\n{\"instructions\": %" PRIu64 ", \"memory_peak_kb\": %" PRIu64
-            ", \"memory_rss_kb\": %" PRIu64 ", \"memory_hwm_kb\": %" PRIu64
-            ", \"memory_data_kb\": %" PRIu64 ", \"memory_stack_kb\": %" PRIu64
-            ", \"io_read_bytes\": %" PRIu64 ", \"io_write_bytes\": %" PRIu64
-            ", \"guest_mmap_bytes\": %" PRIu64 ", \"guest_mmap_peak\": %" PRIu64
-            ", \"guest_heap_bytes\": %" PRIu64
-            ", \"limit_reached\": %s, \"syscalls\": %" PRIu64
-            ", \"syscall_cost\": %" PRIu64
-            ", \"syscall_breakdown\": {%s}}\n",
-            insn_count, vm_peak_kb, vm_rss_kb, vm_hwm_kb, vm_data_kb, vm_stk_kb,
-            io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
-            guest_heap_bytes, limit_reached ? "true" : "false",
-            syscall_count, syscall_cost, syscall_breakdown);
+static size_t profile_hash(uint64_t vaddr, uint64_t n_insns)
+{
+    uint64_t h = vaddr ^ (n_insns << 56);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h & (profile_capacity - 1);
 }
 
-static void vcpu_tb_exec(unsigned int cpu_index, void *udata)
+static void profile_insert(struct tb_profile *slot)
 {
-    uint64_t n = (uint64_t)udata;
-    insn_count += n;
-    if (insn_limit && insn_count >= insn_limit) {
-        limit_reached = true;
-        exit(137);
+    size_t i = profile_hash(slot->vaddr, slot->n_insns);
+    while (profile_table[i]) {
+        i = (i + 1) & (profile_capacity - 1);
     }
+    profile_table[i] = slot;
 }
 
-static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
+static bool profile_grow(void)
 {
-    uint64_t addr = qemu_plugin_tb_vaddr(tb);
-    size_t n = qemu_plugin_tb_n_insns(tb);
+    struct tb_profile **old = profile_table;
+    size_t old_capacity = profile_capacity;
+    size_t capacity = old_capacity ? old_capacity * 2 : 4096;
 
-    // Determine runtime base from first TB if needed
-    if (need_base) {
-        // First TB should be near the entry point
-        // For PIE: runtime_entry = addr (approximately), base = addr - entry_offset
-        runtime_base = addr - entry_offset;
-        start_addr = runtime_base + main_offset;
-        need_base = false;
+    struct tb_profile **table = calloc(capacity, sizeof(*table));
+    if (!table) return false;
+
+    profile_table = table;
+    profile_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i]) profile_insert(old[i]);
     }
+    free(old);
+    return true;
+}
 
-    if (!counting) {
-        // Check if any instruction in this TB is at start_addr
-        for (size_t i = 0; i < n; i++) {
-            struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
-            if (qemu_plugin_insn_vaddr(insn) == start_addr) {
-                counting = true;
-                break;
-            }
+// Function containing a (file-relative) address: the last symbol starting at
+// or below it, unless that symbol has a size and the address is past its end
+static int64_t func_lookup(uint64_t addr)
+{
+    size_t lo = 0, hi = nfuncs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (funcs[mid].addr <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return -1;
+    const struct func_sym *f = &funcs[lo - 1];
+    if (f->size && addr - f->addr >= f->size) return -1;
+    return (int64_t)(lo - 1);
+}
+
+static int func_cmp(const void *a, const void *b)
+{
+    const struct func_sym *x = a, *y = b;
+    if (x->addr != y->addr) return x->addr < y->addr ? -1 : 1;
+    // Prefer the sized symbol among aliases so it survives deduplication
+    return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+// Translation time only: find or create the slot for this block
+static struct tb_profile *profile_slot(uint64_t vaddr, uint64_t n_insns)
+{
+    struct tb_profile *slot = NULL;
+
+    pthread_mutex_lock(&profile_lock);
+    if ((profile_used + 1) * 2 > profile_capacity && !profile_grow()) goto out;
+
+    size_t i = profile_hash(vaddr, n_insns);
+    while (profile_table[i]) {
+        if (profile_table[i]->vaddr == vaddr && profile_table[i]->n_insns == n_insns) {
+            slot = profile_table[i];
+            goto out;
         }
-        if (!counting) return;
+        i = (i + 1) & (profile_capacity - 1);
     }
 
-    qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_exec,
-                                         QEMU_PLUGIN_CB_NO_REGS, (void *)n);
+    if (profile_chunk_used == PROFILE_CHUNK) {
+        // Chunks are never freed: exec callbacks hold pointers into them
+        profile_chunk = calloc(PROFILE_CHUNK, sizeof(*profile_chunk));
+        if (!profile_chunk) goto out;
+        profile_chunk_used = 0;
+    }
+    slot = &profile_chunk[profile_chunk_used++];
+    slot->vaddr = vaddr;
+    slot->n_insns = n_insns;
+    slot->func = func_lookup(vaddr - (is_pie ? runtime_base : 0));
+    profile_table[i] = slot;
+    profile_used++;
+
+out:
+    pthread_mutex_unlock(&profile_lock);
+    return slot;
 }
 
-QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
-                                           const qemu_info_t *info,
-                                           int argc, char **argv)
+static int profile_cmp(const void *a, const void *b)
 {
-    for (int i = 0; i < argc; i++) {
-        char *p = argv[i];
-        if (strncmp(p, "limit=", 6) == 0) {
-            insn_limit = strtoull(p + 6, NULL, 10);
-        } else if (strncmp(p, "binary=", 7) == 0) {
-            parse_elf(p + 7);
-        } else if (strncmp(p, "syscall_cost=", 13) == 0) {
-            syscall_cost = strtoull(p + 13, NULL, 10);
-        } else if (strcmp(p, "from_start") == 0 || strcmp(p, "from_start=true") == 0 || strcmp(p, "from_start=on") == 0) {
-            count_from_start = true;
+    const struct tb_profile *x = *(struct tb_profile *const *)a;
+    const struct tb_profile *y = *(struct tb_profile *const *)b;
+    uint64_t xi = x->exec_count * x->n_insns;
+    uint64_t yi = y->exec_count * y->n_insns;
+    if (xi != yi) return xi < yi ? 1 : -1;
+    return x->vaddr < y->vaddr ? -1 : x->vaddr > y->vaddr;
+}
+
+// Bytes per block entry; one with every counter at 20 digits is about 130
+#define PROFILE_ENTRY_MAX 160
+
+// JSON array of the profile_top hottest blocks by instructions executed.
+// PIE addresses are rebased to file offsets so they match objdump output.
+static char *profile_json(void)
+{
+    size_t n = 0;
+    struct tb_profile **slots = malloc((profile_used ? profile_used : 1) * sizeof(*slots));
+    size_t cap = (size_t)profile_top * PROFILE_ENTRY_MAX + 1;
+    char *out = malloc(cap);
+    if (!slots || !out) {
+        free(slots);
+        free(out);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < profile_capacity; i++) {
+        if (profile_table[i] && profile_table[i]->exec_count) slots[n++] = profile_table[i];
+    }
+    qsort(slots, n, sizeof(*slots), profile_cmp);
+
+    uint64_t base = is_pie ? runtime_base : 0;
+    size_t offset = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < n && i < (size_t)profile_top; i++) {
+        struct tb_profile *slot = slots[i];
+        int len = snprintf(out + offset, cap - offset,
+                           "%s{\"addr\": \"0x%" PRIx64 "\", \"len\": %" PRIu64
+                           ", \"execs\": %" PRIu64 ", \"instructions\": %" PRIu64 "}",
+                           i ? ", " : "", slot->vaddr - base, slot->n_insns,
+                           slot->exec_count, slot->exec_count * slot->n_insns);
+        if (len < 0 || (size_t)len >= cap - offset) {
+            out[offset] = '\0';  // keep the entries that fit whole
+            break;
         }
+        offset += len;
     }
+    free(slots);
+    return out;
+}
 
-    if (count_from_start) {
-        // Count from very first instruction - captures ALL user-space instructions
-        counting = true;
-    } else if (main_offset == 0) {
-        counting = true;  // No binary or couldn't parse, count everything
-    } else if (is_pie) {
-        need_base = true;  // Wait for first TB to determine base
-    } else {
-        start_addr = main_offset;  // Non-PIE: use address directly
+// JSON string body with quotes, backslashes and control characters escaped
+static size_t json_escape(char *out, const char *s, size_t max_chars)
+{
+    size_t n = 0;
+    for (size_t i = 0; s[i] && i < max_chars; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c < 0x20) {
+            n += sprintf(out + n, "\\u%04x", c);
+        } else {
+            out[n++] = c;
+        }
     }
+    out[n] = '\0';
+    return n;
+}
 
-    qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
-    qemu_plugin_register_vcpu_syscall_cb(id, vcpu_syscall);
-    qemu_plugin_register_vcpu_syscall_ret_cb(id, vcpu_syscall_ret);
-    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+struct func_total {
+    int64_t func;
+    uint64_t instructions;
+};
+
+static int func_total_cmp(const void *a, const void *b)
+{
+    const struct func_total *x = a, *y = b;
+    if (x->instructions != y->instructions) return x->instructions < y->instructions ? 1 : -1;
+    return x->func < y->func ? -1 : x->func > y->func;
+}
+
+// JSON array of the profile_top functions by instructions executed, summed
+// over their blocks. Code outside any symbol (stripped binaries, the vDSO,
+// runtime-generated code) is reported as "[unknown]".
+static char *function_json(void)
+{
+    struct func_total *totals = calloc(nfuncs + 1, sizeof(*totals));
+    char *out = malloc(((size_t)profile_top + 1) * (FUNC_NAME_MAX * 6 + 64) + 1);
+    if (!totals || !out) {
+        free(totals);
+        free(out);
+        return NULL;
+    }
+
+    // Slot nfuncs collects the unattributed blocks
+    for (size_t i = 0; i <= nfuncs; i++) {
+        totals[i].func = i < nfuncs ? (int64_t)i : -1;
+    }
+    for (size_t i = 0; i < profile_capacity; i++) {
+        struct tb_profile *slot = profile_table[i];
+        if (!slot) continue;
+        size_t f = slot->func >= 0 ? (size_t)slot->func : nfuncs;
+        totals[f].instructions += slot->exec_count * slot->n_insns;
+    }
+    qsort(totals, nfuncs + 1, sizeof(*totals), func_total_cmp);
+
+    size_t offset = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i <= nfuncs && i < (size_t)profile_top; i++) {
+        if (!totals[i].instructions) break;
+        offset += sprintf(out + offset, "%s{\"name\": \"", i ? ", " : "");
+        offset += json_escape(out + offset,
+                              totals[i].func >= 0 ? funcs[totals[i].func].name : "[unknown]",
+                              FUNC_NAME_MAX);
+        offset += sprintf(out + offset, "\", \"instructions\": %" PRIu64 "}",
+                          totals[i].instructions);
+    }
+    free(totals);
+    return out;
+}
+
+static bool wanted_syms_resolved(void)
+{
+    for (size_t i = 0; i < sizeof(wanted_syms) / sizeof(wanted_syms[0]); i++) {
+        if (wanted_syms[i].when && !*wanted_syms[i].when) continue;
+        if (!*wanted_syms[i].value) return false;
+    }
+    return true;
+}
+
+// One sequential pass over a symbol table: resolve wanted_syms and, with
+// profile=on, collect STT_FUNC symbols
+static void scan_symbols(const Elf64_Sym *syms, size_t nsyms, const char *strtab, size_t strsz)
+{
+    if (profile) {
+        funcs = malloc((nsyms ? nsyms : 1) * sizeof(*funcs));
+    }
+
+    for (size_t i = 0; i < nsyms; i++) {
+        const Elf64_Sym *sym = &syms[i];
+        if (sym->st_value == 0 || sym->st_name >= strsz) continue;
+        const char *name = strtab + sym->st_name;
+
+        if (funcs && ELF64_ST_TYPE(sym->st_info) == STT_FUNC) {
+            funcs[nfuncs++] = (struct func_sym){ sym->st_value, sym->st_size, name };
+        }
+        for (size_t w = 0; w < sizeof(wanted_syms) / sizeof(wanted_syms[0]); w++) {
+            if (wanted_syms[w].when && !*wanted_syms[w].when) continue;
+            if (!*wanted_syms[w].value && strcmp(name, wanted_syms[w].name) == 0) {
+                *wanted_syms[w].value = sym->st_value;
+            }
+        }
+        // Without the profile only the wanted symbols matter
+        if (!funcs && wanted_syms_resolved()) break;
+    }
+
+    if (nfuncs) {
+        // Sort and drop aliases so every address maps to one name
+        qsort(funcs, nfuncs, sizeof(*funcs), func_cmp);
+        size_t kept = 1;
+        for (size_t i = 1; i < nfuncs; i++) {
+            if (funcs[i].addr != funcs[kept - 1].addr) funcs[kept++] = funcs[i];
+        }
+        nfuncs = kept;
+    } else {
+        free(funcs);
+        funcs = NULL;
+    }
+}
+
+// Reads the ELF header and symbols straight from an mmap of the binary, so
+// multi-MB symbol tables (Go, Bun, Deno, GraalVM) cost one sequential scan
+// instead of a stdio call per symbol. Prefers .symtab and falls back to
+// .dynsym for stripped or dynamically linked binaries.
+static void parse_elf(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)map;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+        munmap((void *)map, size);
+        return;
+    }
+
+    entry_offset = ehdr->e_entry;
+    is_pie = (ehdr->e_type == ET_DYN);
+
+    if (ehdr->e_shoff == 0 || ehdr->e_shnum == 0 || ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+        ehdr->e_shoff > size || ehdr->e_shnum > (size - ehdr->e_shoff) / sizeof(Elf64_Shdr)) {
+        goto done;
+    }
+
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(map + ehdr->e_shoff);
+    const Elf64_Shdr *symtab = NULL, *dynsym = NULL;
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type == SHT_SYMTAB) symtab = &shdrs[i];
+        else if (shdrs[i].sh_type == SHT_DYNSYM) dynsym = &shdrs[i];
+    }
+
+    const Elf64_Shdr *syms = symtab ? symtab : dynsym;
+    if (!syms || syms->sh_link >= ehdr->e_shnum) goto done;
+    const Elf64_Shdr *strs = &shdrs[syms->sh_link];
+
+    // Both tables must lie inside the file, and the string table must end in
+    // a NUL so every name is terminated
+    if (syms->sh_offset > size || syms->sh_size > size - syms->sh_offset ||
+        strs->sh_offset > size || strs->sh_size == 0 || strs->sh_size > size - strs->sh_offset ||
+        map[strs->sh_offset + strs->sh_size - 1] != '\0') {
+        goto done;
+    }
+
+    scan_symbols((const Elf64_Sym *)(map + syms->sh_offset), syms->sh_size / sizeof(Elf64_Sym),
+                 (const char *)(map + strs->sh_offset), strs->sh_size);
+
+done:
+    if (!main_offset) main_offset = entry_offset;
+    // funcs names point into the string table, so keep the mapping then
+    if (!funcs) {
+        munmap((void *)map, size);
+    }
+}
+
+// Virtual instructions for a syscall count towards the limit like real ones
+static void charge_syscall(struct vcpu_stats *vs, int64_t num, uint64_t cost)
+{
+    if (!cost) return;
+    vs->insn_count += cost;
+    vs->syscall_cost_acc[num] += cost;
+}
+
+static bool is_socket_fd(uint64_t fd)
+{
+    return fd < SOCKET_FDS_MAX && (socket_fds[fd / 64] >> (fd % 64) & 1);
+}
+
+static bool syslog_put(const void *data, size_t len)
+{
+    if (syslog_truncated || syslog_len + len > SYSLOG_MAX) {
+        syslog_truncated = true;
+        return false;
+    }
+    if (syslog_len + len > syslog_cap) {
+        size_t cap = syslog_cap ? syslog_cap : 4096;
+        while (cap < syslog_len + len) cap *= 2;
+        uint8_t *buf = realloc(syslog_buf, cap);
+        if (!buf) {
+            syslog_truncated = true;
+            return false;
+        }
+        syslog_buf = buf;
+        syslog_cap = cap;
+    }
+    if (len) memcpy(syslog_buf + syslog_len, data, len);
+    syslog_len += len;
+    return true;
+}
+
+static size_t varint_encode(uint8_t out[10], uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+// false at the end of the buffer or on a malformed varint
+static bool varint_decode(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Guest bytes at addr into out (at most len); 0 if unreadable
+static size_t read_guest(uint64_t addr, size_t len, GByteArray *out)
+{
+    if (!addr || !len) return 0;
+    if (len > SYSLOG_DATA_MAX) len = SYSLOG_DATA_MAX;
+    g_byte_array_set_size(out, 0);
+    if (!qemu_plugin_read_memory_vaddr(addr, out, len)) return 0;
+    return out->len < len ? out->len : len;
+}
+
+// Appends len bytes at addr to out, zeros when addr is NULL or unreadable
+static void append_guest(uint64_t addr, size_t len, GByteArray *out)
+{
+    GByteArray *tmp = g_byte_array_new();
+    if (!addr || !qemu_plugin_read_memory_vaddr(addr, tmp, len) || tmp->len < len) {
+        g_byte_array_set_size(tmp, len);
+        memset(tmp->data, 0, len);
+    }
+    g_byte_array_append(out, tmp->data, len);
+    g_byte_array_free(tmp, true);
+}
+
+// Called on the return of every syscall; a = its first four arguments
+static void syslog_event(int64_t num, int64_t ret, const uint64_t *a)
+{
+    uint64_t fd = 0;
+    uint64_t data_addr = 0;
+    size_t data_len = 0;
+    size_t set_len = 0;  // select: bytes of each fd set
+    switch (num) {
+    case 41:  // socket(domain, type, protocol) = fd
+        if (ret >= 0 && ret < SOCKET_FDS_MAX) {
+            __atomic_fetch_or(&socket_fds[ret / 64], 1ULL << (ret % 64), __ATOMIC_RELAXED);
+        }
+        fd = ret >= 0 ? (uint64_t)ret : 0;
+        break;
+    case 3:  // close(fd)
+        if (ret == 0 && a[0] < SOCKET_FDS_MAX) {
+            __atomic_fetch_and(&socket_fds[a[0] / 64], ~(1ULL << (a[0] % 64)), __ATOMIC_RELAXED);
+        }
+        return;
+    case 42:  // connect(fd, addr, addrlen)
+        if (!is_socket_fd(a[0])) return;
+        fd = a[0];
+        data_addr = a[1];
+        data_len = a[2] < 128 ? a[2] : 128;
+        break;
+    case 0:   // read(fd, buf, count)
+    case 45:  // recvfrom(fd, buf, len, ...)
+        if (!is_socket_fd(a[0])) return;
+        fd = a[0];
+        data_addr = a[1];
+        data_len = ret > 0 ? (size_t)ret : 0;
+        break;
+    case 55:  // getsockopt(fd, level, optname, optval, optlen)
+        if (!is_socket_fd(a[0]) || a[1] != 1 || a[2] != 4) return;  // SOL_SOCKET, SO_ERROR
+        fd = a[0];
+        data_addr = ret == 0 ? a[3] : 0;
+        data_len = 4;
+        break;
+    case 228:  // clock_gettime(clock, tp)
+    case 96:   // gettimeofday(tv, tz)
+        fd = num == 228 ? a[0] : 0;
+        data_addr = ret == 0 ? (num == 228 ? a[1] : a[0]) : 0;
+        data_len = 16;
+        break;
+    case 7: case 271:   // poll(fds, nfds, ...): the pollfds with their revents
+        data_addr = a[0];
+        data_len = ret >= 0 ? a[1] * 8 : 0;
+        break;
+    case 23: case 270:  // select(nfds, readfds, writefds, exceptfds, ...): the sets
+        set_len = ret >= 0 ? (a[0] < 1024 ? (a[0] + 63) / 64 * 8 : 128) : 0;
+        break;
+    case 232: case 281: // epoll_wait(epfd, events, maxevents, ...): the ready events
+        fd = a[0];
+        data_addr = a[1];
+        data_len = ret > 0 ? (size_t)ret * 12 : 0;
+        break;
+    case 318:           // getrandom(buf, count, flags): host bytes, never compared
+        data_addr = a[0];
+        data_len = ret > 0 ? (size_t)ret : 0;
+        break;
+    default:
+        return;
+    }
+
+    GByteArray *data = g_byte_array_new();
+    uint8_t type = (uint8_t)(a[1] & 0xf);
+    const uint8_t *bytes = num == 41 ? &type : NULL;
+    size_t len;
+    if (num == 41) {
+        len = 1;
+    } else if (set_len) {
+        for (int i = 1; i <= 3; i++) append_guest(a[i], set_len, data);
+        len = data->len;
+    } else {
+        len = read_guest(data_addr, data_len, data);
+    }
+    if (!bytes) bytes = data->data;
+    uint64_t zigzag = ((uint64_t)ret << 1) ^ (uint64_t)(ret >> 63);
+
+    pthread_mutex_lock(&syslog_lock);
+    if (syslog_record) {
+        uint8_t head[40];
+        size_t n = varint_encode(head, (uint64_t)num);
+        n += varint_encode(head + n, fd);
+        n += varint_encode(head + n, zigzag);
+        n += varint_encode(head + n, len);
+        if (syslog_put(head, n) && !syslog_put(bytes, len)) {
+            syslog_len -= n;  // no call half in the log
+        }
+    }
+    if (replay_log && replay_diverged < 0) {
+        const uint8_t *p = replay_log + replay_pos, *end = replay_log + replay_len;
+        uint64_t r_num, r_fd, r_zigzag, r_len;
+        bool same = varint_decode(&p, end, &r_num) && varint_decode(&p, end, &r_fd) &&
+                    varint_decode(&p, end, &r_zigzag) && varint_decode(&p, end, &r_len) &&
+                    r_len <= (uint64_t)(end - p) &&
+                    r_num == (uint64_t)num && r_fd == fd && r_zigzag == zigzag && r_len == len &&
+                    (num == 228 || num == 96 || num == 318 || memcmp(p, bytes, len) == 0);
+        if (same) {
+            replay_pos = (p + r_len) - replay_log;
+            replay_matched++;
+        } else {
+            replay_diverged = replay_matched;
+        }
+    }
+    pthread_mutex_unlock(&syslog_lock);
+    g_byte_array_free(data, true);
+}
+
+// Reads a recorded log for syscall_replay=; false if it is not one
+static bool load_replay_log(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    size_t cap = 4096, len = 0;
+    uint8_t *buf = malloc(cap);
+    size_t n;
+    while (buf && (n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) {
+            uint8_t *grown = cap < SYSLOG_MAX * 2 ? realloc(buf, cap * 2) : NULL;
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    fclose(f);
+    if (!buf) return false;
+
+    const uint8_t *p = buf + 5, *end = buf + len;
+    uint64_t seed;
+    if (len < 5 || memcmp(buf, SYSLOG_MAGIC, 4) != 0 || buf[4] != SYSLOG_VERSION ||
+        !varint_decode(&p, end, &seed)) {
+        free(buf);
+        return false;
+    }
+    // Count the calls up front, so a short re-run shows as a divergence too
+    const uint8_t *q = p;
+    while (q < end) {
+        uint64_t v[4];
+        for (int i = 0; i < 4; i++) {
+            if (!varint_decode(&q, end, &v[i])) {
+                free(buf);
+                return false;
+            }
+        }
+        if (v[3] > (uint64_t)(end - q)) {
+            free(buf);
+            return false;
+        }
+        q += v[3];
+        replay_entries++;
+    }
+    replay_log = buf;
+    replay_pos = p - buf;
+    replay_len = len;
+    return true;
+}
+
+// Base64 of the log with its header, for the stats JSON; NULL without one
+static char *syslog_base64(void)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint8_t head[16];
+    memcpy(head, SYSLOG_MAGIC, 4);
+    head[4] = SYSLOG_VERSION;
+    size_t head_len = 5 + varint_encode(head + 5, syslog_seed);
+
+    pthread_mutex_lock(&syslog_lock);
+    size_t len = head_len + syslog_len;
+    char *out = malloc((len + 2) / 3 * 4 + 1);
+    if (out) {
+        char *o = out;
+        uint32_t acc = 0;
+        int bits = 0;
+        for (size_t i = 0; i < len; i++) {
+            acc = acc << 8 | (i < head_len ? head[i] : syslog_buf[i - head_len]);
+            bits += 8;
+            while (bits >= 6) {
+                bits -= 6;
+                *o++ = digits[acc >> bits & 63];
+            }
+        }
+        if (bits) *o++ = digits[acc << (6 - bits) & 63];
+        while ((o - out) % 4) *o++ = '=';
+        *o = '\0';
+    }
+    pthread_mutex_unlock(&syslog_lock);
+    return out;
+}
+
+static void vcpu_syscall(qemu_plugin_id_t id, unsigned int vcpu_index,
+                         int64_t num, uint64_t a1, uint64_t a2,
+                         uint64_t a3, uint64_t a4, uint64_t a5,
+                         uint64_t a6, uint64_t a7, uint64_t a8)
+{
+    // Mapping syscalls are applied on return, once the kernel accepted them,
+    // and are tracked from the start like the memory they map
+    struct vcpu_stats *vs = vcpu_stats_of(vcpu_index);
+    vs->sys_args[0] = a1;
+    vs->sys_args[1] = a2;
+    vs->sys_args[2] = a3;
+    vs->sys_args[3] = a4;
+
+    // Always count syscalls when from_start mode is enabled
+    // (counting should already be true, but syscalls might fire before first TB)
+    if (!counting && !count_from_start) return;
+
+    vs->syscall_count++;
+    if (num >= 0 && num < MAX_TRACKED_SYSCALLS) {
+        vs->syscall_counts[num]++;
+    }
+
+    if (num >= 0 && num < MAX_TRACKED_SYSCALLS) {
+        charge_syscall(vs, num, syscall_cost_table[num].base);
+    }
+
+    // In inline mode the exec-path check only sees this vCPU's own slot, so
+    // multi-threaded guests also get the all-vCPU total checked here
+    if ((syscall_costs || inline_count) && insn_limit &&
+        total_insn_count() >= insn_limit) {
+        stop_at_limit();
+    }
+}
+
+static void vcpu_syscall_ret(qemu_plugin_id_t id, unsigned int vcpu_index,
+                              int64_t num, int64_t ret)
+{
+    // Track brk return values to measure heap growth
+    if (num == 12 && ret > 0) {  // brk returns new brk address (or current if arg was 0)
+        uint64_t new_brk = (uint64_t)ret;
+        uint64_t unset = 0;
+        __atomic_compare_exchange_n(&guest_brk_base, &unset, new_brk, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        uint64_t old_brk = __atomic_exchange_n(&guest_brk_current, new_brk, __ATOMIC_RELAXED);
+        if (rss_trace && new_brk < old_brk) {
+            pages_drop(page_align_up(new_brk), old_brk);
+        }
+    }
+
+    // Failed calls return -errno and change nothing
+    const uint64_t *a = vcpu_stats_of(vcpu_index)->sys_args;
+    if (syslog_record || replay_log) {
+        syslog_event(num, ret, a);
+    }
+    if (ret >= 0 && num == 9) {  // mmap(addr, length, ...) = addr
+        if (rss_trace) {
+            pages_drop(ret, ret + a[1]);  // MAP_FIXED replaces pages with fresh ones
+        }
+        guest_map(ret, a[1]);
+    } else if (ret == 0 && num == 11) {  // munmap(addr, length)
+        if (rss_trace) {
+            pages_drop(a[0], a[0] + a[1]);
+        }
+        guest_unmap(a[0], a[1]);
+    } else if (ret >= 0 && num == 25) {  // mremap(old, old_len, new_len, flags, ...) = new
+        uint64_t old_len = page_align_up(a[1]), new_len = page_align_up(a[2]);
+        bool keep_old = a[3] & 4;  // MREMAP_DONTUNMAP leaves the old range mapped, empty
+        if (rss_trace) {
+            if ((uint64_t)ret != a[0]) {
+                pages_move(a[0], ret, old_len < new_len ? old_len : new_len);
+            }
+            if (new_len < old_len) {
+                pages_drop(a[0] + new_len, a[0] + old_len);
+            }
+        }
+        if (!keep_old) {
+            guest_unmap(a[0], old_len);
+        }
+        guest_map(ret, new_len);
+    } else if (ret == 0 && num == 28 && rss_trace &&  // madvise(addr, length, advice)
+               (a[2] == 4 || a[2] == 8 || a[2] == 9)) {  // MADV_DONTNEED, FREE, REMOVE
+        pages_drop(a[0], a[0] + a[1]);
+    }
+
+    // Per-byte cost from the length actually transferred
+    if (ret > 0 && num >= 0 && num < MAX_TRACKED_SYSCALLS &&
+        syscall_cost_table[num].per_byte && (counting || count_from_start)) {
+        struct vcpu_stats *vs = vcpu_stats_of(vcpu_index);
+        charge_syscall(vs, num, (uint64_t)ret * syscall_cost_table[num].per_byte /
+                                SYSCALL_COST_SCALE);
+        if (insn_limit && total_insn_count() >= insn_limit) {
+            stop_at_limit();
+        }
+    }
+}
+
+static bool pwrite_all(int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return true;
+}
+
+// Opens a host-seeded file, takes the nonce out of it and leaves it empty;
+// -1 if it does not hold one
+static int open_seeded_file(const char *path, uint8_t nonce[STATS_NONCE_SIZE])
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, nonce, STATS_NONCE_SIZE, 0);
+    if (n != STATS_NONCE_SIZE || ftruncate(fd, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The guest shares the plugin's fd table, so the whole file is rewritten
+// from offset 0 and cut to the record
+static void write_stats_record(const char *json, size_t len)
+{
+    struct stats_header header = {
+        .version = STATS_VERSION,
+        .header_size = sizeof(header),
+        .length = len,
+    };
+    memcpy(header.magic, STATS_MAGIC, sizeof(header.magic));
+    memcpy(header.nonce, stats_nonce, sizeof(header.nonce));
+    if (!pwrite_all(stats_fd, &header, sizeof(header), 0) ||
+        !pwrite_all(stats_fd, json, len, sizeof(header)) ||
+        ftruncate(stats_fd, sizeof(header) + len) != 0) {
+        fprintf(stderr, "sandbox: cannot write stats record\n");
+    }
+}
+
+// Writes the stats line; false if it was already written
+static bool write_stats(void)
+{
+    if (__atomic_exchange_n(&stats_written, true, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+
+    uint64_t vm_peak_kb = 0;
+    uint64_t vm_rss_kb = 0;
+    uint64_t vm_hwm_kb = 0;
+    uint64_t vm_data_kb = 0;
+    uint64_t vm_stk_kb = 0;
+
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status) {
+        char line[256];
+        while (fgets(line, sizeof(line), status)) {
+            if (strncmp(line, "VmPeak:", 7) == 0) {
+                sscanf(line + 7, "%" SCNu64, &vm_peak_kb);
+            } else if (strncmp(line, "VmRSS:", 6) == 0) {
+                sscanf(line + 6, "%" SCNu64, &vm_rss_kb);
+            } else if (strncmp(line, "VmHWM:", 6) == 0) {
+                sscanf(line + 6, "%" SCNu64, &vm_hwm_kb);
+            } else if (strncmp(line, "VmData:", 7) == 0) {
+                sscanf(line + 7, "%" SCNu64, &vm_data_kb);
+            } else if (strncmp(line, "VmStk:", 6) == 0) {
+                sscanf(line + 6, "%" SCNu64, &vm_stk_kb);
+            }
+        }
+        fclose(status);
+    }
+
+    uint64_t io_read_bytes = 0;
+    uint64_t io_write_bytes = 0;
+
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io) {
+        char line[256];
+        while (fgets(line, sizeof(line), io)) {
+            if (strncmp(line, "rchar:", 6) == 0) {
+                sscanf(line + 6, "%" SCNu64, &io_read_bytes);
+            } else if (strncmp(line, "wchar:", 6) == 0) {
+                sscanf(line + 6, "%" SCNu64, &io_write_bytes);
+            }
+        }
+        fclose(io);
+    }
+
+    // Merge per-vCPU syscall counts
+    int nvcpus = qemu_plugin_num_vcpus();
+    uint64_t syscall_counts[MAX_TRACKED_SYSCALLS] = {0};
+    uint64_t syscall_costs_acc[MAX_TRACKED_SYSCALLS] = {0};
+    uint64_t syscall_cost_total = 0;
+    for (int v = 0; v < nvcpus; v++) {
+        struct vcpu_stats *vs = vcpu_stats_of(v);
+        for (int i = 0; i < MAX_TRACKED_SYSCALLS; i++) {
+            syscall_counts[i] += vs->syscall_counts[i];
+            syscall_costs_acc[i] += vs->syscall_cost_acc[i];
+            syscall_cost_total += vs->syscall_cost_acc[i];
+        }
+    }
+
+    // Regions still open at exit (or at the limit) run to the end
+    uint64_t roi_insns = 0;
+    bool roi_seen = false;
+    for (int v = 0; v < nvcpus; v++) {
+        struct vcpu_stats *vs = vcpu_stats_of(v);
+        roi_insns += vs->roi_count;
+        if (vs->roi_active) {
+            roi_insns += vs->insn_count - vs->roi_start;
+            roi_seen = true;
+        }
+    }
+    roi_seen = roi_seen || roi_regions;
+    char cost_stats[64] = "";
+    if (cost_model) {
+        snprintf(cost_stats, sizeof(cost_stats), ", \"cycles_estimate\": %" PRIu64,
+                 qemu_plugin_u64_sum(cost_entry) / COST_SCALE);
+    }
+
+    // Addresses still in the rings go through the model first
+    char mem_stats[160] = "";
+    if (mem_trace) {
+        uint64_t l1_misses = 0, l2_misses = 0;
+        for (int v = 0; v < nvcpus; v++) {
+            struct vcpu_mem *vm = vcpu_mem_of(v);
+            mem_drain(vm);
+            l1_misses += vm->l1_misses;
+            l2_misses += vm->l2_misses;
+        }
+        snprintf(mem_stats, sizeof(mem_stats),
+                 ", \"loads\": %" PRIu64 ", \"stores\": %" PRIu64
+                 ", \"l1_misses\": %" PRIu64 ", \"l2_misses\": %" PRIu64,
+                 qemu_plugin_u64_sum(loads_entry), qemu_plugin_u64_sum(stores_entry),
+                 l1_misses, l2_misses);
+    }
+
+    char rss_stats[64] = "";
+    if (rss_trace) {
+        snprintf(rss_stats, sizeof(rss_stats), ", \"guest_rss_peak_bytes\": %" PRIu64,
+                 __atomic_load_n(&rss_peak_pages, __ATOMIC_RELAXED) * GUEST_PAGE_SIZE);
+    }
+
+    char roi_stats[96] = "";
+    if (roi_seen) {
+        snprintf(roi_stats, sizeof(roi_stats),
+                 ", \"roi_instructions\": %" PRIu64 ", \"roi_regions\": %" PRIu64,
+                 roi_insns, roi_regions);
+    }
+
+    // Host CPU of the whole process (QEMU startup, syscalls and all);
+    // translation is extrapolated from the sampled translations
+    struct rusage usage;
+    uint64_t host_cpu_ns = 0;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        host_cpu_ns = ((uint64_t)usage.ru_utime.tv_sec + (uint64_t)usage.ru_stime.tv_sec) * 1000000000ULL +
+                      ((uint64_t)usage.ru_utime.tv_usec + (uint64_t)usage.ru_stime.tv_usec) * 1000ULL;
+    }
+    uint64_t translated = __atomic_load_n(&tb_translated, __ATOMIC_RELAXED);
+    uint64_t translated_insns = __atomic_load_n(&tb_translated_insns, __ATOMIC_RELAXED);
+    uint64_t samples = __atomic_load_n(&trans_samples, __ATOMIC_RELAXED);
+    uint64_t host_translate_ns = 0;
+    if (samples) {
+        host_translate_ns = (uint64_t)((double)__atomic_load_n(&trans_sample_ns, __ATOMIC_RELAXED) /
+                                       samples * translated);
+        if (host_translate_ns > host_cpu_ns) host_translate_ns = host_cpu_ns;
+    }
+    char emulation_stats[320];
+    snprintf(emulation_stats, sizeof(emulation_stats),
+             ", \"emulation\": {\"tb_translated\": %" PRIu64 ", \"tb_retranslated\": %" PRIu64
+             ", \"tb_translated_insns\": %" PRIu64 ", \"tb_avg_insns\": %.2f, \"host_cpu_ns\": %" PRIu64
+             ", \"host_translate_ns\": %" PRIu64 ", \"host_exec_ns\": %" PRIu64
+             ", \"translate_samples\": %" PRIu64 "}",
+             translated, __atomic_load_n(&tb_retranslated, __ATOMIC_RELAXED), translated_insns,
+             translated ? (double)translated_insns / translated : 0.0, host_cpu_ns,
+             host_translate_ns, host_cpu_ns - host_translate_ns, samples);
+
+    char *profile_blocks = profile ? profile_json() : NULL;
+    char *profile_funcs = profile ? function_json() : NULL;
+    char *syscall_log = syslog_record ? syslog_base64() : NULL;
+
+    // A re-run that made fewer logged calls than the recording diverged too
+    char replay_stats[160] = "";
+    if (replay_log) {
+        pthread_mutex_lock(&syslog_lock);
+        int64_t diverged = replay_diverged;
+        if (diverged < 0 && replay_matched < replay_entries) diverged = replay_matched;
+        char at[24] = "null";
+        if (diverged >= 0) snprintf(at, sizeof(at), "%" PRId64, diverged);
+        snprintf(replay_stats, sizeof(replay_stats),
+                 ", \"syscall_replay\": {\"entries\": %" PRIu64 ", \"matched\": %" PRIu64
+                 ", \"diverged_at\": %s}",
+                 replay_entries, replay_matched, at);
+        pthread_mutex_unlock(&syslog_lock);
+    }
+
+    // Calculate guest heap size from brk
+    uint64_t guest_heap_bytes = 0;
+    if (guest_brk_base && guest_brk_current > guest_brk_base) {
+        guest_heap_bytes = guest_brk_current - guest_brk_base;
+    }
+
+    // Built in memory so no section is ever cut short
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *out = open_memstream(&json, &json_len);
+    if (!out) {
+        free(profile_blocks);
+        free(profile_funcs);
+        free(syscall_log);
+        return true;
+    }
+
+    fprintf(out, "{\"instructions\": %" PRIu64 "%s, \"memory_peak_kb\": %" PRIu64
+            ", \"memory_rss_kb\": %" PRIu64 ", \"memory_hwm_kb\": %" PRIu64
+            ", \"memory_data_kb\": %" PRIu64 ", \"memory_stack_kb\": %" PRIu64
+            ", \"io_read_bytes\": %" PRIu64 ", \"io_write_bytes\": %" PRIu64
+            ", \"guest_mmap_bytes\": %" PRIu64 ", \"guest_mmap_peak\": %" PRIu64
+            ", \"guest_heap_bytes\": %" PRIu64
+            ", \"limit_reached\": %s, \"syscalls\": %" PRIu64
+            ", \"syscall_cost\": %" PRIu64 ", \"syscall_breakdown\": {",
+            total_insn_count(), cost_stats, vm_peak_kb, vm_rss_kb, vm_hwm_kb, vm_data_kb, vm_stk_kb,
+            io_read_bytes, io_write_bytes, guest_mmap_bytes, guest_mmap_peak,
+            guest_heap_bytes, limit_reached ? "true" : "false",
+            qemu_plugin_u64_sum(syscall_entry), syscall_cost);
+
+    // Syscall breakdown for non-zero counts
+    bool first = true;
+    for (int i = 0; i < MAX_TRACKED_SYSCALLS; i++) {
+        if (syscall_counts[i] > 0) {
+            const char *name = syscall_name(i);
+            if (name) {
+                fprintf(out, "%s\"%s\": %" PRIu64, first ? "" : ", ", name, syscall_counts[i]);
+            } else {
+                fprintf(out, "%s\"sys_%d\": %" PRIu64, first ? "" : ", ", i, syscall_counts[i]);
+            }
+            first = false;
+        }
+    }
+    fputc('}', out);
+
+    // Virtual instructions charged per syscall, when any syscall costs
+    if (syscall_costs) {
+        fprintf(out, ", \"syscall_cost_total\": %" PRIu64 ", \"syscall_cost_breakdown\": {",
+                syscall_cost_total);
+        first = true;
+        for (int i = 0; i < MAX_TRACKED_SYSCALLS; i++) {
+            if (syscall_costs_acc[i] > 0) {
+                const char *name = syscall_name(i);
+                if (name) {
+                    fprintf(out, "%s\"%s\": %" PRIu64, first ? "" : ", ", name,
+                            syscall_costs_acc[i]);
+                } else {
+                    fprintf(out, "%s\"sys_%d\": %" PRIu64, first ? "" : ", ", i,
+                            syscall_costs_acc[i]);
+                }
+                first = false;
+            }
+        }
+        fputc('}', out);
+    }
+
+    // Per-thread breakdown, indexed by vCPU (qemu-user reuses the index of
+    // an exited thread, so a slot can cover several short-lived threads)
+    fputs(", \"thread_breakdown\": [", out);
+    for (int v = 0; v < nvcpus; v++) {
+        struct vcpu_stats *vs = vcpu_stats_of(v);
+        fprintf(out, "%s{\"vcpu\": %d, \"instructions\": %" PRIu64 ", \"syscalls\": %" PRIu64 "}",
+                v ? ", " : "", v, vs->insn_count, vs->syscall_count);
+    }
+    fprintf(out, "], \"mode\": \"qemu\"%s%s%s%s%s", emulation_stats, mem_stats, rss_stats, roi_stats,
+            replay_stats);
+    if (syscall_log) {
+        fprintf(out, ", \"syscall_log\": \"%s\"%s", syscall_log,
+                syslog_truncated ? ", \"syscall_log_truncated\": true" : "");
+    }
+    if (profile_blocks) {
+        fprintf(out, ", \"profile\": [%s]", profile_blocks);
+    }
+    if (profile_funcs) {
+        fprintf(out, ", \"functions\": [%s]", profile_funcs);
+    }
+    fputc('}', out);
+    fclose(out);
+    free(profile_blocks);
+    free(profile_funcs);
+    free(syscall_log);
+
+    if (stats_fd >= 0) {
+        write_stats_record(json, json_len);
+    } else {
+        fprintf(stderr, "\n%s\n", json);
+    }
+    free(json);
+    return true;
+}
+
+static void plugin_exit(qemu_plugin_id_t id, void *p)
+{
+    write_stats();
+}
+
+// Overwrites the progress file with the current totals. Totals are summed
+// while other vCPUs run, so they are a moment's snapshot, not exact.
+static void write_progress(void)
+{
+    // Another vCPU writing a sample right now is as good as this one
+    if (pthread_mutex_trylock(&progress_lock) != 0) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t brk_base = __atomic_load_n(&guest_brk_base, __ATOMIC_RELAXED);
+    uint64_t brk_current = __atomic_load_n(&guest_brk_current, __ATOMIC_RELAXED);
+    uint64_t seq = ++progress_seq;
+    struct progress_sample sample = {
+        .version = PROGRESS_VERSION,
+        .size = sizeof(sample),
+        .seq = seq,
+        .instructions = total_insn_count(),
+        .syscalls = qemu_plugin_u64_sum(syscall_entry),
+        .guest_mmap_bytes = __atomic_load_n(&guest_mmap_bytes, __ATOMIC_RELAXED),
+        .guest_heap_bytes = brk_base && brk_current > brk_base ? brk_current - brk_base : 0,
+        .guest_rss_bytes = __atomic_load_n(&rss_pages, __ATOMIC_RELAXED) * GUEST_PAGE_SIZE,
+        .elapsed_ns = (uint64_t)(now.tv_sec - progress_epoch.tv_sec) * 1000000000ULL +
+                      (uint64_t)(now.tv_nsec - progress_epoch.tv_nsec),
+        .seq_end = seq,
+    };
+    memcpy(sample.magic, PROGRESS_MAGIC, sizeof(sample.magic));
+    memcpy(sample.nonce, progress_nonce, sizeof(sample.nonce));
+    // A lost sample is only a gap in the progress, the next one replaces it
+    pwrite_all(progress_fd, &sample, sizeof(sample), 0);
+
+    pthread_mutex_unlock(&progress_lock);
+}
+
+// Callback mode: this vCPU's count passed its progress_at
+static void check_progress(struct vcpu_stats *vs)
+{
+    vs->progress_at = vs->insn_count + progress_every;
+    write_progress();
+}
+
+static void vcpu_tb_exec(unsigned int cpu_index, void *udata)
+{
+    uint64_t n = (uint64_t)udata;
+    struct vcpu_stats *vs = vcpu_stats_of(cpu_index);
+    vs->insn_count += n;
+    if (insn_limit && vs->insn_count >= vs->limit_check_at) {
+        check_total_limit(vs);
+    }
+    if (progress_every && vs->insn_count >= vs->progress_at) {
+        check_progress(vs);
+    }
+}
+
+// x86-64 opcode class from the raw instruction bytes. Only what the cost
+// table distinguishes is decoded: legacy/REX prefixes, VEX/EVEX, the opcode
+// and, where it selects the operation, the ModRM reg field.
+static enum insn_class classify_insn(const uint8_t *b, size_t len)
+{
+    size_t i = 0;
+    bool rep = false, lock = false;
+
+    for (; i < len; i++) {
+        uint8_t c = b[i];
+        if (c == 0xf2 || c == 0xf3) rep = true;
+        else if (c == 0xf0) lock = true;
+        else if (c != 0x66 && c != 0x67 && c != 0x2e && c != 0x36 &&
+                 c != 0x3e && c != 0x26 && c != 0x64 && c != 0x65) break;
+    }
+    if (i < len && (b[i] & 0xf0) == 0x40) i++;  // REX
+    if (i >= len) return IC_DEFAULT;
+    if (lock) return IC_ATOMIC;
+
+    uint8_t op = b[i];
+    uint8_t modrm = i + 1 < len ? b[i + 1] : 0;
+    uint8_t reg = (modrm >> 3) & 7;
+
+    switch (op) {
+    case 0xc4: case 0xc5: case 0x62:  // VEX / EVEX (always in 64-bit mode)
+        return IC_SIMD;
+    case 0x90:
+        return rep ? IC_SERIALIZING : IC_NOP;  // F3 90 is pause
+    case 0xa4 ... 0xa7: case 0xaa ... 0xaf:
+        return rep ? IC_REP_STRING : IC_STRING;
+    case 0x70 ... 0x7f: case 0xe0 ... 0xe3: case 0xe8: case 0xe9: case 0xeb:
+    case 0xc2: case 0xc3:
+        return IC_BRANCH;
+    case 0x69: case 0x6b:
+        return IC_MUL;
+    case 0xf6: case 0xf7:
+        if (reg == 4 || reg == 5) return IC_MUL;
+        if (reg == 6 || reg == 7) return IC_DIV;
+        return IC_DEFAULT;
+    case 0xff:
+        return reg >= 2 && reg <= 5 ? IC_BRANCH : IC_DEFAULT;
+    case 0x86: case 0x87:
+        return (modrm >> 6) != 3 ? IC_ATOMIC : IC_DEFAULT;  // xchg with memory locks
+    case 0xd8 ... 0xdf:
+        return IC_X87;
+    case 0x0f:
+        break;
+    default:
+        return IC_DEFAULT;
+    }
+
+    // Two-byte opcodes
+    if (i + 1 >= len) return IC_DEFAULT;
+    switch (b[i + 1]) {
+    case 0x05:
+        return IC_SYSCALL;
+    case 0x18 ... 0x1f:
+        return IC_NOP;
+    case 0x80 ... 0x8f:
+        return IC_BRANCH;
+    case 0xaf:
+        return IC_MUL;
+    case 0x31: case 0xa2: case 0xae:
+        return IC_SERIALIZING;  // rdtsc, cpuid, fences
+    case 0x51: case 0x5e:
+        return IC_SIMD_DIV;     // sqrt*, div*
+    case 0x10 ... 0x17: case 0x28 ... 0x2f: case 0x38: case 0x3a:
+    case 0x50: case 0x52 ... 0x5d: case 0x5f ... 0x7f:
+    case 0xc2 ... 0xc6: case 0xd0 ... 0xff:
+        return IC_SIMD;
+    default:
+        return IC_DEFAULT;
+    }
+}
+
+// Table file: one "<class> <cycles>" per line, '#' starts a comment.
+// Classes not listed keep the weight of "default" (1 cycle unless set).
+static bool load_cost_model(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    double weights[IC_COUNT];
+    bool set[IC_COUNT] = { false };
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char name[64];
+        double cycles;
+        if (sscanf(line, "%63s %lf", name, &cycles) != 2 || cycles < 0) continue;
+        for (int c = 0; c < IC_COUNT; c++) {
+            if (strcmp(name, insn_class_names[c]) == 0) {
+                weights[c] = cycles;
+                set[c] = true;
+            }
+        }
+    }
+    fclose(f);
+
+    double fallback = set[IC_DEFAULT] ? weights[IC_DEFAULT] : 1.0;
+    for (int c = 0; c < IC_COUNT; c++) {
+        class_cost[c] = (uint64_t)((set[c] ? weights[c] : fallback) * COST_SCALE + 0.5);
+    }
+    return true;
+}
+
+static int syscall_number(const char *name)
+{
+    const char *digits = strncmp(name, "sys_", 4) == 0 ? name + 4 : name;
+    char *end;
+    long num = strtol(digits, &end, 10);
+    if (*end == '\0' && end != digits) {
+        return num >= 0 && num < MAX_TRACKED_SYSCALLS ? (int)num : -1;
+    }
+    for (int i = 0; i < MAX_TRACKED_SYSCALLS; i++) {
+        const char *known = syscall_name(i);
+        if (known && strcmp(known, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Table file: one "<syscall> <base> [<per byte>]" per line, costs in
+// instructions, '#' starts a comment. The syscall is a name, a number or
+// "default" for every syscall not listed. Without a file (path NULL) every
+// syscall costs the flat syscall_cost.
+static bool load_syscall_costs(const char *path)
+{
+    struct syscall_cost_entry fallback = { syscall_cost, 0 };
+    bool set[MAX_TRACKED_SYSCALLS] = { false };
+
+    if (path) {
+        FILE *f = fopen(path, "r");
+        if (!f) return false;
+
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            char *hash = strchr(line, '#');
+            if (hash) *hash = '\0';
+
+            char name[64];
+            double base, per_byte = 0;
+            int fields = sscanf(line, "%63s %lf %lf", name, &base, &per_byte);
+            if (fields < 2 || base < 0 || per_byte < 0) continue;
+            struct syscall_cost_entry entry = {
+                (uint64_t)(base + 0.5), (uint64_t)(per_byte * SYSCALL_COST_SCALE + 0.5)
+            };
+            if (strcmp(name, "default") == 0) {
+                fallback = entry;
+                continue;
+            }
+            int num = syscall_number(name);
+            if (num < 0) {
+                fprintf(stderr, "sandbox: unknown syscall %s in %s\n", name, path);
+                continue;
+            }
+            syscall_cost_table[num] = entry;
+            set[num] = true;
+        }
+        fclose(f);
+    }
+
+    for (int i = 0; i < MAX_TRACKED_SYSCALLS; i++) {
+        if (!set[i]) syscall_cost_table[i] = fallback;
+        if (syscall_cost_table[i].base || syscall_cost_table[i].per_byte) syscall_costs = true;
+    }
+    return true;
+}
+
+// Translation time: summed weight of the block's instructions
+static uint64_t tb_cost(struct qemu_plugin_tb *tb, size_t n)
+{
+    uint64_t cost = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        uint8_t buf[16];
+        size_t len = qemu_plugin_insn_data(insn, buf, sizeof(buf));
+        cost += class_cost[classify_insn(buf, len)];
+    }
+    return cost;
+}
+
+static void vcpu_mem_access(unsigned int cpu_index, qemu_plugin_meminfo_t info,
+                            uint64_t vaddr, void *udata)
+{
+    struct vcpu_mem *vm = vcpu_mem_of(cpu_index);
+    // Runs of accesses to one page (the common case within a block) cost a
+    // compare; only a page change looks at the bitmap
+    if (rss_trace) {
+        uint64_t page = vaddr >> GUEST_PAGE_SHIFT;
+        if (page != vm->last_page) {
+            vm->last_page = page;
+            page_touch(page);
+        }
+    }
+    if (!udata) return;
+    vm->ring[vm->ring_len++] = vaddr >> line_shift;
+    if (vm->ring_len == MEM_RING_SIZE) {
+        mem_drain(vm);
+    }
+}
+
+// Translation time: count and trace every memory access of the block.
+// Instructions without loads or stores generate no code for these. Blocks
+// run before counting starts only feed the page bitmap (udata NULL).
+static void mem_scan_tb(struct qemu_plugin_tb *tb, size_t n, bool counted)
+{
+    bool model = mem_trace && counted;
+    for (size_t i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        if (model) {
+            qemu_plugin_register_vcpu_mem_inline_per_vcpu(insn, QEMU_PLUGIN_MEM_R,
+                                                          QEMU_PLUGIN_INLINE_ADD_U64, loads_entry, 1);
+            qemu_plugin_register_vcpu_mem_inline_per_vcpu(insn, QEMU_PLUGIN_MEM_W,
+                                                          QEMU_PLUGIN_INLINE_ADD_U64, stores_entry, 1);
+        }
+        qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem_access, QEMU_PLUGIN_CB_NO_REGS,
+                                         QEMU_PLUGIN_MEM_RW, model ? (void *)1 : NULL);
+    }
+}
+
+// Callback mode with profile=on: the block's slot carries its length
+static void vcpu_tb_exec_profiled(unsigned int cpu_index, void *udata)
+{
+    struct tb_profile *slot = udata;
+    __atomic_fetch_add(&slot->exec_count, 1, __ATOMIC_RELAXED);
+
+    struct vcpu_stats *vs = vcpu_stats_of(cpu_index);
+    vs->insn_count += slot->n_insns;
+    if (insn_limit && vs->insn_count >= vs->limit_check_at) {
+        check_total_limit(vs);
+    }
+    if (progress_every && vs->insn_count >= vs->progress_at) {
+        check_progress(vs);
+    }
+}
+
+// Inline mode with profile=on: counting stays inline, only the profile calls out
+static void vcpu_tb_profile(unsigned int cpu_index, void *udata)
+{
+    struct tb_profile *slot = udata;
+    __atomic_fetch_add(&slot->exec_count, 1, __ATOMIC_RELAXED);
+}
+
+// ROI marker callbacks. udata is the marker's distance from the end of its
+// block: insn_count already includes the whole block when they run, so
+// tail - 1 instructions after a begin marker are already inside the region
+// and tail instructions from an end marker on are not. Markers themselves
+// are never counted, and nested begins or stray ends are ignored.
+static void vcpu_roi_begin(unsigned int cpu_index, void *udata)
+{
+    struct vcpu_stats *vs = vcpu_stats_of(cpu_index);
+    if (vs->roi_active) return;
+    vs->roi_start = vs->insn_count - (uint64_t)udata + 1;
+    vs->roi_active = 1;
+}
+
+static void vcpu_roi_end(unsigned int cpu_index, void *udata)
+{
+    struct vcpu_stats *vs = vcpu_stats_of(cpu_index);
+    if (!vs->roi_active) return;
+    vs->roi_count += vs->insn_count - (uint64_t)udata - vs->roi_start;
+    vs->roi_active = 0;
+    __atomic_fetch_add(&roi_regions, 1, __ATOMIC_RELAXED);
+}
+
+static bool insn_is_marker(struct qemu_plugin_insn *insn, const uint8_t *marker)
+{
+    uint8_t buf[ROI_MARKER_LEN];
+    if (qemu_plugin_insn_size(insn) != ROI_MARKER_LEN) return false;
+    if (qemu_plugin_insn_data(insn, buf, sizeof(buf)) != sizeof(buf)) return false;
+    return memcmp(buf, marker, sizeof(buf)) == 0;
+}
+
+// Translation time: hook the ROI markers in this block, if any
+static void roi_scan_tb(struct qemu_plugin_tb *tb, size_t n)
+{
+    uint64_t base = is_pie ? runtime_base : 0;
+    for (size_t i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        uint64_t vaddr = qemu_plugin_insn_vaddr(insn);
+        void *tail = (void *)(uintptr_t)(n - i);
+
+        if ((roi_begin_offset && vaddr == base + roi_begin_offset) ||
+            insn_is_marker(insn, roi_begin_marker)) {
+            qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_roi_begin, QEMU_PLUGIN_CB_NO_REGS, tail);
+        } else if ((roi_end_offset && vaddr == base + roi_end_offset) ||
+                   insn_is_marker(insn, roi_end_marker)) {
+            qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_roi_end, QEMU_PLUGIN_CB_NO_REGS, tail);
+        }
+    }
+}
+
+static void vcpu_limit_hit(unsigned int cpu_index, void *udata)
+{
+    // Only reached once this vCPU's scoreboard slot is >= insn_limit
+    stop_at_limit();
+}
+
+// Inline mode: this vCPU's slot is within PRECISE_MARGIN of insn_limit
+static void vcpu_limit_near(unsigned int cpu_index, void *udata)
+{
+    request_precise();
+}
+
+// Inline mode: this vCPU ran progress_every instructions since its last sample
+static void vcpu_progress(unsigned int cpu_index, void *udata)
+{
+    vcpu_stats_of(cpu_index)->progress_acc = 0;
+    write_progress();
+}
+
+// Precise blocks: runs before each instruction, udata is its distance from
+// the end of the block (insn_count already includes the whole block). Stops
+// before the first instruction past insn_limit and uncounts the rest.
+static void vcpu_insn_limit(unsigned int cpu_index, void *udata)
+{
+    uint64_t tail = (uint64_t)udata;
+    if (total_insn_count() - tail < insn_limit) return;
+    vcpu_stats_of(cpu_index)->insn_count -= tail;
+    stop_at_limit();
+}
+
+static void vcpu_init(qemu_plugin_id_t id, unsigned int vcpu_index)
+{
+    // New threads start with a fair share of whatever budget is left
+    if (insn_limit) {
+        check_total_limit(vcpu_stats_of(vcpu_index));
+    }
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t seen_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key & (seen_capacity - 1);
+}
+
+static void seen_reset(void)
+{
+    pthread_mutex_lock(&seen_lock);
+    if (seen_table) memset(seen_table, 0, seen_capacity * sizeof(*seen_table));
+    seen_used = 0;
+    pthread_mutex_unlock(&seen_lock);
+}
+
+static bool seen_grow(void)
+{
+    uint64_t *old = seen_table;
+    size_t old_capacity = seen_capacity;
+    size_t capacity = old_capacity ? old_capacity * 2 : 4096;
+
+    uint64_t *table = calloc(capacity, sizeof(*table));
+    if (!table) return false;
+
+    seen_table = table;
+    seen_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i]) continue;
+        size_t j = seen_hash(old[i]);
+        while (seen_table[j]) j = (j + 1) & (capacity - 1);
+        seen_table[j] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+// Records a translation of vaddr; true if the address was translated before
+static bool seen_insert(uint64_t vaddr)
+{
+    uint64_t key = vaddr + 1;
+    bool found = false;
+
+    pthread_mutex_lock(&seen_lock);
+    // Once full only addresses already in the set are still recognised
+    bool room = (seen_used + 1) * 2 <= seen_capacity || (seen_used < SEEN_MAX && seen_grow());
+    if (seen_capacity) {
+        size_t i = seen_hash(key);
+        while (seen_table[i]) {
+            if (seen_table[i] == key) {
+                found = true;
+                break;
+            }
+            i = (i + 1) & (seen_capacity - 1);
+        }
+        if (!found && room) {
+            seen_table[i] = key;
+            seen_used++;
+        }
+    }
+    pthread_mutex_unlock(&seen_lock);
+    return found;
+}
+
+static void vcpu_trans_sample_end(unsigned int cpu_index, void *udata)
+{
+    if (trans_sample_start && trans_sample_id == (uint64_t)(uintptr_t)udata) {
+        uint64_t ns = thread_cpu_ns() - trans_sample_start;
+        trans_sample_start = 0;
+        __atomic_fetch_add(&trans_samples, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&trans_sample_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+static void count_translation(struct qemu_plugin_tb *tb, uint64_t addr, size_t n)
+{
+    uint64_t seq = __atomic_fetch_add(&tb_translated, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tb_translated_insns, n, __ATOMIC_RELAXED);
+    if (seen_insert(addr)) {
+        __atomic_fetch_add(&tb_retranslated, 1, __ATOMIC_RELAXED);
+    }
+
+    if (trans_sample_every && seq % trans_sample_every == 0) {
+        // A sample whose block never ran (flushed first) is replaced
+        trans_sample_id = __atomic_add_fetch(&trans_sample_ids, 1, __ATOMIC_RELAXED);
+        qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_trans_sample_end, QEMU_PLUGIN_CB_NO_REGS,
+                                             (void *)(uintptr_t)trans_sample_id);
+        trans_sample_start = thread_cpu_ns();
+    }
+}
+
+static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
+{
+    uint64_t addr = qemu_plugin_tb_vaddr(tb);
+    size_t n = qemu_plugin_tb_n_insns(tb);
+
+    count_translation(tb, addr, n);
+
+    // Determine runtime base from first TB if needed
+    if (need_base) {
+        // First TB should be near the entry point
+        // For PIE: runtime_entry = addr (approximately), base = addr - entry_offset
+        runtime_base = addr - entry_offset;
+        start_addr = runtime_base + main_offset;
+        need_base = false;
+    }
+
+    // Code is resident too: a block's pages count once it is translated
+    if (rss_trace && n) {
+        struct qemu_plugin_insn *last = qemu_plugin_tb_get_insn(tb, n - 1);
+        uint64_t end = qemu_plugin_insn_vaddr(last) + qemu_plugin_insn_size(last) - 1;
+        for (uint64_t page = addr >> GUEST_PAGE_SHIFT; page <= end >> GUEST_PAGE_SHIFT; page++) {
+            page_touch(page);
+        }
+    }
+
+    if (!counting) {
+        // Check if any instruction in this TB is at start_addr
+        for (size_t i = 0; i < n; i++) {
+            struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+            if (qemu_plugin_insn_vaddr(insn) == start_addr) {
+                counting = true;
+                break;
+            }
+        }
+        if (!counting) {
+            // Startup code's pages are resident too
+            if (rss_trace) {
+                mem_scan_tb(tb, n, false);
+            }
+            return;
+        }
+    }
+
+    if (roi) {
+        roi_scan_tb(tb, n);
+    }
+
+    if (cost_model) {
+        qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(tb, QEMU_PLUGIN_INLINE_ADD_U64,
+                                                          cost_entry, tb_cost(tb, n));
+    }
+
+    if (mem_trace || rss_trace) {
+        mem_scan_tb(tb, n, true);
+    }
+
+    struct tb_profile *slot = profile ? profile_slot(addr, n) : NULL;
+
+    if (precise && insn_limit) {
+        for (size_t i = 0; i < n; i++) {
+            qemu_plugin_register_vcpu_insn_exec_cb(qemu_plugin_tb_get_insn(tb, i), vcpu_insn_limit,
+                                                   QEMU_PLUGIN_CB_NO_REGS,
+                                                   (void *)(uintptr_t)(n - i));
+        }
+    }
+
+    if (inline_count) {
+        // Inline ops run in registration order, so the condition sees the
+        // count including this TB - same semantics as vcpu_tb_exec
+        qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(tb, QEMU_PLUGIN_INLINE_ADD_U64,
+                                                          insn_entry, n);
+        if (insn_limit && !precise) {
+            qemu_plugin_register_vcpu_tb_exec_cond_cb(tb, vcpu_limit_hit, QEMU_PLUGIN_CB_NO_REGS,
+                                                      QEMU_PLUGIN_COND_GE, insn_entry,
+                                                      insn_limit, NULL);
+            if (insn_limit > PRECISE_MARGIN && !precise_requested) {
+                qemu_plugin_register_vcpu_tb_exec_cond_cb(tb, vcpu_limit_near, QEMU_PLUGIN_CB_NO_REGS,
+                                                          QEMU_PLUGIN_COND_GE, insn_entry,
+                                                          insn_limit - PRECISE_MARGIN, NULL);
+            }
+        }
+        if (progress_every) {
+            qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(tb, QEMU_PLUGIN_INLINE_ADD_U64,
+                                                              progress_entry, n);
+            qemu_plugin_register_vcpu_tb_exec_cond_cb(tb, vcpu_progress, QEMU_PLUGIN_CB_NO_REGS,
+                                                      QEMU_PLUGIN_COND_GE, progress_entry,
+                                                      progress_every, NULL);
+        }
+        if (slot) {
+            qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_profile, QEMU_PLUGIN_CB_NO_REGS, slot);
+        }
+        return;
+    }
+
+    if (slot) {
+        qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_exec_profiled,
+                                             QEMU_PLUGIN_CB_NO_REGS, slot);
+        return;
+    }
+
+    qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_exec,
+                                         QEMU_PLUGIN_CB_NO_REGS, (void *)n);
+}
+
+// Also re-run after the precise-limit reset, which drops every callback
+static void register_callbacks(qemu_plugin_id_t id)
+{
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
+    qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
+    qemu_plugin_register_vcpu_syscall_cb(id, vcpu_syscall);
+    qemu_plugin_register_vcpu_syscall_ret_cb(id, vcpu_syscall_ret);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+}
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
+                                           const qemu_info_t *info,
+                                           int argc, char **argv)
+{
+    const char *binary_path = NULL;
+    const char *syscall_costs_path = NULL;
+    for (int i = 0; i < argc; i++) {
+        char *p = argv[i];
+        if (strncmp(p, "limit=", 6) == 0) {
+            insn_limit = strtoull(p + 6, NULL, 10);
+        } else if (strncmp(p, "binary=", 7) == 0) {
+            binary_path = p + 7;
+        } else if (strncmp(p, "stats_file=", 11) == 0) {
+            stats_fd = open_seeded_file(p + 11, stats_nonce);
+            if (stats_fd < 0) {
+                fprintf(stderr, "sandbox: cannot take nonce from stats file %s\n", p + 11);
+                return -1;
+            }
+        } else if (strncmp(p, "progress=", 9) == 0) {
+            progress_every = strtoull(p + 9, NULL, 10) * 1000000;
+        } else if (strncmp(p, "progress_file=", 14) == 0) {
+            progress_fd = open_seeded_file(p + 14, progress_nonce);
+            if (progress_fd < 0) {
+                fprintf(stderr, "sandbox: cannot take nonce from progress file %s\n", p + 14);
+                return -1;
+            }
+        } else if (strncmp(p, "syscall_cost=", 13) == 0) {
+            syscall_cost = strtoull(p + 13, NULL, 10);
+        } else if (strncmp(p, "syscall_costs=", 14) == 0) {
+            syscall_costs_path = p + 14;
+        } else if (strcmp(p, "from_start") == 0 || strcmp(p, "from_start=true") == 0 || strcmp(p, "from_start=on") == 0) {
+            count_from_start = true;
+        } else if (strcmp(p, "count=inline") == 0) {
+            inline_count = true;
+        } else if (strcmp(p, "count=tb") == 0) {
+            inline_count = false;
+        } else if (strncmp(p, "cost_model=", 11) == 0) {
+            if (!load_cost_model(p + 11)) {
+                fprintf(stderr, "sandbox: cannot read cost model %s\n", p + 11);
+                return -1;
+            }
+            cost_model = true;
+        } else if (strcmp(p, "mem=on") == 0 || strcmp(p, "mem=true") == 0) {
+            mem_trace = true;
+        } else if (strcmp(p, "rss=on") == 0 || strcmp(p, "rss=true") == 0) {
+            rss_trace = true;
+        } else if (strncmp(p, "l1_kb=", 6) == 0) {
+            l1_kb = strtoull(p + 6, NULL, 10);
+        } else if (strncmp(p, "l1_ways=", 8) == 0) {
+            l1_ways = strtoull(p + 8, NULL, 10);
+        } else if (strncmp(p, "l2_kb=", 6) == 0) {
+            l2_kb = strtoull(p + 6, NULL, 10);
+        } else if (strncmp(p, "l2_ways=", 8) == 0) {
+            l2_ways = strtoull(p + 8, NULL, 10);
+        } else if (strncmp(p, "cache_line=", 11) == 0) {
+            cache_line = strtoull(p + 11, NULL, 10);
+        } else if (strcmp(p, "roi=on") == 0 || strcmp(p, "roi=true") == 0) {
+            roi = true;
+        } else if (strcmp(p, "profile=on") == 0 || strcmp(p, "profile=true") == 0) {
+            profile = true;
+        } else if (strcmp(p, "syscall_log=on") == 0 || strcmp(p, "syscall_log=true") == 0) {
+            syslog_record = true;
+        } else if (strncmp(p, "seed=", 5) == 0) {
+            syslog_seed = strtoull(p + 5, NULL, 10);
+        } else if (strncmp(p, "syscall_replay=", 15) == 0) {
+            if (!load_replay_log(p + 15)) {
+                fprintf(stderr, "sandbox: cannot read syscall log %s\n", p + 15);
+                return -1;
+            }
+        } else if (strncmp(p, "trans_sample=", 13) == 0) {
+            trans_sample_every = strtoull(p + 13, NULL, 10);
+        } else if (strncmp(p, "profile_top=", 12) == 0) {
+            profile_top = atoi(p + 12);
+            if (profile_top < 1) profile_top = 1;
+        }
+    }
+
+    // Loaded after all options, since syscall_cost= is the table's fallback
+    if (!load_syscall_costs(syscall_costs_path)) {
+        fprintf(stderr, "sandbox: cannot read syscall costs %s\n", syscall_costs_path);
+        return -1;
+    }
+
+    // Parsed after all options, since profile=on also keeps the symbol table
+    if (binary_path) {
+        parse_elf(binary_path);
+    }
+
+    stats_score = qemu_plugin_scoreboard_new(sizeof(struct vcpu_stats));
+    insn_entry = qemu_plugin_scoreboard_u64_in_struct(stats_score, struct vcpu_stats, insn_count);
+    syscall_entry = qemu_plugin_scoreboard_u64_in_struct(stats_score, struct vcpu_stats,
+                                                         syscall_count);
+    cost_entry = qemu_plugin_scoreboard_u64_in_struct(stats_score, struct vcpu_stats, cost);
+    progress_entry = qemu_plugin_scoreboard_u64_in_struct(stats_score, struct vcpu_stats,
+                                                          progress_acc);
+
+    // Samples need somewhere to go
+    if (progress_fd < 0) {
+        progress_every = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &progress_epoch);
+
+    if (mem_trace) {
+        if (!l1_kb || !l1_ways || !l2_kb || !l2_ways || !cache_line || (cache_line & (cache_line - 1))) {
+            fprintf(stderr, "sandbox: cache sizes must be non-zero and cache_line a power of two\n");
+            return -1;
+        }
+        while ((1ULL << line_shift) < cache_line) line_shift++;
+    }
+    if (mem_trace || rss_trace) {
+        mem_score = qemu_plugin_scoreboard_new(sizeof(struct vcpu_mem));
+        loads_entry = qemu_plugin_scoreboard_u64_in_struct(mem_score, struct vcpu_mem, loads);
+        stores_entry = qemu_plugin_scoreboard_u64_in_struct(mem_score, struct vcpu_mem, stores);
+    }
+
+    if (count_from_start) {
+        // Count from very first instruction - captures ALL user-space instructions
+        counting = true;
+    } else if (main_offset == 0) {
+        counting = true;  // No binary or couldn't parse, count everything
+    } else if (is_pie) {
+        need_base = true;  // Wait for first TB to determine base
+    } else {
+        start_addr = main_offset;  // Non-PIE: use address directly
+    }
+
+    // The profile and ROI symbols rebase PIE addresses even when counting from _start
+    if ((profile || roi_begin_offset || roi_end_offset) && is_pie) {
+        need_base = true;
+    }
+
+    // Tight limits are precise from the first block, no reset needed
+    if (insn_limit && insn_limit <= PRECISE_MARGIN) {
+        precise_requested = precise = true;
+    }
+
+    plugin_id = id;
+    register_callbacks(id);
     return 0;
 }
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""Rebuilds the network a recorded run saw, for an offline re-run.
+
+Usage: replay.py <syscall log>
+
+Reads a log the plugin recorded with syscall_log=on (see SYSLOG_MAGIC in
+plugin/sandbox.c), listens on every loopback TCP address the recorded run
+connected to, prints the log's seed for QEMU's -seed and stays in the
+background serving connections. Each accepted connection is sent the bytes
+the recorded run read from the matching connection, in connect order per
+address, and closed after them if the recorded run read to the end.
+Addresses the recorded run found closed get no listener, so they refuse.
+
+Only loopback TCP is rebuilt: other addresses are unreachable under
+--network=none and UDP replies are not served, so a run that used them
+shows as diverged in the plugin's syscall_replay stats. getrandom is not
+served back either (the seed only covers AT_RANDOM): the plugin compares
+only its length, so a run whose output depends on its bytes can differ
+without diverging. Listening below
+port 1024 needs root, as in `docker run` mode (not the runner's slots).
+"""
+import os
+import selectors
+import socket
+import sys
+from pathlib import Path
+
+MAGIC = b"CTFR"
+VERSION = 2
+# x86_64 syscall numbers logged by the plugin
+SYS_READ, SYS_SOCKET, SYS_CONNECT, SYS_RECVFROM, SYS_GETSOCKOPT = 0, 41, 42, 45, 55
+SOCK_STREAM = 1
+
+
+def varint(data: bytes, pos: int):
+    value, shift = 0, 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        if not byte & 0x80:
+            return value, pos
+        shift += 7
+
+
+def parse(data: bytes):
+    """(seed, [(syscall, fd, ret, data)]) from a log"""
+    if data[:4] != MAGIC or data[4] != VERSION:
+        raise ValueError(f"not a version {VERSION} syscall log")
+    seed, pos = varint(data, 5)
+    calls = []
+    while pos < len(data):
+        num, pos = varint(data, pos)
+        fd, pos = varint(data, pos)
+        zigzag, pos = varint(data, pos)
+        length, pos = varint(data, pos)
+        calls.append((num, fd, (zigzag >> 1) ^ -(zigzag & 1), data[pos:pos + length]))
+        pos += length
+    return seed, calls
+
+
+def sockaddr(raw: bytes):
+    """(family, host, port) of a loopback AF_INET/AF_INET6 sockaddr, else None"""
+    if len(raw) < 8:
+        return None
+    family = int.from_bytes(raw[:2], "little")
+    port = int.from_bytes(raw[2:4], "big")
+    if family == socket.AF_INET and raw[4] == 127:
+        return socket.AF_INET, socket.inet_ntop(socket.AF_INET, raw[4:8]), port
+    if family == socket.AF_INET6 and len(raw) >= 24 and raw[8:24] == socket.inet_pton(socket.AF_INET6, "::1"):
+        return socket.AF_INET6, "::1", port
+    return None
+
+
+def connections(calls):
+    """Per loopback address, the replies of each open connection in order:
+    (bytes read, whether the recorded run read to the end)"""
+    stream_fds = set()
+    live = {}  # fd -> [address, open, data, eof]
+    done = []
+
+    def finish(fd):
+        conn = live.pop(fd, None)
+        if conn:
+            done.append(conn)
+
+    for num, fd, ret, data in calls:
+        if num == SYS_SOCKET:
+            finish(fd)
+            if ret >= 0 and data and data[0] == SOCK_STREAM:
+                stream_fds.add(fd)
+            else:
+                stream_fds.discard(fd)
+        elif num == SYS_CONNECT and fd in stream_fds:
+            finish(fd)
+            address = sockaddr(data)
+            if address:
+                live[fd] = [address, ret == 0, bytearray(), False]
+        elif num == SYS_GETSOCKOPT and fd in live and ret == 0 and data:
+            if int.from_bytes(data[:4], "little", signed=True) == 0:
+                live[fd][1] = True
+        elif num in (SYS_READ, SYS_RECVFROM) and fd in live:
+            if ret > 0:
+                live[fd][1] = True
+                live[fd][2] += data
+            elif ret == 0:
+                live[fd][3] = True
+    for fd in list(live):
+        finish(fd)
+
+    replies = {}
+    for address, is_open, data, eof in done:
+        if is_open:
+            replies.setdefault(address, []).append((bytes(data), eof))
+    return replies
+
+
+def serve(listeners: dict, replies: dict):
+    sel = selectors.DefaultSelector()
+    for address, listener in listeners.items():
+        sel.register(listener, selectors.EVENT_READ, ("listen", address))
+    while True:
+        for key, _ in sel.select():
+            kind, address = key.data
+            if kind == "listen":
+                conn, _ = key.fileobj.accept()
+                queue = replies[address]
+                data, eof = queue.pop(0) if len(queue) > 1 else queue[0]
+                try:
+                    conn.sendall(data)
+                except OSError:
+                    conn.close()
+                    continue
+                if eof:
+                    conn.close()
+                else:
+                    sel.register(conn, selectors.EVENT_READ, ("peer", address))
+            else:
+                # Drain whatever the guest sends until it closes
+                try:
+                    more = key.fileobj.recv(65536)
+                except OSError:
+                    more = b""
+                if not more:
+                    sel.unregister(key.fileobj)
+                    key.fileobj.close()
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: replay.py <syscall log>", file=sys.stderr)
+        sys.exit(1)
+    seed, calls = parse(Path(sys.argv[1]).read_bytes())
+    replies = connections(calls)
+
+    # Bound before the seed is printed, so the guest never races them
+    listeners = {}
+    for family, host, port in replies:
+        listener = socket.socket(family, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind((host, port))
+        listener.listen(64)
+        listeners[(family, host, port)] = listener
+
+    if os.fork():
+        print(seed, flush=True)
+        return
+    devnull = os.open(os.devnull, os.O_RDWR)
+    for fd in (0, 1, 2):
+        os.dup2(devnull, fd)
+    os.setsid()
+    serve(listeners, replies)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,369 @@
+#!/usr/bin/env python3
+"""Long-lived sandbox runner.
+
+Keeps a fixed pool of slots inside one container and serves jobs over TCP,
+so the worker does not pay `docker run` startup for every execution.
+
+Protocol (one job per connection):
+  request:  JSON header line, then `binary_size` bytes of binary, then
+            `stdin_size` bytes of stdin
+            {"limit": N, "binary_size": N, "stdin_size": N,
+             "env": {"KEY": "VALUE"}, "network": false, "timeout_sec": 30,
+             "cpu": null, "stats_nonce": "<32 hex>",
+             "progress_nonce": "<32 hex>", "progress_every": N,
+             "token": "<RUNNER_TOKEN>"}
+            (cpu: optional CPU to pin the job to; stats_nonce, progress_nonce
+            and progress_every: optional, see below; env: keys in
+            RESERVED_ENV are dropped, and network jobs get SYSCALL_RECORD=on)
+  progress: while the job runs, zero or more JSON lines each followed by
+            `progress_size` bytes of progress sample
+            {"progress_size": N}
+  response: JSON header line, then `stdout_size` bytes of stdout, then
+            `stderr_size` bytes of stderr, then `stats_size` bytes of stats
+            {"exit_code": N, "stdout_size": N, "stderr_size": N,
+             "stats_size": N, "error": null}
+
+With a stats_nonce the plugin writes its stats as a record to a file seeded
+with the nonce (see STATS_MAGIC in plugin/sandbox.c), which is returned as is
+for the caller to check, with stats_size set once the job ran. Without one the
+stats stay a line at the end of stderr and stats_size is left out.
+
+With a progress_nonce the plugin also overwrites a second seeded file with a
+progress sample every progress_every (default 100) million instructions (see
+PROGRESS_MAGIC in plugin/sandbox.c). The runner checks it every
+PROGRESS_POLL_SEC and sends each new sample as is, ahead of the response.
+
+A header of {"op": "version", "token": ...} is answered with
+{"version": "<stamp>", "slots": N, "env": {...}}: the image version stamp
+from /sandbox-version, how many jobs run at once (more wait for a slot) and
+the FORWARDED_ENV settings every job gets.
+
+Every request must carry the shared secret RUNNER_TOKEN, without which the
+runner does not start: a job can ask for networking, so anything that
+reaches the port could otherwise run code with it. Publish the port on
+loopback only (`-p 127.0.0.1:7070:7070`).
+
+Each slot is a memory cgroup limited to RUNNER_SLOT_MEMORY_MB (default 512,
+0 disables), so one job hitting its limit is OOM-killed alone instead of
+taking the other slots and the runner with it. The runner remounts the
+container's cgroup v2 tree writable for this (hence SYS_ADMIN), moves
+itself into a `runner` leaf and creates one `slot<N>` cgroup per slot.
+
+Each job runs through slot.sh in fresh mount/pid/ipc/uts (and, unless
+network is requested, net) namespaces with its own /tmp and /var tmpfs.
+
+Batch mode (`runner.py --batch <manifest>`) serves no port: it runs every
+line of an NDJSON manifest as a job over the slots and prints one NDJSON
+line per job as it finishes, then exits. A manifest line is a request
+header whose "binary" and "stdin" name files next to the manifest
+            {"id": N, "binary": "0.bin", "stdin": "0.stdin", "limit": N, ...}
+and the reply carries the output as base64
+            {"id": N, "exit_code": N, "error": null, "stdout": "<base64>",
+             "stderr": "<base64>", "stats": "<base64>"}
+"""
+import base64
+import hmac
+import json
+import os
+import queue
+import shutil
+import socketserver
+import subprocess
+import sys
+import threading
+from concurrent.futures import ThreadPoolExecutor
+from pathlib import Path
+
+PORT = int(os.environ.get("RUNNER_PORT", "7070"))
+TOKEN = os.environ.get("RUNNER_TOKEN", "")
+SLOT_MEMORY_MB = int(os.environ.get("RUNNER_SLOT_MEMORY_MB", "512"))
+CGROUP_ROOT = Path("/sys/fs/cgroup")
+# Runner env passed on to every job. It changes results as much as the
+# image does, so the version reply carries it for execution cache keys.
+FORWARDED_ENV = ("COUNT_MODE", "PROFILE", "PROFILE_TOP", "ROI", "COST_MODEL", "SYSCALL_COSTS", "MEM", "RSS",
+                 "TRANS_SAMPLE", "SYSCALL_RECORD")
+SLOTS = int(os.environ.get("RUNNER_SLOTS", str(os.cpu_count() or 1)))
+SLOT_DIR = Path(os.environ.get("RUNNER_SLOT_DIR", "/run/slots"))
+MAX_TIMEOUT_SEC = int(os.environ.get("RUNNER_MAX_TIMEOUT_SEC", "60"))
+MAX_BINARY_SIZE = int(os.environ.get("RUNNER_MAX_BINARY_SIZE", str(200 * 1024 * 1024)))
+MAX_STDIN_SIZE = int(os.environ.get("RUNNER_MAX_STDIN_SIZE", str(16 * 1024 * 1024)))
+MAX_STATS_SIZE = int(os.environ.get("RUNNER_MAX_STATS_SIZE", str(64 * 1024 * 1024)))
+STATS_DIR = Path(os.environ.get("RUNNER_STATS_DIR", "/run/stats"))
+PROGRESS_POLL_SEC = float(os.environ.get("RUNNER_PROGRESS_POLL_SEC", "1"))
+# Env the runner sets itself (or leaves unset on purpose); a request's env
+# must not override them, e.g. to move the stats record or lift the limit
+RESERVED_ENV = {"PATH", "JOB_DIR", "STATS_DIR", "LIMIT", "STATS_FILE", "PROGRESS_FILE", "PROGRESS",
+                "COUNT_MODE", "SYSCALL_RECORD", "SYSCALL_REPLAY"}
+# A plugin sample is 96 bytes; anything longer is the guest's
+MAX_PROGRESS_SIZE = 4096
+VERSION_FILE = Path("/sandbox-version")
+
+# Slots are handed out one job at a time; a connection blocks until one is free
+free_slots: "queue.Queue[Path]" = queue.Queue()
+
+
+def forwarded_env() -> dict:
+    """Plugin settings of the runner's own env that every job gets"""
+    return {key: os.environ[key] for key in FORWARDED_ENV if os.environ.get(key)}
+
+
+def prepare_cgroups():
+    """One memory-limited cgroup per slot under the container's own"""
+    if not os.access(CGROUP_ROOT / "cgroup.subtree_control", os.W_OK):
+        subprocess.run(["mount", "-o", "remount,rw", str(CGROUP_ROOT)], check=True)
+    # A cgroup holding processes cannot hand controllers to its children
+    leaf = CGROUP_ROOT / "runner"
+    leaf.mkdir(exist_ok=True)
+    for pid in (CGROUP_ROOT / "cgroup.procs").read_text().split():
+        try:
+            (leaf / "cgroup.procs").write_text(pid)
+        except OSError:
+            pass  # exited meanwhile
+    (CGROUP_ROOT / "cgroup.subtree_control").write_text("+memory")
+    for i in range(SLOTS):
+        cgroup = CGROUP_ROOT / f"slot{i}"
+        cgroup.mkdir(exist_ok=True)
+        (cgroup / "memory.max").write_text(str(SLOT_MEMORY_MB * 1024 * 1024))
+        (cgroup / "memory.oom.group").write_text("1")
+        try:
+            (cgroup / "memory.swap.max").write_text("0")
+        except FileNotFoundError:
+            pass  # no swap accounting, so no swap to limit
+
+
+def prepare_slots():
+    if SLOT_MEMORY_MB > 0:
+        try:
+            prepare_cgroups()
+        except (OSError, subprocess.CalledProcessError) as e:
+            sys.exit(f"Per-slot memory cgroups unavailable ({e}); they need cgroup v2, "
+                     "--cgroupns=private and SYS_ADMIN. RUNNER_SLOT_MEMORY_MB=0 runs without them.")
+    for i in range(SLOTS):
+        slot = SLOT_DIR / str(i)
+        slot.mkdir(parents=True, exist_ok=True)
+        # Outside the slot so the job cannot replace the file, only write it
+        (STATS_DIR / str(i)).mkdir(mode=0o755, parents=True, exist_ok=True)
+        free_slots.put(slot)
+
+
+def reset_slot(slot: Path):
+    for entry in slot.iterdir():
+        if entry.is_dir() and not entry.is_symlink():
+            shutil.rmtree(entry, ignore_errors=True)
+        else:
+            entry.unlink(missing_ok=True)
+    (STATS_DIR / slot.name / "stats").unlink(missing_ok=True)
+    (STATS_DIR / slot.name / "progress").unlink(missing_ok=True)
+
+
+def seed_file(path: Path, nonce_hex: str):
+    path.write_bytes(bytes.fromhex(nonce_hex))
+    path.chmod(0o666)
+
+
+def run_job(slot: Path, header: dict, binary: bytes, stdin: bytes, send_progress) -> dict:
+    binary_path = slot / "binary"
+    binary_path.write_bytes(binary)
+    binary_path.chmod(0o755)
+
+    stats_path = None
+    if header.get("stats_nonce"):
+        stats_path = STATS_DIR / slot.name / "stats"
+        seed_file(stats_path, header["stats_nonce"])
+    progress_path = None
+    if header.get("progress_nonce"):
+        progress_path = STATS_DIR / slot.name / "progress"
+        seed_file(progress_path, header["progress_nonce"])
+
+    # The request's env first, so the runner's own keys always win over it
+    env = {str(key): str(value) for key, value in (header.get("env") or {}).items()
+           if str(key) not in RESERVED_ENV}
+    env.update({
+        "PATH": "/usr/local/bin:/usr/bin:/bin",
+        "JOB_DIR": str(slot),
+        "LIMIT": str(int(header["limit"])),
+    })
+    env.update(forwarded_env())
+    # Networked runs log what they saw so they can be re-verified without it
+    if header.get("network"):
+        env["SYSCALL_RECORD"] = "on"
+    if stats_path or progress_path:
+        env["STATS_DIR"] = str(STATS_DIR / slot.name)
+    if stats_path:
+        env["STATS_FILE"] = "/stats/stats"
+    if progress_path:
+        env["PROGRESS_FILE"] = "/stats/progress"
+        if header.get("progress_every"):
+            env["PROGRESS"] = str(int(header["progress_every"]))
+
+    cmd = []
+    if SLOT_MEMORY_MB > 0:
+        # Join the slot's cgroup before anything of the job starts
+        cmd += ["sh", "-c", 'echo 0 > "$0" && exec "$@"', str(CGROUP_ROOT / f"slot{slot.name}" / "cgroup.procs")]
+    if header.get("cpu") is not None:
+        cmd += ["taskset", "-c", str(int(header["cpu"]))]
+    cmd += ["unshare", "--mount", "--pid", "--ipc", "--uts", "--fork", "--kill-child", "--mount-proc"]
+    if not header.get("network"):
+        cmd.append("--net")
+    cmd.append("/runner/slot.sh")
+
+    timeout = min(int(header.get("timeout_sec") or MAX_TIMEOUT_SEC), MAX_TIMEOUT_SEC)
+    proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, env=env)
+    output = {}
+
+    def communicate():
+        try:
+            output["out"] = proc.communicate(stdin, timeout=timeout)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            output["out"] = proc.communicate()
+            output["timed_out"] = True
+
+    # The job runs on its own thread so this one can pass progress on meanwhile
+    waiter = threading.Thread(target=communicate, daemon=True)
+    waiter.start()
+    last_sample = None
+    while waiter.is_alive():
+        waiter.join(PROGRESS_POLL_SEC if progress_path else None)
+        if progress_path:
+            with progress_path.open("rb") as f:
+                sample = f.read(MAX_PROGRESS_SIZE)
+            if sample and sample != last_sample:
+                send_progress(sample)
+                last_sample = sample
+
+    stdout, stderr = output["out"]
+    if output.get("timed_out"):
+        return {"exit_code": -1, "stdout": stdout or b"", "stderr": stderr or b"",
+                "error": f"Execution timed out after {timeout} seconds"}
+
+    result = {"exit_code": proc.returncode, "stdout": stdout, "stderr": stderr, "error": None}
+    if stats_path:
+        # The guest can write the file too; a real record is cut to size
+        with stats_path.open("rb") as f:
+            result["stats"] = f.read(MAX_STATS_SIZE)
+    return result
+
+
+class JobHandler(socketserver.StreamRequestHandler):
+    def send_progress(self, sample: bytes):
+        # A caller that went away still gets the job run to the end and the
+        # slot reset; only the progress stops
+        if self.progress_lost:
+            return
+        try:
+            self.wfile.write(json.dumps({"progress_size": len(sample)}).encode() + b"\n")
+            self.wfile.write(sample)
+            self.wfile.flush()
+        except OSError:
+            self.progress_lost = True
+
+    def reply(self, result: dict):
+        stdout = result.get("stdout", b"")
+        stderr = result.get("stderr", b"")
+        stats = result.get("stats")
+        header = {
+            "exit_code": result.get("exit_code", -1),
+            "stdout_size": len(stdout),
+            "stderr_size": len(stderr),
+            "error": result.get("error"),
+        }
+        if stats is not None:
+            header["stats_size"] = len(stats)
+        self.wfile.write(json.dumps(header).encode() + b"\n")
+        self.wfile.write(stdout)
+        self.wfile.write(stderr)
+        if stats is not None:
+            self.wfile.write(stats)
+        self.wfile.flush()
+
+    def handle(self):
+        try:
+            header = json.loads(self.rfile.readline())
+            if not hmac.compare_digest(str(header.get("token", "")).encode(), TOKEN.encode()):
+                self.reply({"error": "Invalid runner token"})
+                return
+            if header.get("op") == "version":
+                version = VERSION_FILE.read_text().strip() if VERSION_FILE.exists() else None
+                self.wfile.write(json.dumps({"version": version, "slots": SLOTS, "env": forwarded_env()}).encode() + b"\n")
+                return
+            binary_size = int(header["binary_size"])
+            stdin_size = int(header.get("stdin_size", 0))
+        except (ValueError, KeyError, TypeError, AttributeError) as e:
+            self.reply({"error": f"Invalid request header: {e}"})
+            return
+
+        if binary_size > MAX_BINARY_SIZE or stdin_size > MAX_STDIN_SIZE:
+            self.reply({"error": "Request payload too large"})
+            return
+
+        binary = self.rfile.read(binary_size)
+        stdin = self.rfile.read(stdin_size)
+        if len(binary) != binary_size or len(stdin) != stdin_size:
+            self.reply({"error": "Truncated request payload"})
+            return
+
+        self.progress_lost = False
+        slot = free_slots.get()
+        try:
+            result = run_job(slot, header, binary, stdin, self.send_progress)
+        except (OSError, ValueError, KeyError) as e:
+            result = {"error": f"Runner failed: {e}"}
+        finally:
+            reset_slot(slot)
+            free_slots.put(slot)
+
+        self.reply(result)
+
+
+class RunnerServer(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def run_batch(manifest: Path):
+    jobs = [json.loads(line) for line in manifest.read_text().splitlines() if line.strip()]
+    write_lock = threading.Lock()
+
+    def run_one(header: dict):
+        slot = free_slots.get()
+        try:
+            binary = (manifest.parent / header["binary"]).read_bytes()
+            stdin = (manifest.parent / header["stdin"]).read_bytes() if header.get("stdin") else b""
+            result = run_job(slot, header, binary, stdin, lambda sample: None)
+        except Exception as e:
+            # One bad entry fails alone; the rest of the batch still runs
+            result = {"error": f"Runner failed: {e}"}
+        finally:
+            reset_slot(slot)
+            free_slots.put(slot)
+
+        reply = {"id": header.get("id"), "exit_code": result.get("exit_code", -1), "error": result.get("error")}
+        for key in ("stdout", "stderr", "stats"):
+            if result.get(key) is not None:
+                reply[key] = base64.b64encode(result[key]).decode()
+        with write_lock:
+            sys.stdout.write(json.dumps(reply) + "\n")
+            sys.stdout.flush()
+
+    with ThreadPoolExecutor(SLOTS) as pool:
+        for _ in pool.map(run_one, jobs):
+            pass
+
+
+def main():
+    if len(sys.argv) > 2 and sys.argv[1] == "--batch":
+        prepare_slots()
+        run_batch(Path(sys.argv[2]))
+        return
+    if not TOKEN:
+        sys.exit("RUNNER_TOKEN must be set: every request has to carry it")
+    prepare_slots()
+    with RunnerServer(("0.0.0.0", PORT), JobHandler) as server:
+        print(f"Sandbox runner listening on :{PORT} with {SLOTS} slots", flush=True)
+        server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs one runner job inside the namespaces created by runner.py.
+# Mirrors the `docker run` sandbox: fresh /tmp and /var tmpfs, binary
+# read-only at /work/binary, the job's stats file (if any) under /stats,
+# then drops to nobody with no capabilities.
+set -e
+
+mount -t tmpfs -o rw,exec,nosuid,nodev,mode=1777,size=64m tmpfs /tmp
+mount -t tmpfs -o rw,nosuid,nodev,mode=1777,size=16m tmpfs /var
+mount --bind "$JOB_DIR" /work
+mount -o remount,bind,ro,nosuid,nodev /work
+if [ -n "$STATS_DIR" ]; then
+    mount --bind "$STATS_DIR" /stats
+fi
+unset JOB_DIR STATS_DIR
+
+exec setpriv --reuid=65534 --regid=65534 --clear-groups \
+    --inh-caps=-all --bounding-set=-all --no-new-privs \
+    /entrypoint.sh
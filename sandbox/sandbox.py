@@ -1,10 +1,36 @@
 #!/usr/bin/env python3
+import base64
+import dataclasses
 import json
-import re
+import math
+import os
+import shutil
+import struct
 import subprocess
 import tempfile
 from dataclasses import dataclass
 from pathlib import Path
+from typing import Iterable, Iterator, Tuple
+
+# Stats record written to the stats file (see STATS_MAGIC in plugin/sandbox.c):
+# magic, version, header size, nonce, payload length, then the JSON payload
+STATS_HEADER = struct.Struct("<8sII16sQ")
+STATS_MAGIC = b"CTFSTATS"
+STATS_VERSION = 1
+
+# Batch container memory beyond its slots' limits, for the runner itself
+RUNNER_OVERHEAD_MB = 128
+
+
+def stats_payload(record: bytes, nonce: bytes):
+    if len(record) < STATS_HEADER.size:
+        return None
+    magic, version, header_size, record_nonce, length = STATS_HEADER.unpack_from(record)
+    if magic != STATS_MAGIC or version != STATS_VERSION or record_nonce != nonce:
+        return None
+    if header_size < STATS_HEADER.size or header_size + length > len(record):
+        return None
+    return record[header_size:header_size + length]
 
 
 @dataclass
@@ -18,6 +44,16 @@ class Result:
     syscalls: int = 0
     syscall_cost: int = 0
     syscall_breakdown: dict = None
+    syscall_cost_breakdown: dict = None  # with a syscall cost table
+    thread_breakdown: list = None
+    cycles_estimate: int = None  # with the plugin cost model
+    profile: list = None  # hottest blocks, with profile=True
+    functions: list = None  # instructions per function, with profile=True
+    # Memory traffic and cache model estimates, with mem=True
+    loads: int = None
+    stores: int = None
+    l1_misses: int = None
+    l2_misses: int = None
     # QEMU process memory (for reference)
     memory_rss_kb: int = 0
     memory_hwm_kb: int = 0
@@ -29,6 +65,10 @@ class Result:
     guest_mmap_bytes: int = 0
     guest_mmap_peak: int = 0
     guest_heap_bytes: int = 0
+    guest_rss_peak_bytes: int = None  # touched pages still mapped, with rss=True
+    emulation: dict = None  # QEMU translation counts and host CPU time
+    syscall_log: bytes = None  # with record_syscalls=True, input for replay_log
+    syscall_replay: dict = None  # with replay_log: entries, matched, diverged_at
 
 
 def run(
@@ -38,11 +78,37 @@ def run(
     memory_limit_mb: int = 256,
     timeout_sec: float = 30,
     stdin: bytes = b"",
+    profile: bool = False,
+    mem: bool = False,
+    rss: bool = False,
+    count_mode: str = None,
+    image: str = "sandbox",
+    network: bool = False,
+    record_syscalls: bool = False,
+    replay_log: bytes = None,
 ) -> Result:
+    """Run one binary in a fresh container.
+
+    record_syscalls logs the results of network, random and clock syscalls
+    (Result.syscall_log), usually with network=True. Passing such a log as
+    replay_log re-runs offline against the recorded loopback listeners; the
+    re-run reproduced the recording when syscall_replay["diverged_at"] is
+    None."""
     with tempfile.NamedTemporaryFile(delete=False) as f:
         f.write(binary)
         binary_path = f.name
 
+    # The plugin takes the nonce from this file and replaces it with its record
+    nonce = os.urandom(16)
+    stats_dir = Path(tempfile.mkdtemp())
+    stats_path = stats_dir / "stats"
+    stats_path.write_bytes(nonce)
+    stats_path.chmod(0o666)
+    replay_args = []
+    if replay_log is not None:
+        (stats_dir / "replay").write_bytes(replay_log)
+        replay_args = ["-e", "SYSCALL_REPLAY=/stats/replay"]
+
     try:
         Path(binary_path).chmod(0o755)
         proc = subprocess.run(
@@ -50,39 +116,60 @@ def run(
                 "docker", "run", "--rm", "-i",
                 f"--memory={memory_limit_mb}m",
                 f"--memory-swap={memory_limit_mb}m",
-                "--network=none",
+                *([] if network else ["--network=none"]),
                 "--read-only",
                 "--tmpfs=/tmp:rw,exec,nosuid,size=64m",
                 "--tmpfs=/var:rw,nosuid,size=16m",
                 "-e", f"LIMIT={instruction_limit}",
+                "-e", f"PROFILE={'on' if profile else 'off'}",
+                "-e", f"MEM={'on' if mem else 'off'}",
+                "-e", f"RSS={'on' if rss else 'off'}",
+                *(["-e", f"COUNT_MODE={count_mode}"] if count_mode else []),
+                *(["-e", "SYSCALL_RECORD=on"] if record_syscalls else []),
+                *replay_args,
+                "-e", "STATS_FILE=/stats/stats",
+                "-v", f"{stats_dir}:/stats",
                 "-v", f"{binary_path}:/work/binary:ro",
-                "sandbox",
+                image,
             ],
             input=stdin,
             capture_output=True,
             timeout=timeout_sec,
         )
+        record = stats_path.read_bytes()
     finally:
         Path(binary_path).unlink()
+        shutil.rmtree(stats_dir, ignore_errors=True)
 
-    stderr = proc.stderr
+    return parse_result(record, nonce, proc.stdout, proc.stderr, proc.returncode)
+
+
+def parse_result(record: bytes, nonce: bytes, stdout: bytes, stderr: bytes, exit_code: int) -> Result:
     stats = {"instructions": 0, "memory_peak_kb": 0, "limit_reached": False}
 
-    match = re.search(rb'\n(\{[^\n]+\})\n?$', stderr)
-    if match:
-        stats = json.loads(match.group(1))
-        stderr = stderr[:match.start()]
+    payload = stats_payload(record, nonce)
+    if payload is not None:
+        stats = json.loads(payload)
 
     return Result(
         instructions=stats["instructions"],
         memory_peak_kb=stats["memory_peak_kb"],
-        stdout=proc.stdout,
+        stdout=stdout,
         stderr=stderr,
-        exit_code=proc.returncode,
+        exit_code=exit_code,
         limit_reached=stats["limit_reached"],
         syscalls=stats.get("syscalls", 0),
         syscall_cost=stats.get("syscall_cost", 0),
         syscall_breakdown=stats.get("syscall_breakdown", {}),
+        syscall_cost_breakdown=stats.get("syscall_cost_breakdown", {}),
+        thread_breakdown=stats.get("thread_breakdown", []),
+        cycles_estimate=stats.get("cycles_estimate"),
+        profile=stats.get("profile", []),
+        functions=stats.get("functions", []),
+        loads=stats.get("loads"),
+        stores=stats.get("stores"),
+        l1_misses=stats.get("l1_misses"),
+        l2_misses=stats.get("l2_misses"),
         memory_rss_kb=stats.get("memory_rss_kb", 0),
         memory_hwm_kb=stats.get("memory_hwm_kb", 0),
         memory_data_kb=stats.get("memory_data_kb", 0),
@@ -92,30 +179,183 @@ def run(
         guest_mmap_bytes=stats.get("guest_mmap_bytes", 0),
         guest_mmap_peak=stats.get("guest_mmap_peak", 0),
         guest_heap_bytes=stats.get("guest_heap_bytes", 0),
+        guest_rss_peak_bytes=stats.get("guest_rss_peak_bytes"),
+        emulation=stats.get("emulation"),
+        syscall_log=base64.b64decode(stats["syscall_log"]) if stats.get("syscall_log") else None,
+        syscall_replay=stats.get("syscall_replay"),
     )
 
 
+@dataclass
+class BatchEntry:
+    binary: bytes
+    stdin: bytes = b""
+    instruction_limit: int = 10_000_000
+    id: str = None  # returned with the result; defaults to the entry's index
+
+
+def run_batch(
+    entries: Iterable[BatchEntry],
+    *,
+    parallel: int = os.cpu_count() or 1,
+    memory_limit_mb: int = 256,
+    timeout_sec: float = 30,
+    profile: bool = False,
+    mem: bool = False,
+    rss: bool = False,
+    count_mode: str = None,
+    image: str = "sandbox",
+) -> Iterator[Tuple[str, Result]]:
+    """Run many binaries in one container, `parallel` QEMU processes at a
+    time, yielding (id, Result) for each as it finishes.
+
+    The container is the long-lived runner (runner/runner.py) started in
+    batch mode, so every entry gets the runner's per-job namespaces and
+    its own stats nonce. memory_limit_mb applies to each binary through
+    the runner's per-slot memory cgroups; the container gets `parallel`
+    times that plus room for the runner itself."""
+    # mkdtemp is 0700: the runner reads it as root, jobs (nobody) cannot
+    batch_dir = Path(tempfile.mkdtemp())
+    ids, nonces = [], []
+    try:
+        with (batch_dir / "manifest.ndjson").open("w") as manifest:
+            for i, entry in enumerate(entries):
+                ids.append(entry.id if entry.id is not None else str(i))
+                nonces.append(os.urandom(16))
+                (batch_dir / f"{i}.bin").write_bytes(entry.binary)
+                job = {"id": i, "binary": f"{i}.bin", "limit": entry.instruction_limit,
+                       "stats_nonce": nonces[i].hex(), "timeout_sec": math.ceil(timeout_sec)}
+                if entry.stdin:
+                    (batch_dir / f"{i}.stdin").write_bytes(entry.stdin)
+                    job["stdin"] = f"{i}.stdin"
+                manifest.write(json.dumps(job) + "\n")
+
+        memory = memory_limit_mb * parallel + RUNNER_OVERHEAD_MB
+        cmd = [
+            "docker", "run", "--rm",
+            f"--memory={memory}m",
+            f"--memory-swap={memory}m",
+            "--cgroupns=private",
+            "--network=none",
+            "--read-only",
+            f"--tmpfs=/run/slots:rw,exec,size={memory}m",
+            "--tmpfs=/run/stats:rw,size=64m",
+            "--tmpfs=/tmp:rw,size=16m",
+            "--cap-add=SYS_ADMIN",
+            "--security-opt", "apparmor=unconfined",
+            "-e", f"RUNNER_SLOTS={parallel}",
+            "-e", f"RUNNER_SLOT_MEMORY_MB={memory_limit_mb}",
+            "-e", f"RUNNER_MAX_TIMEOUT_SEC={math.ceil(timeout_sec)}",
+            "-e", f"PROFILE={'on' if profile else 'off'}",
+            "-e", f"MEM={'on' if mem else 'off'}",
+            "-e", f"RSS={'on' if rss else 'off'}",
+            *(["-e", f"COUNT_MODE={count_mode}"] if count_mode else []),
+            "-v", f"{batch_dir}:/batch:ro",
+            "--entrypoint", "/runner/runner.py",
+            image, "--batch", "/batch/manifest.ndjson",
+        ]
+        done = 0
+        with subprocess.Popen(cmd, stdout=subprocess.PIPE) as proc:
+            for line in proc.stdout:
+                reply = json.loads(line)
+                i = int(reply["id"])
+                fields = {k: base64.b64decode(reply.get(k) or "") for k in ("stdout", "stderr", "stats")}
+                result = parse_result(fields["stats"], nonces[i], fields["stdout"], fields["stderr"],
+                                      reply.get("exit_code", -1))
+                if reply.get("error"):
+                    result.stderr += reply["error"].encode()
+                done += 1
+                yield ids[i], result
+        if done < len(ids):
+            raise RuntimeError(f"Batch runner exited with {proc.returncode} after {done} of {len(ids)} entries")
+    finally:
+        shutil.rmtree(batch_dir, ignore_errors=True)
+
+
+def result_json(result: Result) -> dict:
+    """Result as a JSON-ready dict, output bytes decoded as UTF-8"""
+    record = dataclasses.asdict(result)
+    for key in ("stdout", "stderr"):
+        record[key] = record[key].decode(errors="replace")
+    if record["syscall_log"] is not None:
+        record["syscall_log"] = base64.b64encode(record["syscall_log"]).decode()
+    return record
+
+
+def batch_main(manifest_path: Path, argv: list):
+    """Run an NDJSON manifest of {"binary", "stdin", "limit", "id"} lines
+    (paths relative to the manifest) and print one NDJSON result per entry
+    as it finishes"""
+    parallel = os.cpu_count() or 1
+    if "--parallel" in argv:
+        parallel = int(argv[argv.index("--parallel") + 1])
+    entries = []
+    for line in manifest_path.read_text().splitlines():
+        if not line.strip():
+            continue
+        item = json.loads(line)
+        entries.append(BatchEntry(
+            binary=(manifest_path.parent / item["binary"]).read_bytes(),
+            stdin=(manifest_path.parent / item["stdin"]).read_bytes() if item.get("stdin") else b"",
+            instruction_limit=int(item.get("limit", 10_000_000)),
+            id=item.get("id", item["binary"]),
+        ))
+    results = run_batch(entries, parallel=parallel, profile="--profile" in argv, mem="--mem" in argv,
+                        rss="--rss" in argv)
+    for entry_id, result in results:
+        print(json.dumps({"id": entry_id, **result_json(result)}), flush=True)
+
+
 if __name__ == "__main__":
     import sys
     if len(sys.argv) < 2:
-        print("Usage: sandbox.py <binary> [instruction_limit]", file=sys.stderr)
+        print("Usage: sandbox.py <binary> [instruction_limit] [--profile] [--mem] [--rss]\n"
+              "       sandbox.py --batch <manifest.ndjson> [--parallel N] [--profile] [--mem] [--rss]",
+              file=sys.stderr)
         sys.exit(1)
-    binary_data = Path(sys.argv[1]).read_bytes()
-    limit = int(sys.argv[2]) if len(sys.argv) > 2 else 10_000_000
-    result = run(binary_data, instruction_limit=limit)
+    if sys.argv[1] == "--batch":
+        batch_main(Path(sys.argv[2]), sys.argv[3:])
+        sys.exit(0)
+    profile = "--profile" in sys.argv
+    mem = "--mem" in sys.argv
+    rss = "--rss" in sys.argv
+    args = [a for a in sys.argv[1:] if a not in ("--profile", "--mem", "--rss")]
+    binary_data = Path(args[0]).read_bytes()
+    limit = int(args[1]) if len(args) > 1 else 10_000_000
+    result = run(binary_data, instruction_limit=limit, profile=profile, mem=mem, rss=rss)
     print(f"Exit code: {result.exit_code}")
     print(f"Instructions: {result.instructions}")
+    if result.cycles_estimate is not None:
+        print(f"Cycles (estimate): {result.cycles_estimate}")
+    if result.loads is not None:
+        print(f"Memory accesses: {result.loads} loads, {result.stores} stores")
+        print(f"Cache misses (estimate): {result.l1_misses} L1, {result.l2_misses} L2")
     print(f"Memory peak (QEMU): {result.memory_peak_kb} KB")
     print(f"Guest memory:")
     print(f"  mmap current: {result.guest_mmap_bytes} bytes")
     print(f"  mmap peak: {result.guest_mmap_peak} bytes")
     print(f"  heap (brk): {result.guest_heap_bytes} bytes")
+    if result.guest_rss_peak_bytes is not None:
+        print(f"  resident peak: {result.guest_rss_peak_bytes} bytes")
     print(f"Limit reached: {result.limit_reached}")
     print(f"Syscalls: {result.syscalls}")
     if result.syscall_breakdown:
         print(f"Syscall breakdown:")
         for name, count in sorted(result.syscall_breakdown.items(), key=lambda x: -x[1]):
-            print(f"  {name}: {count}")
+            cost = (result.syscall_cost_breakdown or {}).get(name)
+            print(f"  {name}: {count}" + (f" (cost {cost})" if cost else ""))
+    if result.thread_breakdown and len(result.thread_breakdown) > 1:
+        print(f"Threads:")
+        for t in result.thread_breakdown:
+            print(f"  vcpu {t['vcpu']}: {t['instructions']} instructions, {t['syscalls']} syscalls")
+    if result.profile:
+        print(f"Hot blocks:")
+        for b in result.profile:
+            print(f"  {b['addr']} ({b['len']} insns): {b['execs']} execs, {b['instructions']} instructions")
+    if result.functions:
+        print(f"Functions:")
+        for fn in result.functions:
+            print(f"  {fn['name']}: {fn['instructions']} instructions")
     if result.stdout:
         print(f"Stdout: {result.stdout.decode(errors='replace')}")
     if result.stderr:
@@ -41,8 +41,29 @@ export interface StatusResponse {
 	error: string | null;
 }
 
+// Published by the worker while a job runs; display only, never scored
+export interface ProgressUpdate {
+	job_id: string;
+	instructions: number;
+	syscalls: number;
+	guest_mmap_bytes: number;
+	guest_heap_bytes: number;
+	guest_rss_bytes?: number;
+	elapsed_ms: number;
+	instructions_per_sec: number;
+	instruction_limit: number;
+	limit_eta_ms?: number;
+}
+
 export interface ExecutionResult {
 	instructions: number;
+	mode?: ExecutionMode;
+	cycles?: number; // measured, native mode only
+	cycles_estimate?: number; // weighted by the sandbox cost model
+	loads?: number; // with MEM=on, as are the cache model's misses
+	stores?: number;
+	l1_misses?: number;
+	l2_misses?: number;
 	memory_peak_kb: number;
 	memory_rss_kb?: number;
 	memory_hwm_kb?: number;
@@ -54,6 +75,8 @@ export interface ExecutionResult {
 	guest_mmap_bytes?: number;
 	guest_mmap_peak?: number;
 	guest_heap_bytes?: number;
+	// Peak of touched, still-mapped guest pages (sandbox RSS=on)
+	guest_rss_peak_bytes?: number;
 	limit_reached: boolean;
 	exit_code: number;
 	stdout: string; // base64 encoded
@@ -61,6 +84,48 @@ export interface ExecutionResult {
 	execution_time_ms: number;
 	syscalls: number;
 	syscall_breakdown: Record<string, number>;
+	syscall_cost_breakdown?: Record<string, number>; // virtual instructions, with a syscall cost table
+	thread_breakdown?: ThreadStats[];
+	instructions_net?: number; // instructions minus the runtime's empty-program baseline
+	baseline_instructions?: number;
+	roi_instructions?: number; // inside ROI markers, when the guest has any
+	roi_regions?: number;
+	profile?: BlockProfile[]; // present when the sandbox runs with PROFILE=on
+	functions?: FunctionProfile[]; // per-function totals, alongside profile
+	emulation?: EmulationStats; // QEMU mode only
+}
+
+// QEMU's own work during a run; translation time is sampled
+export interface EmulationStats {
+	tb_translated: number;
+	tb_retranslated: number; // a block address translated again
+	tb_translated_insns: number;
+	tb_avg_insns: number;
+	host_cpu_ns: number;
+	host_translate_ns: number;
+	host_exec_ns: number;
+	translate_samples?: number;
+}
+
+// Per-vCPU (guest thread) counters
+export interface ThreadStats {
+	vcpu: number;
+	instructions: number;
+	syscalls: number;
+}
+
+// Hot translation block from the plugin profile
+export interface BlockProfile {
+	addr: string; // hex, rebased to the file for PIE binaries
+	len: number; // instructions in the block
+	execs: number;
+	instructions: number; // len * execs
+}
+
+// Instructions attributed to one ELF function symbol ("[unknown]" outside any)
+export interface FunctionProfile {
+	name: string;
+	instructions: number;
 }
 
 export interface BinaryMetadata {
@@ -70,6 +135,34 @@ export interface BinaryMetadata {
 	compile_flags?: Record<string, string>;
 }
 
+// Counts are null where an entry fell outside that run's reported top
+export interface FunctionDelta {
+	name: string;
+	base: number | null;
+	other: number | null;
+	delta: number | null;
+}
+
+export interface BlockDelta {
+	addr: string;
+	len: number;
+	base: number | null;
+	other: number | null;
+	delta: number | null;
+}
+
+export interface RunDiff {
+	base_run_id: string;
+	other_run_id: string;
+	base_instructions: number;
+	other_instructions: number;
+	instructions_delta: number;
+	same_binary: boolean;
+	profiled: boolean;
+	functions: FunctionDelta[];
+	blocks: BlockDelta[];
+}
+
 export interface RunDetails {
 	id: string;
 	job_id: string;
@@ -102,6 +195,7 @@ export interface RunDetails {
 	stdout?: string;
 	stderr?: string;
 	benchmark_id?: string;
+	mode: ExecutionMode; // native runs are approximate and cannot be diffed
 	created_at: string;
 	started_at?: string;
 	completed_at?: string;
@@ -174,6 +268,7 @@ export interface ChallengeDetail {
 	output_spec: string;
 	test_cases: PublicTestCase[];
 	verify_mode: string;
+	score_metric?: string; // "instructions", "roi" or "net"
 	baselines?: ChallengeBaseline[];
 }
 
@@ -281,7 +376,10 @@ export type Language =
 	| 'racket'
 	| 'wasm';
 
-export type Optimization = 'debug' | 'release' | 'size';
+// qemu: exact emulated counts (used for scoring); native: hardware counters, faster but approximate
+export type ExecutionMode = 'qemu' | 'native';
+
+export type Optimization = 'debug' | 'release' | 'size' | 'pgo';
 
 class ApiClient {
 	private async request<T>(path: string, options?: RequestInit): Promise<T> {
@@ -308,7 +406,8 @@ class ApiClient {
 		sourceCode: string,
 		language: Language,
 		optimization: Optimization = 'release',
-		flags: Record<string, string> = {}
+		flags: Record<string, string> = {},
+		trainingStdin: string[] = []
 	): Promise<CompileSubmitResponse> {
 		const formData = new FormData();
 		formData.append('source_code', sourceCode);
@@ -323,6 +422,11 @@ class ApiClient {
 			formData.append('flags', JSON.stringify(activeFlags));
 		}
 
+		// optimization=pgo: stdin of each training run
+		for (const stdin of trainingStdin) {
+			formData.append('training_stdin', stdin);
+		}
+
 		return this.request('/compile', {
 			method: 'POST',
 			body: formData
@@ -342,7 +446,8 @@ class ApiClient {
 		instructionLimit?: number,
 		stdin?: string,
 		benchmarkId?: string,
-		envVars?: Record<string, string>
+		envVars?: Record<string, string>,
+		mode?: ExecutionMode
 	): Promise<SubmitResponse> {
 		const formData = new FormData();
 		formData.append('binary_id', binaryId);
@@ -358,6 +463,9 @@ class ApiClient {
 		if (envVars && Object.keys(envVars).length > 0) {
 			formData.append('env_vars', JSON.stringify(envVars));
 		}
+		if (mode) {
+			formData.append('mode', mode);
+		}
 
 		return this.request('/submit', {
 			method: 'POST',
@@ -373,6 +481,21 @@ class ApiClient {
 		return this.request(`/result/${jobId}`);
 	}
 
+	// Status changes and progress updates as server-sent events; the stream
+	// ends after the completed or failed status
+	statusStream(
+		jobId: string,
+		onStatus: (status: StatusResponse) => void,
+		onProgress: (progress: ProgressUpdate) => void
+	): EventSource {
+		const source = new EventSource(`${API_BASE}/status/${jobId}/stream`, {
+			withCredentials: true
+		});
+		source.addEventListener('status', (e) => onStatus(JSON.parse((e as MessageEvent).data)));
+		source.addEventListener('progress', (e) => onProgress(JSON.parse((e as MessageEvent).data)));
+		return source;
+	}
+
 	// Helper to poll for compile completion
 	async waitForCompile(jobId: string, timeoutMs = 120000): Promise<CompileResultResponse> {
 		const startTime = Date.now();
@@ -475,6 +598,11 @@ class ApiClient {
 		return this.request(`/runs/job/${jobId}`);
 	}
 
+	// Per-function and per-block instruction deltas from one run to another
+	async diffRuns(baseRunId: string, otherRunId: string): Promise<RunDiff> {
+		return this.request(`/runs/${baseRunId}/diff/${otherRunId}`);
+	}
+
 	async listRuns(limit = 50, offset = 0): Promise<RunDetails[]> {
 		return this.request(`/runs?limit=${limit}&offset=${offset}`);
 	}
@@ -1,5 +1,5 @@
 import { writable, derived } from 'svelte/store';
-import type { Language, Optimization } from '$lib/api/client';
+import type { ExecutionMode, Language, Optimization } from '$lib/api/client';
 
 // Language metadata for display
 export interface LanguageInfo {
@@ -472,6 +472,17 @@ export const languageFlags: Record<string, FlagDefinition[]> = {
 			description: 'C++ exceptions',
 			type: 'boolean',
 			default: 'true'
+		},
+		{
+			name: 'runtime',
+			label: 'Runtime',
+			description: 'Minimal: musl + libc++ for cheaper startup',
+			type: 'select',
+			options: [
+				{ value: 'default', label: 'Default (glibc)' },
+				{ value: 'minimal', label: 'Minimal (musl)' }
+			],
+			default: 'default'
 		}
 	],
 	rust: [
@@ -583,6 +594,7 @@ export const currentOptimization = writable<Optimization>('release');
 export const sourceCode = writable<string>(languages[0].defaultCode);
 export const stdin = writable<string>('');
 export const instructionLimit = writable<number>(10_000_000);
+export const executionMode = writable<ExecutionMode>('qemu');
 export const compilerFlags = writable<Record<string, string>>({});
 
 // Derived store for current language info
@@ -1,5 +1,12 @@
 import { writable, derived } from 'svelte/store';
-import { api, type ExecutionResult, type CompileResultResponse } from '$lib/api/client';
+import {
+	api,
+	type ExecutionMode,
+	type ExecutionResult,
+	type CompileResultResponse,
+	type ProgressUpdate,
+	type StatusResponse
+} from '$lib/api/client';
 
 export type JobPhase = 'idle' | 'compiling' | 'running' | 'completed' | 'error';
 
@@ -12,6 +19,7 @@ export interface JobState {
 	error: string | null;
 	compilePosition: number | null;
 	executePosition: number | null;
+	progress: ProgressUpdate | null;
 }
 
 const initialState: JobState = {
@@ -22,7 +30,8 @@ const initialState: JobState = {
 	executeResult: null,
 	error: null,
 	compilePosition: null,
-	executePosition: null
+	executePosition: null,
+	progress: null
 };
 
 function createJobStore() {
@@ -41,7 +50,8 @@ function createJobStore() {
 			optimization: string,
 			instructionLimit: number,
 			stdin: string,
-			flags: Record<string, string> = {}
+			flags: Record<string, string> = {},
+			mode: ExecutionMode = 'qemu'
 		) {
 			// Reset state
 			set({
@@ -51,11 +61,13 @@ function createJobStore() {
 
 			try {
 				// Step 1: Submit compile job
+				// A PGO build trains on the stdin it is about to run with
 				const compileResponse = await api.compile(
 					sourceCode,
 					language as any,
 					optimization as any,
-					flags
+					flags,
+					optimization === 'pgo' ? [stdin] : []
 				);
 
 				update((s) => ({
@@ -77,7 +89,10 @@ function createJobStore() {
 				const submitResponse = await api.submit(
 					compileResult.binary_id,
 					instructionLimit,
-					stdin || undefined
+					stdin || undefined,
+					undefined,
+					undefined,
+					mode
 				);
 
 				update((s) => ({
@@ -133,7 +148,17 @@ function createJobStore() {
 			throw new Error('Compile timeout');
 		},
 
+		// Follows the job's status stream, falling back to polling when the
+		// stream cannot be opened or drops
 		async pollExecute(jobId: string): Promise<ExecutionResult> {
+			const status = await this.streamExecute(jobId).catch(() => null);
+			if (status?.status === 'completed') {
+				return api.result(jobId);
+			}
+			if (status?.status === 'failed') {
+				throw new Error(status.error || 'Execution failed');
+			}
+
 			const timeout = 60000;
 			const startTime = Date.now();
 
@@ -157,6 +182,27 @@ function createJobStore() {
 			}
 
 			throw new Error('Execution timeout');
+		},
+
+		// Resolves with the final status, or null if the stream dropped first
+		streamExecute(jobId: string): Promise<StatusResponse | null> {
+			return new Promise((resolve) => {
+				const source = api.statusStream(
+					jobId,
+					(status) => {
+						update((s) => ({ ...s, executePosition: status.position }));
+						if (status.status === 'completed' || status.status === 'failed') {
+							source.close();
+							resolve(status);
+						}
+					},
+					(progress) => update((s) => ({ ...s, progress }))
+				);
+				source.onerror = () => {
+					source.close();
+					resolve(null);
+				};
+			});
 		}
 	};
 }
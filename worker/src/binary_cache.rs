@@ -0,0 +1,247 @@
+//! Worker-local, size-bounded LRU cache of job binaries on disk.
+//!
+//! Binary ids are content hashes (`sha256-<hex>`), so a cached file can never
+//! go stale and only eviction removes it. Files are stored executable so the
+//! sandbox can bind-mount them instead of a per-job temp copy. Each job gets
+//! its own hard link to the file: eviction can remove the cached name between
+//! a lookup and the mount, but not a job's link.
+
+use serde::{de::DeserializeOwned, Serialize};
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::os::unix::fs::PermissionsExt;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+use tracing::{info, warn};
+use uuid::Uuid;
+
+struct Entry {
+    size: u64,
+    last_used: u64,
+}
+
+struct State {
+    entries: HashMap<String, Entry>,
+    total_bytes: u64,
+    // Monotonic use counter standing in for access time
+    tick: u64,
+}
+
+/// A job's hard link to a cached binary, removed when dropped
+pub struct CachedFile {
+    path: PathBuf,
+}
+
+impl std::ops::Deref for CachedFile {
+    type Target = Path;
+
+    fn deref(&self) -> &Path {
+        &self.path
+    }
+}
+
+impl Drop for CachedFile {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.path);
+    }
+}
+
+pub struct BinaryCache {
+    dir: PathBuf,
+    max_bytes: u64,
+    state: Mutex<State>,
+}
+
+/// Only content-addressed ids are cached, which also keeps ids safe as file names
+fn is_cacheable(binary_id: &str) -> bool {
+    binary_id
+        .strip_prefix("sha256-")
+        .map(|hex| hex.len() == 64 && hex.bytes().all(|b| b.is_ascii_digit() || (b'a'..=b'f').contains(&b)))
+        .unwrap_or(false)
+}
+
+impl BinaryCache {
+    /// Open the cache directory, adopting files left by a previous run in
+    /// modification-time order and removing partial writes
+    pub fn open(dir: PathBuf, max_bytes: u64) -> std::io::Result<Self> {
+        std::fs::create_dir_all(&dir)?;
+
+        let mut found = Vec::new();
+        for entry in std::fs::read_dir(&dir)? {
+            let entry = entry?;
+            let name = entry.file_name().to_string_lossy().into_owned();
+            if name.contains(".tmp-") || name.contains(".job-") {
+                let _ = std::fs::remove_file(entry.path());
+                continue;
+            }
+            if !is_cacheable(&name) {
+                continue;
+            }
+            let meta = entry.metadata()?;
+            found.push((meta.modified().ok(), name, meta.len()));
+        }
+        found.sort();
+
+        let mut state = State {
+            entries: HashMap::new(),
+            total_bytes: 0,
+            tick: 0,
+        };
+        for (_, name, size) in found {
+            state.tick += 1;
+            state.total_bytes += size;
+            state.entries.insert(name, Entry { size, last_used: state.tick });
+        }
+
+        info!(
+            "Binary cache at {} ({} binaries, {} MB of {} MB)",
+            dir.display(),
+            state.entries.len(),
+            state.total_bytes / (1024 * 1024),
+            max_bytes / (1024 * 1024)
+        );
+
+        let cache = Self {
+            dir,
+            max_bytes,
+            state: Mutex::new(state),
+        };
+        cache.evict(None);
+        Ok(cache)
+    }
+
+    fn binary_path(&self, binary_id: &str) -> PathBuf {
+        self.dir.join(binary_id)
+    }
+
+    fn metadata_path(&self, binary_id: &str) -> PathBuf {
+        self.dir.join(format!("{}.meta.json", binary_id))
+    }
+
+    /// Hard-link a cached binary for one job. Called with the state locked,
+    /// so eviction cannot remove the file first.
+    fn link(&self, binary_id: &str) -> std::io::Result<CachedFile> {
+        let path = self.dir.join(format!("{}.job-{}", binary_id, Uuid::new_v4()));
+        std::fs::hard_link(self.binary_path(binary_id), &path)?;
+        Ok(CachedFile { path })
+    }
+
+    /// Cached binary contents and the job's link to the cached (executable) file
+    pub async fn get(&self, binary_id: &str) -> Option<(Vec<u8>, CachedFile)> {
+        let linked = {
+            let mut state = self.state.lock().unwrap();
+            state.tick += 1;
+            let tick = state.tick;
+            state.entries.get_mut(binary_id)?.last_used = tick;
+            self.link(binary_id)
+        };
+
+        let read = match linked {
+            Ok(file) => tokio::fs::read(&*file).await.map(|data| (data, file)),
+            Err(e) => Err(e),
+        };
+        match read {
+            Ok(found) => Some(found),
+            Err(e) => {
+                warn!(binary_id, "Dropping unreadable cached binary: {}", e);
+                self.remove(binary_id);
+                None
+            }
+        }
+    }
+
+    /// Store a freshly fetched binary, evicting least recently used ones to stay
+    /// under the size bound. Returns the job's link to the cached file.
+    pub async fn insert(&self, binary_id: &str, data: &[u8]) -> Result<CachedFile, String> {
+        if !is_cacheable(binary_id) {
+            return Err(format!("Binary id {} is not a content hash", binary_id));
+        }
+        if format!("sha256-{}", hex::encode(Sha256::digest(data))) != binary_id {
+            return Err(format!("Binary content does not match id {}", binary_id));
+        }
+
+        write_atomic(&self.binary_path(binary_id), data, 0o755).await?;
+
+        let linked = {
+            let mut state = self.state.lock().unwrap();
+            state.tick += 1;
+            let tick = state.tick;
+            let size = data.len() as u64;
+            if let Some(old) = state.entries.insert(binary_id.to_string(), Entry { size, last_used: tick }) {
+                state.total_bytes -= old.size;
+            }
+            state.total_bytes += size;
+            self.link(binary_id)
+        };
+        self.evict(Some(binary_id));
+
+        linked.map_err(|e| format!("Failed to link cached binary: {}", e))
+    }
+
+    pub async fn get_metadata<T: DeserializeOwned>(&self, binary_id: &str) -> Option<T> {
+        if !self.state.lock().unwrap().entries.contains_key(binary_id) {
+            return None;
+        }
+        let data = tokio::fs::read(self.metadata_path(binary_id)).await.ok()?;
+        serde_json::from_slice(&data).ok()
+    }
+
+    /// Store metadata next to an already cached binary
+    pub async fn insert_metadata<T: Serialize>(&self, binary_id: &str, metadata: &T) -> Result<(), String> {
+        if !self.state.lock().unwrap().entries.contains_key(binary_id) {
+            return Ok(());
+        }
+        let data = serde_json::to_vec(metadata).map_err(|e| format!("Failed to serialize metadata: {}", e))?;
+        write_atomic(&self.metadata_path(binary_id), &data, 0o644).await
+    }
+
+    fn remove(&self, binary_id: &str) {
+        let mut state = self.state.lock().unwrap();
+        if let Some(entry) = state.entries.remove(binary_id) {
+            state.total_bytes -= entry.size;
+        }
+        // A sandbox still bind-mounting the file keeps its inode alive
+        let _ = std::fs::remove_file(self.binary_path(binary_id));
+        let _ = std::fs::remove_file(self.metadata_path(binary_id));
+    }
+
+    /// Evict least recently used binaries until under the bound, never `keep`
+    fn evict(&self, keep: Option<&str>) {
+        let mut state = self.state.lock().unwrap();
+        while state.total_bytes > self.max_bytes {
+            let victim = state
+                .entries
+                .iter()
+                .filter(|(id, _)| Some(id.as_str()) != keep)
+                .min_by_key(|(_, e)| e.last_used)
+                .map(|(id, _)| id.clone());
+            let Some(victim) = victim else { break };
+
+            if let Some(entry) = state.entries.remove(&victim) {
+                state.total_bytes -= entry.size;
+            }
+            let _ = std::fs::remove_file(self.binary_path(&victim));
+            let _ = std::fs::remove_file(self.metadata_path(&victim));
+        }
+    }
+}
+
+/// Write via a temp file and rename so readers never see a partial file
+async fn write_atomic(path: &Path, data: &[u8], mode: u32) -> Result<(), String> {
+    let tmp = path.with_file_name(format!(
+        "{}.tmp-{}",
+        path.file_name().unwrap_or_default().to_string_lossy(),
+        Uuid::new_v4()
+    ));
+
+    tokio::fs::write(&tmp, data)
+        .await
+        .map_err(|e| format!("Failed to write cache file: {}", e))?;
+    tokio::fs::set_permissions(&tmp, std::fs::Permissions::from_mode(mode))
+        .await
+        .map_err(|e| format!("Failed to set permissions: {}", e))?;
+    tokio::fs::rename(&tmp, path).await.map_err(|e| {
+        let _ = std::fs::remove_file(&tmp);
+        format!("Failed to move cache file into place: {}", e)
+    })
+}
@@ -1,26 +1,62 @@
-use async_nats::jetstream::{self, consumer::PullConsumer, kv::Store};
+mod binary_cache;
+mod metrics;
+
+use async_nats::jetstream::{self, consumer::PullConsumer, kv::Store, AckKind};
+use binary_cache::{BinaryCache, CachedFile};
 use base64::{engine::general_purpose::STANDARD as BASE64, Engine};
 use chrono::{DateTime, Utc};
 use futures::StreamExt;
 use regex::bytes::Regex;
 use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
 use std::env;
 use std::os::unix::fs::PermissionsExt;
-use std::sync::LazyLock;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, LazyLock, Mutex};
 use std::time::{Duration, Instant};
-use tempfile::NamedTempFile;
-use tokio::io::AsyncWriteExt;
+use tempfile::{NamedTempFile, TempDir};
+use tokio::io::{AsyncBufReadExt, AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::net::TcpStream;
 use tokio::process::Command;
-use tracing::{error, info};
+use tokio::sync::{OwnedSemaphorePermit, Semaphore, SemaphorePermit};
+use tracing::{error, info, warn};
 use uuid::Uuid;
 
 const JOBS_STREAM: &str = "JOBS";
 const JOBS_KV: &str = "jobs";
 const RESULTS_KV: &str = "results";
+const EXEC_CACHE_KV: &str = "exec_cache";
+/// Key in EXEC_CACHE_KV naming the sandbox image version that cache keys are built with
+const SANDBOX_VERSION_KEY: &str = "sandbox_version";
+/// Empty-program instruction counts, keyed by sandbox version and baseline binary
+const BASELINES_KV: &str = "baselines";
+/// Baselines are empty programs; anything near this is not one
+const BASELINE_INSTRUCTION_LIMIT: u64 = 1_000_000_000;
 
 static STATS_REGEX: LazyLock<Regex> =
     LazyLock::new(|| Regex::new(r"\n(\{[^\n]+\})\n?$").unwrap());
 
+/// Stats record the plugin writes to its stats file (see STATS_MAGIC in
+/// sandbox/plugin/sandbox.c): magic, version, header size, nonce, payload length
+const STATS_MAGIC: &[u8; 8] = b"CTFSTATS";
+const STATS_VERSION: u32 = 1;
+const STATS_HEADER_SIZE: usize = 40;
+/// The guest can write the stats file too; a plugin record never gets near this
+const MAX_STATS_SIZE: u64 = 64 * 1024 * 1024;
+
+/// Sample the plugin overwrites its progress file with every PROGRESS million
+/// instructions (see PROGRESS_MAGIC in sandbox/plugin/sandbox.c)
+const PROGRESS_MAGIC: &[u8; 8] = b"CTFPROG\0";
+const PROGRESS_VERSION: u32 = 1;
+const PROGRESS_SAMPLE_SIZE: usize = 96;
+/// Largest progress frame the runner sends; longer files are the guest's
+const MAX_PROGRESS_SIZE: usize = 4096;
+/// Running jobs' progress is published on `progress.<job id>`
+const PROGRESS_SUBJECT: &str = "progress";
+/// How often a `docker run` sandbox's progress file is read
+const PROGRESS_POLL: Duration = Duration::from_secs(1);
+
 #[derive(Debug, Clone, Serialize, Deserialize)]
 struct Job {
     id: Uuid,
@@ -36,6 +72,42 @@ struct Job {
     network_enabled: bool,
     #[serde(default)]
     env_vars: std::collections::HashMap<String, String>,
+    /// Multi-input job: run the binary once per entry (`stdin` is ignored)
+    #[serde(default)]
+    stdin_batch: Vec<Vec<u8>>,
+    #[serde(default)]
+    mode: ExecMode,
+}
+
+/// How a job is executed: emulated with exact counts, or natively under
+/// hardware counters for quick, unscored runs
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+enum ExecMode {
+    #[default]
+    Qemu,
+    Native,
+}
+
+/// Execution cache entry; `job_id` is the job the result was first produced
+/// (and persisted as a run) under
+#[derive(Debug, Serialize, Deserialize)]
+struct CachedExecution {
+    job_id: Uuid,
+    result: ExecutionResult,
+}
+
+/// One case of a multi-input job, with the per-case id its run was persisted under
+#[derive(Debug, Serialize)]
+struct BatchCaseResult {
+    job_id: Uuid,
+    result: Option<ExecutionResult>,
+    error: Option<String>,
+}
+
+#[derive(Debug, Serialize)]
+struct BatchResult {
+    cases: Vec<BatchCaseResult>,
 }
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
@@ -56,9 +128,23 @@ struct JobMetadata {
     error: Option<String>,
 }
 
-#[derive(Debug, Deserialize)]
+#[derive(Debug, Default, Deserialize)]
 struct PluginStats {
     instructions: u64,
+    #[serde(default)]
+    mode: Option<String>,
+    #[serde(default)]
+    cycles: Option<u64>,
+    #[serde(default)]
+    cycles_estimate: Option<u64>,
+    #[serde(default)]
+    loads: Option<u64>,
+    #[serde(default)]
+    stores: Option<u64>,
+    #[serde(default)]
+    l1_misses: Option<u64>,
+    #[serde(default)]
+    l2_misses: Option<u64>,
     memory_peak_kb: u64,
     #[serde(default)]
     memory_rss_kb: u64,
@@ -79,6 +165,9 @@ struct PluginStats {
     guest_mmap_peak: u64,
     #[serde(default)]
     guest_heap_bytes: u64,
+    /// Peak pages the guest touched and still had mapped, with RSS=on
+    #[serde(default)]
+    guest_rss_peak_bytes: Option<u64>,
     limit_reached: bool,
     #[serde(default)]
     syscalls: u64,
@@ -86,11 +175,85 @@ struct PluginStats {
     syscall_cost: u64,
     #[serde(default)]
     syscall_breakdown: std::collections::HashMap<String, u64>,
+    #[serde(default)]
+    syscall_cost_breakdown: std::collections::HashMap<String, u64>,
+    #[serde(default)]
+    thread_breakdown: Vec<ThreadStats>,
+    #[serde(default)]
+    roi_instructions: Option<u64>,
+    #[serde(default)]
+    roi_regions: u64,
+    #[serde(default)]
+    profile: Vec<BlockProfile>,
+    #[serde(default)]
+    functions: Vec<FunctionProfile>,
+    #[serde(default)]
+    emulation: Option<EmulationStats>,
+    #[serde(default)]
+    syscall_log: Option<String>,
+}
+
+/// QEMU's own work during a run, from the plugin: translations and host CPU
+/// time, with translation time extrapolated from sampled translations
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct EmulationStats {
+    pub tb_translated: u64,
+    /// Translations of a block address that was translated before
+    pub tb_retranslated: u64,
+    pub tb_translated_insns: u64,
+    pub tb_avg_insns: f64,
+    pub host_cpu_ns: u64,
+    pub host_translate_ns: u64,
+    pub host_exec_ns: u64,
+    #[serde(default)]
+    pub translate_samples: u64,
+}
+
+/// Per-vCPU (guest thread) counters from the plugin
+#[derive(Debug, Clone, Serialize, Deserialize)]
+struct ThreadStats {
+    vcpu: u32,
+    instructions: u64,
+    syscalls: u64,
+}
+
+/// One translation block from the plugin's profile=on output
+#[derive(Debug, Clone, Serialize, Deserialize)]
+struct BlockProfile {
+    addr: String,
+    len: u64,
+    execs: u64,
+    instructions: u64,
+}
+
+/// Instructions attributed to one function symbol (`[unknown]` outside any)
+#[derive(Debug, Clone, Serialize, Deserialize)]
+struct FunctionProfile {
+    name: String,
+    instructions: u64,
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
 struct ExecutionResult {
     instructions: u64,
+    /// "qemu" (exact, emulated) or "native" (hardware counters)
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    mode: Option<String>,
+    /// Measured user-space cycles, native mode only
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    cycles: Option<u64>,
+    /// Weighted cost from the plugin's cost model, when one is loaded
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    cycles_estimate: Option<u64>,
+    /// Guest memory accesses and the cache model's misses, with MEM=on
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    loads: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    stores: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    l1_misses: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    l2_misses: Option<u64>,
     memory_peak_kb: u64,
     #[serde(default)]
     memory_rss_kb: u64,
@@ -111,6 +274,8 @@ struct ExecutionResult {
     guest_mmap_peak: u64,
     #[serde(default)]
     guest_heap_bytes: u64,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    guest_rss_peak_bytes: Option<u64>,
     limit_reached: bool,
     exit_code: i32,
     stdout: String,
@@ -120,6 +285,34 @@ struct ExecutionResult {
     syscalls: u64,
     #[serde(default)]
     syscall_breakdown: std::collections::HashMap<String, u64>,
+    /// Virtual instructions charged per syscall, when a syscall cost table is loaded
+    #[serde(default, skip_serializing_if = "std::collections::HashMap::is_empty")]
+    syscall_cost_breakdown: std::collections::HashMap<String, u64>,
+    #[serde(default)]
+    thread_breakdown: Vec<ThreadStats>,
+    /// Instructions minus the empty-program baseline for the binary's runtime
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    instructions_net: Option<u64>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    baseline_instructions: Option<u64>,
+    /// Instructions inside ROI markers, when the guest has any
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    roi_instructions: Option<u64>,
+    #[serde(default)]
+    roi_regions: u64,
+    /// Hottest translation blocks, present when the sandbox runs with PROFILE=on
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    profile: Vec<BlockProfile>,
+    /// Instructions per function symbol, alongside `profile`
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    functions: Vec<FunctionProfile>,
+    /// Emulator overhead of the run, QEMU mode only
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    emulation: Option<EmulationStats>,
+    /// Base64 log of the network, random and clock syscall results of a
+    /// network-enabled run, for an offline re-run (SYSCALL_REPLAY)
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    syscall_log: Option<String>,
 }
 
 struct Config {
@@ -129,6 +322,61 @@ struct Config {
     memory_limit_mb: u32,
     timeout_sec: u64,
     job_ttl_seconds: u64,
+    /// host:port of a long-lived sandbox runner; unset runs `docker run` per job
+    sandbox_runner_addr: Option<String>,
+    /// Shared secret the runner requires on every request (its RUNNER_TOKEN)
+    sandbox_runner_token: String,
+    /// CPUs sandboxes run on, one at a time each (CPU_SLOTS, or the first
+    /// WORKER_CONCURRENCY CPUs the worker may run on)
+    cpu_slots: Vec<usize>,
+    /// Pin each sandbox to its slot's CPU
+    cpu_pinning: bool,
+    /// On-disk LRU cache of fetched binaries; must be visible to the docker
+    /// daemon at the same path (shared /tmp). None disables the cache.
+    binary_cache_dir: Option<std::path::PathBuf>,
+    binary_cache_max_mb: u64,
+    exec_cache_ttl_seconds: u64,
+    /// Image for native-mode jobs (sandbox/Dockerfile.native); None runs
+    /// them on QEMU like any other job
+    native_sandbox_image: Option<String>,
+    /// Seconds between re-running a recent native job on QEMU to compare
+    /// counts (0 disables)
+    native_cross_check_sec: u64,
+    /// Native/QEMU instruction difference, in percent, that is logged as drift
+    native_drift_warn_pct: f64,
+    /// Millions of instructions between a running job's progress samples
+    /// (0 disables them)
+    progress_every_m: u64,
+    /// Where /metrics is served; None disables it
+    metrics_addr: Option<String>,
+    /// Retranslations in one run that are logged and counted as suspect
+    retranslation_warn: u64,
+}
+
+/// CPUs this process may run on (its sched_getaffinity mask, which a
+/// cgroup cpuset narrows too), read from /proc/self/status. Falls back to
+/// 0..available_parallelism where that is unavailable.
+fn allowed_cpus() -> Vec<usize> {
+    let status = std::fs::read_to_string("/proc/self/status").unwrap_or_default();
+    let cpus: Vec<usize> = status
+        .lines()
+        .find_map(|line| line.strip_prefix("Cpus_allowed_list:"))
+        .map(|list| {
+            list.trim()
+                .split(',')
+                .filter_map(|range| match range.split_once('-') {
+                    Some((lo, hi)) => Some(lo.parse().ok()?..=hi.parse().ok()?),
+                    None => range.parse().ok().map(|cpu| cpu..=cpu),
+                })
+                .flatten()
+                .collect()
+        })
+        .unwrap_or_default();
+    if cpus.is_empty() {
+        (0..std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1)).collect()
+    } else {
+        cpus
+    }
 }
 
 impl Config {
@@ -149,12 +397,65 @@ impl Config {
                 .ok()
                 .and_then(|s| s.parse().ok())
                 .unwrap_or(3600),
+            sandbox_runner_addr: env::var("SANDBOX_RUNNER_ADDR").ok().filter(|s| !s.is_empty()),
+            sandbox_runner_token: env::var("SANDBOX_RUNNER_TOKEN").unwrap_or_default(),
+            cpu_slots: env::var("CPU_SLOTS")
+                .ok()
+                .map(|s| s.split(',').filter_map(|c| c.trim().parse().ok()).collect::<Vec<usize>>())
+                .filter(|cpus| !cpus.is_empty())
+                .unwrap_or_else(|| {
+                    let allowed = allowed_cpus();
+                    let concurrency = env::var("WORKER_CONCURRENCY")
+                        .ok()
+                        .and_then(|s| s.parse().ok())
+                        .filter(|&n: &usize| n > 0)
+                        .unwrap_or(allowed.len());
+                    allowed.into_iter().cycle().take(concurrency).collect()
+                }),
+            cpu_pinning: env::var("CPU_PINNING")
+                .map(|s| !matches!(s.as_str(), "0" | "false" | "off"))
+                .unwrap_or(true),
+            binary_cache_dir: match env::var("BINARY_CACHE_DIR") {
+                Ok(dir) if dir.is_empty() => None,
+                Ok(dir) => Some(dir.into()),
+                Err(_) => Some("/tmp/binary-cache".into()),
+            },
+            binary_cache_max_mb: env::var("BINARY_CACHE_MAX_MB")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(2048),
+            exec_cache_ttl_seconds: env::var("EXEC_CACHE_TTL_SECONDS")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(7 * 86400),
+            native_sandbox_image: env::var("NATIVE_SANDBOX_IMAGE").ok().filter(|s| !s.is_empty()),
+            native_cross_check_sec: env::var("NATIVE_CROSS_CHECK_SEC")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(3600),
+            native_drift_warn_pct: env::var("NATIVE_DRIFT_WARN_PCT")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(5.0),
+            progress_every_m: env::var("PROGRESS_EVERY_M")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(100),
+            metrics_addr: match env::var("METRICS_ADDR") {
+                Ok(addr) if addr.is_empty() => None,
+                Ok(addr) => Some(addr),
+                Err(_) => Some("0.0.0.0:9100".to_string()),
+            },
+            retranslation_warn: env::var("RETRANSLATION_WARN")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(10_000),
         }
     }
 }
 
-async fn execute_sandbox(job: &Job, binary: &[u8], config: &Config) -> Result<ExecutionResult, String> {
-    // Write binary to temp file
+/// Write the binary to an executable temp file for mounting into the sandbox
+async fn write_temp_binary(binary: &[u8]) -> Result<NamedTempFile, String> {
     let temp_file = NamedTempFile::new().map_err(|e| format!("Failed to create temp file: {}", e))?;
     let binary_path = temp_file.path().to_path_buf();
 
@@ -180,6 +481,75 @@ async fn execute_sandbox(job: &Job, binary: &[u8], config: &Config) -> Result<Ex
         .await
         .map_err(|e| format!("Failed to set permissions: {}", e))?;
 
+    Ok(temp_file)
+}
+
+/// Run one job in the sandbox, pinned to `cpu` when given. `cached_path` is
+/// the job's link to the binary in the binary cache, mounted as-is when present.
+/// `progress` receives the plugin's progress samples while the job runs.
+async fn execute_sandbox(
+    job: &Job,
+    binary: &[u8],
+    cached_path: Option<&Path>,
+    config: &Config,
+    cpu: Option<usize>,
+    progress: Option<&ProgressReporter<'_>>,
+) -> Result<ExecutionResult, String> {
+    let result = run_sandbox(job, binary, cached_path, config, cpu, progress).await;
+    if let Some((instructions, emulation)) = result.as_ref().ok().and_then(|r| Some((r.instructions, r.emulation.as_ref()?))) {
+        // Many re-translations mean self-modifying code or JIT churn, which
+        // costs the host far more than the guest instructions show
+        let heavy = config.retranslation_warn > 0 && emulation.tb_retranslated > config.retranslation_warn;
+        if heavy {
+            warn!(
+                job_id = %job.id,
+                binary_id = %job.binary_id,
+                tb_translated = emulation.tb_translated,
+                tb_retranslated = emulation.tb_retranslated,
+                host_translate_ns = emulation.host_translate_ns,
+                "Run re-translated many blocks"
+            );
+        }
+        metrics::METRICS.record(instructions, emulation, heavy);
+    }
+    result
+}
+
+async fn run_sandbox(
+    job: &Job,
+    binary: &[u8],
+    cached_path: Option<&Path>,
+    config: &Config,
+    cpu: Option<usize>,
+    progress: Option<&ProgressReporter<'_>>,
+) -> Result<ExecutionResult, String> {
+    let native_image = match job.mode {
+        ExecMode::Native => config.native_sandbox_image.as_deref(),
+        ExecMode::Qemu => None,
+    };
+    if let (None, Some(addr)) = (native_image, &config.sandbox_runner_addr) {
+        return execute_runner(job, binary, config, addr, cpu, progress).await;
+    }
+
+    // Already on disk and executable: skip the temp copy
+    let _temp_file;
+    let binary_path = match cached_path {
+        Some(path) => path.to_path_buf(),
+        None => {
+            let temp_file = write_temp_binary(binary).await?;
+            let path = temp_file.path().to_path_buf();
+            _temp_file = temp_file;
+            path
+        }
+    };
+
+    // The native launcher has no stats file and prints its stats line itself
+    let nonce = *Uuid::new_v4().as_bytes();
+    let stats_dir = match native_image {
+        Some(_) => None,
+        None => Some(create_stats_dir(&nonce, progress.map(|p| &p.nonce)).await?),
+    };
+
     let start = Instant::now();
 
     // Build docker command
@@ -192,9 +562,21 @@ async fn execute_sandbox(job: &Job, binary: &[u8], config: &Config) -> Result<Ex
         &format!("--memory-swap={}m", config.memory_limit_mb),
     ]);
 
-    // Only disable network if not explicitly enabled
+    // Only disable network if not explicitly enabled; networked runs log
+    // what they saw so they can be re-verified without it
     if !job.network_enabled {
         cmd.arg("--network=none");
+    } else if native_image.is_none() {
+        cmd.args(["-e", "SYSCALL_RECORD=on"]);
+    }
+
+    if let Some(cpu) = cpu {
+        cmd.arg(format!("--cpuset-cpus={}", cpu));
+    }
+
+    // The native launcher opens the counters and then drops to nobody
+    if native_image.is_some() {
+        cmd.args(["--cap-drop=ALL", "--cap-add=PERFMON", "--cap-add=SETUID", "--cap-add=SETGID"]);
     }
 
     cmd.args([
@@ -206,15 +588,32 @@ async fn execute_sandbox(job: &Job, binary: &[u8], config: &Config) -> Result<Ex
     ]);
 
     // Pass environment variables from challenge
-    for (key, value) in &job.env_vars {
+    for (key, value) in job_env(job) {
         cmd.arg("-e");
         cmd.arg(format!("{}={}", key, value));
     }
 
+    if let Some(dir) = &stats_dir {
+        cmd.args([
+            "-v",
+            &format!("{}:/stats", dir.path().display()),
+            "-e",
+            "STATS_FILE=/stats/stats",
+        ]);
+        if let Some(reporter) = progress {
+            cmd.args([
+                "-e",
+                "PROGRESS_FILE=/stats/progress",
+                "-e",
+                &format!("PROGRESS={}", reporter.every_m),
+            ]);
+        }
+    }
+
     cmd.args([
         "-v",
         &format!("{}:/work/binary:ro", binary_path.display()),
-        &config.sandbox_image,
+        native_image.unwrap_or(&config.sandbox_image),
     ]);
 
     cmd.stdin(std::process::Stdio::piped());
@@ -232,12 +631,21 @@ async fn execute_sandbox(job: &Job, binary: &[u8], config: &Config) -> Result<Ex
         drop(child.stdin.take());
     }
 
-    // Wait with timeout
-    let result = tokio::time::timeout(
+    // Wait with timeout, passing progress on meanwhile
+    let wait = tokio::time::timeout(
         Duration::from_secs(config.timeout_sec),
         child.wait_with_output(),
-    )
-    .await;
+    );
+    let result = match (progress, &stats_dir) {
+        (Some(reporter), Some(dir)) => {
+            let path = dir.path().join("progress");
+            tokio::select! {
+                result = wait => result,
+                _ = reporter.watch(&path) => unreachable!("progress watch never returns"),
+            }
+        }
+        _ => wait.await,
+    };
 
     let execution_time_ms = start.elapsed().as_millis() as u64;
 
@@ -247,52 +655,398 @@ async fn execute_sandbox(job: &Job, binary: &[u8], config: &Config) -> Result<Ex
         Err(_) => return Err(format!("Execution timed out after {} seconds", config.timeout_sec)),
     };
 
-    // Parse plugin stats from stderr
-    let mut stderr = output.stderr;
-    let stats = if let Some(captures) = STATS_REGEX.captures(&stderr) {
-        let json_match = captures.get(1).unwrap();
-        let stats: PluginStats = serde_json::from_slice(json_match.as_bytes()).unwrap_or(PluginStats {
-            instructions: 0,
-            memory_peak_kb: 0,
-            memory_rss_kb: 0,
-            memory_hwm_kb: 0,
-            memory_data_kb: 0,
-            memory_stack_kb: 0,
-            io_read_bytes: 0,
-            io_write_bytes: 0,
-            guest_mmap_bytes: 0,
-            guest_mmap_peak: 0,
-            guest_heap_bytes: 0,
-            limit_reached: false,
-            syscalls: 0,
-            syscall_cost: 0,
-            syscall_breakdown: std::collections::HashMap::new(),
-        });
-        // Remove stats JSON from stderr
-        stderr.truncate(json_match.start() - 1);
-        stats
-    } else {
-        PluginStats {
-            instructions: 0,
-            memory_peak_kb: 0,
-            memory_rss_kb: 0,
-            memory_hwm_kb: 0,
-            memory_data_kb: 0,
-            memory_stack_kb: 0,
-            io_read_bytes: 0,
-            io_write_bytes: 0,
-            guest_mmap_bytes: 0,
-            guest_mmap_peak: 0,
-            guest_heap_bytes: 0,
-            limit_reached: false,
-            syscalls: 0,
-            syscall_cost: 0,
-            syscall_breakdown: std::collections::HashMap::new(),
+    let record = match &stats_dir {
+        Some(dir) => Some(read_stats_file(&dir.path().join("stats")).await),
+        None => None,
+    };
+    let stats = match &record {
+        Some(record) => StatsChannel::Record(stats_payload(record, &nonce)),
+        None => StatsChannel::Stderr,
+    };
+
+    build_result(
+        output.status.code().unwrap_or(-1),
+        &output.stdout,
+        output.stderr,
+        stats,
+        execution_time_ms,
+    )
+}
+
+/// Sandbox env this worker sets itself (or leaves unset on purpose); a job's
+/// env must not override them, e.g. to move the stats record or lift the limit
+const RESERVED_ENV: &[&str] = &[
+    "LIMIT", "STATS_FILE", "PROGRESS_FILE", "PROGRESS", "COUNT_MODE", "SYSCALL_RECORD", "SYSCALL_REPLAY",
+];
+
+/// The job's env vars the sandbox gets: all but RESERVED_ENV
+fn job_env(job: &Job) -> impl Iterator<Item = (&String, &String)> {
+    job.env_vars.iter().filter(|(key, _)| !RESERVED_ENV.contains(&key.as_str()))
+}
+
+/// Per-job directory mounted at /stats, with the stats file seeded with the
+/// nonce the plugin must put in its record, and the progress file with the
+/// one for its samples when progress is wanted
+async fn create_stats_dir(nonce: &[u8; 16], progress_nonce: Option<&[u8; 16]>) -> Result<TempDir, String> {
+    let dir = tempfile::tempdir().map_err(|e| format!("Failed to create stats dir: {}", e))?;
+    seed_file(&dir.path().join("stats"), nonce).await?;
+    if let Some(progress_nonce) = progress_nonce {
+        seed_file(&dir.path().join("progress"), progress_nonce).await?;
+    }
+    Ok(dir)
+}
+
+/// A file holding only `nonce`, writable by the sandbox's unprivileged user
+async fn seed_file(path: &Path, nonce: &[u8; 16]) -> Result<(), String> {
+    tokio::fs::write(path, nonce)
+        .await
+        .map_err(|e| format!("Failed to write {}: {}", path.display(), e))?;
+    tokio::fs::set_permissions(path, std::fs::Permissions::from_mode(0o666))
+        .await
+        .map_err(|e| format!("Failed to set permissions: {}", e))
+}
+
+async fn read_stats_file(path: &Path) -> Vec<u8> {
+    let mut data = Vec::new();
+    if let Ok(file) = tokio::fs::File::open(path).await {
+        let _ = file.take(MAX_STATS_SIZE).read_to_end(&mut data).await;
+    }
+    data
+}
+
+/// Where a run's plugin stats come from
+enum StatsChannel<'a> {
+    /// The line at the end of stderr (native launcher, runners without stats files)
+    Stderr,
+    /// The stats record's payload, None when the run left no valid record
+    Record(Option<&'a [u8]>),
+}
+
+/// JSON payload of a stats record, borrowed from `record`, if it is a version
+/// this worker reads and carries the job's nonce
+fn stats_payload<'a>(record: &'a [u8], nonce: &[u8; 16]) -> Option<&'a [u8]> {
+    if record.len() < STATS_HEADER_SIZE || &record[..8] != STATS_MAGIC {
+        return None;
+    }
+    let version = u32::from_le_bytes(record[8..12].try_into().ok()?);
+    let header_size = u32::from_le_bytes(record[12..16].try_into().ok()?) as usize;
+    if version != STATS_VERSION || header_size < STATS_HEADER_SIZE || &record[16..32] != nonce {
+        return None;
+    }
+    let length = usize::try_from(u64::from_le_bytes(record[32..40].try_into().ok()?)).ok()?;
+    record.get(header_size..header_size.checked_add(length)?)
+}
+
+/// One progress sample, as the plugin wrote it
+struct ProgressSample {
+    seq: u64,
+    instructions: u64,
+    syscalls: u64,
+    guest_mmap_bytes: u64,
+    guest_heap_bytes: u64,
+    guest_rss_bytes: u64,
+    elapsed_ns: u64,
+}
+
+/// Progress sample in `data`, if it is a version this worker reads, carries
+/// the job's progress nonce and was not read mid-write
+fn progress_sample(data: &[u8], nonce: &[u8; 16]) -> Option<ProgressSample> {
+    if data.len() < PROGRESS_SAMPLE_SIZE || &data[..8] != PROGRESS_MAGIC {
+        return None;
+    }
+    let version = u32::from_le_bytes(data[8..12].try_into().ok()?);
+    let size = u32::from_le_bytes(data[12..16].try_into().ok()?) as usize;
+    if version != PROGRESS_VERSION || size != PROGRESS_SAMPLE_SIZE || &data[16..32] != nonce {
+        return None;
+    }
+    let word = |offset: usize| u64::from_le_bytes(data[offset..offset + 8].try_into().unwrap());
+    if word(32) != word(88) {
+        return None;
+    }
+    Some(ProgressSample {
+        seq: word(32),
+        instructions: word(40),
+        syscalls: word(48),
+        guest_mmap_bytes: word(56),
+        guest_heap_bytes: word(64),
+        guest_rss_bytes: word(72),
+        elapsed_ns: word(80),
+    })
+}
+
+/// Published on `progress.<job id>` while a job runs. The guest can fake its
+/// samples, so these are for display only and never feed a result.
+#[derive(Debug, Serialize)]
+struct ProgressUpdate {
+    job_id: Uuid,
+    instructions: u64,
+    syscalls: u64,
+    guest_mmap_bytes: u64,
+    guest_heap_bytes: u64,
+    /// Pages touched and still mapped, with RSS=on
+    #[serde(skip_serializing_if = "Option::is_none")]
+    guest_rss_bytes: Option<u64>,
+    /// Since the plugin started, so container startup is left out
+    elapsed_ms: u64,
+    instructions_per_sec: u64,
+    instruction_limit: u64,
+    /// Time until the instruction limit at the average rate so far
+    #[serde(skip_serializing_if = "Option::is_none")]
+    limit_eta_ms: Option<u64>,
+}
+
+/// Forwards one job's progress samples to NATS
+struct ProgressReporter<'a> {
+    nats: &'a async_nats::Client,
+    job_id: Uuid,
+    instruction_limit: u64,
+    every_m: u64,
+    nonce: [u8; 16],
+    /// Samples are rewritten in place; only a newer seq is published
+    last_seq: AtomicU64,
+}
+
+impl<'a> ProgressReporter<'a> {
+    fn new(nats: &'a async_nats::Client, job: &Job, every_m: u64) -> Self {
+        Self {
+            nats,
+            job_id: job.id,
+            instruction_limit: job.instruction_limit,
+            every_m,
+            nonce: *Uuid::new_v4().as_bytes(),
+            last_seq: AtomicU64::new(0),
+        }
+    }
+
+    async fn report(&self, data: &[u8]) {
+        let Some(sample) = progress_sample(data, &self.nonce) else { return };
+        if self.last_seq.fetch_max(sample.seq, Ordering::Relaxed) >= sample.seq {
+            return;
+        }
+
+        let per_sec = match sample.elapsed_ns {
+            0 => 0.0,
+            ns => sample.instructions as f64 * 1e9 / ns as f64,
+        };
+        let left = self.instruction_limit.saturating_sub(sample.instructions);
+        let update = ProgressUpdate {
+            job_id: self.job_id,
+            instructions: sample.instructions,
+            syscalls: sample.syscalls,
+            guest_mmap_bytes: sample.guest_mmap_bytes,
+            guest_heap_bytes: sample.guest_heap_bytes,
+            guest_rss_bytes: (sample.guest_rss_bytes > 0).then_some(sample.guest_rss_bytes),
+            elapsed_ms: sample.elapsed_ns / 1_000_000,
+            instructions_per_sec: per_sec as u64,
+            instruction_limit: self.instruction_limit,
+            limit_eta_ms: (per_sec > 0.0 && left > 0).then(|| (left as f64 * 1000.0 / per_sec) as u64),
+        };
+
+        let payload = match serde_json::to_vec(&update) {
+            Ok(payload) => payload,
+            Err(e) => {
+                warn!(job_id = %self.job_id, "Failed to encode progress: {}", e);
+                return;
+            }
+        };
+        if let Err(e) = self.nats.publish(format!("{}.{}", PROGRESS_SUBJECT, self.job_id), payload.into()).await {
+            warn!(job_id = %self.job_id, "Failed to publish progress: {}", e);
+        }
+    }
+
+    /// Report the samples the plugin writes to `path`; never returns, so runs
+    /// alongside the sandbox until it exits
+    async fn watch(&self, path: &Path) {
+        let mut tick = tokio::time::interval(PROGRESS_POLL);
+        loop {
+            tick.tick().await;
+            let mut data = Vec::new();
+            if let Ok(file) = tokio::fs::File::open(path).await {
+                let _ = file.take(PROGRESS_SAMPLE_SIZE as u64).read_to_end(&mut data).await;
+            }
+            self.report(&data).await;
+        }
+    }
+}
+
+#[derive(Debug, Serialize)]
+struct RunnerRequest<'a> {
+    limit: u64,
+    binary_size: usize,
+    stdin_size: usize,
+    env: &'a std::collections::HashMap<String, String>,
+    network: bool,
+    timeout_sec: u64,
+    cpu: Option<usize>,
+    stats_nonce: String,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    progress_nonce: Option<String>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    progress_every: Option<u64>,
+    token: &'a str,
+}
+
+#[derive(Debug, Deserialize)]
+struct RunnerResponse {
+    exit_code: i32,
+    stdout_size: usize,
+    stderr_size: usize,
+    /// Size of the stats file that follows stderr; absent from runners that
+    /// leave the stats on stderr
+    #[serde(default)]
+    stats_size: Option<usize>,
+    error: Option<String>,
+}
+
+/// Lines the runner answers with: progress frames while the job runs, then
+/// the response
+#[derive(Debug, Deserialize)]
+#[serde(untagged)]
+enum RunnerMessage {
+    Progress { progress_size: usize },
+    Response(RunnerResponse),
+}
+
+/// Run a job on the long-lived sandbox runner (sandbox/runner/runner.py)
+/// instead of starting a fresh container
+async fn execute_runner(
+    job: &Job,
+    binary: &[u8],
+    config: &Config,
+    addr: &str,
+    cpu: Option<usize>,
+    progress: Option<&ProgressReporter<'_>>,
+) -> Result<ExecutionResult, String> {
+    let start = Instant::now();
+    let nonce = *Uuid::new_v4().as_bytes();
+    // The runner records networked runs' syscalls itself (see `network`)
+    let env: std::collections::HashMap<String, String> =
+        job_env(job).map(|(key, value)| (key.clone(), value.clone())).collect();
+
+    let exchange = async {
+        let stream = TcpStream::connect(addr)
+            .await
+            .map_err(|e| format!("Failed to connect to sandbox runner {}: {}", addr, e))?;
+        let (reader, mut writer) = stream.into_split();
+
+        let request = RunnerRequest {
+            limit: job.instruction_limit,
+            binary_size: binary.len(),
+            stdin_size: job.stdin.len(),
+            env: &env,
+            network: job.network_enabled,
+            timeout_sec: config.timeout_sec,
+            cpu,
+            stats_nonce: hex::encode(nonce),
+            progress_nonce: progress.map(|p| hex::encode(p.nonce)),
+            progress_every: progress.map(|p| p.every_m),
+            token: &config.sandbox_runner_token,
+        };
+        let mut header = serde_json::to_vec(&request).map_err(|e| format!("Failed to encode runner request: {}", e))?;
+        header.push(b'\n');
+        writer.write_all(&header).await.map_err(|e| format!("Failed to send runner request: {}", e))?;
+        writer.write_all(binary).await.map_err(|e| format!("Failed to send binary: {}", e))?;
+        writer.write_all(&job.stdin).await.map_err(|e| format!("Failed to send stdin: {}", e))?;
+        writer.flush().await.map_err(|e| format!("Failed to send runner request: {}", e))?;
+
+        let mut reader = BufReader::new(reader);
+        let mut line = Vec::new();
+        let response = loop {
+            line.clear();
+            reader
+                .read_until(b'\n', &mut line)
+                .await
+                .map_err(|e| format!("Failed to read runner response: {}", e))?;
+            let message: RunnerMessage =
+                serde_json::from_slice(&line).map_err(|e| format!("Failed to parse runner response: {}", e))?;
+            match message {
+                RunnerMessage::Progress { progress_size } => {
+                    if progress_size > MAX_PROGRESS_SIZE {
+                        return Err(format!("Runner sent a {} byte progress sample", progress_size));
+                    }
+                    let mut sample = vec![0u8; progress_size];
+                    reader.read_exact(&mut sample).await.map_err(|e| format!("Failed to read progress: {}", e))?;
+                    if let Some(reporter) = progress {
+                        reporter.report(&sample).await;
+                    }
+                }
+                RunnerMessage::Response(response) => break response,
+            }
+        };
+
+        let mut stdout = vec![0u8; response.stdout_size];
+        reader.read_exact(&mut stdout).await.map_err(|e| format!("Failed to read stdout: {}", e))?;
+        let mut stderr = vec![0u8; response.stderr_size];
+        reader.read_exact(&mut stderr).await.map_err(|e| format!("Failed to read stderr: {}", e))?;
+        let mut stats = vec![0u8; response.stats_size.unwrap_or(0).min(MAX_STATS_SIZE as usize)];
+        reader.read_exact(&mut stats).await.map_err(|e| format!("Failed to read stats: {}", e))?;
+
+        Ok::<_, String>((response, stdout, stderr, stats))
+    };
+
+    // Leave the runner a moment past its own timeout to report back
+    let (response, stdout, stderr, stats) =
+        match tokio::time::timeout(Duration::from_secs(config.timeout_sec + 5), exchange).await {
+            Ok(result) => result?,
+            Err(_) => return Err(format!("Execution timed out after {} seconds", config.timeout_sec)),
+        };
+
+    if let Some(error) = response.error {
+        return Err(error);
+    }
+
+    let execution_time_ms = start.elapsed().as_millis() as u64;
+    let channel = match response.stats_size {
+        Some(_) => StatsChannel::Record(stats_payload(&stats, &nonce)),
+        None => StatsChannel::Stderr,
+    };
+    build_result(response.exit_code, &stdout, stderr, channel, execution_time_ms)
+}
+
+/// Parse the plugin stats (splitting the line off stderr when they are there)
+/// and assemble the job result. A run that was given a stats file but left no
+/// readable record there is an error, never a 0-instruction result: the guest
+/// can lose the record on purpose (closing the plugin's fd, SIGKILL).
+fn build_result(
+    exit_code: i32,
+    stdout: &[u8],
+    mut stderr: Vec<u8>,
+    channel: StatsChannel,
+    execution_time_ms: u64,
+) -> Result<ExecutionResult, String> {
+    let stats = match channel {
+        // Guest stderr is left alone: a stats-looking line there is just output
+        StatsChannel::Record(Some(payload)) => serde_json::from_slice(payload).map_err(|e| {
+            warn!("Unreadable sandbox stats record: {}", e);
+            format!("Unreadable sandbox stats record: {}", e)
+        })?,
+        StatsChannel::Record(None) => {
+            warn!("Sandbox left no valid stats record");
+            return Err("Sandbox left no valid stats record".to_string());
+        }
+        StatsChannel::Stderr => {
+            if let Some(captures) = STATS_REGEX.captures(&stderr) {
+                let json_match = captures.get(1).unwrap();
+                let stats: PluginStats =
+                    serde_json::from_slice(json_match.as_bytes()).unwrap_or(PluginStats::default());
+                // Remove stats JSON from stderr
+                stderr.truncate(json_match.start() - 1);
+                stats
+            } else {
+                PluginStats::default()
+            }
         }
     };
 
     Ok(ExecutionResult {
         instructions: stats.instructions,
+        mode: stats.mode,
+        cycles: stats.cycles,
+        cycles_estimate: stats.cycles_estimate,
+        loads: stats.loads,
+        stores: stats.stores,
+        l1_misses: stats.l1_misses,
+        l2_misses: stats.l2_misses,
         memory_peak_kb: stats.memory_peak_kb,
         memory_rss_kb: stats.memory_rss_kb,
         memory_hwm_kb: stats.memory_hwm_kb,
@@ -303,16 +1057,142 @@ async fn execute_sandbox(job: &Job, binary: &[u8], config: &Config) -> Result<Ex
         guest_mmap_bytes: stats.guest_mmap_bytes,
         guest_mmap_peak: stats.guest_mmap_peak,
         guest_heap_bytes: stats.guest_heap_bytes,
+        guest_rss_peak_bytes: stats.guest_rss_peak_bytes,
         limit_reached: stats.limit_reached,
-        exit_code: output.status.code().unwrap_or(-1),
-        stdout: BASE64.encode(&output.stdout),
+        exit_code,
+        stdout: BASE64.encode(stdout),
         stderr: BASE64.encode(&stderr),
         execution_time_ms,
         syscalls: stats.syscalls,
         syscall_breakdown: stats.syscall_breakdown,
+        syscall_cost_breakdown: stats.syscall_cost_breakdown,
+        thread_breakdown: stats.thread_breakdown,
+        instructions_net: None,
+        baseline_instructions: None,
+        roi_instructions: stats.roi_instructions,
+        roi_regions: stats.roi_regions,
+        profile: stats.profile,
+        functions: stats.functions,
+        emulation: stats.emulation,
+        syscall_log: stats.syscall_log,
     })
 }
 
+/// The runner's answer to a version request: image stamp and slot count
+async fn query_runner(config: &Config, addr: &str) -> Option<serde_json::Value> {
+    let stream = TcpStream::connect(addr).await.ok()?;
+    let (reader, mut writer) = stream.into_split();
+    let mut request = serde_json::to_vec(&serde_json::json!({
+        "op": "version",
+        "token": config.sandbox_runner_token,
+    }))
+    .ok()?;
+    request.push(b'\n');
+    writer.write_all(&request).await.ok()?;
+    let mut line = Vec::new();
+    BufReader::new(reader).read_until(b'\n', &mut line).await.ok()?;
+    let response: serde_json::Value = serde_json::from_slice(&line).ok()?;
+    if let Some(error) = response.get("error").and_then(|e| e.as_str()) {
+        error!("Sandbox runner {} refused the version request: {}", addr, error);
+        return None;
+    }
+    Some(response)
+}
+
+/// Version stamp of the sandbox image (/sandbox-version), asked from the
+/// runner or read from the image. A runner's own plugin env (COUNT_MODE,
+/// SYSCALL_COSTS, PROFILE, ...) changes results as much as the image, so it
+/// is part of the version and with it of every cache key. None disables the
+/// execution cache.
+async fn detect_sandbox_version(config: &Config) -> Option<String> {
+    let version = if let Some(addr) = &config.sandbox_runner_addr {
+        let info = query_runner(config, addr).await?;
+        let mut version = info.get("version")?.as_str()?.to_string();
+        if let Some(env) = info.get("env").and_then(|e| e.as_object()).filter(|e| !e.is_empty()) {
+            // serde_json maps are sorted by key
+            let pairs: Vec<String> = env.iter().map(|(k, v)| format!("{}={}", k, v.as_str().unwrap_or_default())).collect();
+            version = format!("{}+{}", version, pairs.join(","));
+        }
+        version
+    } else {
+        let output = Command::new("docker")
+            .args(["run", "--rm", "--network=none", "--entrypoint", "cat", &config.sandbox_image, "/sandbox-version"])
+            .output()
+            .await
+            .ok()?;
+        if !output.status.success() {
+            return None;
+        }
+        String::from_utf8(output.stdout).ok()?.trim().to_string()
+    };
+
+    (!version.is_empty()).then_some(version)
+}
+
+/// Execution cache key: everything that determines the plugin's output. The
+/// runner's own plugin env is part of `sandbox_version`.
+/// Must match `compute_exec_cache_key` in api/src/queue.rs.
+fn compute_exec_cache_key(sandbox_version: &str, job: &Job) -> String {
+    let mut hasher = Sha256::new();
+    hasher.update(sandbox_version.as_bytes());
+    hasher.update(b";");
+    hasher.update(job.binary_id.as_bytes());
+    hasher.update(b";");
+    hasher.update(hex::encode(Sha256::digest(&job.stdin)).as_bytes());
+    hasher.update(b";");
+    hasher.update(job.instruction_limit.to_string().as_bytes());
+    hasher.update(b";");
+    // Sort env vars for consistent hashing
+    let mut env_pairs: Vec<_> = job.env_vars.iter().collect();
+    env_pairs.sort_by_key(|(k, _)| *k);
+    for (k, v) in env_pairs {
+        hasher.update(k.as_bytes());
+        hasher.update(b"=");
+        hasher.update(v.as_bytes());
+        hasher.update(b";");
+    }
+    hex::encode(hasher.finalize())
+}
+
+/// Look up a job in the execution cache. Network-enabled and native jobs are
+/// never cached since their output need not be deterministic.
+async fn check_exec_cache(exec_cache_kv: &Store, sandbox_version: Option<&str>, job: &Job) -> Option<CachedExecution> {
+    if job.network_enabled || job.mode == ExecMode::Native {
+        return None;
+    }
+    let key = compute_exec_cache_key(sandbox_version?, job);
+    let entry = exec_cache_kv.get(&key).await.ok()??;
+    serde_json::from_slice(&entry).ok()
+}
+
+async fn store_exec_cache(
+    exec_cache_kv: &Store,
+    sandbox_version: Option<&str>,
+    job: &Job,
+    result: &ExecutionResult,
+) -> Result<(), String> {
+    let Some(version) = sandbox_version else { return Ok(()) };
+    if job.network_enabled || job.mode == ExecMode::Native {
+        return Ok(());
+    }
+
+    let entry = CachedExecution {
+        job_id: job.id,
+        result: result.clone(),
+    };
+    exec_cache_kv
+        .put(
+            &compute_exec_cache_key(version, job),
+            serde_json::to_vec(&entry)
+                .map_err(|e| format!("Failed to serialize cache entry: {}", e))?
+                .into(),
+        )
+        .await
+        .map_err(|e| format!("Failed to store cache entry: {}", e))?;
+
+    Ok(())
+}
+
 async fn update_job_status(
     jobs_kv: &Store,
     job_id: &Uuid,
@@ -359,7 +1239,7 @@ async fn update_job_status(
 async fn store_job_result(
     results_kv: &Store,
     job_id: &Uuid,
-    result: &ExecutionResult,
+    result: &impl Serialize,
 ) -> Result<(), String> {
     let key = job_id.to_string();
 
@@ -407,20 +1287,31 @@ struct SaveRunRequest {
     stderr: Option<String>,
     started_at: Option<DateTime<Utc>>,
     completed_at: Option<DateTime<Utc>>,
+    // "native" keeps approximate counts out of diffs and benchmark bests
+    #[serde(skip_serializing_if = "Option::is_none")]
+    mode: Option<String>,
+    // Stored as the run's profile blob, for diffs between runs
+    #[serde(skip_serializing_if = "Vec::is_empty")]
+    profile: Vec<BlockProfile>,
+    #[serde(skip_serializing_if = "Vec::is_empty")]
+    functions: Vec<FunctionProfile>,
 }
 
-#[derive(Debug, Deserialize)]
+#[derive(Debug, Serialize, Deserialize)]
 struct BinaryMetadata {
     language: Option<String>,
     optimization: Option<String>,
     compiler_version: Option<String>,
+    /// Empty program from the same language, optimization, flags and compiler image
+    #[serde(default)]
+    baseline_binary_id: Option<String>,
 }
 
 async fn persist_run(
     http_client: &reqwest::Client,
     api_url: &str,
     job: &Job,
-    binary_size: usize,
+    binary_size: Option<usize>,
     metadata: Option<&BinaryMetadata>,
     result: &ExecutionResult,
 ) -> Result<(), String> {
@@ -428,7 +1319,7 @@ async fn persist_run(
         job_id: job.id,
         benchmark_id: job.benchmark_id.clone(),
         binary_id: job.binary_id.clone(),
-        binary_size: Some(binary_size as i64),
+        binary_size: binary_size.map(|size| size as i64),
         language: metadata.and_then(|m| m.language.clone()),
         optimization: metadata.and_then(|m| m.optimization.clone()),
         compiler_version: metadata.and_then(|m| m.compiler_version.clone()),
@@ -453,6 +1344,9 @@ async fn persist_run(
         stderr: Some(result.stderr.clone()),
         started_at: None, // Could track this if needed
         completed_at: Some(Utc::now()),
+        mode: result.mode.clone(),
+        profile: result.profile.clone(),
+        functions: result.functions.clone(),
     };
 
     let response = http_client
@@ -472,6 +1366,491 @@ async fn persist_run(
     Ok(())
 }
 
+/// Run every stdin of a multi-input job against the already-fetched binary,
+/// each case on its own CPU slot as slots free up. Each case is persisted as
+/// its own run under a fresh job id.
+async fn execute_batch(
+    worker: &Worker,
+    job: &Job,
+    binary: &[u8],
+    cached_path: Option<&Path>,
+    metadata: Option<&BinaryMetadata>,
+    baseline: Option<u64>,
+) -> BatchResult {
+    let config = &worker.config;
+    let exec_cache_kv = &worker.exec_cache_kv;
+    let sandbox_version = worker.sandbox_version.as_deref();
+
+    let cases = job.stdin_batch.iter().map(|stdin| {
+        let case_job = Job {
+            id: Uuid::new_v4(),
+            user_id: job.user_id,
+            binary_id: job.binary_id.clone(),
+            instruction_limit: job.instruction_limit,
+            stdin: stdin.clone(),
+            created_at: job.created_at,
+            benchmark_id: job.benchmark_id.clone(),
+            network_enabled: job.network_enabled,
+            env_vars: job.env_vars.clone(),
+            stdin_batch: Vec::new(),
+            mode: job.mode,
+        };
+
+        async move {
+            if let Some(cached) = check_exec_cache(exec_cache_kv, sandbox_version, &case_job).await {
+                // A run of the case's own, as for a single cached job
+                if let Err(e) = persist_run(&worker.http_client, &config.api_url, &case_job, Some(binary.len()), metadata, &cached.result).await {
+                    error!("Failed to persist run to database: {}", e);
+                }
+                return BatchCaseResult { job_id: case_job.id, result: Some(cached.result), error: None };
+            }
+
+            let slot = worker.cpu_slots.acquire().await;
+            let outcome = execute_sandbox(&case_job, binary, cached_path, config, slot.pin(), None).await;
+            drop(slot);
+
+            match outcome {
+                Ok(mut result) => {
+                    apply_baseline(&mut result, baseline);
+                    if let Err(e) = store_exec_cache(exec_cache_kv, sandbox_version, &case_job, &result).await {
+                        error!("Failed to store execution cache entry: {}", e);
+                    }
+                    if let Err(e) = persist_run(&worker.http_client, &config.api_url, &case_job, Some(binary.len()), metadata, &result).await {
+                        error!("Failed to persist run to database: {}", e);
+                    }
+                    BatchCaseResult { job_id: case_job.id, result: Some(result), error: None }
+                }
+                Err(e) => {
+                    error!(job_id = %job.id, case_id = %case_job.id, error = %e, "Batch case failed");
+                    BatchCaseResult { job_id: case_job.id, result: None, error: Some(e) }
+                }
+            }
+        }
+    });
+
+    BatchResult {
+        cases: futures::future::join_all(cases).await,
+    }
+}
+
+/// Pool of CPUs that sandboxes are pinned to, one sandbox per CPU at a time
+struct CpuSlots {
+    permits: Semaphore,
+    free: Mutex<Vec<usize>>,
+    count: usize,
+    pinning: bool,
+}
+
+/// A claimed CPU; returned to the pool on drop
+struct CpuSlot<'a> {
+    slots: &'a CpuSlots,
+    cpu: usize,
+    _permit: SemaphorePermit<'a>,
+}
+
+impl CpuSlots {
+    fn new(cpus: Vec<usize>, pinning: bool) -> Self {
+        Self {
+            permits: Semaphore::new(cpus.len()),
+            count: cpus.len(),
+            free: Mutex::new(cpus),
+            pinning,
+        }
+    }
+
+    fn len(&self) -> usize {
+        self.count
+    }
+
+    async fn acquire(&self) -> CpuSlot<'_> {
+        let permit = self.permits.acquire().await.expect("CPU slot semaphore closed");
+        let cpu = self.free.lock().unwrap().pop().expect("a free CPU for every permit");
+        CpuSlot { slots: self, cpu, _permit: permit }
+    }
+}
+
+impl CpuSlot<'_> {
+    /// CPU to pin the sandbox to, if pinning is enabled
+    fn pin(&self) -> Option<usize> {
+        self.slots.pinning.then_some(self.cpu)
+    }
+}
+
+impl Drop for CpuSlot<'_> {
+    fn drop(&mut self) {
+        self.slots.free.lock().unwrap().push(self.cpu);
+    }
+}
+
+/// State shared by the in-flight job tasks
+struct Worker {
+    config: Config,
+    http_client: reqwest::Client,
+    /// Core NATS, for the fire-and-forget progress updates
+    nats: async_nats::Client,
+    jobs_kv: Store,
+    results_kv: Store,
+    exec_cache_kv: Store,
+    baselines_kv: Store,
+    sandbox_version: Option<String>,
+    cpu_slots: CpuSlots,
+    binary_cache: Option<BinaryCache>,
+    // One baseline measurement at a time, so concurrent first jobs of a
+    // runtime don't all run its empty program
+    baseline_lock: tokio::sync::Mutex<()>,
+    /// Latest completed native job, re-run on QEMU by the cross-check task
+    native_sample: Mutex<Option<(Job, u64)>>,
+}
+
+/// Task body for one queue message: runs the job while telling JetStream it
+/// is still in progress, then acks it
+async fn process_message(worker: Arc<Worker>, msg: jetstream::Message, job: Job, _permit: OwnedSemaphorePermit) {
+    let job_id = job.id;
+
+    // Jobs can wait for a CPU slot (or run a whole batch) for longer than
+    // ack_wait; keep the message from being redelivered meanwhile
+    let progress = async {
+        let mut tick = tokio::time::interval(Duration::from_secs(worker.config.timeout_sec.max(2) / 2));
+        tick.tick().await;
+        loop {
+            tick.tick().await;
+            if let Err(e) = msg.ack_with(AckKind::Progress).await {
+                error!(job_id = %job_id, "Failed to send progress ack: {}", e);
+            }
+        }
+    };
+
+    tokio::select! {
+        _ = handle_job(&worker, job) => {}
+        _ = progress => {}
+    }
+
+    if let Err(e) = msg.ack().await {
+        error!("Failed to ack message: {}", e);
+    }
+}
+
+async fn fetch_binary(worker: &Worker, binary_id: &str) -> Result<Vec<u8>, String> {
+    let resp = worker
+        .http_client
+        .get(&format!("{}/binaries/{}", worker.config.api_url, binary_id))
+        .timeout(Duration::from_secs(60))
+        .send()
+        .await
+        .map_err(|e| format!("Failed to fetch binary: {}", e))?;
+
+    if !resp.status().is_success() {
+        return Err(format!("Binary not found: {}", binary_id));
+    }
+
+    resp.bytes()
+        .await
+        .map(|b| b.to_vec())
+        .map_err(|e| format!("Failed to fetch binary: {}", e))
+}
+
+/// Binary metadata: worker-local cache first, then the API
+async fn load_metadata(worker: &Worker, binary_id: &str) -> Option<BinaryMetadata> {
+    let cache = worker.binary_cache.as_ref();
+    if let Some(cache) = cache {
+        if let Some(m) = cache.get_metadata::<BinaryMetadata>(binary_id).await {
+            return Some(m);
+        }
+    }
+    let fetched = fetch_binary_metadata(worker, binary_id).await;
+    if let (Some(cache), Some(m)) = (cache, &fetched) {
+        if let Err(e) = cache.insert_metadata(binary_id, m).await {
+            warn!(binary_id, "Not caching binary metadata: {}", e);
+        }
+    }
+    fetched
+}
+
+async fn fetch_binary_metadata(worker: &Worker, binary_id: &str) -> Option<BinaryMetadata> {
+    match worker
+        .http_client
+        .get(&format!("{}/binaries/{}/metadata", worker.config.api_url, binary_id))
+        .timeout(Duration::from_secs(10))
+        .send()
+        .await
+    {
+        Ok(resp) if resp.status().is_success() => resp.json().await.ok(),
+        _ => None,
+    }
+}
+
+/// Binary contents and, when cached on disk, the job's link to the file
+/// (keep it until the sandbox has exited): worker-local cache first, then the API
+async fn load_binary(worker: &Worker, binary_id: &str) -> Result<(Vec<u8>, Option<CachedFile>), String> {
+    let cache = worker.binary_cache.as_ref();
+    if let Some(cache) = cache {
+        if let Some((binary, file)) = cache.get(binary_id).await {
+            info!(binary_id, binary_size = binary.len(), "Binary cache hit");
+            return Ok((binary, Some(file)));
+        }
+    }
+
+    let binary = fetch_binary(worker, binary_id).await?;
+    info!(binary_id, binary_size = binary.len(), "Binary fetched");
+
+    let file = match cache {
+        Some(cache) => cache
+            .insert(binary_id, &binary)
+            .await
+            .map_err(|e| warn!(binary_id, "Not caching binary: {}", e))
+            .ok(),
+        None => None,
+    };
+    Ok((binary, file))
+}
+
+fn baseline_key(sandbox_version: &str, baseline_binary_id: &str) -> String {
+    let mut hasher = Sha256::new();
+    hasher.update(sandbox_version.as_bytes());
+    hasher.update(b";");
+    hasher.update(baseline_binary_id.as_bytes());
+    hex::encode(hasher.finalize())
+}
+
+async fn get_baseline(baselines_kv: &Store, key: &str) -> Option<u64> {
+    let entry = baselines_kv.get(key).await.ok()??;
+    std::str::from_utf8(&entry).ok()?.parse().ok()
+}
+
+/// Empty-program instruction count for the binary's runtime. Measured by
+/// running the baseline binary the compile worker recorded, once per sandbox
+/// version, and shared between workers through BASELINES_KV.
+async fn baseline_instructions(worker: &Worker, metadata: Option<&BinaryMetadata>) -> Option<u64> {
+    let baseline_id = metadata?.baseline_binary_id.as_deref()?;
+    let key = baseline_key(worker.sandbox_version.as_deref()?, baseline_id);
+
+    if let Some(n) = get_baseline(&worker.baselines_kv, &key).await {
+        return Some(n);
+    }
+    let _guard = worker.baseline_lock.lock().await;
+    if let Some(n) = get_baseline(&worker.baselines_kv, &key).await {
+        return Some(n);
+    }
+
+    let (binary, cached_path) = load_binary(worker, baseline_id)
+        .await
+        .map_err(|e| warn!(baseline_binary_id = baseline_id, "Baseline unavailable: {}", e))
+        .ok()?;
+    let job = Job {
+        id: Uuid::new_v4(),
+        user_id: None,
+        binary_id: baseline_id.to_string(),
+        instruction_limit: BASELINE_INSTRUCTION_LIMIT,
+        stdin: Vec::new(),
+        created_at: Utc::now(),
+        benchmark_id: None,
+        network_enabled: false,
+        env_vars: std::collections::HashMap::new(),
+        stdin_batch: Vec::new(),
+        mode: ExecMode::Qemu,
+    };
+
+    let slot = worker.cpu_slots.acquire().await;
+    let outcome = execute_sandbox(&job, &binary, cached_path.as_deref(), &worker.config, slot.pin(), None).await;
+    drop(slot);
+
+    let result = match outcome {
+        Ok(r) if r.exit_code == 0 && !r.limit_reached => r,
+        Ok(r) => {
+            warn!(baseline_binary_id = baseline_id, exit_code = r.exit_code, "Baseline run did not complete cleanly");
+            return None;
+        }
+        Err(e) => {
+            warn!(baseline_binary_id = baseline_id, "Baseline run failed: {}", e);
+            return None;
+        }
+    };
+
+    info!(baseline_binary_id = baseline_id, instructions = result.instructions, "Baseline measured");
+    if let Err(e) = worker
+        .baselines_kv
+        .put(&key, result.instructions.to_string().into_bytes().into())
+        .await
+    {
+        error!("Failed to store baseline: {}", e);
+    }
+    Some(result.instructions)
+}
+
+fn apply_baseline(result: &mut ExecutionResult, baseline: Option<u64>) {
+    if let Some(baseline) = baseline {
+        result.baseline_instructions = Some(baseline);
+        result.instructions_net = Some(result.instructions.saturating_sub(baseline));
+    }
+}
+
+/// Run one job from the queue: fetch the binary, execute, store and persist the
+/// result. The caller acks the message afterwards whatever the outcome.
+async fn handle_job(worker: &Worker, job: Job) {
+    info!(job_id = %job.id, instruction_limit = job.instruction_limit, binary_id = %job.binary_id, "Processing job");
+
+    // Same binary, stdin, limit and env on the same sandbox version: reuse the result
+    if job.stdin_batch.is_empty() {
+        if let Some(cached) = check_exec_cache(&worker.exec_cache_kv, worker.sandbox_version.as_deref(), &job).await {
+            info!(job_id = %job.id, cached_job_id = %cached.job_id, "Execution cache hit");
+            if let Err(e) = store_job_result(&worker.results_kv, &job.id, &cached.result).await {
+                error!("Failed to store result: {}", e);
+            }
+            // The job gets its own run row: callers look runs up by their
+            // job id, and the cached job's run may be someone else's
+            let metadata = load_metadata(worker, &job.binary_id).await;
+            if let Err(e) = persist_run(&worker.http_client, &worker.config.api_url, &job, None, metadata.as_ref(), &cached.result).await {
+                error!("Failed to persist run to database: {}", e);
+            }
+            if let Err(e) = update_job_status(&worker.jobs_kv, &job.id, JobStatus::Completed, None).await {
+                error!("Failed to update job status: {}", e);
+            }
+            return;
+        }
+    }
+
+    // Binary and metadata: worker-local cache first, then the API
+    let (binary, cached_path) = match load_binary(worker, &job.binary_id).await {
+        Ok(loaded) => loaded,
+        Err(e) => {
+            error!(job_id = %job.id, "{}", e);
+            let _ = update_job_status(&worker.jobs_kv, &job.id, JobStatus::Failed, Some(e)).await;
+            return;
+        }
+    };
+
+    let metadata = load_metadata(worker, &job.binary_id).await;
+
+    if let Some(ref m) = metadata {
+        info!(job_id = %job.id, language = ?m.language, optimization = ?m.optimization, "Binary metadata fetched");
+    }
+
+    // Measured once per runtime and sandbox version, a KV read afterwards.
+    // Baselines are QEMU counts, so native runs get none.
+    let baseline = match job.mode {
+        ExecMode::Qemu => baseline_instructions(worker, metadata.as_ref()).await,
+        ExecMode::Native => None,
+    };
+
+    // Update status to running
+    if let Err(e) = update_job_status(&worker.jobs_kv, &job.id, JobStatus::Running, None).await {
+        error!("Failed to update job status: {}", e);
+    }
+
+    // Multi-input job: every case against the same binary, one combined result
+    if !job.stdin_batch.is_empty() {
+        let batch = execute_batch(worker, &job, &binary, cached_path.as_deref(), metadata.as_ref(), baseline).await;
+        info!(job_id = %job.id, cases = batch.cases.len(), "Batch job completed");
+
+        if let Err(e) = store_job_result(&worker.results_kv, &job.id, &batch).await {
+            error!("Failed to store result: {}", e);
+        }
+        if let Err(e) = update_job_status(&worker.jobs_kv, &job.id, JobStatus::Completed, None).await {
+            error!("Failed to update job status: {}", e);
+        }
+        return;
+    }
+
+    // Execute the sandbox. Native runs are short and have no plugin to sample.
+    let progress = (worker.config.progress_every_m > 0 && job.mode == ExecMode::Qemu)
+        .then(|| ProgressReporter::new(&worker.nats, &job, worker.config.progress_every_m));
+    let slot = worker.cpu_slots.acquire().await;
+    let outcome =
+        execute_sandbox(&job, &binary, cached_path.as_deref(), &worker.config, slot.pin(), progress.as_ref()).await;
+    drop(slot);
+
+    match outcome {
+        Ok(mut result) => {
+            apply_baseline(&mut result, baseline);
+            info!(
+                job_id = %job.id,
+                instructions = result.instructions,
+                exit_code = result.exit_code,
+                time_ms = result.execution_time_ms,
+                "Job completed"
+            );
+
+            if result.mode.as_deref() == Some("native") && !result.limit_reached {
+                *worker.native_sample.lock().unwrap() = Some((job.clone(), result.instructions));
+            }
+
+            // Store result in NATS KV (for fast access)
+            if let Err(e) = store_job_result(&worker.results_kv, &job.id, &result).await {
+                error!("Failed to store result: {}", e);
+            }
+            if let Err(e) = store_exec_cache(&worker.exec_cache_kv, worker.sandbox_version.as_deref(), &job, &result).await {
+                error!("Failed to store execution cache entry: {}", e);
+            }
+
+            // Persist run to PostgreSQL (permanent storage)
+            if let Err(e) = persist_run(&worker.http_client, &worker.config.api_url, &job, Some(binary.len()), metadata.as_ref(), &result).await {
+                error!("Failed to persist run to database: {}", e);
+                // Don't fail the job - NATS KV still has the result
+            }
+
+            // Update status to completed
+            if let Err(e) = update_job_status(&worker.jobs_kv, &job.id, JobStatus::Completed, None).await {
+                error!("Failed to update job status: {}", e);
+            }
+        }
+        Err(e) => {
+            error!(job_id = %job.id, error = %e, "Job failed");
+
+            // Update status to failed
+            if let Err(e2) = update_job_status(&worker.jobs_kv, &job.id, JobStatus::Failed, Some(e)).await {
+                error!("Failed to update job status: {}", e2);
+            }
+        }
+    }
+}
+
+/// Periodically re-run the latest native job on QEMU and log how far the
+/// hardware count is from the emulated one, to catch drift between modes
+async fn native_cross_check(worker: Arc<Worker>) {
+    let mut tick = tokio::time::interval(Duration::from_secs(worker.config.native_cross_check_sec));
+    tick.tick().await;
+    loop {
+        tick.tick().await;
+        let Some((job, native_instructions)) = worker.native_sample.lock().unwrap().take() else { continue };
+
+        let (binary, cached_path) = match load_binary(&worker, &job.binary_id).await {
+            Ok(loaded) => loaded,
+            Err(e) => {
+                warn!(job_id = %job.id, "Native cross-check skipped: {}", e);
+                continue;
+            }
+        };
+        let qemu_job = Job { mode: ExecMode::Qemu, ..job };
+
+        let slot = worker.cpu_slots.acquire().await;
+        let outcome = execute_sandbox(&qemu_job, &binary, cached_path.as_deref(), &worker.config, slot.pin(), None).await;
+        drop(slot);
+
+        let qemu_instructions = match outcome {
+            Ok(result) if !result.limit_reached && result.instructions > 0 => result.instructions,
+            Ok(_) => continue,
+            Err(e) => {
+                warn!(job_id = %qemu_job.id, "Native cross-check failed: {}", e);
+                continue;
+            }
+        };
+
+        let drift_pct = (native_instructions as f64 - qemu_instructions as f64) / qemu_instructions as f64 * 100.0;
+        if drift_pct.abs() > worker.config.native_drift_warn_pct {
+            warn!(
+                job_id = %qemu_job.id,
+                binary_id = %qemu_job.binary_id,
+                native_instructions,
+                qemu_instructions,
+                drift_pct,
+                "Native and QEMU instruction counts drifted apart"
+            );
+        } else {
+            info!(job_id = %qemu_job.id, native_instructions, qemu_instructions, drift_pct, "Native cross-check");
+        }
+    }
+}
+
 #[tokio::main]
 async fn main() {
     // Initialize tracing
@@ -482,9 +1861,12 @@ async fn main() {
         )
         .init();
 
-    let config = Config::from_env();
+    let mut config = Config::from_env();
 
     info!("Starting CTF Worker (NATS: {}, sandbox: {})", config.nats_url, config.sandbox_image);
+    if let Some(addr) = &config.sandbox_runner_addr {
+        info!("Executing jobs on sandbox runner at {}", addr);
+    }
 
     // Connect to NATS with longer request timeout for large binary operations
     let client = loop {
@@ -503,7 +1885,7 @@ async fn main() {
         }
     };
 
-    let jetstream = jetstream::new(client);
+    let jetstream = jetstream::new(client.clone());
 
     // Get or create stream
     let stream = jetstream
@@ -539,6 +1921,53 @@ async fn main() {
         .await
         .expect("Failed to create results KV");
 
+    let exec_cache_kv = jetstream
+        .create_key_value(jetstream::kv::Config {
+            bucket: EXEC_CACHE_KV.to_string(),
+            max_age: Duration::from_secs(config.exec_cache_ttl_seconds),
+            storage: jetstream::stream::StorageType::File,
+            ..Default::default()
+        })
+        .await
+        .expect("Failed to create exec_cache KV");
+
+    let baselines_kv = jetstream
+        .create_key_value(jetstream::kv::Config {
+            bucket: BASELINES_KV.to_string(),
+            max_age: Duration::from_secs(config.exec_cache_ttl_seconds),
+            storage: jetstream::stream::StorageType::File,
+            ..Default::default()
+        })
+        .await
+        .expect("Failed to create baselines KV");
+
+    // Cache keys include the sandbox version, so a new QEMU/plugin image
+    // misses every old entry. Publish it for the API's pre-queue lookups.
+    let sandbox_version = detect_sandbox_version(&config).await;
+
+    // Jobs past the runner's slots would wait for one inside the exchange
+    // timeout and time out spuriously, so never run more at once
+    if let Some(addr) = config.sandbox_runner_addr.clone() {
+        let slots = query_runner(&config, &addr)
+            .await
+            .and_then(|r| r.get("slots")?.as_u64())
+            .map(|n| n.max(1) as usize)
+            .unwrap_or(1);
+        if slots < config.cpu_slots.len() {
+            warn!("Sandbox runner has {} slots, running {} jobs at once instead of {}", slots, slots, config.cpu_slots.len());
+            config.cpu_slots.truncate(slots);
+        }
+    }
+    match &sandbox_version {
+        Some(version) => {
+            info!("Sandbox version {}", version);
+            if let Err(e) = exec_cache_kv.put(SANDBOX_VERSION_KEY, version.clone().into_bytes().into()).await {
+                error!("Failed to publish sandbox version: {}", e);
+            }
+        }
+        None => error!("Could not determine sandbox version, execution cache disabled"),
+    }
+
     // HTTP client for fetching binaries from API
     let http_client = reqwest::Client::builder()
         .timeout(Duration::from_secs(120))
@@ -560,11 +1989,55 @@ async fn main() {
         .await
         .expect("Failed to create consumer");
 
-    info!("Worker ready, waiting for jobs...");
+    let binary_cache = config.binary_cache_dir.clone().and_then(|dir| {
+        BinaryCache::open(dir, config.binary_cache_max_mb * 1024 * 1024)
+            .map_err(|e| error!("Binary cache disabled: {}", e))
+            .ok()
+    });
+
+    let worker = Arc::new(Worker {
+        cpu_slots: CpuSlots::new(config.cpu_slots.clone(), config.cpu_pinning),
+        binary_cache,
+        config,
+        http_client,
+        nats: client,
+        jobs_kv,
+        results_kv,
+        exec_cache_kv,
+        baselines_kv,
+        sandbox_version,
+        baseline_lock: tokio::sync::Mutex::new(()),
+        native_sample: Mutex::new(None),
+    });
+
+    if let Some(addr) = worker.config.metrics_addr.clone() {
+        tokio::spawn(metrics::serve(addr));
+    }
+
+    if worker.config.native_sandbox_image.is_some() && worker.config.native_cross_check_sec > 0 {
+        tokio::spawn(native_cross_check(worker.clone()));
+    }
 
-    // Process messages
+    // Jobs in flight (fetching, running or persisting); twice the CPU slots so
+    // binary fetches and persists overlap with running sandboxes
+    let in_flight = Arc::new(Semaphore::new(worker.cpu_slots.len() * 2));
+
+    info!(
+        "Worker ready, waiting for jobs ({} sandbox slots, pinning {})",
+        worker.cpu_slots.len(),
+        if worker.config.cpu_pinning { "on" } else { "off" }
+    );
+
+    // Process messages: each job runs in its own task and acks itself, so a
+    // slow job never holds up the fetch loop
     loop {
-        let mut messages = match consumer.fetch().max_messages(1).messages().await {
+        let first = in_flight.clone().acquire_owned().await.expect("in-flight semaphore closed");
+        let mut permits = vec![first];
+        while let Ok(permit) = in_flight.clone().try_acquire_owned() {
+            permits.push(permit);
+        }
+
+        let mut messages = match consumer.fetch().max_messages(permits.len()).messages().await {
             Ok(m) => m,
             Err(e) => {
                 error!("Failed to fetch messages: {}", e);
@@ -573,6 +2046,7 @@ async fn main() {
             }
         };
 
+        let mut received = 0;
         while let Some(msg_result) = messages.next().await {
             let msg = match msg_result {
                 Ok(m) => m,
@@ -591,108 +2065,16 @@ async fn main() {
                 }
             };
 
-            info!(job_id = %job.id, instruction_limit = job.instruction_limit, binary_id = %job.binary_id, "Processing job");
-
-            // Fetch binary from API
-            let binary = match http_client
-                .get(&format!("{}/binaries/{}", config.api_url, job.binary_id))
-                .timeout(Duration::from_secs(60))
-                .send()
-                .await
-            {
-                Ok(resp) if resp.status().is_success() => {
-                    match resp.bytes().await {
-                        Ok(b) => b.to_vec(),
-                        Err(e) => {
-                            error!("Failed to read binary response: {}", e);
-                            let _ = update_job_status(&jobs_kv, &job.id, JobStatus::Failed, Some(format!("Failed to fetch binary: {}", e))).await;
-                            let _ = msg.ack().await;
-                            continue;
-                        }
-                    }
-                }
-                Ok(resp) => {
-                    error!("Binary not found: HTTP {}", resp.status());
-                    let _ = update_job_status(&jobs_kv, &job.id, JobStatus::Failed, Some(format!("Binary not found: {}", job.binary_id))).await;
-                    let _ = msg.ack().await;
-                    continue;
-                }
-                Err(e) => {
-                    error!("Failed to fetch binary: {}", e);
-                    let _ = update_job_status(&jobs_kv, &job.id, JobStatus::Failed, Some(format!("Failed to fetch binary: {}", e))).await;
-                    let _ = msg.ack().await;
-                    continue;
-                }
-            };
-
-            info!(job_id = %job.id, binary_size = binary.len(), "Binary fetched");
-
-            // Fetch binary metadata
-            let metadata: Option<BinaryMetadata> = match http_client
-                .get(&format!("{}/binaries/{}/metadata", config.api_url, job.binary_id))
-                .timeout(Duration::from_secs(10))
-                .send()
-                .await
-            {
-                Ok(resp) if resp.status().is_success() => {
-                    resp.json().await.ok()
-                }
-                _ => None
-            };
-
-            if let Some(ref m) = metadata {
-                info!(job_id = %job.id, language = ?m.language, optimization = ?m.optimization, "Binary metadata fetched");
-            }
-
-            // Update status to running
-            if let Err(e) = update_job_status(&jobs_kv, &job.id, JobStatus::Running, None).await {
-                error!("Failed to update job status: {}", e);
-            }
-
-            // Execute the sandbox
-            match execute_sandbox(&job, &binary, &config).await {
-                Ok(result) => {
-                    info!(
-                        job_id = %job.id,
-                        instructions = result.instructions,
-                        exit_code = result.exit_code,
-                        time_ms = result.execution_time_ms,
-                        "Job completed"
-                    );
-
-                    // Store result in NATS KV (for fast access)
-                    if let Err(e) = store_job_result(&results_kv, &job.id, &result).await {
-                        error!("Failed to store result: {}", e);
-                    }
-
-                    // Persist run to PostgreSQL (permanent storage)
-                    if let Err(e) = persist_run(&http_client, &config.api_url, &job, binary.len(), metadata.as_ref(), &result).await {
-                        error!("Failed to persist run to database: {}", e);
-                        // Don't fail the job - NATS KV still has the result
-                    }
-
-                    // Update status to completed
-                    if let Err(e) = update_job_status(&jobs_kv, &job.id, JobStatus::Completed, None).await {
-                        error!("Failed to update job status: {}", e);
-                    }
-                }
-                Err(e) => {
-                    error!(job_id = %job.id, error = %e, "Job failed");
-
-                    // Update status to failed
-                    if let Err(e2) = update_job_status(&jobs_kv, &job.id, JobStatus::Failed, Some(e)).await {
-                        error!("Failed to update job status: {}", e2);
-                    }
-                }
-            }
-
-            // Acknowledge the message
-            if let Err(e) = msg.ack().await {
-                error!("Failed to ack message: {}", e);
-            }
+            let Some(permit) = permits.pop() else { break };
+            received += 1;
+            tokio::spawn(process_message(worker.clone(), msg, job, permit));
         }
 
-        // Small delay before next fetch
-        tokio::time::sleep(Duration::from_millis(100)).await;
+        // Nothing queued: back off briefly before the next fetch
+        if received == 0 {
+            drop(permits);
+            tokio::time::sleep(Duration::from_millis(100)).await;
+        }
     }
 }
+
@@ -0,0 +1,146 @@
+//! Emulator overhead metrics in the Prometheus text format.
+//!
+//! Every QEMU run's `emulation` stats (see sandbox/plugin/sandbox.c) are
+//! added to process-wide counters, served at `/metrics` on METRICS_ADDR.
+//! Host time is kept in nanoseconds and exported in seconds.
+
+use std::fmt::Write as _;
+use std::sync::atomic::{AtomicU64, Ordering};
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio::net::TcpListener;
+use tracing::{error, info};
+
+/// Upper bounds, in seconds, of the per-run host CPU histogram
+const HOST_SECONDS_BUCKETS: [f64; 10] = [0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0];
+
+pub struct Metrics {
+    runs: AtomicU64,
+    guest_instructions: AtomicU64,
+    tb_translated: AtomicU64,
+    tb_translated_insns: AtomicU64,
+    tb_retranslated: AtomicU64,
+    host_cpu_ns: AtomicU64,
+    host_translate_ns: AtomicU64,
+    host_exec_ns: AtomicU64,
+    retranslation_heavy_runs: AtomicU64,
+    host_seconds_buckets: [AtomicU64; HOST_SECONDS_BUCKETS.len()],
+}
+
+pub static METRICS: Metrics = Metrics {
+    runs: AtomicU64::new(0),
+    guest_instructions: AtomicU64::new(0),
+    tb_translated: AtomicU64::new(0),
+    tb_translated_insns: AtomicU64::new(0),
+    tb_retranslated: AtomicU64::new(0),
+    host_cpu_ns: AtomicU64::new(0),
+    host_translate_ns: AtomicU64::new(0),
+    host_exec_ns: AtomicU64::new(0),
+    retranslation_heavy_runs: AtomicU64::new(0),
+    host_seconds_buckets: [const { AtomicU64::new(0) }; HOST_SECONDS_BUCKETS.len()],
+};
+
+impl Metrics {
+    /// Add one run; `heavy` marks a run over the retranslation threshold
+    pub fn record(&self, instructions: u64, emulation: &crate::EmulationStats, heavy: bool) {
+        self.runs.fetch_add(1, Ordering::Relaxed);
+        self.guest_instructions.fetch_add(instructions, Ordering::Relaxed);
+        self.tb_translated.fetch_add(emulation.tb_translated, Ordering::Relaxed);
+        self.tb_translated_insns.fetch_add(emulation.tb_translated_insns, Ordering::Relaxed);
+        self.tb_retranslated.fetch_add(emulation.tb_retranslated, Ordering::Relaxed);
+        self.host_cpu_ns.fetch_add(emulation.host_cpu_ns, Ordering::Relaxed);
+        self.host_translate_ns.fetch_add(emulation.host_translate_ns, Ordering::Relaxed);
+        self.host_exec_ns.fetch_add(emulation.host_exec_ns, Ordering::Relaxed);
+        if heavy {
+            self.retranslation_heavy_runs.fetch_add(1, Ordering::Relaxed);
+        }
+        let seconds = emulation.host_cpu_ns as f64 / 1e9;
+        if let Some(i) = HOST_SECONDS_BUCKETS.iter().position(|&le| seconds <= le) {
+            self.host_seconds_buckets[i].fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn render(&self) -> String {
+        let get = |c: &AtomicU64| c.load(Ordering::Relaxed);
+        let seconds = |c: &AtomicU64| c.load(Ordering::Relaxed) as f64 / 1e9;
+        let mut out = String::new();
+
+        let mut counter = |name: &str, help: &str, value: String| {
+            let _ = writeln!(out, "# HELP {} {}\n# TYPE {} counter\n{} {}", name, help, name, name, value);
+        };
+        counter("ctf_sandbox_runs_total", "QEMU sandbox runs", get(&self.runs).to_string());
+        counter(
+            "ctf_sandbox_guest_instructions_total",
+            "Guest instructions executed",
+            get(&self.guest_instructions).to_string(),
+        );
+        counter("ctf_sandbox_tb_translated_total", "Translation blocks translated", get(&self.tb_translated).to_string());
+        counter(
+            "ctf_sandbox_tb_translated_insns_total",
+            "Guest instructions in translated blocks; over tb_translated, the average block length",
+            get(&self.tb_translated_insns).to_string(),
+        );
+        counter(
+            "ctf_sandbox_tb_retranslated_total",
+            "Translations of a block address translated before (self-modifying code, TB flushes)",
+            get(&self.tb_retranslated).to_string(),
+        );
+        counter(
+            "ctf_sandbox_retranslation_heavy_runs_total",
+            "Runs with more retranslations than RETRANSLATION_WARN",
+            get(&self.retranslation_heavy_runs).to_string(),
+        );
+        counter("ctf_sandbox_host_cpu_seconds_total", "Host CPU time of sandboxed QEMU", seconds(&self.host_cpu_ns).to_string());
+        counter(
+            "ctf_sandbox_host_translate_seconds_total",
+            "Host CPU time translating, extrapolated from sampled translations (0 unless sandboxes set TRANS_SAMPLE)",
+            seconds(&self.host_translate_ns).to_string(),
+        );
+        counter(
+            "ctf_sandbox_host_exec_seconds_total",
+            "Host CPU time outside translation",
+            seconds(&self.host_exec_ns).to_string(),
+        );
+
+        let name = "ctf_sandbox_run_host_cpu_seconds";
+        let _ = writeln!(out, "# HELP {} Host CPU time per QEMU run\n# TYPE {} histogram", name, name);
+        let mut cumulative = 0;
+        for (le, bucket) in HOST_SECONDS_BUCKETS.iter().zip(&self.host_seconds_buckets) {
+            cumulative += get(bucket);
+            let _ = writeln!(out, "{}_bucket{{le=\"{}\"}} {}", name, le, cumulative);
+        }
+        let _ = writeln!(out, "{}_bucket{{le=\"+Inf\"}} {}", name, get(&self.runs));
+        let _ = writeln!(out, "{}_sum {}", name, seconds(&self.host_cpu_ns));
+        let _ = writeln!(out, "{}_count {}", name, get(&self.runs));
+        out
+    }
+}
+
+/// Serve the metrics to any request on `addr`, one response per connection
+pub async fn serve(addr: String) {
+    let listener = match TcpListener::bind(&addr).await {
+        Ok(listener) => listener,
+        Err(e) => {
+            error!("Metrics disabled, cannot listen on {}: {}", addr, e);
+            return;
+        }
+    };
+    info!("Serving metrics on {}/metrics", addr);
+
+    loop {
+        let Ok((mut stream, _)) = listener.accept().await else {
+            continue;
+        };
+        tokio::spawn(async move {
+            // Only the scraper talks to this port; the request itself is not needed
+            let mut request = [0u8; 1024];
+            let _ = stream.read(&mut request).await;
+            let body = METRICS.render();
+            let response = format!(
+                "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+                body.len(),
+                body
+            );
+            let _ = stream.write_all(response.as_bytes()).await;
+        });
+    }
+}